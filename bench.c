@@ -0,0 +1,641 @@
+/*******************************************************************************
+ * Author:      agent
+ * Date:        October 14, 2026
+ * Filename:    bench.c
+ *
+ * Description: Micro-benchmarks for smallsh. Includes smallsh.c without its
+ * main() and measures parseCommandLine(), with and without the parse cache,
+ * expandVariables() and line classifier throughput on synthetic lines,
+ * spawn-to-exit latency of /bin/true in the foreground and background, and
+ * how fast checkBackgroundChildren() reaps thousands of children, how long a
+ * large command history takes to open and search, and the cost of queueing a
+ * signal for the main loop. Each result
+ * is printed to stdout as one JSON object per line so that runs can be
+ * compared by a script. Built and run by "make bench".
+ ******************************************************************************/
+
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+#define PARSE_RUNS 200000       // Default lines parsed per parse benchmark
+#define SPAWN_RUNS 2000         // Default commands per latency benchmark
+#define REAP_CHILDREN 2000      // Default children per reaping benchmark
+#define BENCH_CMD "/bin/true"   // Command launched by the spawn benchmarks
+#define BENCH_LINE_CHARS 2048   // Characters in the synthetic lines
+#define BENCH_ARGS 512          // Arguments in the many-argument lines
+#define FILE_LIST_ARGS 20000    // Paths in the generated file-list line
+#define HISTORY_ENTRIES 1000000 // Lines in the generated history file
+#define HISTORY_SEARCHES 100    // Prefix searches timed over the history
+#define SIGNAL_BURST 1000       // Signals raised between drains in a burst
+
+int saved_stdout = -1;          // Real stdout while the shell is silenced
+
+/*******************************************************************************
+ * Function name:   double elapsedSeconds(struct timespec *start,
+ *                                        struct timespec *end)
+ *
+ * Description:     Works out the time between two monotonic timestamps.
+ *
+ * Receives:        start       Timestamp taken first
+ *                  end         Timestamp taken second
+ *
+ * Returns:         Seconds from start to end
+ ******************************************************************************/
+
+double elapsedSeconds(struct timespec *start, struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t benchNow()
+ *
+ * Description:     Reads the monotonic clock.
+ *
+ * Returns:         Monotonic time in nanoseconds
+ ******************************************************************************/
+
+uint64_t benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*******************************************************************************
+ * Function name:   void silenceShell(bool silent)
+ *
+ * Description:     Sends stdout to /dev/null while the shell's own messages
+ *                  ("background pid is", completion notices) would mix with
+ *                  the results, and restores it afterwards.
+ *
+ * Receives:        silent      bool    true to silence stdout, false to
+ *                                      restore it
+ ******************************************************************************/
+
+void silenceShell(bool silent) {
+    fflush(stdout);
+    if(silent) {
+        int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    } else {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void benchParse(Command *command, const char *name,
+ *                                  const char *line, long runs)
+ *
+ * Description:     Parses the same line repeatedly and prints the time per
+ *                  line and the throughput in megabytes of input per second.
+ *
+ * Receives:        command     Command struct pointer to parse into
+ *                  name        Name of the benchmark in the results
+ *                  line        Line to parse
+ *                  runs        Number of times to parse the line
+ ******************************************************************************/
+
+void benchParse(Command *command, const char *name, const char *line,
+                long runs) {
+    size_t length = strlen(line);
+    char *buffer = heapAlloc(length + 1);   // Copy of the line to parse
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < runs; i++) {
+        // Parsing writes into the line, so parse a fresh copy every time
+        memcpy(buffer, line, length + 1);
+        resetCommand(command);
+        command->line = buffer;
+        command->lineLength = length;
+        parseCommandLine(command);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsedSeconds(&start, &end);
+    printf("{\"bench\":\"%s\",\"runs\":%ld,\"bytes\":%zu,\"args\":%d,"
+           "\"ns_per_op\":%.1f,\"mb_per_sec\":%.1f}\n", name, runs, length,
+           command->numArgs, seconds * 1e9 / runs,
+           length * runs / seconds / 1e6);
+    heapFree(buffer);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void benchExpand(Arena *arena, const char *name,
+ *                                   const char *word, long runs)
+ *
+ * Description:     Expands every variable reference in the same word
+ *                  repeatedly and prints the time per word. The offsets are
+ *                  found once up front, as the tokenizer would.
+ *
+ * Receives:        arena       Arena the expanded words are allocated in
+ *                  name        Name of the benchmark in the results
+ *                  word        Word to expand
+ *                  runs        Number of times to expand the word
+ ******************************************************************************/
+
+void benchExpand(Arena *arena, const char *name, const char *word,
+                 long runs) {
+    static size_t expansions[BENCH_LINE_CHARS / 2]; // Reference offsets
+    size_t numExpansions = 0;
+    size_t length = strlen(word);
+    size_t expanded = length;   // Length of the expanded word
+    struct timespec start, end;
+
+    for(size_t i = 0; i < length; i++) {
+        size_t reference = 0;
+        if(word[i] == PID_EXPAND_CHAR) {
+            reference = parseReference(word + i, NULL, NULL);
+        }
+        if(reference > 0) {
+            expansions[numExpansions++] = i;
+            i += reference - 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < runs; i++) {
+        arenaReset(arena);
+        if(numExpansions > 0) {
+            expanded = strlen(expandVariables(arena, word, length,
+                                              expansions, numExpansions));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsedSeconds(&start, &end);
+    printf("{\"bench\":\"%s\",\"runs\":%ld,\"bytes\":%zu,\"expanded\":%zu,"
+           "\"ns_per_op\":%.1f,\"mb_per_sec\":%.1f}\n", name, runs, length,
+           expanded, seconds * 1e9 / runs, length * runs / seconds / 1e6);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void benchClassify(const char *name,
+ *                                     uint64_t (*classify)(const char*),
+ *                                     const char *line, long runs)
+ *
+ * Description:     Classifies the same line repeatedly with one classifier
+ *                  and prints its throughput, and whether its mask matches
+ *                  the scalar classifier's.
+ *
+ * Receives:        name        Name of the benchmark in the results
+ *                  classify    Block classifier to measure
+ *                  line        Line to classify
+ *                  runs        Number of times to classify the line
+ ******************************************************************************/
+
+void benchClassify(const char *name, uint64_t (*classify)(const char*),
+                   const char *line, long runs) {
+    static uint64_t expected[(BENCH_LINE_CHARS + 63) / 64]; // Scalar mask
+    size_t length = strlen(line);
+    struct timespec start, end;
+
+    classify_block = classifyBlockScalar;
+    classifyLine(line, length);
+    memcpy(expected, line_mask, (length + 63) / 64 * sizeof(uint64_t));
+
+    classify_block = classify;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < runs; i++) {
+        classifyLine(line, length);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bool match = !memcmp(expected, line_mask,
+                         (length + 63) / 64 * sizeof(uint64_t));
+    initClassifier();
+
+    double seconds = elapsedSeconds(&start, &end);
+    printf("{\"bench\":\"%s\",\"runs\":%ld,\"bytes\":%zu,\"match\":%s,"
+           "\"ns_per_op\":%.1f,\"mb_per_sec\":%.1f}\n", name, runs, length,
+           match ? "true" : "false", seconds * 1e9 / runs,
+           length * runs / seconds / 1e6);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void printLatencies(const char *name, uint64_t *ns,
+ *                                      long runs)
+ *
+ * Description:     Sorts a set of latencies and prints their mean, median,
+ *                  99th percentile and maximum in microseconds.
+ *
+ * Receives:        name        Name of the benchmark in the results
+ *                  ns          Latencies in nanoseconds, sorted in place
+ *                  runs        Number of latencies
+ ******************************************************************************/
+
+void printLatencies(const char *name, uint64_t *ns, long runs) {
+    double total = 0;
+    for(long i = 0; i < runs; i++) {
+        total += ns[i];
+    }
+    qsort(ns, runs, sizeof(uint64_t), compareDurations);
+    printf("{\"bench\":\"%s\",\"runs\":%ld,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+           "\"p99_us\":%.1f,\"max_us\":%.1f}\n", name, runs,
+           total / runs / 1000.0, ns[(runs - 1) / 2] / 1000.0,
+           ns[(runs - 1) * 99 / 100] / 1000.0, ns[runs - 1] / 1000.0);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void runLine(Command *command, const char *line)
+ *
+ * Description:     Parses and executes a line the way the prompt loop does.
+ *
+ * Receives:        command     Command struct pointer to parse into
+ *                  line        Line to run
+ ******************************************************************************/
+
+void runLine(Command *command, const char *line) {
+    static char buffer[BENCH_LINE_CHARS + 1];   // Copy of the line to parse
+
+    strcpy(buffer, line);
+    resetCommand(command);
+    command->line = buffer;
+    command->lineLength = strlen(line);
+    parseCommandLine(command);
+    executeCommand(command);
+}
+
+/*******************************************************************************
+ * Function name:   void benchSpawn(Command *command, long runs)
+ *
+ * Description:     Runs /bin/true through executeCommand() in the
+ *                  foreground, then the true and echo built-ins, which run
+ *                  in the shell, and then /bin/true in the background
+ *                  waiting for each job to be reaped, printing the latency
+ *                  from parsing the line to the command finishing.
+ *
+ * Receives:        command     Command struct pointer to parse into
+ *                  runs        Number of commands to run in each mode
+ ******************************************************************************/
+
+void benchSpawn(Command *command, long runs) {
+    uint64_t *ns = heapAlloc(sizeof(uint64_t) * runs);
+    struct pollfd childEvents = {sigchld_fd, POLLIN, 0};
+
+    // Foreground: executeCommand() returns once the job has been reaped
+    for(long i = 0; i < runs; i++) {
+        uint64_t start = benchNow();
+        runLine(command, BENCH_CMD);
+        ns[i] = benchNow() - start;
+    }
+    printLatencies("spawn_fg", ns, runs);
+
+    // Built-in stand-ins for installed programs run without a process
+    for(long i = 0; i < runs; i++) {
+        uint64_t start = benchNow();
+        runLine(command, "true");
+        ns[i] = benchNow() - start;
+    }
+    printLatencies("builtin_true", ns, runs);
+    for(long i = 0; i < runs; i++) {
+        uint64_t start = benchNow();
+        runLine(command, "echo hello > /dev/null");
+        ns[i] = benchNow() - start;
+    }
+    printLatencies("builtin_echo_redirect", ns, runs);
+
+    // Background: wait on the signalfd until the reaper has finished the job
+    silenceShell(true);
+    for(long i = 0; i < runs; i++) {
+        uint64_t start = benchNow();
+        runLine(command, BENCH_CMD " &");
+        while(job_table.doneHead == -1) {
+            if(poll(&childEvents, 1, -1) > 0) {
+                reapChildren();
+            }
+        }
+        ns[i] = benchNow() - start;
+        printBackgroundNotices();
+    }
+    silenceShell(false);
+    printLatencies("spawn_bg", ns, runs);
+    heapFree(ns);
+}
+
+/*******************************************************************************
+ * Function name:   void benchReap(Command *command, long children)
+ *
+ * Description:     Starts many background children at once and then times
+ *                  only the calls to checkBackgroundChildren() that reap
+ *                  them, printing the number of children reaped per second.
+ *
+ * Receives:        command     Command struct pointer to parse into
+ *                  children    Number of background children to start
+ ******************************************************************************/
+
+void benchReap(Command *command, long children) {
+    struct pollfd childEvents = {sigchld_fd, POLLIN, 0};
+    uint64_t reaping = 0;       // Nanoseconds spent reaping
+    long calls = 0;             // Calls to checkBackgroundChildren()
+
+    silenceShell(true);
+    for(long i = 0; i < children; i++) {
+        runLine(command, BENCH_CMD " &");
+    }
+    while(job_table.running > 0) {
+        if(poll(&childEvents, 1, -1) > 0) {
+            uint64_t start = benchNow();
+            checkBackgroundChildren();
+            reaping += benchNow() - start;
+            calls++;
+        }
+    }
+    silenceShell(false);
+
+    printf("{\"bench\":\"reap\",\"children\":%ld,\"calls\":%ld,"
+           "\"seconds\":%.6f,\"children_per_sec\":%.0f}\n", children, calls,
+           reaping / 1e9, children / (reaping / 1e9));
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void closeBenchHistory()
+ *
+ * Description:     Unmaps and closes the history so that openHistory() opens
+ *                  it again from scratch.
+ ******************************************************************************/
+
+void closeBenchHistory() {
+    munmap(history.text, history.textMapped);
+    munmap(history.entries, history.indexMapped);
+    close(history.textFD);
+    close(history.indexFD);
+    if(history.order) {
+        munmap(history.order, history.orderMapped);
+        close(history.sortedFD);
+    }
+    heapFree(history.sortedPath);
+    history = (History){false, -1, -1, NULL, 0, 0, NULL, 0, 0,
+                        history.line, history.lineSize, -1, NULL, NULL, 0,
+                        NULL, NULL, 0};
+}
+
+/*******************************************************************************
+ * Function name:   void benchHistory()
+ *
+ * Description:     Writes a history file of HISTORY_ENTRIES lines, many of
+ *                  them sharing their first 8 characters, and times opening
+ *                  it with no index, which indexes and sorts every line,
+ *                  opening it with only the sorted index gone, which sorts
+ *                  it again, opening it again, which only maps it, and
+ *                  opening it after HISTORY_UNSORTED_MAX more lines were
+ *                  written, which merges them in. Then times prefix
+ *                  searches that find the oldest line or nothing: the
+ *                  first one after the history is opened, as in a new
+ *                  shell, and HISTORY_SEARCHES more.
+ ******************************************************************************/
+
+void benchHistory() {
+    char path[] = "/tmp/smallsh-bench-history.XXXXXX";
+    char index[sizeof(path) + sizeof(HISTORY_INDEX_SUFFIX)];
+    char sorted[sizeof(path) + sizeof(HISTORY_SORTED_SUFFIX)];
+    int fd = mkstemp(path);
+    if(fd == -1) {
+        perror("mkstemp()");
+        return;
+    }
+    snprintf(index, sizeof(index), "%s%s", path, HISTORY_INDEX_SUFFIX);
+    snprintf(sorted, sizeof(sorted), "%s%s", path, HISTORY_SORTED_SUFFIX);
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "cat oldest-entry.txt\n");
+    for(long i = 1; i < HISTORY_ENTRIES; i++) {
+        switch(i % 4) {
+            case 0: fprintf(file, "git commit -m 'change %ld'\n", i); break;
+            case 1: fprintf(file, "make -j8 target%ld\n", i % 100); break;
+            case 2: fprintf(file, "ls -la /tmp/dir%ld\n", i); break;
+            default: fprintf(file, "echo $HOME %ld > out.txt &\n", i);
+        }
+    }
+    fclose(file);
+    setenv(HISTORY_VAR, path, 1);
+
+    // The first open indexes and sorts every line, later opens only map
+    // the files unless lines were added without being sorted
+    uint64_t start = benchNow();
+    openHistory();
+    double indexing = (benchNow() - start) / 1e6;
+    size_t count = history.count;
+    closeBenchHistory();
+    unlink(sorted);
+    start = benchNow();
+    openHistory();
+    double sorting = (benchNow() - start) / 1e6;
+    closeBenchHistory();
+    start = benchNow();
+    openHistory();
+    double mapping = (benchNow() - start) / 1e6;
+    closeBenchHistory();
+    file = fopen(path, "a");
+    for(long i = 0; i <= HISTORY_UNSORTED_MAX; i++) {
+        fprintf(file, "ls -la /tmp/new%ld\n", i);
+    }
+    fclose(file);
+    start = benchNow();
+    openHistory();
+    double merging = (benchNow() - start) / 1e6;
+    printf("{\"bench\":\"history_open\",\"entries\":%zu,\"index_ms\":%.3f,"
+           "\"sort_ms\":%.3f,\"mapped_ms\":%.3f,\"merge_ms\":%.3f,"
+           "\"sorted\":%zu}\n", count, indexing, sorting, mapping, merging,
+           history.sortedCount);
+
+    // Searches that match only the oldest line, or share its key but not
+    // the rest of it, or match nothing, each timed first in a newly opened
+    // history
+    const char *prefixes[] = {"cat old", "git commit -m 'none", "history"};
+    const char *names[] = {"history_prefix_oldest", "history_prefix_long",
+                           "history_prefix_miss"};
+    double first[3];
+    for(int p = 0; p < 3; p++) {
+        uint64_t ns[HISTORY_SEARCHES];
+        size_t length = strlen(prefixes[p]);
+        closeBenchHistory();
+        openHistory();
+        start = benchNow();
+        findHistoryPrefix(prefixes[p], length);
+        first[p] = (benchNow() - start) / 1e3;
+        for(int i = 0; i < HISTORY_SEARCHES; i++) {
+            start = benchNow();
+            findHistoryPrefix(prefixes[p], length);
+            ns[i] = benchNow() - start;
+        }
+        printLatencies(names[p], ns, HISTORY_SEARCHES);
+    }
+    printf("{\"bench\":\"history_prefix_first\",\"oldest_us\":%.3f,"
+           "\"long_us\":%.3f,\"miss_us\":%.3f}\n", first[0], first[1],
+           first[2]);
+    closeBenchHistory();
+    unlink(path);
+    unlink(index);
+    unlink(sorted);
+    unsetenv(HISTORY_VAR);
+}
+
+/*******************************************************************************
+ * Function name:   void benchSignals(long runs)
+ *
+ * Description:     Raises SIGUSR1, caught by queueSignal(), and drains the
+ *                  signal ring after each one, then raises SIGNAL_BURST at
+ *                  once so that most of them find the ring full, and checks
+ *                  that the drain acts on every one of them.
+ *
+ * Receives:        runs        Number of signals raised one at a time
+ ******************************************************************************/
+
+void benchSignals(long runs) {
+    catchSignal(SIGUSR1);
+    uint64_t start = benchNow();
+    for(long i = 0; i < runs; i++) {
+        raise(SIGUSR1);
+        drainSignals();
+    }
+    double single = (double)(benchNow() - start) / runs;
+
+    unsigned long handled = signal_ring.handled;
+    start = benchNow();
+    for(int i = 0; i < SIGNAL_BURST; i++) {
+        raise(SIGUSR1);
+    }
+    drainSignals();
+    double burst = (double)(benchNow() - start) / SIGNAL_BURST;
+    printf("{\"bench\":\"signal_ring\",\"runs\":%ld,\"ns_per_signal\":%.1f,"
+           "\"burst\":%d,\"burst_ns_per_signal\":%.1f,\"burst_handled\":%lu,"
+           "\"past_full_ring\":%lu}\n", runs, single, SIGNAL_BURST, burst,
+           signal_ring.handled - handled, signal_ring.coalesced);
+    fflush(stdout);
+    signal(SIGUSR1, SIG_DFL);
+}
+
+/*******************************************************************************
+ * Function name:   int main(int argc, char *argv[])
+ *
+ * Description:     Sets up the shell's PID string, variables, reaper, signal
+ *                  ring and event loop and runs each benchmark. The optional
+ *                  arguments scale the runs:
+ *                  bench [parse runs] [spawn runs] [reap children]
+ ******************************************************************************/
+
+int main(int argc, char *argv[]) {
+    static char line[BENCH_LINE_CHARS + 1];    // Synthetic command line
+    long parseRuns = argc > 1 ? atol(argv[1]) : PARSE_RUNS;
+    long spawnRuns = argc > 2 ? atol(argv[2]) : SPAWN_RUNS;
+    long reapCount = argc > 3 ? atol(argv[3]) : REAP_CHILDREN;
+    if(parseRuns < 1 || spawnRuns < 1 || reapCount < 1) {
+        fprintf(stderr, "usage: %s [parse runs] [spawn runs] [reap children]\n",
+                argv[0]);
+        return 1;
+    }
+
+    cachePIDString();
+    initVariables();
+    initClassifier();
+    initReaper();
+    initSignalRing();
+    initEventLoop();
+    Command *command = heapAlloc(sizeof(Command));
+    initCommand(command);
+
+    // A typical command
+    benchParse(command, "parse_short", "ls -la /tmp > out.txt &",
+               parseRuns);
+
+    // One argument filling the whole line
+    memset(line, 'a', BENCH_LINE_CHARS);
+    line[BENCH_LINE_CHARS] = '\0';
+    benchParse(command, "parse_max_chars", line, parseRuns / 10);
+
+    // As many one-character arguments as the shell accepts
+    for(int i = 0; i < BENCH_ARGS; i++) {
+        line[2 * i] = 'a';
+        line[2 * i + 1] = ' ';
+    }
+    line[2 * BENCH_ARGS - 1] = '\0';
+    benchParse(command, "parse_max_args", line, parseRuns / 10);
+
+    // Long path arguments filling the line
+    line[0] = '\0';
+    while(strlen(line) + 40 < BENCH_LINE_CHARS) {
+        strcat(line, "/usr/lib/x86_64-linux-gnu/libexample.so ");
+    }
+    benchParse(command, "parse_long_args", line, parseRuns / 10);
+
+    // Arguments that all need "$$" expansion
+    line[0] = '\0';
+    for(int i = 0; i < BENCH_ARGS / 2; i++) {
+        strcat(line, "f$$ ");
+    }
+    benchParse(command, "parse_pid_args", line, parseRuns / 10);
+
+    // A single word that is mostly "$$"
+    memset(line, '$', BENCH_LINE_CHARS - 2);
+    line[BENCH_LINE_CHARS - 2] = '\0';
+    benchExpand(&command->arena, "expand_pid_dense", line, parseRuns / 10);
+
+    // A word built from variables, each looked up in the variable store
+    setVariable("BENCH_DIR", 9, "/usr/local/share", 16, false);
+    benchExpand(&command->arena, "expand_vars",
+                "$BENCH_DIR/${BENCH_DIR}/$BENCH_DIR:$$", parseRuns);
+
+    // Quoted words that are unquoted in place
+    line[0] = '\0';
+    for(int i = 0; i < BENCH_ARGS / 4; i++) {
+        strcat(line, "'a b' \"c\" ");
+    }
+    benchParse(command, "parse_quoted", line, parseRuns / 10);
+
+    // Lines repeated with the parse cache on, so that every parse after the
+    // first is a cache hit
+    initParseCache(PARSE_CACHE_SIZE);
+    benchParse(command, "parse_quoted_cached", line, parseRuns / 10);
+    benchParse(command, "parse_short_cached", "ls -la /tmp > out.txt &",
+               parseRuns);
+    for(int i = 0; i < BENCH_ARGS; i++) {
+        line[2 * i] = 'a';
+        line[2 * i + 1] = ' ';
+    }
+    line[2 * BENCH_ARGS - 1] = '\0';
+    benchParse(command, "parse_max_args_cached", line, parseRuns / 10);
+
+    // A generated file list far past the initial buffer sizes and too long
+    // to be cached; the first run grows the buffers and later runs reuse them
+    char *fileList = heapAlloc(FILE_LIST_ARGS * 16 + 1);
+    char *end = fileList;
+    for(int i = 0; i < FILE_LIST_ARGS; i++) {
+        end += sprintf(end, "dir/file%05d.c ", i);
+    }
+    end[-1] = '\0';
+    benchParse(command, "parse_file_list", fileList, parseRuns / 1000 + 1);
+    heapFree(fileList);
+
+    // Each line classifier on a line with special characters throughout
+    srand(1);
+    for(int i = 0; i < BENCH_LINE_CHARS - 1; i++) {
+        line[i] = " \t'\"\\$abcdefghijklmnopqrstuvwxyz"[rand() % 32];
+    }
+    line[BENCH_LINE_CHARS - 1] = '\0';
+    benchClassify("classify_scalar", classifyBlockScalar, line, parseRuns);
+#if defined(__SSE2__)
+    benchClassify("classify_sse2", classifyBlockSSE2, line, parseRuns);
+    if(__builtin_cpu_supports("avx2")) {
+        benchClassify("classify_avx2", classifyBlockAVX2, line, parseRuns);
+    }
+#elif defined(__aarch64__)
+    benchClassify("classify_neon", classifyBlockNEON, line, parseRuns);
+#endif
+
+    benchSpawn(command, spawnRuns);
+    benchReap(command, reapCount);
+    benchHistory();
+    benchSignals(parseRuns);
+
+    freeCommand(command);
+    heapFree(command);
+    return 0;
+}
@@ -6,8 +6,9 @@
  * Description: Shell program that implements three built-in commands (cd,
  * status, and exit) and for all other commands forks a child process and
  * executes the installed Linux command. User can redirect stdin with
- * < [filename], redirect stdout with > [filename], and run a command in the
- * background by using & as the final argument. User can toggle
+ * < [filename], redirect stdout with > [filename], connect commands into a
+ * pipeline with |, and run a command in the background by using & as the
+ * final argument. User can toggle
  * foreground-only mode on and off with Ctrl-Z. In foreground-only mode,
  * execution of background processes is disabled and a final & argument will
  * be ignored. Displays the PID of a background process when it begins execution
@@ -15,20 +16,56 @@
  * kills a foreground process, the signal number is displayed.
  ******************************************************************************/
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/sched.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-#define MAX_CMD_CHARS 2048      // Max number of characters in a command line
-#define MAX_ARGS 512            // Max number of arguments in a command
+#define CMD_CHARS 2048          // Characters the command buffers start with
+#define ARGS_SIZE 64            // Arguments the argument list starts with
+#define EXPANSIONS_SIZE 16      // References the offset list starts with
+#define LINE_LIMIT 131072       // Longest line if ARG_MAX can't be found
 #define PROMPT ": "             // Character used to prompt the user
 #define COMMENT_PREFIX '#'      // Character that indicates a comment line
 #define PID_EXPAND_CHAR '$'     // A set of two of these expands into the PID
@@ -36,545 +73,12124 @@
 #define MAX_PID_CHARS 20        // Max number of characters in a PID
 #define INPUT_REDIRECT "<"      // Character used for stdin redirection
 #define OUTPUT_REDIRECT ">"     // Character used for stdout redirection
+#define APPEND_REDIRECT ">>"    // Characters used to append stdout to a file
+#define ERROR_REDIRECT "2>"     // Characters used for stderr redirection
+#define ERROR_TO_OUTPUT "2>&1"  // Characters that send stderr to stdout
+#define ALL_OUTPUT_REDIRECT "&>"    // Characters redirecting stdout and stderr
+#define CAPTURE_PREFIX '@'      // Marks a log name after "&>"
+#define PIPE_STR "|"            // Character used to connect pipeline stages
+#define AND_STR "&&"            // Runs the next pipeline if the last succeeded
+#define OR_STR "||"             // Runs the next pipeline if the last failed
+#define SEQUENCE_STR ";"        // Runs the next pipeline after the last
+#define PIPE_SIZE_VAR "SMALLSH_PIPE_SIZE"   // Env var setting pipe buffer size
+#define JOB_TABLE_SIZE 16       // Initial number of slots in the job table
+#define SIGNAL_BATCH 16         // Notifications read from sigchld_fd at once
+#define SIGNAL_RING_SIZE 64     // Signals queued by handlers, a power of two
+#define SIGNAL_DRAIN_BATCH 16   // Queued signals taken off the ring at once
+#define JOB_ID_PREFIX '%'       // Character that marks a job id argument
+#define MAX_JOBS_VAR "SMALLSH_MAX_JOBS" // Env var limiting background jobs
+#define QUEUED_ARG 'a'          // Marks an argument of a queued job
+#define QUEUED_STAGE_END 's'    // Marks the end of a queued job's stage
+#define QUEUED_OPERATOR 'o'     // Marks an operator argument of a queued job
+#define COMMAND_HASH_SIZE 64    // Initial number of slots in the command hash
+#define VAR_STORE_SIZE 64       // Initial number of slots in the variable store
+#define DEFAULT_PATH "/bin:/usr/bin"    // Search path used if PATH is unset
+#define TRACE_FD_VAR "SMALLSH_TRACE_FD" // Env var choosing the trace FD
+#define TRACE_OPTION "trace-timing"     // set -o option that turns on tracing
+#define TRACE_SAMPLES 4096      // Durations kept per phase for percentiles
+#define TRACE_RECORD_MAX 160    // Max characters in one trace record
+#define SPAWN_MODE_VAR "SMALLSH_SPAWN"  // Env var that overrides launch path
+#define BENCH_SPAWN_FLAG "--bench-spawn"    // Flag that runs spawn benchmark
+#define BENCH_SPAWN_RUNS 1000   // Default commands per benchmarked path
+#define BENCH_SPAWN_CMD "/bin/true" // Command launched by spawn benchmark
+#define STARTUP_PROFILE_FLAG "--startup-profile"  // Flag that times startup
+#define STARTUP_STEPS 16        // Max startup steps timed by the profile
+#define GLOB_CHARS "*?["        // Characters that make a word a pattern
+#define DIR_CACHE_SIZE 16       // Directory listings kept for globbing
+#define DIR_READ_SIZE 65536     // Bytes read by each getdents64() call
+#define DIR_SETTLE_NS 1000000000    // Age a directory's mtime must reach
+                                    // before its listing is trusted
+#define METRICS_FILE_VAR "SMALLSH_METRICS_FILE" // Env var naming the file
+                                                // metrics are written to
+#define METRICS_INTERVAL_VAR "SMALLSH_METRICS_INTERVAL" // Env var setting
+                                                        // seconds between
+                                                        // metrics writes
+#define METRICS_INTERVAL 10     // Default seconds between metrics writes
+#define METRICS_TEXT_SIZE 4096  // Initial size of the metrics text buffer
+#define HISTOGRAM_SUB_BITS 3    // Histogram buckets per power of two: 2^3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+#define HISTOGRAM_LE_FIRST 10   // First Prometheus bucket bound: 2^10 ns
+#define HISTOGRAM_LE_LAST 34    // Last Prometheus bucket bound: 2^34 ns
+#define ARENA_CHUNK_SIZE (4 * CMD_CHARS)    // Default arena chunk bytes
+#define ARENA_ALIGN sizeof(void*)   // Alignment of arena allocations
+#define MASK_WORDS ((CMD_CHARS + 63) / 64)  // Words line_mask starts with
+#define PAGE_BYTES 4096         // Smallest page size, for reads past a line
+#define SHORT_RUN 8             // Runs the tokenizer scans without the mask
+#define READ_BLOCK_SIZE 65536   // Bytes the input buffer starts with
+#define SAVED_FD_MIN 10         // Lowest FD a built-in's saved stdio goes to
+#define SPAWN_SERVER_FDS 32     // Max FDs passed with one spawn request
+#define SPAWN_MESSAGE_SIZE 65536    // Max bytes in one spawn request
+#define EVENTS_VAR "SMALLSH_EVENTS" // Env var choosing the event back end
+#define URING_ENTRIES 8         // Submission queue entries of the io_uring
+#define EVENT_BIT(source) (1u << (source))  // Mask bit of an EventSource
+#define BUILTIN_KEY(length, first, last) \
+    (((length) << 16) | ((unsigned char)(first) << 8) | (unsigned char)(last))
+#define LOG_DIR_VAR "SMALLSH_LOG_DIR"   // Env var naming the directory of logs
+#define LOG_SIZE_VAR "SMALLSH_LOG_SIZE" // Env var setting log rotation size
+#define LOG_SIZE 1048576        // Default bytes in a log before it is rotated
+#define LOG_KEEP 3              // Number of rotated logs kept
+#define LOG_SUFFIX ".log"       // Ending of a log's filename
+#define CAPTURE_TABLE_SIZE 8    // Initial number of slots in the capture table
+#define CAPTURE_BATCH 16        // Captures handled per drain
+#define LOG_HEADER_MAX 96       // Max characters in a log chunk's header
+#define LOG_STAMP_SECONDS 1     // Seconds a writer's chunks share a header
+#define HISTORY_VAR "SMALLSH_HISTORY"   // Env var naming the history file
+#define HISTORY_FILE ".smallsh_history" // History file in the home directory
+#define HISTORY_INDEX_SUFFIX ".idx"     // Ending of the history index's name
+#define HISTORY_SORTED_SUFFIX ".srt"    // Ending of the sorted index's name
+#define HISTORY_RESERVE (64 << 20)      // Bytes mapped past a history file
+#define HISTORY_CHAR '!'        // Starts a history reference
+#define HISTORY_BATCH 256       // Index entries written at once
+#define HISTORY_BLOCK 256       // Sorted entries each block maximum covers
+#define HISTORY_UNSORTED_MAX 4096   // Entries added before they are sorted
+#define PARSE_CACHE_VAR "SMALLSH_PARSE_CACHE"   // Env var sizing parse cache
+#define PARSE_CACHE_SIZE 64     // Default number of lines in the parse cache
+#define PARSE_CACHE_LINE_MAX CMD_CHARS  // Longest line the parse cache keeps
+#define PARSE_CACHE_BLOCK_MIN 256   // Shortest line an entry's block fits
+#define LINE_HASH_MULTIPLIER 0x9e3779b97f4a7c15ull  // Mixes line hash words
+#define LIMIT_OPTIONS 8         // Resource limits the ulimit built-in sets
+#define CGROUP_VAR "SMALLSH_CGROUP"     // Env var naming the slices' parent
+#define CGROUP_MOUNTS "/proc/self/mounts"   // Where the cgroup2 mount is found
+#define CGROUP_SELF "/proc/self/cgroup"     // Where the shell's cgroup is found
+#define SLICE_TABLE_SIZE 4      // Initial number of slots in the slice table
+#define SLICE_VALUE_MAX 64      // Max characters of a slice setting listed
+#define CONTROL_VAR "SMALLSH_CONTROL"   // Env var naming the control socket
+#define CONTROL_TCP_PREFIX "tcp:"       // Starts a TCP control socket address
+#define CONTROL_HOST "127.0.0.1"        // Host of a TCP address without one
+#define CONTROL_HEADER 4        // Bytes of the length before each frame
+#define CONTROL_FRAME_MAX 65536 // Max bytes in the body of a request frame
+#define CONTROL_READ 4096       // Bytes read from a control client at once
+#define CONTROL_REPLY_MAX 256   // Max characters in one reply frame
+#define CONTROL_TABLE_SIZE 8    // Initial number of control client slots
+#define CONTROL_BATCH 16        // Control socket events handled per drain
+
+extern char **environ;
+
+/*******************************************************************************
+ * Enum name:       SpawnMode
+ * Description:     Selects how external commands are launched. SPAWN_AUTO
+ *                  uses posix_spawn unless the command needs something only
+ *                  fork() can do, SPAWN_FORK always forks, and SPAWN_SERVER
+ *                  asks the spawn server to launch them.
+ ******************************************************************************/
+
+typedef enum SpawnMode {
+    SPAWN_AUTO,
+    SPAWN_FORK,
+    SPAWN_SERVER
+} SpawnMode;
+
+/*******************************************************************************
+ * Struct name:     SpawnRequest
+ * Description:     Header of a message asking the spawn server to launch a
+ *                  command. It is followed by numDups pairs of ints, each a
+ *                  source and a target FD for dup2(), then the executable's
+ *                  path, the arguments and the environment entries, each
+ *                  terminated. A source of 0 or more indexes the FDs passed
+ *                  with the message and a negative source -(fd + 1) names
+ *                  one of the child's own FDs. When the shell has changed
+ *                  directory since the last request, its new working
+ *                  directory is passed as the last FD.
+ *
+ * Members:         pid_t pgid          Process group to join: 0 starts a new
+ *                                      group, -1 stays in the shell's group
+ *                  bool terminal       True if the group takes the terminal
+ *                  bool background     True for a background process
+ *                  int numDups         Number of dup2() calls to make
+ *                  int pathLength      Bytes in the path, 0 to search PATH
+ *                  int numArgs         Number of arguments
+ *                  int numEnv          Number of environment entries, or -1
+ *                                      if the environment hasn't changed
+ *                                      since the last request
+ *                  bool directory      True if the last FD passed is the
+ *                                      working directory to change to
+ ******************************************************************************/
+
+typedef struct SpawnRequest {
+    pid_t pgid;
+    bool terminal;
+    bool background;
+    bool directory;
+    int numDups;
+    int pathLength;
+    int numArgs;
+    int numEnv;
+} SpawnRequest;
 
 bool foreground_only = false;   // Indicates foreground-only mode in effect
+SpawnMode spawn_mode = SPAWN_AUTO;  // Launch path selected at startup
+int spawn_server_fd = -1;       // Socket to the spawn server, or -1
+pid_t spawn_server_pid = -1;    // PID of the spawn server, or -1
+unsigned long spawn_server_env = 0; // envVersion the spawn server last got
+unsigned long cwd_version = 0;  // Times the shell has changed directory
+unsigned long spawn_server_cwd = 0; // cwd_version the spawn server last got
+unsigned long heap_calls = 0;   // Number of malloc()/free() calls made
+char pid_string[MAX_PID_CHARS]; // Shell PID as text, cached at startup
+size_t pid_string_len = 0;      // Number of characters in pid_string
+char background_operator[] = BACKGROUND_STR;    // Operator arguments point
+char input_operator[] = INPUT_REDIRECT;         // to these strings, so that
+char output_operator[] = OUTPUT_REDIRECT;       // quoted words with the same
+char append_operator[] = APPEND_REDIRECT;       // text aren't operators
+char error_operator[] = ERROR_REDIRECT;
+char error_to_output_operator[] = ERROR_TO_OUTPUT;
+char all_output_operator[] = ALL_OUTPUT_REDIRECT;
+char pipe_operator[] = PIPE_STR;
+char and_operator[] = AND_STR;
+char or_operator[] = OR_STR;
+char sequence_operator[] = SEQUENCE_STR;
+uint64_t *line_mask = NULL;     // Bit set for each special char of the line
+size_t line_mask_words = 0;     // Number of words allocated for line_mask
+size_t line_limit = LINE_LIMIT; // Longest line that is run, from ARG_MAX
+const bool special_chars[256] = {   // Characters the tokenizer stops at
+    ['\0'] = true, [' '] = true, ['\t'] = true, ['\''] = true, ['"'] = true,
+    ['\\'] = true, [PID_EXPAND_CHAR] = true, ['*'] = true, ['?'] = true,
+    ['['] = true, [';'] = true, ['&'] = true, ['|'] = true
+};
+uint64_t (*classify_block)(const char*) = NULL;  // Chosen line classifier
+const char *classifier_name = NULL;     // Name of the chosen classifier
+bool interactive = true;        // False in script mode: no prompt is printed
+bool job_control = false;       // Each job gets its own group and terminal
+pid_t shell_pid = -1;           // PID of the shell, not of a forked stage
+int pipe_size = 0;              // Pipe buffer size to request, 0 for default
+int fg_status = 0;              // Exit status of foreground processes
+int builtin_status = 0;         // Exit status of the last built-in run in
+                                // the shell process
+int sigchld_fd = -1;            // Readable when a child changes state
+sigset_t shell_sigmask;         // Signal mask to restore in children
+long max_jobs = 0;              // Max background jobs running at once, 0
+                                // until jobLimit() counts the CPUs
+bool throttle_all = false;      // True if every & command obeys max_jobs
+
+/*******************************************************************************
+ * Struct name:     ArenaChunk
+ * Description:     A block of memory handed out by an Arena
+ *
+ * Members:         ArenaChunk* next    Next chunk in the arena's chain
+ *                  size_t size         Number of bytes in data
+ *                  char data[]         Memory handed out by arenaAlloc()
+ ******************************************************************************/
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+/*******************************************************************************
+ * Struct name:     Arena
+ * Description:     Bump allocator for memory that lives as long as a single
+ *                  command. Chunks are kept when the arena is reset, so once
+ *                  the arena has grown to fit the largest command no more
+ *                  heap calls are needed.
+ *
+ * Members:         ArenaChunk* first   First chunk of the chain
+ *                  ArenaChunk* current Chunk allocations are taken from
+ *                  size_t used         Bytes used in the current chunk
+ ******************************************************************************/
+
+typedef struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    size_t used;
+} Arena;
+
+/*******************************************************************************
+ * Enum name:       ReadResult
+ * Description:     Outcome of a call to readLine()
+ ******************************************************************************/
+
+typedef enum ReadResult {
+    READ_LINE,          // A complete line was read
+    READ_EOF,           // No more input
+    READ_INTERRUPTED,   // A signal interrupted the read
+    READ_TOO_LONG       // A line over line_limit was read and discarded
+} ReadResult;
+
+/*******************************************************************************
+ * Struct name:     LineReader
+ * Description:     Reads input in large blocks and splits it into lines in
+ *                  user space, so that a script costs one read() per block
+ *                  instead of one or more per line. The buffer doubles
+ *                  whenever a line doesn't fit in it.
+ *
+ * Members:         int fd                  File descriptor input is read from
+ *                  char* buffer            Block of input read from fd
+ *                  size_t size             Number of bytes in buffer
+ *                  size_t start            Offset of the first unread byte
+ *                  size_t end              Offset one past the last byte read
+ *                  unsigned long lineNumber Number of lines read so far
+ *                  bool eof                True once read() has returned 0
+ ******************************************************************************/
+
+typedef struct LineReader {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t start;
+    size_t end;
+    unsigned long lineNumber;
+    bool eof;
+} LineReader;
+
+/*******************************************************************************
+ * Enum name:       EventSource
+ * Description:     Things the shell waits on, each watched through one FD
+ ******************************************************************************/
+
+typedef enum EventSource {
+    EVENT_INPUT,        // The FD commands are read from has input
+    EVENT_CHILD,        // sigchld_fd has SIGCHLD notifications
+    EVENT_SERVER,       // The spawn server's socket has hung up
+    EVENT_CAPTURE,      // A captured job's output is waiting to be logged
+    EVENT_SIGNAL,       // A signal handler has queued a signal
+    EVENT_CONTROL,      // A control client or connection is waiting
+    EVENT_METRICS,      // The metrics timer has expired
+    EVENT_SOURCES       // Number of sources
+} EventSource;
+
+/*******************************************************************************
+ * Enum name:       EventBackend
+ * Description:     How the event loop waits: EVENTS_URING submits one-shot
+ *                  poll requests to an io_uring and waits for completions in
+ *                  the same io_uring_enter() call, EVENTS_EPOLL waits with
+ *                  epoll_wait().
+ ******************************************************************************/
+
+typedef enum EventBackend {
+    EVENTS_EPOLL,
+    EVENTS_URING
+} EventBackend;
+
+/*******************************************************************************
+ * Struct name:     EventLoop
+ * Description:     The FD the shell waits on for every EventSource and the
+ *                  state of its epoll set or io_uring. A source is armed
+ *                  while a wait on it is registered with the kernel; the
+ *                  input is armed one-shot, so that input typed while a
+ *                  foreground job runs doesn't wake the shell.
+ *
+ * Members:         EventBackend backend    Back end in use
+ *                  int fd                  epoll or io_uring FD, or -1
+ *                  int fds[]               FD of each source, or -1
+ *                  bool armed[]            True while a source is armed
+ *                  bool alwaysReady[]      True for a regular file, which
+ *                                          can always be read
+ *                  unsigned *sqHead        Submission queue ring head,
+ *                  unsigned *sqTail        tail, mask and array of SQE
+ *                  unsigned *sqMask        indexes
+ *                  unsigned *sqArray
+ *                  struct io_uring_sqe* sqes   Submission queue entries
+ *                  unsigned *cqHead        Completion queue ring head, tail
+ *                  unsigned *cqTail        and mask
+ *                  unsigned *cqMask
+ *                  struct io_uring_cqe* cqes   Completion queue entries
+ *                  unsigned queued         SQEs not yet submitted
+ *                  unsigned long waits     Number of waits that blocked
+ ******************************************************************************/
+
+typedef struct EventLoop {
+    EventBackend backend;
+    int fd;
+    int fds[EVENT_SOURCES];
+    bool armed[EVENT_SOURCES];
+    bool alwaysReady[EVENT_SOURCES];
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+    unsigned long waits;
+} EventLoop;
+
+/*******************************************************************************
+ * Struct name:     SignalRing
+ * Description:     Queue of caught signals between the handler, which only
+ *                  adds a signal number and wakes the event loop, and the
+ *                  main loop, which takes them off in batches and acts on
+ *                  them. Handlers run with every signal blocked, so there is
+ *                  never more than one adding at a time, and the indexes
+ *                  are read and written atomically, so neither side takes a
+ *                  lock. A signal that finds the ring full is counted
+ *                  instead, so a burst is handled in full once drained.
+ *
+ * Members:         int signals[]   Signal numbers, indexed by position
+ *                                  modulo SIGNAL_RING_SIZE
+ *                  unsigned head   Position of the next signal to take off,
+ *                                  written by the main loop
+ *                  unsigned tail   Position the next signal goes to,
+ *                                  written by the handler
+ *                  unsigned overflow[]     Signals of each number that
+ *                                          found the ring full
+ *                  unsigned overflowed     Nonzero once overflow has a
+ *                                          count to take
+ *                  unsigned woken  Nonzero once the handler has woken the
+ *                                  main loop for the signals queued
+ *                  int wakeFD      eventfd the handler writes to, or -1
+ *                  unsigned long handled   Signals acted on
+ *                  unsigned long coalesced Signals that were counted in
+ *                                          overflow rather than queued
+ ******************************************************************************/
+
+typedef struct SignalRing {
+    int signals[SIGNAL_RING_SIZE];
+    unsigned head;
+    unsigned tail;
+    unsigned overflow[NSIG];
+    unsigned overflowed;
+    unsigned woken;
+    int wakeFD;
+    unsigned long handled;
+    unsigned long coalesced;
+} SignalRing;
+
+/*******************************************************************************
+ * Struct name:     CaptureLog
+ * Description:     A log that captured output is moved into, shared by
+ *                  every capture given the same name
+ *
+ * Members:         char* name      Name the log was given after "@", or
+ *                                  NULL if the slot is empty
+ *                  char* path      Absolute path of the log file, stored in
+ *                                  the same allocation as name
+ *                  int fd          FD the log file is open on
+ *                  off_t size      Number of bytes in the log file
+ *                  off_t limit     Size past which the log is rotated
+ *                  int captures    Number of captures writing to the log
+ *                  unsigned long writer    Launch named by the last header,
+ *                                          or 0
+ *                  time_t stamped  Time of the last header
+ ******************************************************************************/
+
+typedef struct CaptureLog {
+    char *name;
+    char *path;
+    int fd;
+    off_t size;
+    off_t limit;
+    int captures;
+    unsigned long writer;
+    time_t stamped;
+} CaptureLog;
+
+/*******************************************************************************
+ * Struct name:     Capture
+ * Description:     The pipe a job's captured stdout and stderr are written
+ *                  into, read by the shell until every writer has closed it
+ *
+ * Members:         int fd          Read end of the pipe, or -1 if the slot is
+ *                                  empty
+ *                  int log         Index of the CaptureLog it is moved into
+ *                  int jobId       Id of the job writing into it, or 0
+ *                                  before the job has launched
+ *                  pid_t pid       PID of the stage writing into it
+ *                  unsigned long launch    Number of the stage among those
+ *                                          launched with captures, which
+ *                                          unlike jobId is never reused
+ ******************************************************************************/
+
+typedef struct Capture {
+    int fd;
+    int log;
+    int jobId;
+    pid_t pid;
+    unsigned long launch;
+} Capture;
+
+/*******************************************************************************
+ * Struct name:     CaptureTable
+ * Description:     Every open capture and log. The pipes are watched through
+ *                  one epoll set, so the event loop has a single capture FD
+ *                  to wait on however many jobs are captured.
+ *
+ * Members:         Capture* captures   Array of capture slots
+ *                  int capacity        Number of slots in captures
+ *                  CaptureLog* logs    Array of log slots
+ *                  int numLogs         Number of slots in logs
+ *                  int epollFD         epoll set of the capture pipes, or -1
+ *                                      before the first capture
+ *                  bool splice         False once splice() has been refused
+ *                                      for a log, after which output is
+ *                                      copied with read() and write()
+ *                  unsigned long chunks    Number of chunks logged
+ *                  unsigned long bytes     Number of bytes logged
+ *                  unsigned long launches  Number of stages launched with
+ *                                          captures
+ *                  int peekFDs[2]  Pipe captured output is copied into with
+ *                                  tee() to look at it without taking it
+ *                                  from its pipe, or -1s before the first
+ *                                  time
+ ******************************************************************************/
+
+typedef struct CaptureTable {
+    Capture *captures;
+    int capacity;
+    CaptureLog *logs;
+    int numLogs;
+    int epollFD;
+    bool splice;
+    unsigned long chunks;
+    unsigned long bytes;
+    unsigned long launches;
+    int peekFDs[2];
+} CaptureTable;
+
+/*******************************************************************************
+ * Struct name:     Redirection
+ * Description:     One IO redirection of a pipeline stage, planned when the
+ *                  line is parsed. Redirections are applied in the order
+ *                  they were given, after the stage's pipes are connected.
+ *
+ * Members:         int fd          FD the redirection replaces
+ *                  char* operator  Operator the redirection was given with
+ *                  char* file      File to open onto fd, or NULL to
+ *                                  duplicate sourceFD onto it
+ *                  int flags       open() flags for file
+ *                  int sourceFD    FD duplicated onto fd if file is NULL
+ *                  int openedFD    FD the parent opened file on, or -1
+ *                  bool capture    True if file is a log name after "&>"
+ *                  int captured    Slot of the capture the parent started
+ *                                  for it, or -1
+ *
+ *                  "&>" plans two redirections: stdout to its file, then
+ *                  stderr to stdout with a NULL operator, since the second
+ *                  isn't written back when the stage is stored or shown.
+ ******************************************************************************/
+
+typedef struct Redirection {
+    int fd;
+    char *operator;
+    char *file;
+    int flags;
+    int sourceFD;
+    int openedFD;
+    bool capture;
+    int captured;
+} Redirection;
+
+/*******************************************************************************
+ * Struct name:     Stage
+ * Description:     One command of a pipeline
+ *
+ * Members:         char* args      NULL-terminated arguments of the stage,
+ *                                  pointing into the Command's args array,
+ *                                  with the redirections taken out
+ *                  int numArgs     Number of arguments in the args array
+ *                  pid_t pid       PID of the stage's process once launched,
+ *                                  or -1 if it couldn't be launched
+ *                  Redirection* redirections   The stage's redirections,
+ *                                  pointing into the Command's array
+ *                  int numRedirections Number of redirections
+ ******************************************************************************/
+
+typedef struct Stage {
+    char **args;
+    int numArgs;
+    pid_t pid;
+    Redirection *redirections;
+    int numRedirections;
+} Stage;
+
+/*******************************************************************************
+ * Enum name:       ListOperator
+ * Description:     How a pipeline is joined to the one before it on the line
+ ******************************************************************************/
+
+typedef enum ListOperator {
+    LIST_ALWAYS,            // First pipeline, or after ";" or "&"
+    LIST_AND,               // After "&&": runs if the last status was 0
+    LIST_OR                 // After "||": runs if the last status wasn't 0
+} ListOperator;
+
+/*******************************************************************************
+ * Struct name:     Pipeline
+ * Description:     One pipeline of a command line. A line is a list of
+ *                  pipelines joined by ";", "&", "&&" and "||", which the
+ *                  shell evaluates itself, so a pipeline that is skipped
+ *                  never starts a process.
+ *
+ * Members:         int firstStage  Index of the pipeline's first stage in
+ *                                  the Command's stages array
+ *                  int numStages   Number of stages in the pipeline
+ *                  ListOperator joiner How the pipeline follows the last one
+ *                  bool background True if the pipeline was ended by "&"
+ ******************************************************************************/
+
+typedef struct Pipeline {
+    int firstStage;
+    int numStages;
+    ListOperator joiner;
+    bool background;
+} Pipeline;
 
 /*******************************************************************************
  * Struct name:     Command
  * Description:     Represents a command input by the user
  *
- * Members:         char* args      Array of arguments input by the user
+ * Members:         char* args      Array of arguments input by the user. The
+ *                                  arguments of each pipeline stage are
+ *                                  followed by a NULL pointer.
  *                  char* line      The line of command text input by the user
- *                  int numArgs     Number of arguments in the args array
+ *                  size_t lineLength   Number of characters in line
+ *                  int numArgs     Number of slots used in the args array
+ *                  Stage* stages   The pipeline stages of the command
+ *                  int numStages   Number of stages in the stages array
+ *                  Pipeline* pipelines The pipelines of the line, each a
+ *                                  run of stages
+ *                  int numPipelines    Number of pipelines in the array
  *                  bool background True if the command was run as a background
  *                                  process, false if not.
+ *                  Redirection* redirections   Redirections of every stage
+ *                  int numRedirections Number of redirections in the array
+ *                  int argCapacity Number of arguments args has room for,
+ *                                  besides its terminator. stages and
+ *                                  pipelines have room for one more and
+ *                                  redirections for as many.
+ *                  size_t* expansions  Offsets of the variable references
+ *                                      in the word being parsed
+ *                  size_t expansionCapacity    Number of offsets expansions
+ *                                              has room for
+ *                  Arena arena     Memory for the arguments of the command
  ******************************************************************************/
 
 typedef struct Command {
     char **args;
     char *line;
+    size_t lineLength;
     int numArgs;
+    Stage *stages;
+    int numStages;
+    Pipeline *pipelines;
+    int numPipelines;
     bool background;
+    Redirection *redirections;
+    int numRedirections;
+    int argCapacity;
+    size_t *expansions;
+    size_t expansionCapacity;
+    Arena arena;
 } Command;
 
-void promptLoop(Command *command);
-void parseCommandLine(Command *command);
-void expandPID(char **argument);
-int getPIDString(char **pidStr);
-void printExitValOrSignal(int exitStatus);
-int executeCommand(Command *command);
-void redirect(Command* command);
-void checkBackgroundChildren();
-void catchSIGTSTP(int signo);
+/*******************************************************************************
+ * Struct name:     Launch
+ * Description:     Describes how the process for a pipeline stage is set up
+ *
+ * Members:         int inputFD     Pipe read end to use as stdin, or -1
+ *                  int outputFD    Pipe write end to use as stdout, or -1
+ *                  pid_t pgid      Process group to join: 0 starts a new
+ *                                  group, -1 stays in the shell's group
+ *                  bool background True if the stage is part of a background
+ *                                  process
+ *                  bool terminal   True if the process group should be given
+ *                                  the terminal
+ *                  int nullFD      /dev/null, opened for a background stage
+ *                                  whose stdin or stdout goes nowhere else,
+ *                                  or -1
+ *                  int sliceFD     Directory of the slice the process is
+ *                                  launched into, or -1
+ ******************************************************************************/
+
+typedef struct Launch {
+    int inputFD;
+    int outputFD;
+    pid_t pgid;
+    bool background;
+    bool terminal;
+    int nullFD;
+    int sliceFD;
+} Launch;
+
+/*******************************************************************************
+ * Struct name:     ControlClient
+ * Description:     A connection to the control socket. Requests and replies
+ *                  are frames: a 4-byte big-endian length, then that many
+ *                  bytes of text. The buffers are kept when the slot is
+ *                  reused.
+ *
+ * Members:         int fd          Connected socket, or -1 if the slot is
+ *                                  free
+ *                  bool writing    True while the socket is watched for
+ *                                  room to write the rest of out
+ *                  char* in        Bytes received that don't yet make up a
+ *                                  whole frame
+ *                  size_t inUsed   Number of bytes in in
+ *                  size_t inSize   Size of the buffer allocated for in
+ *                  char* out       Reply frames the socket hasn't taken yet
+ *                  size_t outUsed  Number of bytes in out
+ *                  size_t outSize  Size of the buffer allocated for out
+ *                  bool metrics    True once the client has asked for the
+ *                                  metrics, which it is then sent every
+ *                                  interval
+ ******************************************************************************/
+
+typedef struct ControlClient {
+    int fd;
+    bool writing;
+    char *in;
+    size_t inUsed;
+    size_t inSize;
+    char *out;
+    size_t outUsed;
+    size_t outSize;
+    bool metrics;
+} ControlClient;
+
+/*******************************************************************************
+ * Struct name:     ControlTable
+ * Description:     The control socket and its clients. The listening socket
+ *                  and every client are in an epoll set of their own, which
+ *                  the event loop watches as EVENT_CONTROL.
+ *
+ * Members:         int listenFD        Listening socket, or -1
+ *                  int epollFD         epoll set of the sockets, or -1
+ *                  char* path          Unix socket file removed when the
+ *                                      shell exits, or NULL
+ *                  ControlClient* clients  Array of client slots
+ *                  int capacity        Number of slots in clients
+ *                  int client          Client whose request is running, or
+ *                                      -1
+ *                  bool replied        True once the running request's job
+ *                                      has been replied about
+ *                  int job             Index of the job the running
+ *                                      pipeline launched or queued, or -1
+ *                  Command* command    Command requests are parsed into
+ *                  char* line          Copy of the request being run
+ *                  size_t lineSize     Size of the buffer allocated for line
+ *                  unsigned long requests  Requests run
+ *                  unsigned long replies   Reply frames queued
+ ******************************************************************************/
+
+typedef struct ControlTable {
+    int listenFD;
+    int epollFD;
+    char *path;
+    ControlClient *clients;
+    int capacity;
+    int client;
+    bool replied;
+    int job;
+    Command *command;
+    char *line;
+    size_t lineSize;
+    unsigned long requests;
+    unsigned long replies;
+} ControlTable;
+
+/*******************************************************************************
+ * Enum name:       JobState
+ * Description:     State of a slot in the job table
+ ******************************************************************************/
+
+typedef enum JobState {
+    JOB_FREE,           // The slot isn't in use
+    JOB_QUEUED,         // The job is waiting for a free slot to launch
+    JOB_RUNNING,        // Some of the job's processes haven't terminated
+    JOB_STOPPED,        // Every process not yet reaped is stopped
+    JOB_DONE            // All of the job's processes have terminated
+} JobState;
+
+/*******************************************************************************
+ * Struct name:     Job
+ * Description:     A command launched by the shell, made up of one process
+ *                  per pipeline stage
+ *
+ * Members:         int id          Job id, one more than the job's index in
+ *                                  the job table
+ *                  JobState state  State of the job
+ *                  bool background True for a background job
+ *                  int numProcs    Number of processes not yet reaped
+ *                  int numStopped  Number of those processes that are
+ *                                  stopped
+ *                  pid_t lastPid   PID of the final stage's process
+ *                  pid_t pgid      Process group of the job's processes, or
+ *                                  -1 if they are in the shell's group
+ *                  int slice       Index of the slice the job is launched
+ *                                  into, or -1
+ *                  int client      Control client the job's results are
+ *                                  sent to, or -1
+ *                  int status      Exit status of the final stage
+ *                  int stopSignal  Signal that last stopped a process
+ *                  bool stopNotice True if the job stopped in the
+ *                                  background and hasn't been reported
+ *                  bool savedModes True if modes holds the terminal modes
+ *                                  the job had when it stopped
+ *                  struct termios modes    Terminal modes given back to the
+ *                                          job when it is continued in the
+ *                                          foreground
+ *                  int next        Index of the next job on the free list,
+ *                                  the launch queue, the completion list or
+ *                                  the list queue, or -1
+ *                  char* text      The job's arguments joined by spaces. The
+ *                                  buffer is kept when the slot is reused.
+ *                  size_t textSize Size of the buffer allocated for text
+ *                  char* queued    Arguments of a queued job, each stored as
+ *                                  QUEUED_ARG (or QUEUED_OPERATOR) followed
+ *                                  by the string, with QUEUED_STAGE_END
+ *                                  after each stage
+ *                  size_t queuedSize   Size of the buffer allocated for
+ *                                      queued
+ *                  bool hasRest    True if rest holds pipelines of a control
+ *                                  request's list to run once the job is
+ *                                  done
+ *                  ListOperator restJoiner How the first pipeline of rest
+ *                                          follows the job
+ *                  char* rest      The pipelines left, stored like queued
+ *                                  but as the words of the line: each
+ *                                  argument and operator, with "|", ";",
+ *                                  "&", "&&" or "||" between stages
+ *                  size_t restSize Size of the buffer allocated for rest
+ *                  struct timespec start   Monotonic time the job launched
+ *                  struct timespec end     Monotonic time the job finished
+ *                  struct rusage usage     Resources used by all of the
+ *                                          job's reaped processes
+ ******************************************************************************/
+
+typedef struct Job {
+    int id;
+    JobState state;
+    bool background;
+    int numProcs;
+    int numStopped;
+    pid_t lastPid;
+    pid_t pgid;
+    int slice;
+    int client;
+    int status;
+    int stopSignal;
+    bool stopNotice;
+    bool savedModes;
+    struct termios modes;
+    int next;
+    char *text;
+    size_t textSize;
+    char *queued;
+    size_t queuedSize;
+    bool hasRest;
+    ListOperator restJoiner;
+    char *rest;
+    size_t restSize;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+} Job;
+
+/*******************************************************************************
+ * Struct name:     PidEntry
+ * Description:     Entry of the job table's PID map
+ *
+ * Members:         pid_t pid       PID of a running child, or 0 if empty
+ *                  int job         Index of the child's job
+ *                  bool stopped    True while the child is stopped
+ ******************************************************************************/
+
+typedef struct PidEntry {
+    pid_t pid;
+    int job;
+    bool stopped;
+} PidEntry;
+
+/*******************************************************************************
+ * Struct name:     JobTable
+ * Description:     Every job the shell has launched that hasn't been
+ *                  reported yet. An open-addressing hash map from PID to job
+ *                  lets the reaper find a child's job in constant time.
+ *
+ * Members:         Job* jobs           Array of job slots
+ *                  int capacity        Number of slots in jobs
+ *                  int freeHead        Index of the first free slot, or -1
+ *                  int doneHead        Index of the first completed
+ *                                      background job to report, or -1
+ *                  int doneTail        Index of the last completed
+ *                                      background job to report, or -1
+ *                  int queueHead       Index of the next queued job to
+ *                                      launch, or -1
+ *                  int queueTail       Index of the last queued job, or -1
+ *                  int listHead        Index of the first done job whose
+ *                                      list has more pipelines to run, or -1
+ *                  int listTail        Index of the last such job, or -1
+ *                  long running        Number of background jobs running
+ *                  PidEntry* pids      PID map, a power of two in size
+ *                  size_t pidCapacity  Number of entries in pids
+ *                  size_t pidCount     Number of entries in use
+ *                  int current         Index of the job fg and bg act on
+ *                                      when given none, or -1
+ *                  int stopNotices     Number of background jobs that have
+ *                                      stopped since the last notices
+ ******************************************************************************/
+
+typedef struct JobTable {
+    Job *jobs;
+    int capacity;
+    int freeHead;
+    int doneHead;
+    int doneTail;
+    int queueHead;
+    int queueTail;
+    int listHead;
+    int listTail;
+    long running;
+    PidEntry *pids;
+    size_t pidCapacity;
+    size_t pidCount;
+    int current;
+    int stopNotices;
+} JobTable;
+
+/*******************************************************************************
+ * Struct name:     HashedCommand
+ * Description:     Location of a command found by searching PATH
+ *
+ * Members:         char* name      Command name, or NULL if the slot is empty
+ *                  char* path      Path of the command's executable, stored
+ *                                  in the same allocation as name
+ *                  unsigned long hits  Number of times the location was used
+ ******************************************************************************/
+
+typedef struct HashedCommand {
+    char *name;
+    char *path;
+    unsigned long hits;
+} HashedCommand;
+
+/*******************************************************************************
+ * Struct name:     CommandHash
+ * Description:     Open-addressing hash table from command name to the
+ *                  executable found for it in PATH
+ *
+ * Members:         HashedCommand* entries  Slots, a power of two in number
+ *                  size_t capacity         Number of slots in entries
+ *                  size_t count            Number of slots in use
+ *                  unsigned long pathVersion   var_store.pathVersion the
+ *                                              locations were found with
+ ******************************************************************************/
+
+typedef struct CommandHash {
+    HashedCommand *entries;
+    size_t capacity;
+    size_t count;
+    unsigned long pathVersion;
+} CommandHash;
+
+/*******************************************************************************
+ * Struct name:     DirentRecord
+ * Description:     One directory entry as getdents64() returns it
+ *
+ * Members:         uint64_t inode  Inode number
+ *                  int64_t offset  Position of the next record
+ *                  unsigned short length   Size of this record in bytes
+ *                  unsigned char type  DT_* type of the entry, or DT_UNKNOWN
+ *                  char name       NUL-terminated name
+ ******************************************************************************/
+
+typedef struct DirentRecord {
+    uint64_t inode;
+    int64_t offset;
+    unsigned short length;
+    unsigned char type;
+    char name[];
+} DirentRecord;
+
+/*******************************************************************************
+ * Struct name:     DirListing
+ * Description:     The names in one directory, read with getdents64() and
+ *                  sorted, which glob patterns are matched against. The
+ *                  listing is used again while the directory's mtime is
+ *                  unchanged, which it is as long as no entry is added,
+ *                  removed or renamed. A directory changed within the last
+ *                  DIR_SETTLE_NS could change again without its mtime
+ *                  moving, so such a listing is read again every time.
+ *
+ * Members:         dev_t device    Device of the directory
+ *                  ino_t inode     Inode of the directory
+ *                  struct timespec mtime   Directory's mtime when read
+ *                  bool settled    True if mtime was old enough when the
+ *                                  listing was read for it to be trusted
+ *                  char* names     Each entry: its DT_* type byte, then its
+ *                                  NUL-terminated name
+ *                  size_t namesSize    Size of the buffer allocated for names
+ *                  char** entries  The entries in names, sorted by name
+ *                  int count       Number of entries
+ *                  int capacity    Number of slots in entries
+ *                  bool busy       True while a pattern is being matched
+ *                                  against the listing, so that it isn't
+ *                                  replaced
+ *                  unsigned long used  dir_cache.clock when last used, or 0
+ *                                      if the slot is free
+ ******************************************************************************/
+
+typedef struct DirListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    bool settled;
+    char *names;
+    size_t namesSize;
+    char **entries;
+    int count;
+    int capacity;
+    bool busy;
+    unsigned long used;
+} DirListing;
+
+/*******************************************************************************
+ * Struct name:     DirCache
+ * Description:     The directory listings kept for glob expansion. The
+ *                  least recently used one is replaced when all
+ *                  DIR_CACHE_SIZE slots are in use.
+ *
+ * Members:         DirListing* listings    Slots, NULL until the first glob
+ *                  char* buffer    DIR_READ_SIZE bytes getdents64() reads
+ *                                  into
+ *                  char* path      Path being matched, PATH_MAX bytes
+ *                  unsigned long clock Counts lookups, to find the least
+ *                                      recently used slot
+ *                  unsigned long globs     Words expanded
+ *                  unsigned long reads     Directories read
+ *                  unsigned long cached    Listings used without a read
+ ******************************************************************************/
+
+typedef struct DirCache {
+    DirListing *listings;
+    char *buffer;
+    char *path;
+    unsigned long clock;
+    unsigned long globs;
+    unsigned long reads;
+    unsigned long cached;
+} DirCache;
+
+/*******************************************************************************
+ * Struct name:     Variable
+ * Description:     A shell variable. Its name is interned when it is first
+ *                  set; its value lives in a "NAME=value" entry that an
+ *                  exported variable shares with the environment children
+ *                  are given.
+ *
+ * Members:         char* name          Interned name
+ *                  size_t nameLength   Number of characters in name
+ *                  size_t hash         hashName() of name
+ *                  char* entry         "NAME=value"
+ *                  size_t entrySize    Number of bytes allocated for entry
+ *                  char* value         Value, inside entry
+ *                  size_t valueLength  Number of characters in value
+ *                  int envIndex        Index of entry in the environment, or
+ *                                      -1 if the variable isn't exported
+ ******************************************************************************/
+
+typedef struct Variable {
+    char *name;
+    size_t nameLength;
+    size_t hash;
+    char *entry;
+    size_t entrySize;
+    char *value;
+    size_t valueLength;
+    int envIndex;
+} Variable;
+
+/*******************************************************************************
+ * Struct name:     VariableStore
+ * Description:     Open-addressing hash table of the shell's variables and
+ *                  the environment built from the exported ones, which is
+ *                  updated one entry at a time as variables change
+ *
+ * Members:         Variable* slots         Slots, a power of two in number
+ *                  size_t capacity         Number of slots
+ *                  size_t count            Number of slots in use
+ *                  char** envp             NULL-terminated environment
+ *                  int envCount            Number of entries in envp
+ *                  int envCapacity         Number of pointers allocated
+ *                  unsigned long envVersion    Changes whenever envp does
+ *                  unsigned long pathVersion   Changes whenever PATH does
+ ******************************************************************************/
+
+typedef struct VariableStore {
+    Variable *slots;
+    size_t capacity;
+    size_t count;
+    char **envp;
+    int envCount;
+    int envCapacity;
+    unsigned long envVersion;
+    unsigned long pathVersion;
+} VariableStore;
+
+/*******************************************************************************
+ * Struct name:     CachedWord
+ * Description:     One word of a cached line. Offsets are 32 bits wide to
+ *                  keep the table small, since no line is that long.
+ *
+ * Members:         uint32_t offset     Offset of the unquoted word in the
+ *                                      entry's text
+ *                  uint32_t length     Number of characters in the word
+ *                  uint32_t firstExpansion Index of the word's first
+ *                                          variable reference offset in the
+ *                                          entry's expansions
+ *                  uint16_t numExpansions  Number of references to expand
+ *                  bool operator       True if the word is an operator
+ *                  bool quoted         True if the word used any quoting
+ *                  bool pattern        True if the word has an unquoted
+ *                                      glob character
+ ******************************************************************************/
+
+typedef struct CachedWord {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t firstExpansion;
+    uint16_t numExpansions;
+    bool operator;
+    bool quoted;
+    bool pattern;
+} CachedWord;
+
+/*******************************************************************************
+ * Struct name:     CachedLine
+ * Description:     A line of input and the words parseCommandLine() split it
+ *                  into, before variables were expanded. The line, the text
+ *                  of the words, the word table and the reference offsets
+ *                  share one
+ *                  block, sized for the longest line the entry has held, so
+ *                  a reused entry needs no heap calls.
+ *
+ * Members:         uint64_t hash       hashLine() of the line
+ *                  bool cached         True if the entry can be found in
+ *                                      the cache's buckets
+ *                  char* line          Copy of the raw line
+ *                  size_t lineLength   Number of characters in line
+ *                  char* text          Unquoted words, each terminated
+ *                  size_t textUsed     Number of characters used in text
+ *                  CachedWord* words   One entry per argument
+ *                  int numArgs         Number of entries in words
+ *                  size_t* expansions      Offsets of variable references in
+ *                                          the words
+ *                  size_t numExpansions    Number of offsets in expansions
+ *                  char* block         Memory holding all of the above
+ *                  size_t blockLength  Longest line block has room for
+ *                  int prev            Index of the entry used more
+ *                                      recently, or -1
+ *                  int next            Index of the entry used less
+ *                                      recently, or -1
+ ******************************************************************************/
+
+typedef struct CachedLine {
+    uint64_t hash;
+    bool cached;
+    char *line;
+    size_t lineLength;
+    char *text;
+    size_t textUsed;
+    CachedWord *words;
+    int numArgs;
+    size_t *expansions;
+    size_t numExpansions;
+    char *block;
+    size_t blockLength;
+    int prev;
+    int next;
+} CachedLine;
+
+/*******************************************************************************
+ * Struct name:     ParseCache
+ * Description:     Least-recently-used cache of parsed lines, so that a line
+ *                  repeated by a script or loop is only tokenized once. An
+ *                  open-addressing hash table finds a line's entry and a
+ *                  doubly linked list orders the entries by last use.
+ *
+ * Members:         CachedLine* entries Entry slots
+ *                  int capacity        Number of slots in entries, 0 if the
+ *                                      cache is disabled
+ *                  int count           Number of slots used so far
+ *                  int* buckets        Entry index per bucket, or -1, a
+ *                                      power of two in number
+ *                  size_t numBuckets   Number of buckets
+ *                  int head            Index of the most recently used
+ *                                      entry, or -1
+ *                  int tail            Index of the least recently used
+ *                                      entry, or -1
+ *                  unsigned long hits  Lines found in the cache
+ *                  unsigned long misses    Lines that had to be tokenized
+ ******************************************************************************/
+
+typedef struct ParseCache {
+    CachedLine *entries;
+    int capacity;
+    int count;
+    int *buckets;
+    size_t numBuckets;
+    int head;
+    int tail;
+    unsigned long hits;
+    unsigned long misses;
+} ParseCache;
+
+/*******************************************************************************
+ * Struct name:     HistoryEntry
+ * Description:     Entry of the history index, one per line of the history
+ *                  file, so that any entry is found without reading the
+ *                  file
+ *
+ * Members:         uint64_t offset Offset of the line in the history file
+ *                  uint64_t key    First 8 characters of the line, padded
+ *                                  with NULs, which most prefix searches
+ *                                  need and nothing else
+ ******************************************************************************/
+
+typedef struct HistoryEntry {
+    uint64_t offset;
+    uint64_t key;
+} HistoryEntry;
+
+/*******************************************************************************
+ * Struct name:     HistoryOrder
+ * Description:     Start of the sorted index kept beside the history file.
+ *                  It is followed by the numbers of the first count entries
+ *                  in the order of their lines, then by the largest number
+ *                  in each HISTORY_BLOCK of them. The last entry sorted is
+ *                  recorded so that an index built again since is noticed.
+ *
+ * Members:         uint64_t count      Number of entries sorted
+ *                  uint64_t lastOffset Offset of entry count in the file
+ *                  uint64_t lastKey    Key of entry count
+ ******************************************************************************/
+
+typedef struct HistoryOrder {
+    uint64_t count;
+    uint64_t lastOffset;
+    uint64_t lastKey;
+} HistoryOrder;
+
+/*******************************************************************************
+ * Struct name:     History
+ * Description:     The command history: an append-only file of lines and
+ *                  an index of HistoryEntry structs beside it, both mapped
+ *                  into memory when the history is opened rather than read.
+ *                  Each mapping reaches HISTORY_RESERVE bytes past the end
+ *                  of its file, so appended entries are seen without
+ *                  mapping the file again.
+ *
+ * Members:         bool opened         True once openHistory() has run
+ *                  int textFD          FD of the history file
+ *                  int indexFD         FD of the history index
+ *                  char* text          Mapping of the history file
+ *                  size_t textSize     Number of bytes in the history file
+ *                  size_t textMapped   Number of bytes mapped at text
+ *                  HistoryEntry* entries   Mapping of the index
+ *                  size_t count        Number of entries in the index
+ *                  size_t indexMapped  Number of bytes mapped at entries
+ *                  char* line          Line built by history expansion
+ *                  size_t lineSize     Size of the buffer allocated for line
+ *                  int sortedFD        FD of the sorted index, or -1
+ *                  char* sortedPath    Path of the sorted index, or NULL if
+ *                                      the history is only in memory
+ *                  HistoryOrder* order Mapping of the sorted index
+ *                  size_t orderMapped  Number of bytes mapped at order
+ *                  uint32_t* sorted    Numbers of the first sortedCount
+ *                                      entries, ordered by their lines and
+ *                                      then by number, so the entries
+ *                                      starting with a prefix are together
+ *                  uint32_t* blockMax  Largest number in each HISTORY_BLOCK
+ *                                      of sorted
+ *                  size_t sortedCount  Number of entries in sorted; the
+ *                                      ones after it are searched in order
+ ******************************************************************************/
+
+typedef struct History {
+    bool opened;
+    int textFD;
+    int indexFD;
+    char *text;
+    size_t textSize;
+    size_t textMapped;
+    HistoryEntry *entries;
+    size_t count;
+    size_t indexMapped;
+    char *line;
+    size_t lineSize;
+    int sortedFD;
+    char *sortedPath;
+    HistoryOrder *order;
+    size_t orderMapped;
+    const uint32_t *sorted;
+    const uint32_t *blockMax;
+    size_t sortedCount;
+} History;
+
+/*******************************************************************************
+ * Struct name:     LimitOption
+ * Description:     A resource limit the ulimit built-in can set
+ *
+ * Members:         char option     Option letter that selects the limit
+ *                  int resource    Resource passed to setrlimit()
+ *                  rlim_t unit     Size of one unit of the values ulimit
+ *                                  takes and prints
+ *                  char* name      Description printed by ulimit -a
+ ******************************************************************************/
+
+typedef struct LimitOption {
+    char option;
+    int resource;
+    rlim_t unit;
+    const char *name;
+} LimitOption;
+
+/*******************************************************************************
+ * Struct name:     JobLimits
+ * Description:     Resource limits set with the ulimit built-in. Each
+ *                  process the shell launches sets them on itself before it
+ *                  executes its command, so the shell keeps its own limits.
+ *
+ * Members:         struct rlimit limits[]  Limit of each LimitOption
+ *                  unsigned set            Bit i is set if limits[i] has
+ *                                          been set
+ ******************************************************************************/
+
+typedef struct JobLimits {
+    struct rlimit limits[LIMIT_OPTIONS];
+    unsigned set;
+} JobLimits;
+
+/*******************************************************************************
+ * Struct name:     Slice
+ * Description:     A cgroup v2 group that jobs can be launched into
+ *
+ * Members:         char* name      Name of the slice, which is the name of
+ *                                  its directory under the slice root
+ *                  int fd          FD of the slice's directory
+ ******************************************************************************/
+
+typedef struct Slice {
+    char *name;
+    int fd;
+} Slice;
+
+/*******************************************************************************
+ * Struct name:     SliceTable
+ * Description:     The slices the shell has opened. Slices are never
+ *                  removed, so a job refers to its slice by index.
+ *
+ * Members:         char* root          Path of the cgroup the slices are
+ *                                      made in, or NULL until it is found
+ *                  int rootFD          FD of the root's directory, or -1
+ *                  Slice* slices       Array of slices
+ *                  int count           Number of slices
+ *                  int capacity        Number of slots in slices
+ *                  int background      Index of the slice every background
+ *                                      job is launched into, or -1
+ *                  unsigned long cloned    Processes that clone3() started
+ *                                          in a slice
+ *                  unsigned long moved     Processes that moved themselves
+ *                                          into a slice after fork()
+ ******************************************************************************/
+
+typedef struct SliceTable {
+    char *root;
+    int rootFD;
+    Slice *slices;
+    int count;
+    int capacity;
+    int background;
+    unsigned long cloned;
+    unsigned long moved;
+} SliceTable;
+
+/*******************************************************************************
+ * Struct name:     StartupProfile
+ * Description:     How long each step of startup took, timed when the shell
+ *                  is started with --startup-profile and printed before the
+ *                  first prompt
+ *
+ * Members:         bool enabled    True until the profile has been printed
+ *                  uint64_t start  Monotonic time main() was entered at
+ *                  uint64_t mark   Monotonic time the last step ended at
+ *                  uint64_t beforeMain CPU time the process had used when
+ *                                      main() was entered: exec() and the
+ *                                      dynamic loader
+ *                  const char* names   Name of each step
+ *                  uint64_t times  Nanoseconds each step took
+ *                  int count       Number of steps timed
+ ******************************************************************************/
+
+typedef struct StartupProfile {
+    bool enabled;
+    uint64_t start;
+    uint64_t mark;
+    uint64_t beforeMain;
+    const char *names[STARTUP_STEPS];
+    uint64_t times[STARTUP_STEPS];
+    int count;
+} StartupProfile;
+
+/*******************************************************************************
+ * Struct name:     Histogram
+ * Description:     Counts of durations in nanoseconds, HDR style: values
+ *                  below HISTOGRAM_SUB have a bucket each, and every power
+ *                  of two above that is split into HISTOGRAM_SUB buckets, so
+ *                  a bucket is never wider than an eighth of its values
+ *                  while any 64-bit value has a bucket.
+ *
+ * Members:         uint64_t counts Number of values in each bucket
+ *                  uint64_t count  Number of values recorded
+ *                  uint64_t sum    Sum of the values recorded
+ *                  uint64_t max    Largest value recorded
+ ******************************************************************************/
+
+typedef struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+/*******************************************************************************
+ * Struct name:     Metrics
+ * Description:     Counters and histograms of what the shell has done,
+ *                  shown by stats and written in Prometheus text format to
+ *                  SMALLSH_METRICS_FILE and to control clients that ask for
+ *                  them. The shell is single-threaded, so they are plain
+ *                  integers updated without atomics, apart from the count
+ *                  kept by children in a page shared with them.
+ *
+ * Members:         unsigned long builtins  Commands run in the shell
+ *                  unsigned long external  Commands launched as jobs
+ *                  unsigned long launched  Processes launched, including
+ *                                          the childFailures
+ *                  unsigned long launchFailures    Stages whose process
+ *                                                  couldn't be launched
+ *                  unsigned long* childFailures    Stages whose child
+ *                                  couldn't redirect or execute the
+ *                                  command, counted by the children, or
+ *                                  NULL before mapChildFailures()
+ *                  long peakJobs   Most background jobs running at once
+ *                  Histogram parse Time parseCommandLine() took per line
+ *                  Histogram reap  Time from the shell waking for child
+ *                                  notifications to each child being reaped
+ *                  char* path      File metrics are written to, or NULL
+ *                  char* tempPath  File written and renamed onto path
+ *                  int timerFD     timerfd expiring every interval, or -1
+ *                  long interval   Seconds between writes
+ *                  char* text      The last metrics formatted
+ *                  size_t textUsed Number of characters in text
+ *                  size_t textSize Size of the buffer allocated for text
+ *                  unsigned long writes    Times the file was written
+ ******************************************************************************/
+
+typedef struct Metrics {
+    unsigned long builtins;
+    unsigned long external;
+    unsigned long launched;
+    unsigned long launchFailures;
+    unsigned long *childFailures;
+    long peakJobs;
+    Histogram parse;
+    Histogram reap;
+    char *path;
+    char *tempPath;
+    int timerFD;
+    long interval;
+    char *text;
+    size_t textUsed;
+    size_t textSize;
+    unsigned long writes;
+} Metrics;
+
+/*******************************************************************************
+ * Enum name:       TokenState
+ * Description:     Quoting state of the tokenizer within a word
+ ******************************************************************************/
+
+typedef enum TokenState {
+    TOKEN_UNQUOTED,         // Outside quotes
+    TOKEN_SINGLE_QUOTED,    // Between '...'
+    TOKEN_DOUBLE_QUOTED     // Between "..."
+} TokenState;
+
+/*******************************************************************************
+ * Enum name:       TracePhase
+ * Description:     Phases of the command lifecycle timed by tracing
+ ******************************************************************************/
+
+typedef enum TracePhase {
+    TRACE_READ,         // readLine() returning a line, including any wait
+    TRACE_PARSE,        // parseCommandLine()
+    TRACE_REDIRECT,     // Opening a stage's redirection files
+    TRACE_SPAWN,        // fork(), or posix_spawn() up to the exec
+    TRACE_WAIT,         // Launch of a foreground job until it is reaped
+    TRACE_TOTAL,        // Line read until the command is finished
+    TRACE_PHASES        // Number of phases
+} TracePhase;
+
+/*******************************************************************************
+ * Struct name:     TraceSamples
+ * Description:     Ring buffer of the most recent durations of one phase
+ *
+ * Members:         uint64_t ns[]       Durations in nanoseconds
+ *                  size_t next         Index the next duration is stored at
+ *                  unsigned long total Number of durations ever recorded
+ ******************************************************************************/
+
+typedef struct TraceSamples {
+    uint64_t ns[TRACE_SAMPLES];
+    size_t next;
+    unsigned long total;
+} TraceSamples;
+
+/*******************************************************************************
+ * Enum name:       BuiltinResult
+ * Description:     Outcome of a call to runBuiltin()
+ ******************************************************************************/
+
+typedef enum BuiltinResult {
+    BUILTIN_NONE,       // The command isn't a built-in command
+    BUILTIN_DONE,       // The built-in command ran
+    BUILTIN_EXIT        // The user ran the exit command
+} BuiltinResult;
+
+/*******************************************************************************
+ * Enum name:       BuiltinId
+ * Description:     Index of each built-in command in the builtins table
+ ******************************************************************************/
+
+typedef enum BuiltinId {
+    BUILTIN_ID_EXIT,
+    BUILTIN_ID_CD,
+    BUILTIN_ID_STATUS,
+    BUILTIN_ID_SET,
+    BUILTIN_ID_TIMINGS,
+    BUILTIN_ID_HASH,
+    BUILTIN_ID_JOBS,
+    BUILTIN_ID_WAIT,
+    BUILTIN_ID_STATS,
+    BUILTIN_ID_ECHO,
+    BUILTIN_ID_TRUE,
+    BUILTIN_ID_FALSE,
+    BUILTIN_ID_TEST,
+    BUILTIN_ID_BRACKET,
+    BUILTIN_ID_PWD,
+    BUILTIN_ID_EXPORT,
+    BUILTIN_ID_UNSET,
+    BUILTIN_ID_HISTORY,
+    BUILTIN_ID_FG,
+    BUILTIN_ID_BG,
+    BUILTIN_ID_ULIMIT,
+    BUILTIN_ID_SLICE,
+    BUILTIN_IDS         // Number of built-in commands
+} BuiltinId;
+
+/*******************************************************************************
+ * Struct name:     Builtin
+ * Description:     A command run inside the shell instead of a child process
+ *
+ * Members:         char* name      Name the command is run by
+ *                  int run(char**) Runs the command with its arguments and
+ *                                  returns its exit status, or NULL for
+ *                                  exit, which ends the shell
+ *                  bool utility    True for a stand-in for an installed
+ *                                  program, whose exit status is kept for
+ *                                  the status command like a foreground
+ *                                  process's
+ ******************************************************************************/
+
+typedef struct Builtin {
+    const char *name;
+    int (*run)(char **args);
+    bool utility;
+} Builtin;
+
+JobTable job_table = {NULL, 0, -1, -1, -1, -1, -1, -1, -1, 0, NULL, 0, 0, -1,
+                      0};
+Job last_fg_job;                // Copy of the last foreground job to finish
+struct termios shell_modes;     // Terminal modes restored at the prompt
+Command *queue_command = NULL;  // Command a queued job is rebuilt into
+Command *list_command = NULL;   // Command the rest of a list is rebuilt into
+bool list_running = false;      // True while continueLists() runs lists
+CommandHash command_hash = {NULL, 0, 0, 0};     // Remembered PATH lookups
+DirCache dir_cache = {NULL, NULL, NULL, 0, 0, 0, 0};   // Listings for globs
+VariableStore var_store = {NULL, 0, 0, NULL, 0, 0, 1, 1};   // Variables
+ParseCache parse_cache = {NULL, 0, 0, NULL, 0, -1, -1, 0, 0};   // Parsed lines
+EventLoop event_loop = {EVENTS_EPOLL, -1, {-1, -1, -1, -1, -1, -1, -1}};
+SignalRing signal_ring = {{0}, 0, 0, {0}, 0, 0, -1, 0, 0};  // Caught signals
+CaptureTable capture_table = {NULL, 0, NULL, 0, -1, true, 0, 0, 0,
+                              {-1, -1}};    // Logging
+History history = {false, -1, -1, NULL, 0, 0, NULL, 0, 0, NULL, 0, -1, NULL,
+                   NULL, 0, NULL, NULL, 0};  // Lines typed at the prompt
+JobLimits job_limits = {{{0, 0}}, 0};   // Limits set with ulimit
+SliceTable slice_table = {NULL, -1, NULL, 0, 0, -1, 0, 0};  // cgroup slices
+ControlTable control_table = {-1, -1, NULL, NULL, 0, -1, false, -1, NULL,
+                              NULL, 0, 0, 0};   // Control socket and clients
+StartupProfile startup_profile = {false, 0, 0, 0, {NULL}, {0}, 0};  // Timing
+Metrics metrics = {0, 0, 0, 0, NULL, 0, {{0}, 0, 0, 0}, {{0}, 0, 0, 0}, NULL,
+                   NULL, -1, METRICS_INTERVAL, NULL, 0, 0, 0};  // Monitoring
+const LimitOption limit_options[LIMIT_OPTIONS] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (KiB)"},
+    {'d', RLIMIT_DATA, 1024, "data segment size (KiB)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (KiB)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (KiB)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (KiB)"}
+};
+const char *event_backend_names[] = {"epoll", "io_uring"};
+bool trace_enabled = false;     // True if command phases are being timed
+int trace_fd = -1;              // FD trace records are written to, or -1
+unsigned long trace_command = 0;    // Number of the command being traced
+TraceSamples trace_samples[TRACE_PHASES];   // Recent durations of each phase
+char trace_buffer[8192];        // Trace records waiting to be written
+size_t trace_used = 0;          // Number of characters in trace_buffer
+const char *trace_phase_names[TRACE_PHASES] = {
+    "read", "parse", "redirect", "spawn", "wait", "total"
+};
+
+void *heapAlloc(size_t size);
+void *heapRealloc(void *ptr, size_t size);
+void heapFree(void *ptr);
+void arenaInit(Arena *arena);
+void *arenaAlloc(Arena *arena, size_t size);
+void arenaReset(Arena *arena);
+void arenaFree(Arena *arena);
+void resetCommand(Command *command);
+void reserveArgs(Command *command, int count);
+void initLineReader(LineReader *reader, int fd);
+ReadResult readLine(LineReader *reader, char **line, size_t *length);
+void promptLoop(Command *command, LineReader *reader);
+void parseCommandLine(Command *command);
+char *operatorToken(const char *word);
+void splitStages(Command *command);
+void initParseCache(int capacity);
+uint64_t hashLine(const char *line, size_t length);
+void unlinkCachedLine(int index);
+void linkCachedLine(int index, bool front);
+void removeCachedBucket(int index);
+CachedLine *findCachedLine(uint64_t hash, const char *line, size_t length);
+CachedLine *newCachedLine(uint64_t hash, const char *line, size_t length);
+void addCachedWord(CachedLine *entry, const char *word, size_t length,
+                   bool operator, bool quoted, bool pattern,
+                   const size_t *expansions, size_t numExpansions);
+void storeCachedLine(CachedLine *entry, bool parsed);
+void loadCachedLine(CachedLine *entry, Command *command);
+#if defined(__SSE2__)
+uint64_t classifyBlockSSE2(const char *block);
+uint64_t classifyBlockAVX2(const char *block);
+#elif defined(__aarch64__)
+uint64_t classifyBlockNEON(const char *block);
+#endif
+uint64_t classifyBlockScalar(const char *block);
+void initClassifier();
+void classifyLine(const char *line, size_t length);
+size_t nextSpecial(size_t pos, size_t length);
+char *expandWord(Arena *arena, char *word, size_t length,
+                 const size_t *expansions, size_t numExpansions);
+char *expandVariables(Arena *arena, const char *word, size_t length,
+                      const size_t *expansions, size_t numExpansions);
+bool isPattern(Command *command, int index);
+int globWord(Command *command, int index);
+int globPath(Command *command, int index, size_t pathLength, char *pattern);
+bool isDirectory(const char *path, unsigned char type);
+DirListing *listDirectory(const char *path);
+bool readDirectory(DirListing *listing, int fd);
+int compareEntries(const void *left, const void *right);
+void cachePIDString();
+bool isNameChar(char c, bool first);
+bool isName(const char *name, size_t length);
+size_t parseReference(const char *ref, const char **name, size_t *nameLength);
+void initVariables();
+size_t hashName(const char *name, size_t length);
+Variable *findVariable(const char *name, size_t length);
+Variable *setVariable(const char *name, size_t nameLength, const char *value,
+                      size_t valueLength, bool export);
+void exportVariable(Variable *variable);
+void unsetVariable(const char *name, size_t length);
+void growVariables();
+void printExitValOrSignal(int exitStatus);
+int formatExitValOrSignal(char *text, size_t size, int exitStatus);
+int executeCommand(Command *command);
+int runList(Command *command, int status);
+int executePipeline(Command *command, int *status);
+const Builtin *findBuiltin(const char *name);
+BuiltinResult runBuiltin(char **args, int *status);
+BuiltinResult runShellBuiltin(Stage *stage);
+int cdBuiltin(char **args);
+int statusBuiltin(char **args);
+int jobsBuiltin(char **args);
+int statsBuiltin(char **args);
+int echoBuiltin(char **args);
+bool echoOptions(const char *arg, bool *newline, bool *escapes);
+bool echoEscaped(const char *text);
+int trueBuiltin(char **args);
+int falseBuiltin(char **args);
+int testBuiltin(char **args);
+int testExpression(char **args, int count);
+int testUnary(const char *operator, const char *operand);
+int testBinary(const char *left, const char *operator, const char *right);
+bool testBinaryOperator(const char *operator);
+int testOr(char **args, int count, int *next);
+int testAnd(char **args, int count, int *next);
+int testTerm(char **args, int count, int *next);
+int pwdBuiltin(char **args);
+int exportBuiltin(char **args);
+int unsetBuiltin(char **args);
+bool launchPipeline(Command *command, Job *job);
+bool needsFork(Stage *stage, Launch *launch);
+bool isBuiltin(char *name);
+pid_t forkStage(Stage *stage, Launch *launch);
+pid_t spawnStage(Stage *stage, Launch *launch);
+bool startSpawnServer();
+void runSpawnServer(int socketFD);
+void launchServerChild(SpawnRequest *request, int *dups, int *fds,
+                       char *path, char **args);
+pid_t serverStage(Stage *stage, Launch *launch);
+bool planRedirections(Command *command, Stage *stage);
+bool openRedirections(Stage *stage, Launch *launch);
+void closeRedirections(Stage *stage, Launch *launch);
+void applyRedirections(Stage *stage, Launch *launch);
+int startCapture(const char *name, int *writeFD);
+int openCaptureLog(const char *name);
+void releaseCaptureLog(int index);
+void labelCaptures(Stage *stage, Job *job);
+void drainCaptures();
+void logCapture(int index, uint32_t events);
+int capturedLineEnd(Capture *capture, CaptureLog *log, int available);
+bool moveCaptured(Capture *capture, CaptureLog *log, int length);
+void rotateCaptureLog(CaptureLog *log);
+void endCapture(int index);
+void closeCaptures();
+size_t hashString(const char *str);
+char *findCommand(char *name);
+char *addHashedCommand(char *name, char *path);
+void forgetCommand(char *name);
+void clearCommandHash();
+int hashBuiltin(char **args);
+uint64_t traceNow();
+void traceRecord(TracePhase phase, uint64_t start);
+void traceFlush();
+int compareDurations(const void *a, const void *b);
+int timingsBuiltin(char **args);
+int setBuiltin(char **args);
+void openHistory();
+int openHistoryFile(const char *path, const char *suffix);
+void mapHistory();
+void *mapHistoryFile(void *map, size_t *mapped, int fd, size_t size);
+void indexHistory(size_t end);
+void mapSortedHistory();
+void useHistoryOrder(int fd, HistoryOrder *order, size_t size);
+size_t historyOrderSize(size_t count);
+uint64_t historyKey(const char *line, size_t length);
+const char *historyLine(size_t number, size_t *length);
+size_t findHistoryPrefix(const char *prefix, size_t length);
+size_t scanHistoryPrefix(const char *prefix, size_t length, size_t before,
+                         size_t after);
+void sortHistory();
+int compareHistoryEntries(const void *left, const void *right);
+int compareHistoryPrefix(uint32_t number, const char *prefix, size_t length);
+size_t historyBound(const char *prefix, size_t length, bool past);
+int compareNumbersDown(const void *left, const void *right);
+void addHistory(const char *line, size_t length);
+bool expandHistory(Command *command);
+size_t historyReference(const char *ref, size_t *number);
+void appendHistoryLine(size_t *used, const char *text, size_t length);
+int historyBuiltin(char **args);
+int ulimitBuiltin(char **args);
+int limitOption(char option);
+bool parseLimit(const char *value, rlim_t unit, rlim_t *limit);
+void printLimit(rlim_t limit, rlim_t unit);
+void applyJobLimits();
+bool findSliceRoot();
+int findSlice(const char *name);
+bool writeSliceSetting(Slice *slice, const char *setting);
+void printSliceSetting(Slice *slice, const char *file, int width);
+int sliceBuiltin(char **args);
+bool slicePrefix(Command *command, int *slice);
+pid_t cloneIntoSlice(int fd);
+void benchmarkSpawn(int runs);
+uint64_t clockNanoseconds(clockid_t clock);
+void startStartupProfile();
+void startupStep(const char *name);
+void printStartupProfile();
+void printStats();
+void printHistogram(const char *name, const Histogram *histogram);
+int histogramBucket(uint64_t value);
+uint64_t bucketStart(int bucket);
+void recordHistogram(Histogram *histogram, uint64_t value);
+uint64_t histogramQuantile(const Histogram *histogram, double quantile);
+void countRunningJob();
+void mapChildFailures();
+void countChildFailure();
+unsigned long childFailures();
+void openMetrics();
+void armMetricsTimer();
+void drainMetricsTimer();
+void writeMetrics();
+void formatMetrics();
+void appendMetrics(const char *format, ...);
+void appendHistogramMetrics(const char *name, const char *help,
+                            const Histogram *histogram);
+void initReaper();
+Job *addJob(bool background);
+void addJobProcess(Job *job, pid_t pid, bool last);
+size_t hashPid(pid_t pid);
+void growPidMap();
+PidEntry *findJobProcess(pid_t pid);
+Job *takeJobProcess(pid_t pid);
+void freeJob(Job *job);
+void setJobText(Job *job, Command *command);
+Job *findJob(char *spec);
+void addUsage(struct rusage *total, struct rusage *usage);
+double jobSeconds(Job *job);
+void printJobUsage(Job *job);
+int formatJobUsage(char *text, size_t size, Job *job);
+void printJobs(bool verbose);
+int waitBuiltin(char **args);
+int fgBuiltin(char **args);
+int bgBuiltin(char **args);
+Job *jobArgument(const char *name, char **args);
+void continueJob(Job *job);
+void signalJob(Job *job, int signo);
+long jobLimit();
+bool parallelBuiltin(Command *command);
+void queueJob(Job *job, Command *command);
+void startQueuedJobs();
+void storeJobList(Job *job, Command *command, int first);
+void loadJobList(Job *job, Command *command);
+void continueLists();
+void loadQueuedJob(Job *job, Command *command);
+void reapChildren();
+void stopJobProcess(pid_t pid, int status);
+void checkJobStopped(Job *job);
+void printJobStopped(Job *job);
+void initEventLoop();
+void openEventLoop();
+bool initUring();
+void watchEvents(EventSource source, int fd);
+int waitEvents(unsigned wanted);
+int waitEpoll(unsigned wanted);
+int waitUring(unsigned wanted);
+void closeSpawnServer();
+void waitForJob(Job *job);
+void waitForeground(Job *job, bool handoff);
+bool waitForInput(int fd);
+bool printBackgroundNotices();
+void checkBackgroundChildren();
+void initSignalRing();
+void catchSignal(int signo);
+void queueSignal(int signo);
+void drainSignals();
+void handleSignal(int signo);
+void toggleForegroundOnly();
+void openControl();
+int bindControl(const char *address);
+void drainControl();
+void acceptControl();
+void readControl(int index);
+void runControlRequest(int index, const char *line, size_t length);
+void replyControl(int index, const char *text);
+void flushControl(int index);
+void closeControlClient(int index);
+void replyJob(Job *job, const char *text);
+void replyJobStarted(Job *job);
+void noticeJobDone(Job *job);
+void serveControl();
+void closeControl();
+
+const Builtin builtins[BUILTIN_IDS] = {     // Built-in commands by BuiltinId
+    [BUILTIN_ID_EXIT] = {"exit", NULL, false},
+    [BUILTIN_ID_CD] = {"cd", cdBuiltin, false},
+    [BUILTIN_ID_STATUS] = {"status", statusBuiltin, false},
+    [BUILTIN_ID_SET] = {"set", setBuiltin, false},
+    [BUILTIN_ID_TIMINGS] = {"timings", timingsBuiltin, false},
+    [BUILTIN_ID_HASH] = {"hash", hashBuiltin, false},
+    [BUILTIN_ID_JOBS] = {"jobs", jobsBuiltin, false},
+    [BUILTIN_ID_WAIT] = {"wait", waitBuiltin, false},
+    [BUILTIN_ID_STATS] = {"stats", statsBuiltin, false},
+    [BUILTIN_ID_ECHO] = {"echo", echoBuiltin, true},
+    [BUILTIN_ID_TRUE] = {"true", trueBuiltin, true},
+    [BUILTIN_ID_FALSE] = {"false", falseBuiltin, true},
+    [BUILTIN_ID_TEST] = {"test", testBuiltin, true},
+    [BUILTIN_ID_BRACKET] = {"[", testBuiltin, true},
+    [BUILTIN_ID_PWD] = {"pwd", pwdBuiltin, true},
+    [BUILTIN_ID_EXPORT] = {"export", exportBuiltin, false},
+    [BUILTIN_ID_UNSET] = {"unset", unsetBuiltin, false},
+    [BUILTIN_ID_HISTORY] = {"history", historyBuiltin, false},
+    [BUILTIN_ID_FG] = {"fg", fgBuiltin, false},
+    [BUILTIN_ID_BG] = {"bg", bgBuiltin, false},
+    [BUILTIN_ID_ULIMIT] = {"ulimit", ulimitBuiltin, false},
+    [BUILTIN_ID_SLICE] = {"slice", sliceBuiltin, false}
+};
+
+/*******************************************************************************
+ * Function name:   void *heapAlloc(size_t size)
+ *
+ * Description:     Allocates memory with malloc() and counts the call in
+ *                  heap_calls, exiting if memory is exhausted.
+ *
+ * Receives:        size        size_t  Number of bytes to allocate
+ *
+ * Returns:         Pointer to the allocated memory
+ ******************************************************************************/
+
+void *heapAlloc(size_t size) {
+    heap_calls++;
+    void *ptr = malloc(size);
+    if(!ptr) {
+        perror("malloc()");
+        exit(1);
+    }
+    return ptr;
+}
+
+/*******************************************************************************
+ * Function name:   void *heapRealloc(void *ptr, size_t size)
+ *
+ * Description:     Resizes memory with realloc() and counts the call in
+ *                  heap_calls, exiting if memory is exhausted.
+ *
+ * Receives:        ptr         void pointer to allocated memory, or NULL
+ *                  size        size_t  New size in bytes
+ *
+ * Returns:         Pointer to the resized memory
+ ******************************************************************************/
+
+void *heapRealloc(void *ptr, size_t size) {
+    heap_calls++;
+    ptr = realloc(ptr, size);
+    if(!ptr) {
+        perror("realloc()");
+        exit(1);
+    }
+    return ptr;
+}
+
+/*******************************************************************************
+ * Function name:   void heapFree(void *ptr)
+ *
+ * Description:     Frees memory allocated by heapAlloc() and counts the call
+ *                  in heap_calls.
+ *
+ * Receives:        ptr         void pointer to allocated memory, or NULL
+ ******************************************************************************/
+
+void heapFree(void *ptr) {
+    if(ptr) {
+        heap_calls++;
+        free(ptr);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void arenaInit(Arena *arena)
+ *
+ * Description:     Initializes an Arena with a single chunk of
+ *                  ARENA_CHUNK_SIZE bytes.
+ *
+ * Postconditions:  The arena is empty and ready for arenaAlloc()
+ *
+ * Receives:        arena       Arena struct pointer
+ ******************************************************************************/
+
+void arenaInit(Arena *arena) {
+    arena->first = heapAlloc(sizeof(ArenaChunk) + ARENA_CHUNK_SIZE);
+    arena->first->next = NULL;
+    arena->first->size = ARENA_CHUNK_SIZE;
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+/*******************************************************************************
+ * Function name:   void *arenaAlloc(Arena *arena, size_t size)
+ *
+ * Description:     Hands out size bytes from the arena by bumping a pointer.
+ *                  If the current chunk is full, moves on to the next chunk
+ *                  kept from earlier commands, or adds a new chunk large
+ *                  enough for the request.
+ *
+ * Receives:        arena       Arena struct pointer
+ *                  size        size_t  Number of bytes to allocate
+ *
+ * Returns:         Pointer to memory that stays valid until arenaReset()
+ ******************************************************************************/
+
+void *arenaAlloc(Arena *arena, size_t size) {
+    // Round the request up so every allocation stays aligned
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if(arena->used + size > arena->current->size) {
+        ArenaChunk *next = arena->current->next;
+        // No kept chunk is large enough: link a new one after current
+        if(!next || next->size < size) {
+            size_t chunkSize = size > ARENA_CHUNK_SIZE ? size
+                                                       : ARENA_CHUNK_SIZE;
+            ArenaChunk *chunk = heapAlloc(sizeof(ArenaChunk) + chunkSize);
+            chunk->size = chunkSize;
+            chunk->next = next;
+            arena->current->next = chunk;
+            next = chunk;
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+
+    void *ptr = arena->current->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+/*******************************************************************************
+ * Function name:   void arenaReset(Arena *arena)
+ *
+ * Description:     Releases everything allocated from the arena in O(1)
+ *                  time, keeping all chunks for reuse.
+ *
+ * Postconditions:  Pointers returned by arenaAlloc() are no longer valid
+ *
+ * Receives:        arena       Arena struct pointer
+ ******************************************************************************/
+
+void arenaReset(Arena *arena) {
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+/*******************************************************************************
+ * Function name:   void arenaFree(Arena *arena)
+ *
+ * Description:     Frees every chunk owned by the arena.
+ *
+ * Receives:        arena       Arena struct pointer
+ ******************************************************************************/
+
+void arenaFree(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    while(chunk) {
+        ArenaChunk *next = chunk->next;
+        heapFree(chunk);
+        chunk = next;
+    }
+    arena->first = arena->current = NULL;
+    arena->used = 0;
+}
+
+/*******************************************************************************
+ * Function name:   void initCommand(Command *command)
+ *
+ * Description:     Initializes a Command struct.
+ *
+ * Preconditions:   Command struct is uninitialized
+ *
+ * Postconditions:  Memory has been allocated for ARGS_SIZE arguments in the
+ *                  args, stages and redirections arrays, for the reference
+ *                  offsets and for the argument arena, args is an empty
+ *                  list, numStages = 0, numRedirections = 0, numArgs = 0,
+ *                  and background = false.
+ *
+ * Receives:        command     Command struct pointer
+ ******************************************************************************/
+
+void initCommand(Command *command) {
+    // Allocate memory for args and the arena that holds argument strings
+    command->args = heapAlloc(sizeof(char*) * (ARGS_SIZE + 1));
+    command->args[0] = NULL;
+    command->stages = heapAlloc(sizeof(Stage) * (ARGS_SIZE + 1));
+    command->numStages = 0;
+    command->pipelines = heapAlloc(sizeof(Pipeline) * (ARGS_SIZE + 1));
+    command->numPipelines = 0;
+    command->redirections = heapAlloc(sizeof(Redirection) * ARGS_SIZE);
+    command->numRedirections = 0;
+    command->argCapacity = ARGS_SIZE;
+    command->expansions = heapAlloc(sizeof(size_t) * EXPANSIONS_SIZE);
+    command->expansionCapacity = EXPANSIONS_SIZE;
+    arenaInit(&command->arena);
+    // Set all other struct members to defaults
+    command->line = NULL;
+    command->lineLength = 0;
+    command->numArgs = 0;
+    command->background = false;
+}
+
+/*******************************************************************************
+ * Function name:   void resetCommand(Command *command)
+ *
+ * Description:     Prepares a Command struct for the next line of input
+ *                  without any heap calls. The args array, line buffer and
+ *                  arena chunks are all kept for reuse, at the size the
+ *                  longest line so far needed.
+ *
+ * Postconditions:  args is an empty list, numArgs = 0, numStages = 0,
+ *                  numPipelines = 0, numRedirections = 0,
+ *                  background = false, and all
+ *                  argument strings have been released.
+ *
+ * Receives:        command     Command struct pointer
+ ******************************************************************************/
+
+void resetCommand(Command *command) {
+    arenaReset(&command->arena);
+    command->args[0] = NULL;
+    command->numArgs = 0;
+    command->numStages = 0;
+    command->numPipelines = 0;
+    command->numRedirections = 0;
+    command->background = false;
+}
+
+/*******************************************************************************
+ * Function name:   void freeCommand(Command *command)
+ *
+ * Description:     Frees the memory allocated for members of a Command struct
+ *
+ * Postconditions:  All memory allocated for the args, stages, pipelines,
+ *                  redirections, expansions and arena members has been
+ *                  freed. The line belongs to the LineReader.
+ *
+ * Receives:        command     Command struct pointer
+ ******************************************************************************/
+
+void freeCommand(Command *command) {
+    // Free the args, stages and redirections arrays and argument strings
+    heapFree(command->args);
+    command->args = NULL;
+    heapFree(command->stages);
+    command->stages = NULL;
+    heapFree(command->pipelines);
+    command->pipelines = NULL;
+    heapFree(command->redirections);
+    command->redirections = NULL;
+    heapFree(command->expansions);
+    command->expansions = NULL;
+    arenaFree(&command->arena);
+    command->line = NULL;
+}
+
+/*******************************************************************************
+ * Function name:   void reserveArgs(Command *command, int count)
+ *
+ * Description:     Makes room for count arguments, doubling the args, stages,
+ *                  pipelines and redirections arrays together until they
+ *                  are large enough. The arrays may move, so this is only
+ *                  called before any stage points into them.
+ *
+ * Postconditions:  command->argCapacity is at least count
+ *
+ * Receives:        command     Command struct pointer
+ *                  count       int     Number of arguments to make room for
+ ******************************************************************************/
+
+void reserveArgs(Command *command, int count) {
+    if(count <= command->argCapacity) {
+        return;
+    }
+    int capacity = command->argCapacity;
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    command->args = heapRealloc(command->args, sizeof(char*) * (capacity + 1));
+    command->stages = heapRealloc(command->stages,
+                                  sizeof(Stage) * (capacity + 1));
+    command->pipelines = heapRealloc(command->pipelines,
+                                     sizeof(Pipeline) * (capacity + 1));
+    command->redirections = heapRealloc(command->redirections,
+                                        sizeof(Redirection) * capacity);
+    command->argCapacity = capacity;
+}
+
+/*******************************************************************************
+ * Function name:   void initLineReader(LineReader *reader, int fd)
+ *
+ * Description:     Initializes a LineReader that reads from fd.
+ *
+ * Postconditions:  A READ_BLOCK_SIZE buffer has been allocated and is empty
+ *
+ * Receives:        reader      LineReader struct pointer
+ *                  fd          int     File descriptor to read input from
+ ******************************************************************************/
+
+void initLineReader(LineReader *reader, int fd) {
+    reader->fd = fd;
+    reader->buffer = heapAlloc(READ_BLOCK_SIZE);
+    reader->size = READ_BLOCK_SIZE;
+    reader->start = 0;
+    reader->end = 0;
+    reader->lineNumber = 0;
+    reader->eof = false;
+}
+
+/*******************************************************************************
+ * Function name:   ReadResult readLine(LineReader *reader, char **line,
+ *                                      size_t *length)
+ *
+ * Description:     Returns the next line of input with its newline removed.
+ *                  Lines are split out of the buffered block with memchr();
+ *                  read() is only called when the buffer holds no complete
+ *                  line, and the buffer is doubled when a partial line fills
+ *                  it. A line with more than line_limit characters is
+ *                  consumed up to its newline and reported as READ_TOO_LONG
+ *                  rather than returned. A final line without a newline is
+ *                  returned at end of input.
+ *
+ * Postconditions:  On READ_LINE, line points to a null-terminated line inside
+ *                  the reader's buffer that stays valid until the next call
+ *
+ * Receives:        reader      LineReader struct pointer
+ *                  line        char double-pointer set to the line
+ *                  length      size_t pointer set to the line's length
+ *
+ * Returns:         ReadResult describing what was read
+ ******************************************************************************/
+
+ReadResult readLine(LineReader *reader, char **line, size_t *length) {
+    bool discarding = false;    // True while skipping an over-long line
+
+    while(true) {
+        // Return the next complete line if the buffer holds one
+        char *begin = reader->buffer + reader->start;
+        char *newline = memchr(begin, '\n', reader->end - reader->start);
+        if(newline || (reader->eof && reader->end > reader->start)) {
+            size_t lineLength = newline ? (size_t)(newline - begin)
+                                        : reader->end - reader->start;
+            reader->start += lineLength + (newline ? 1 : 0);
+            reader->lineNumber++;
+            if(discarding || lineLength > line_limit) {
+                return READ_TOO_LONG;
+            }
+            begin[lineLength] = '\0';
+            *line = begin;
+            *length = lineLength;
+            return READ_LINE;
+        }
+        if(reader->eof) {
+            return discarding ? READ_TOO_LONG : READ_EOF;
+        }
+
+        // Move the partial line to the front of the buffer. Once it is too
+        // long to be a command, drop what has been read of it.
+        size_t partial = reader->end - reader->start;
+        if(partial > line_limit) {
+            discarding = true;
+            partial = 0;
+        }
+        memmove(reader->buffer, reader->buffer + reader->start, partial);
+        reader->start = 0;
+        reader->end = partial;
+
+        // Make room for more of a line that fills the buffer
+        if(reader->end + 1 >= reader->size) {
+            reader->size *= 2;
+            reader->buffer = heapRealloc(reader->buffer, reader->size);
+        }
+
+        // Fill the rest of the buffer, leaving room for a terminator.
+        // Children that finish while the shell waits are reaped meanwhile.
+        ssize_t bytesRead = -1;
+        errno = EINTR;
+        if(waitForInput(reader->fd)) {
+            bytesRead = read(reader->fd, reader->buffer + reader->end,
+                             reader->size - 1 - reader->end);
+        }
+        if(bytesRead == -1) {
+            // Handle error if read() is interrupted by a signal
+            if(errno == EINTR && !discarding) {
+                return READ_INTERRUPTED;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("read()");
+            bytesRead = 0;
+        }
+        if(bytesRead == 0) {
+            reader->eof = true;
+        }
+        reader->end += (size_t)bytesRead;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void promptLoop(Command *command, LineReader *reader)
+ *
+ * Description:     Prompts user for input, or in script mode reads the next
+ *                  line silently. Ignores input that is blank or represents a
+ *                  comment, and reports lines that have more characters than
+ *                  the limit. Parses the input and executes the command, then
+ *                  prompts the user again in a loop until the user runs the
+ *                  exit command or the input ends.
+ *
+ * Receives:        command     Command struct pointer
+ *                  reader      LineReader struct pointer for the input
+ ******************************************************************************/
+
+void promptLoop(Command *command, LineReader *reader) {
+    ReadResult result;      // Outcome of readLine()
+    size_t length = 0;      // Number of characters in the line read
+    int returnStatus = 0;   // Return value of executeCommand()
+    uint64_t readStart;     // Trace timestamp before reading the line
+    uint64_t lineStart;     // Trace timestamp after reading the line
+    // -1 means the user typed in the exit command
+    // Prompt user
+    while(true) {
+        do {
+            checkBackgroundChildren();  // Check for terminated bg children
+            printStartupProfile();
+            if(interactive) {
+                printf("%s", PROMPT);
+                fflush(stdout);
+            }
+            readStart = traceNow();
+            result = readLine(reader, &command->line, &length);
+            command->lineLength = length;
+            // Report lines that were too long to run
+            if(result == READ_TOO_LONG) {
+                fprintf(stderr, "smallsh: line %lu: longer than the limit of "
+                        "%zu characters, ignored\n", reader->lineNumber,
+                        line_limit);
+            }
+            // Treat end of input like the exit command, once the control
+            // socket's clients have been served
+            if(result == READ_EOF) {
+                if(interactive) {
+                    printf("\n");
+                    fflush(stdout);
+                }
+                serveControl();
+                returnStatus = -1;
+                break;
+            }
+        } while(result != READ_LINE || command->line[0] == COMMENT_PREFIX
+                || length == 0);
+
+        // Expand history references in a line typed at the prompt and add
+        // it to the history
+        if(returnStatus != -1 && interactive) {
+            if(!expandHistory(command)) {
+                resetCommand(command);
+                continue;
+            }
+            addHistory(command->line, command->lineLength);
+        }
+
+        // Parse and execute command, timing each phase if tracing
+        if(returnStatus != -1) {
+            trace_command++;
+            traceRecord(TRACE_READ, readStart);
+            lineStart = traceNow();
+            uint64_t parseStart = clockNanoseconds(CLOCK_MONOTONIC);
+            parseCommandLine(command);
+            recordHistogram(&metrics.parse,
+                            clockNanoseconds(CLOCK_MONOTONIC) - parseStart);
+            traceRecord(TRACE_PARSE, lineStart);
+            returnStatus = executeCommand(command);
+            traceRecord(TRACE_TOTAL, lineStart);
+            if(trace_used) {
+                traceFlush();
+            }
+        }
+
+        // If user typed exit, quit the program by returning to main.
+        if(returnStatus == -1) {
+            freeCommand(command);
+            heapFree(command);
+            return;
+        }
+
+        // Otherwise, reset the Command struct to prepare for more input
+        resetCommand(command);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void parseCommandLine(Command *command)
+ *
+ * Description:     Splits the line entered by the user into words in a single
+ *                  pass and stores them in command->args. Words are separated
+ *                  by blanks. Inside '...' every character is literal; inside
+ *                  "..." a backslash only escapes ", \ and $; elsewhere a
+ *                  backslash makes the next character literal. The quotes and
+ *                  escaping backslashes are removed by moving the rest of the
+ *                  word down in place, so each argument points into the line
+ *                  and only a word with a variable reference ("$$", "$NAME"
+ *                  or "${NAME}") outside single quotes is copied, by the
+ *                  word-expansion stage, into the command's arena. An
+ *                  unquoted word that expands to nothing is dropped. A
+ *                  word that is exactly "&", "<", ">" or "|" with
+ *                  no quoting is an operator, and an unquoted ";", "&&" or
+ *                  "||" is one wherever it is, ending the word before it
+ *                  without a blank. The words are then split into
+ *                  pipeline stages at each "|" operator. Runs of ordinary
+ *                  characters are skipped, or moved down, in bulk: a short
+ *                  run is found by looking at the next few characters, and
+ *                  the first run longer than that has the whole line
+ *                  classified with vector instructions so that the end of
+ *                  every long run is found from the mask. If the parse
+ *                  cache is enabled, a line parsed before is not tokenized
+ *                  again: its words are copied from the cache and only
+ *                  variables are expanded, and a new line's words are added to
+ *                  the cache as they are found.
+ *
+ * Preconditions:   command->line contains user input and command->lineLength
+ *                  its length
+ *
+ * Postconditions:  command->args contains parsed user input and is
+ *                  terminated by a NULL pointer, with each operator that
+ *                  joins stages or pipelines replaced by a NULL pointer
+ *                  ending the previous stage. command->stages describes
+ *                  each stage and command->pipelines each pipeline. If a
+ *                  quote is left open, an error is printed and there are no
+ *                  arguments.
+ *
+ * Receives:        command     Command struct pointer
+ ******************************************************************************/
+
+void parseCommandLine(Command *command) {
+    char *line = command->line;             // Line being split
+    size_t length = command->lineLength;    // Number of characters in line
+    char *in = line;                        // Next character to read
+    int i = 0;                              // Index for command->args
+    bool classified = false;                // True once line_mask is built
+    CachedLine *entry = NULL;               // Cache entry being filled
+    char *listOperator = NULL;              // ";", "&&" or "||" that ended
+                                            // the last word
+
+    // Reuse the words of a line that has been parsed before. Longer lines,
+    // such as generated file lists, are rarely repeated and aren't kept.
+    if(parse_cache.capacity > 0 && length <= PARSE_CACHE_LINE_MAX) {
+        uint64_t hash = hashLine(line, length);
+        entry = findCachedLine(hash, line, length);
+        if(entry) {
+            parse_cache.hits++;
+            loadCachedLine(entry, command);
+            splitStages(command);
+            return;
+        }
+        parse_cache.misses++;
+        entry = newCachedLine(hash, line, length);
+    }
+
+    while(true) {
+        // Store a list operator after the word it ended
+        if(listOperator) {
+            if(entry) {
+                addCachedWord(entry, listOperator, strlen(listOperator), true,
+                              false, false, command->expansions, 0);
+            }
+            if(i == command->argCapacity) {
+                reserveArgs(command, i + 1);
+            }
+            command->args[i++] = listOperator;
+            listOperator = NULL;
+        }
+
+        // Skip the blanks before the next word
+        while(*in == ' ' || *in == '\t') {
+            in++;
+        }
+        if(!*in) {
+            break;
+        }
+
+        char *word = in;                // Start of the word in the line
+        char *out = in;                 // Where the next character goes
+        TokenState state = TOKEN_UNQUOTED;
+        bool quoted = false;            // True if the word used any quoting
+        bool pattern = false;           // True if it has a glob character
+        size_t numExpansions = 0;       // Number of references to expand
+
+        while(true) {
+            // Find the run of ordinary characters before the next special
+            // one. Short runs are found by looking at the next few
+            // characters, longer ones by searching the mask.
+            size_t run = 0;
+            while(run < SHORT_RUN && !special_chars[(unsigned char)in[run]]) {
+                run++;
+            }
+            if(run == SHORT_RUN) {
+                if(!classified) {
+                    classifyLine(line, length);
+                    classified = true;
+                }
+                size_t pos = (size_t)(in - line);
+                run = nextSpecial(pos + SHORT_RUN, length) - pos;
+            }
+
+            // Move the run down, which is only needed once quoting has been
+            // removed
+            if(run > 0) {
+                if(out == in) {
+                    out += run;
+                    in += run;
+                } else if(run > SHORT_RUN) {
+                    memmove(out, in, run);
+                    out += run;
+                    in += run;
+                } else {
+                    while(run--) {
+                        *out++ = *in++;
+                    }
+                }
+            }
+            if(!*in) {
+                break;
+            }
+
+            char c = *in;
+            if(state == TOKEN_SINGLE_QUOTED) {
+                if(c == '\'') {
+                    state = TOKEN_UNQUOTED;
+                    in++;
+                    continue;
+                }
+                *out++ = *in++;
+                continue;
+            }
+            if(state == TOKEN_UNQUOTED) {
+                if(c == ' ' || c == '\t') {
+                    break;
+                }
+                if(c == '\'' || c == '"') {
+                    state = c == '\'' ? TOKEN_SINGLE_QUOTED
+                                      : TOKEN_DOUBLE_QUOTED;
+                    quoted = true;
+                    in++;
+                    continue;
+                }
+                if(c == '\\') {
+                    quoted = true;
+                    in++;
+                    if(*in) {
+                        *out++ = *in++;
+                    }
+                    continue;
+                }
+                if(c == ';' || (c == '&' && in[1] == '&') ||
+                   (c == '|' && in[1] == '|')) {
+                    listOperator = c == ';' ? sequence_operator
+                                   : c == '&' ? and_operator : or_operator;
+                    in += c == ';' ? 1 : 2;
+                    break;
+                }
+                if(c == '*' || c == '?' || c == '[') {
+                    pattern = true;
+                }
+            } else {
+                if(c == '"') {
+                    state = TOKEN_UNQUOTED;
+                    in++;
+                    continue;
+                }
+                if(c == '\\' && (in[1] == '"' || in[1] == '\\' ||
+                                 in[1] == PID_EXPAND_CHAR)) {
+                    in++;
+                    *out++ = *in++;
+                    continue;
+                }
+            }
+            // Remember where a variable reference lands in the word so it
+            // can be expanded, and copy it as it is
+            size_t reference = 0;
+            if(c == PID_EXPAND_CHAR) {
+                reference = parseReference(in, NULL, NULL);
+            }
+            if(reference > 0) {
+                if(numExpansions == command->expansionCapacity) {
+                    command->expansionCapacity *= 2;
+                    command->expansions = heapRealloc(command->expansions,
+                        sizeof(size_t) * command->expansionCapacity);
+                }
+                command->expansions[numExpansions++] = (size_t)(out - word);
+                while(--reference) {
+                    *out++ = *in++;
+                }
+            }
+            *out++ = *in++;
+        }
+
+        if(state != TOKEN_UNQUOTED) {
+            fprintf(stderr, "smallsh: syntax error: unterminated quote\n");
+            fflush(stdout);
+            if(entry) {
+                storeCachedLine(entry, false);
+                entry = NULL;
+            }
+            i = 0;
+            break;
+        }
+
+        // Terminate the word, stepping past the blank that ended it first
+        // since the terminator may be written over it. A list operator
+        // has already been stepped past, and may have been all there was.
+        if(listOperator && out == word && !quoted) {
+            continue;
+        }
+        if(*in && !listOperator) {
+            in++;
+        }
+        *out = '\0';
+
+        // Store the word, or the operator it stands for
+        char *operator = quoted ? NULL : operatorToken(word);
+        if(entry) {
+            addCachedWord(entry, word, (size_t)(out - word), operator != NULL,
+                          quoted, pattern, command->expansions,
+                          numExpansions);
+        }
+        if(i == command->argCapacity) {
+            reserveArgs(command, i + 1);
+        }
+        if(operator) {
+            command->args[i] = operator;
+        } else {
+            command->args[i] = expandWord(&command->arena, word,
+                                          (size_t)(out - word),
+                                          command->expansions, numExpansions);
+            if(!quoted && numExpansions && !*command->args[i]) {
+                continue;
+            }
+            if(pattern && !quoted && isPattern(command, i)) {
+                i += globWord(command, i);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    // Terminate the argument list and set argument count
+    command->args[i] = NULL;
+    command->numArgs = i;
+    if(entry) {
+        storeCachedLine(entry, true);
+    }
+    splitStages(command);
+}
+
+/*******************************************************************************
+ * Function name:   void splitStages(Command *command)
+ *
+ * Description:     Splits the arguments of a command into pipelines and
+ *                  their stages, and plans each stage's redirections. A "|"
+ *                  ends a stage, and ";", "&", "&&" and "||" end a pipeline,
+ *                  "&" also putting it in the background. The list may end
+ *                  with ";" or "&".
+ *
+ * Preconditions:   command->args holds command->numArgs arguments
+ *
+ * Postconditions:  Each operator ending a stage in command->args is replaced
+ *                  by a NULL pointer, command->stages describes each stage
+ *                  and command->pipelines each pipeline. If a redirection
+ *                  has no filename, an error is printed and there are no
+ *                  stages.
+ *
+ * Receives:        command     Command struct pointer
+ ******************************************************************************/
+
+void splitStages(Command *command) {
+    if(command->numArgs == 0) {
+        return;
+    }
+    Pipeline *pipeline = &command->pipelines[0];
+    pipeline->firstStage = 0;
+    pipeline->numStages = 1;
+    pipeline->joiner = LIST_ALWAYS;
+    pipeline->background = false;
+    command->numPipelines = 1;
+    Stage *stage = &command->stages[0];
+    stage->args = command->args;
+    stage->numArgs = 0;
+    command->numStages = 1;
+    for(int j = 0; j < command->numArgs; j++) {
+        char *arg = command->args[j];
+        if(arg != pipe_operator && arg != sequence_operator &&
+           arg != background_operator && arg != and_operator &&
+           arg != or_operator) {
+            stage->numArgs++;
+            continue;
+        }
+        command->args[j] = NULL;
+        stage = &command->stages[command->numStages++];
+        stage->args = &command->args[j + 1];
+        stage->numArgs = 0;
+        if(arg == pipe_operator) {
+            pipeline->numStages++;
+            continue;
+        }
+
+        // Start the next pipeline
+        pipeline->background = arg == background_operator;
+        pipeline = &command->pipelines[command->numPipelines++];
+        pipeline->firstStage = command->numStages - 1;
+        pipeline->numStages = 1;
+        pipeline->joiner = arg == and_operator ? LIST_AND
+                           : arg == or_operator ? LIST_OR : LIST_ALWAYS;
+        pipeline->background = false;
+    }
+
+    // Nothing has to follow a final ";" or "&"
+    if(command->numPipelines > 1 && stage->numArgs == 0 &&
+       pipeline->numStages == 1 && pipeline->joiner == LIST_ALWAYS) {
+        command->numPipelines--;
+        command->numStages--;
+    }
+
+    for(int j = 0; j < command->numStages; j++) {
+        if(!planRedirections(command, &command->stages[j])) {
+            command->numStages = 0;
+            command->numPipelines = 0;
+            return;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void initParseCache(int capacity)
+ *
+ * Description:     Sets up the parse cache to hold up to capacity lines. A
+ *                  capacity of 0 leaves the cache disabled, so every line is
+ *                  tokenized.
+ *
+ * Receives:        capacity    int     Number of lines to cache
+ ******************************************************************************/
+
+void initParseCache(int capacity) {
+    if(capacity <= 0) {
+        return;
+    }
+    parse_cache.entries = heapAlloc(sizeof(CachedLine) * (size_t)capacity);
+    memset(parse_cache.entries, 0, sizeof(CachedLine) * (size_t)capacity);
+    parse_cache.capacity = capacity;
+
+    // Keep the buckets at most half full so probe runs stay short
+    parse_cache.numBuckets = 1;
+    while(parse_cache.numBuckets < (size_t)capacity * 2) {
+        parse_cache.numBuckets *= 2;
+    }
+    parse_cache.buckets = heapAlloc(sizeof(int) * parse_cache.numBuckets);
+    for(size_t i = 0; i < parse_cache.numBuckets; i++) {
+        parse_cache.buckets[i] = -1;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t hashLine(const char *line, size_t length)
+ *
+ * Description:     Hashes a line eight bytes at a time, mixing four words
+ *                  per step into independent lanes so that the multiplies
+ *                  overlap. Cheap enough to run on every line; entries are
+ *                  compared in full, so collisions only cost a comparison.
+ *
+ * Receives:        line        Characters to hash
+ *                  length      size_t  Number of characters in line
+ *
+ * Returns:         Hash of the line
+ ******************************************************************************/
+
+uint64_t hashLine(const char *line, size_t length) {
+    uint64_t lanes[4] = {length, ~length, length << 32, ~length >> 32};
+    uint64_t word;          // Eight characters of the line
+    size_t i = 0;           // Offset of the next characters to mix in
+
+    for(; i + 32 <= length; i += 32) {
+        for(int lane = 0; lane < 4; lane++) {
+            memcpy(&word, line + i + lane * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * LINE_HASH_MULTIPLIER;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    // Mix the last words, and the last few characters padded with zeros,
+    // into the first lane
+    for(; i < length; i += 8) {
+        word = 0;
+        memcpy(&word, line + i, length - i < 8 ? length - i : 8);
+        lanes[0] = (lanes[0] ^ word) * LINE_HASH_MULTIPLIER;
+        lanes[0] ^= lanes[0] >> 29;
+    }
+
+    uint64_t hash = lanes[0] ^ ((lanes[1] << 17) | (lanes[1] >> 47)) ^
+                    ((lanes[2] << 31) | (lanes[2] >> 33)) ^
+                    ((lanes[3] << 47) | (lanes[3] >> 17));
+    hash *= LINE_HASH_MULTIPLIER;
+    return hash ^ (hash >> 32);
+}
+
+/*******************************************************************************
+ * Function name:   void unlinkCachedLine(int index)
+ *
+ * Description:     Takes an entry out of the parse cache's use order.
+ *
+ * Receives:        index       int     Index of the entry
+ ******************************************************************************/
+
+void unlinkCachedLine(int index) {
+    CachedLine *entry = &parse_cache.entries[index];
+    if(entry->prev != -1) {
+        parse_cache.entries[entry->prev].next = entry->next;
+    } else {
+        parse_cache.head = entry->next;
+    }
+    if(entry->next != -1) {
+        parse_cache.entries[entry->next].prev = entry->prev;
+    } else {
+        parse_cache.tail = entry->prev;
+    }
+    entry->prev = entry->next = -1;
+}
+
+/*******************************************************************************
+ * Function name:   void linkCachedLine(int index, bool front)
+ *
+ * Description:     Puts an entry that isn't in the parse cache's use order
+ *                  at its front, as the most recently used entry, or at its
+ *                  back, as the next one to be reused.
+ *
+ * Receives:        index       int     Index of the entry
+ *                  front       bool    True to link the entry at the front
+ ******************************************************************************/
+
+void linkCachedLine(int index, bool front) {
+    CachedLine *entry = &parse_cache.entries[index];
+    if(front) {
+        entry->prev = -1;
+        entry->next = parse_cache.head;
+        if(parse_cache.head != -1) {
+            parse_cache.entries[parse_cache.head].prev = index;
+        } else {
+            parse_cache.tail = index;
+        }
+        parse_cache.head = index;
+    } else {
+        entry->next = -1;
+        entry->prev = parse_cache.tail;
+        if(parse_cache.tail != -1) {
+            parse_cache.entries[parse_cache.tail].next = index;
+        } else {
+            parse_cache.head = index;
+        }
+        parse_cache.tail = index;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void removeCachedBucket(int index)
+ *
+ * Description:     Removes an entry from the parse cache's buckets, so that
+ *                  its line is no longer found.
+ *
+ * Preconditions:   The entry is in the buckets
+ *
+ * Receives:        index       int     Index of the entry
+ ******************************************************************************/
+
+void removeCachedBucket(int index) {
+    size_t mask = parse_cache.numBuckets - 1;
+    size_t slot = parse_cache.entries[index].hash & mask;
+    while(parse_cache.buckets[slot] != index) {
+        slot = (slot + 1) & mask;
+    }
+
+    // Backward-shift deletion, as in takeJobProcess()
+    size_t hole = slot;
+    size_t next = (hole + 1) & mask;
+    while(parse_cache.buckets[next] != -1) {
+        size_t home = parse_cache.entries[parse_cache.buckets[next]].hash
+                      & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            parse_cache.buckets[hole] = parse_cache.buckets[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    parse_cache.buckets[hole] = -1;
+    parse_cache.entries[index].cached = false;
+}
+
+/*******************************************************************************
+ * Function name:   CachedLine *findCachedLine(uint64_t hash,
+ *                                             const char *line,
+ *                                             size_t length)
+ *
+ * Description:     Looks a line up in the parse cache and, if it is there,
+ *                  makes its entry the most recently used.
+ *
+ * Receives:        hash        uint64_t    hashLine() of the line
+ *                  line        Line to look up
+ *                  length      size_t      Number of characters in line
+ *
+ * Returns:         The line's entry, or NULL if it isn't cached
+ ******************************************************************************/
+
+CachedLine *findCachedLine(uint64_t hash, const char *line, size_t length) {
+    size_t mask = parse_cache.numBuckets - 1;
+    for(size_t slot = hash & mask; parse_cache.buckets[slot] != -1;
+        slot = (slot + 1) & mask) {
+        int index = parse_cache.buckets[slot];
+        CachedLine *entry = &parse_cache.entries[index];
+        if(entry->hash == hash && entry->lineLength == length &&
+           !memcmp(entry->line, line, length)) {
+            if(parse_cache.head != index) {
+                unlinkCachedLine(index);
+                linkCachedLine(index, true);
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * Function name:   CachedLine *newCachedLine(uint64_t hash, const char *line,
+ *                                            size_t length)
+ *
+ * Description:     Takes an entry for a line that isn't cached, reusing the
+ *                  least recently used entry once every slot has been used,
+ *                  and copies the line into it before the tokenizer changes
+ *                  the line. The entry's block is grown to fit the line if
+ *                  it is too small, at least doubling, so that an entry is
+ *                  reallocated a few times at most before it fits any line
+ *                  the cache keeps.
+ *
+ * Receives:        hash        uint64_t    hashLine() of the line
+ *                  line        Line to cache
+ *                  length      size_t      Number of characters in line
+ *
+ * Returns:         The entry, which has no words yet and is in neither the
+ *                  buckets nor the use order
+ ******************************************************************************/
+
+CachedLine *newCachedLine(uint64_t hash, const char *line, size_t length) {
+    int index;              // Index of the entry taken
+    if(parse_cache.count < parse_cache.capacity) {
+        index = parse_cache.count++;
+    } else {
+        index = parse_cache.tail;
+        unlinkCachedLine(index);
+        if(parse_cache.entries[index].cached) {
+            removeCachedBucket(index);
+        }
+    }
+    CachedLine *entry = &parse_cache.entries[index];
+
+    // A line of length characters has at most length words and variable
+    // references, since ";" needs no blank after the word before it, and
+    // its words and their terminators fit in 2 * length + 1 characters
+    if(!entry->block || entry->blockLength < length) {
+        size_t room = entry->block ? entry->blockLength * 2
+                                   : PARSE_CACHE_BLOCK_MIN;
+        while(room < length) {
+            room *= 2;
+        }
+        if(room > PARSE_CACHE_LINE_MAX) {
+            room = PARSE_CACHE_LINE_MAX;
+        }
+        size_t maxWords = room + 1;
+        heapFree(entry->block);
+        entry->block = heapAlloc(maxWords * sizeof(size_t) +
+                                 maxWords * sizeof(CachedWord) +
+                                 3 * room + 2);
+        entry->blockLength = room;
+        entry->expansions = (size_t*)entry->block;
+        entry->words = (CachedWord*)(entry->expansions + maxWords);
+        entry->line = (char*)(entry->words + maxWords);
+        entry->text = entry->line + room + 1;
+    }
+
+    entry->hash = hash;
+    entry->cached = false;
+    memcpy(entry->line, line, length);
+    entry->lineLength = length;
+    entry->textUsed = 0;
+    entry->numArgs = 0;
+    entry->numExpansions = 0;
+    entry->prev = entry->next = -1;
+    return entry;
+}
+
+/*******************************************************************************
+ * Function name:   void addCachedWord(CachedLine *entry, const char *word,
+ *                                     size_t length, bool operator,
+ *                                     bool quoted, bool pattern,
+ *                                     const size_t *expansions,
+ *                                     size_t numExpansions)
+ *
+ * Description:     Adds a word found by the tokenizer to a cache entry,
+ *                  before any variable in it is expanded.
+ *
+ * Receives:        entry       CachedLine struct pointer from newCachedLine()
+ *                  word        Unquoted word
+ *                  length      size_t  Number of characters in word
+ *                  operator    bool    True if the word is an operator
+ *                  quoted      bool    True if the word used any quoting
+ *                  pattern     bool    True if the word has an unquoted glob
+ *                                      character
+ *                  expansions  Offsets of variable references in the word
+ *                  numExpansions   size_t  Number of offsets in expansions
+ ******************************************************************************/
+
+void addCachedWord(CachedLine *entry, const char *word, size_t length,
+                   bool operator, bool quoted, bool pattern,
+                   const size_t *expansions, size_t numExpansions) {
+    CachedWord *cached = &entry->words[entry->numArgs++];
+    cached->offset = (uint32_t)entry->textUsed;
+    cached->length = (uint32_t)length;
+    cached->firstExpansion = (uint32_t)entry->numExpansions;
+    cached->numExpansions = (uint16_t)numExpansions;
+    cached->operator = operator;
+    cached->quoted = quoted;
+    cached->pattern = pattern;
+
+    memcpy(entry->text + entry->textUsed, word, length);
+    entry->text[entry->textUsed + length] = '\0';
+    entry->textUsed += length + 1;
+    memcpy(entry->expansions + entry->numExpansions, expansions,
+           numExpansions * sizeof(size_t));
+    entry->numExpansions += numExpansions;
+}
+
+/*******************************************************************************
+ * Function name:   void storeCachedLine(CachedLine *entry, bool parsed)
+ *
+ * Description:     Finishes an entry taken by newCachedLine(). A line that
+ *                  parsed is added to the buckets as the most recently used
+ *                  entry; one that didn't is left out of the buckets and
+ *                  put at the back of the use order to be reused first.
+ *
+ * Receives:        entry       CachedLine struct pointer
+ *                  parsed      bool    True if the line parsed
+ ******************************************************************************/
+
+void storeCachedLine(CachedLine *entry, bool parsed) {
+    int index = (int)(entry - parse_cache.entries);
+    linkCachedLine(index, parsed);
+    if(parsed) {
+        size_t mask = parse_cache.numBuckets - 1;
+        size_t slot = entry->hash & mask;
+        while(parse_cache.buckets[slot] != -1) {
+            slot = (slot + 1) & mask;
+        }
+        parse_cache.buckets[slot] = index;
+        entry->cached = true;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void loadCachedLine(CachedLine *entry, Command *command)
+ *
+ * Description:     Rebuilds the arguments of a cached line. The text of the
+ *                  words is copied into the command's arena, so the entry
+ *                  can be reused while the command runs, and each variable
+ *                  is expanded again with its current value.
+ *
+ * Postconditions:  command->args holds the line's arguments, terminated by
+ *                  a NULL pointer, ready for splitStages()
+ *
+ * Receives:        entry       CachedLine struct pointer
+ *                  command     Command struct pointer
+ ******************************************************************************/
+
+void loadCachedLine(CachedLine *entry, Command *command) {
+    char *text = arenaAlloc(&command->arena, entry->textUsed);
+    memcpy(text, entry->text, entry->textUsed);
+
+    int numArgs = 0;        // Number of arguments after expansion
+    reserveArgs(command, entry->numArgs);
+    for(int i = 0; i < entry->numArgs; i++) {
+        CachedWord *cached = &entry->words[i];
+        char *word = text + cached->offset;
+        if(cached->operator) {
+            command->args[numArgs++] = operatorToken(word);
+            continue;
+        }
+        command->args[numArgs] = expandWord(&command->arena, word,
+                                            cached->length,
+                                            entry->expansions +
+                                            cached->firstExpansion,
+                                            cached->numExpansions);
+        if(cached->pattern && !cached->quoted && isPattern(command, numArgs)) {
+            numArgs += globWord(command, numArgs);
+            reserveArgs(command, numArgs + entry->numArgs - i - 1);
+        } else if(cached->quoted || !cached->numExpansions ||
+                  *command->args[numArgs]) {
+            numArgs++;
+        }
+    }
+    command->args[numArgs] = NULL;
+    command->numArgs = numArgs;
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t classifyBlockScalar(const char *block)
+ *
+ * Description:     Classifies 64 bytes of a line one byte at a time. Used
+ *                  when no vector instructions are available.
+ *
+ * Receives:        block       64 bytes to classify
+ *
+ * Returns:         Mask with bit i set if block[i] is a special character
+ ******************************************************************************/
+
+uint64_t classifyBlockScalar(const char *block) {
+    uint64_t bits = 0;
+    for(int i = 0; i < 64; i++) {
+        if(block[i] && special_chars[(unsigned char)block[i]]) {
+            bits |= (uint64_t)1 << i;
+        }
+    }
+    return bits;
+}
+
+#if defined(__SSE2__)
+/*******************************************************************************
+ * Function name:   uint64_t classifyBlockSSE2(const char *block)
+ *
+ * Description:     Classifies 64 bytes of a line 16 bytes at a time with
+ *                  SSE2 byte comparisons.
+ *
+ * Receives:        block       64 bytes to classify
+ *
+ * Returns:         Mask with bit i set if block[i] is a special character
+ ******************************************************************************/
+
+uint64_t classifyBlockSSE2(const char *block) {
+    uint64_t bits = 0;
+    for(int i = 0; i < 64; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(block + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\'')),
+                             _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\')),
+                             _mm_cmpeq_epi8(chunk,
+                                            _mm_set1_epi8(PID_EXPAND_CHAR)))));
+        __m128i glob = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('*')),
+                         _mm_cmpeq_epi8(chunk, _mm_set1_epi8('?'))),
+            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('[')));
+        __m128i list = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(';')),
+                         _mm_cmpeq_epi8(chunk, _mm_set1_epi8('&'))),
+            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('|')));
+        hits = _mm_or_si128(hits, _mm_or_si128(glob, list));
+        bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << i;
+    }
+    return bits;
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t classifyBlockAVX2(const char *block)
+ *
+ * Description:     Classifies 64 bytes of a line 32 bytes at a time with
+ *                  AVX2 byte comparisons. Compiled for AVX2 on its own so
+ *                  the rest of the shell still runs on any x86-64 processor;
+ *                  only called if the processor supports AVX2.
+ *
+ * Receives:        block       64 bytes to classify
+ *
+ * Returns:         Mask with bit i set if block[i] is a special character
+ ******************************************************************************/
+
+__attribute__((target("avx2")))
+uint64_t classifyBlockAVX2(const char *block) {
+    uint64_t bits = 0;
+    for(int i = 0; i < 64; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(block + i));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\'')),
+                    _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'))),
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\\')),
+                    _mm256_cmpeq_epi8(chunk,
+                                      _mm256_set1_epi8(PID_EXPAND_CHAR)))));
+        __m256i glob = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('*')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('?'))),
+            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('[')));
+        __m256i list = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(';')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('&'))),
+            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('|')));
+        hits = _mm256_or_si256(hits, _mm256_or_si256(glob, list));
+        bits |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hits) << i;
+    }
+    return bits;
+}
+#endif
+
+#if defined(__aarch64__)
+/*******************************************************************************
+ * Function name:   uint64_t classifyBlockNEON(const char *block)
+ *
+ * Description:     Classifies 64 bytes of a line 16 bytes at a time with NEON
+ *                  byte comparisons. NEON has no movemask instruction, so
+ *                  each comparison byte is reduced to its bit by weighting
+ *                  it and adding neighbouring bytes pairwise.
+ *
+ * Receives:        block       64 bytes to classify
+ *
+ * Returns:         Mask with bit i set if block[i] is a special character
+ ******************************************************************************/
+
+uint64_t classifyBlockNEON(const char *block) {
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                        1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t weight = vld1q_u8(weights);
+    uint8x16_t hits[4];
+
+    for(int i = 0; i < 4; i++) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t*)block + i * 16);
+        hits[i] = vorrq_u8(
+            vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(' ')),
+                              vceqq_u8(chunk, vdupq_n_u8('\t'))),
+                     vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('\'')),
+                              vceqq_u8(chunk, vdupq_n_u8('"')))),
+            vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('\\')),
+                     vceqq_u8(chunk, vdupq_n_u8(PID_EXPAND_CHAR))));
+        uint8x16_t glob = vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('*')),
+                                            vceqq_u8(chunk, vdupq_n_u8('?'))),
+                                   vceqq_u8(chunk, vdupq_n_u8('[')));
+        uint8x16_t list = vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(';')),
+                                            vceqq_u8(chunk, vdupq_n_u8('&'))),
+                                   vceqq_u8(chunk, vdupq_n_u8('|')));
+        hits[i] = vandq_u8(vorrq_u8(hits[i], vorrq_u8(glob, list)), weight);
+    }
+    uint8x16_t sum = vpaddq_u8(vpaddq_u8(hits[0], hits[1]),
+                               vpaddq_u8(hits[2], hits[3]));
+    sum = vpaddq_u8(sum, sum);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
+}
+#endif
+
+/*******************************************************************************
+ * Function name:   void initClassifier()
+ *
+ * Description:     Chooses the fastest line classifier the processor
+ *                  supports: AVX2 if the processor has it, otherwise SSE2 on
+ *                  x86-64 or NEON on ARM64, and the scalar classifier
+ *                  elsewhere.
+ *
+ * Postconditions:  classify_block and classifier_name are set
+ ******************************************************************************/
+
+void initClassifier() {
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        classify_block = classifyBlockAVX2;
+        classifier_name = "avx2";
+    } else {
+        classify_block = classifyBlockSSE2;
+        classifier_name = "sse2";
+    }
+#elif defined(__aarch64__)
+    classify_block = classifyBlockNEON;
+    classifier_name = "neon";
+#else
+    classify_block = classifyBlockScalar;
+    classifier_name = "scalar";
+#endif
+}
+
+/*******************************************************************************
+ * Function name:   void classifyLine(const char *line, size_t length)
+ *
+ * Description:     Builds line_mask for a line in one pass, with a bit set
+ *                  for every blank, quote, backslash, "$", glob character
+ *                  and ";", "&" or "|" so that the tokenizer can skip
+ *                  straight over ordinary characters. The other operators
+ *                  are whole words and "#" only matters at the start of
+ *                  the line, so they don't need marking. The last
+ *                  partial block is classified in place when its 64 bytes
+ *                  lie within one page, since the loads can't fault then,
+ *                  and the bits past the end are cleared; otherwise it is
+ *                  copied into a padded buffer first.
+ *
+ * Postconditions:  Bit i of line_mask is set if line[i] is special; the mask
+ *                  has been doubled until it covers the line
+ *
+ * Receives:        line        Line to classify
+ *                  length      Number of characters in line
+ ******************************************************************************/
+
+void classifyLine(const char *line, size_t length) {
+    char tail[64];          // Last partial block, padded with NULs
+    size_t i = 0;           // Start of the next block
+
+    // Grow the mask for a longer line than any before
+    if((length + 63) / 64 > line_mask_words) {
+        while((length + 63) / 64 > line_mask_words) {
+            line_mask_words = line_mask_words ? line_mask_words * 2
+                                              : MASK_WORDS;
+        }
+        heapFree(line_mask);
+        line_mask = heapAlloc(line_mask_words * sizeof(uint64_t));
+    }
+
+    for(; i + 64 <= length; i += 64) {
+        line_mask[i / 64] = classify_block(line + i);
+    }
+    if(i < length) {
+        const char *block = line + i;
+        if(((uintptr_t)block & (PAGE_BYTES - 1)) > PAGE_BYTES - 64) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, length - i);
+            block = tail;
+        }
+        line_mask[i / 64] = classify_block(block) &
+                            (~(uint64_t)0 >> (64 - (length - i)));
+    }
+}
+
+/*******************************************************************************
+ * Function name:   size_t nextSpecial(size_t pos, size_t length)
+ *
+ * Description:     Finds the next special character at or after pos using
+ *                  the mask built by classifyLine().
+ *
+ * Receives:        pos         Index in the line to search from
+ *                  length      Number of characters in the line
+ *
+ * Returns:         Index of the next special character, or length if there
+ *                  are none
+ ******************************************************************************/
+
+size_t nextSpecial(size_t pos, size_t length) {
+    if(pos >= length) {
+        return length;
+    }
+    size_t word = pos / 64;
+    uint64_t bits = line_mask[word] & (~(uint64_t)0 << pos % 64);
+    while(!bits) {
+        word++;
+        if(word * 64 >= length) {
+            return length;
+        }
+        bits = line_mask[word];
+    }
+    return word * 64 + (size_t)__builtin_ctzll(bits);
+}
+
+/*******************************************************************************
+ * Function name:   char *operatorToken(const char *word)
+ *
+ * Description:     Looks up an unquoted word among the shell's operators.
+ *                  Operators are stored in the argument list as pointers to
+ *                  the operator strings themselves, so that a quoted "|" or
+ *                  ">" is passed to the program as an ordinary argument:
+ *                  compare an argument with the operator's address, not its
+ *                  text. The operators are "&", "<", ">", ">>", "2>",
+ *                  "2>&1", "&>", "|", ";", "&&" and "||".
+ *
+ * Receives:        word        Unquoted word
+ *
+ * Returns:         The operator string the word stands for, or NULL if the
+ *                  word isn't an operator
+ ******************************************************************************/
+
+char *operatorToken(const char *word) {
+    // Two- and four-character operators
+    if(word[0] == '>' && word[1] == '>' && !word[2]) {
+        return append_operator;
+    }
+    if(word[0] == '&' && word[1] == '>' && !word[2]) {
+        return all_output_operator;
+    }
+    if(word[0] == '&' && word[1] == '&' && !word[2]) {
+        return and_operator;
+    }
+    if(word[0] == '|' && word[1] == '|' && !word[2]) {
+        return or_operator;
+    }
+    if(word[0] == '2' && word[1] == '>') {
+        if(!word[2]) {
+            return error_operator;
+        }
+        return strcmp(word + 2, ERROR_TO_OUTPUT + 2) ? NULL
+                                                     : error_to_output_operator;
+    }
+
+    if(!word[0] || word[1]) {
+        return NULL;
+    }
+    switch(word[0]) {
+        case '&':
+            return background_operator;
+        case '<':
+            return input_operator;
+        case '>':
+            return output_operator;
+        case '|':
+            return pipe_operator;
+        case ';':
+            return sequence_operator;
+        default:
+            return NULL;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   char *expandWord(Arena *arena, char *word, size_t length,
+ *                                   const size_t *expansions,
+ *                                   size_t numExpansions)
+ *
+ * Description:     Word-expansion stage applied to every word of a command
+ *                  line. Currently performs variable expansion. A word with
+ *                  nothing to expand is returned as it is, without copying.
+ *
+ * Receives:        arena           Arena struct pointer for an expanded word
+ *                  word            Word to expand, with quoting removed
+ *                  length          Number of characters in word
+ *                  expansions      Offsets of each variable reference to
+ *                                  expand in word
+ *                  numExpansions   Number of offsets in expansions
+ *
+ * Returns:         word, or its expansion allocated in the arena
+ ******************************************************************************/
+
+char *expandWord(Arena *arena, char *word, size_t length,
+                 const size_t *expansions, size_t numExpansions) {
+    if(numExpansions == 0) {
+        return word;
+    }
+    return expandVariables(arena, word, length, expansions, numExpansions);
+}
+
+/*******************************************************************************
+ * Function name:   char *expandVariables(Arena *arena, const char *word,
+ *                                        size_t length,
+ *                                        const size_t *expansions,
+ *                                        size_t numExpansions)
+ *
+ * Description:     Copies a word into the arena, replacing the variable
+ *                  reference at each of the given offsets with the value of
+ *                  the variable, or with nothing if it isn't set. The
+ *                  tokenizer finds the offsets, since a reference inside
+ *                  single quotes is left alone. Each reference costs one
+ *                  probe of the variable store, and the result is sized
+ *                  exactly and written in a single sweep.
+ *
+ * Preconditions:   initVariables() has been called
+ *
+ * Receives:        arena           Arena struct pointer for the new string
+ *                  word            Word to expand
+ *                  length          Number of characters in word
+ *                  expansions      Offsets of each reference to expand in
+ *                                  increasing order
+ *                  numExpansions   Number of offsets in expansions
+ *
+ * Returns:         Expanded copy of the word allocated in the arena
+ ******************************************************************************/
+
+char *expandVariables(Arena *arena, const char *word, size_t length,
+                      const size_t *expansions, size_t numExpansions) {
+    const Variable *stackValues[EXPANSIONS_SIZE];   // Usual-sized lists
+    size_t stackLengths[EXPANSIONS_SIZE];
+    const Variable **values = stackValues;  // Variable of each reference
+    size_t *lengths = stackLengths;         // Length of each reference
+
+    if(numExpansions > EXPANSIONS_SIZE) {
+        values = arenaAlloc(arena, numExpansions * sizeof(Variable*));
+        lengths = arenaAlloc(arena, numExpansions * sizeof(size_t));
+    }
+
+    // Look up each variable to size the result
+    size_t size = length;
+    for(size_t i = 0; i < numExpansions; i++) {
+        const char *name;
+        size_t nameLength;
+        lengths[i] = parseReference(word + expansions[i], &name, &nameLength);
+        values[i] = findVariable(name, nameLength);
+        size -= lengths[i];
+        size += values[i] ? values[i]->valueLength : 0;
+    }
+    char *newWord = arenaAlloc(arena, size + 1);
+
+    // Copy the word, writing each value in place of its reference
+    char *out = newWord;
+    size_t copied = 0;      // Number of characters of word handled so far
+    for(size_t i = 0; i < numExpansions; i++) {
+        memcpy(out, word + copied, expansions[i] - copied);
+        out += expansions[i] - copied;
+        if(values[i]) {
+            memcpy(out, values[i]->value, values[i]->valueLength);
+            out += values[i]->valueLength;
+        }
+        copied = expansions[i] + lengths[i];
+    }
+    memcpy(out, word + copied, length - copied);
+    out[length - copied] = '\0';
+    return newWord;
+}
+
+/*******************************************************************************
+ * Function name:   bool isPattern(Command *command, int index)
+ *
+ * Description:     Tells whether an unquoted word the tokenizer found a "*",
+ *                  "?" or "[" in is a glob pattern to expand. The filename
+ *                  of a redirection isn't, since it must stay a single word.
+ *
+ * Receives:        command     Command struct pointer
+ *                  index       int     Index of the word in command->args
+ *
+ * Returns:         true if the word should be expanded with globWord()
+ ******************************************************************************/
+
+bool isPattern(Command *command, int index) {
+    if(index == 0) {
+        return true;
+    }
+    char *operator = command->args[index - 1];
+    return operator != input_operator && operator != output_operator &&
+           operator != append_operator && operator != error_operator &&
+           operator != all_output_operator;
+}
+
+/*******************************************************************************
+ * Function name:   int globWord(Command *command, int index)
+ *
+ * Description:     Replaces a glob pattern with the paths that match it, in
+ *                  sorted order. Each "/"-separated part of the pattern is
+ *                  matched with fnmatch() against a cached listing of the
+ *                  directory the parts before it name, and a name starting
+ *                  with "." only matches a part that starts with one. A
+ *                  pattern that matches nothing is kept as it is.
+ *
+ * Preconditions:   isPattern() is true for the word, which is the last one
+ *                  in command->args
+ *
+ * Postconditions:  The matches are in command->args from index on, in the
+ *                  command's arena
+ *
+ * Receives:        command     Command struct pointer
+ *                  index       int     Index of the pattern in command->args
+ *
+ * Returns:         Number of arguments now taking the pattern's place
+ ******************************************************************************/
+
+int globWord(Command *command, int index) {
+    char *word = command->args[index];  // Pattern, kept if nothing matches
+    size_t length = strlen(word);
+    char *pattern = memcpy(arenaAlloc(&command->arena, length + 1), word,
+                           length + 1);
+
+    if(!dir_cache.listings) {
+        dir_cache.listings = heapAlloc(sizeof(DirListing) * DIR_CACHE_SIZE);
+        memset(dir_cache.listings, 0, sizeof(DirListing) * DIR_CACHE_SIZE);
+        dir_cache.buffer = heapAlloc(DIR_READ_SIZE);
+        dir_cache.path = heapAlloc(PATH_MAX);
+    }
+    dir_cache.globs++;
+
+    // An absolute pattern is matched from the root
+    size_t pathLength = 0;
+    if(*pattern == '/') {
+        dir_cache.path[pathLength++] = '/';
+        while(*pattern == '/') {
+            pattern++;
+        }
+    }
+    dir_cache.path[pathLength] = '\0';
+
+    int matches = globPath(command, index, pathLength, pattern);
+    if(matches == 0) {
+        command->args[index] = word;
+        return 1;
+    }
+    return matches;
+}
+
+/*******************************************************************************
+ * Function name:   int globPath(Command *command, int index,
+ *                               size_t pathLength, char *pattern)
+ *
+ * Description:     Matches the rest of a glob pattern below the directory
+ *                  in dir_cache.path, one part at a time. A part without
+ *                  glob characters is taken as it is, and a file named by
+ *                  the last such part must exist; a part followed by "/"
+ *                  only matches directories.
+ *
+ * Preconditions:   dir_cache.path holds pathLength characters: none for
+ *                  the working directory, or a path ending with "/"
+ *
+ * Postconditions:  Each match is in command->args from index on. pattern
+ *                  is unchanged.
+ *
+ * Receives:        command     Command struct pointer
+ *                  index       int     Where the first match goes
+ *                  pathLength  size_t  Number of characters in the path
+ *                  pattern     Rest of the pattern
+ *
+ * Returns:         Number of matches added
+ ******************************************************************************/
+
+int globPath(Command *command, int index, size_t pathLength, char *pattern) {
+    char *path = dir_cache.path;    // Path being built
+    char *slash = strchr(pattern, '/'); // End of this part of the pattern
+    char *rest = NULL;              // Parts after this one, or NULL
+    DirListing *listing = NULL;     // Listing this part is matched against
+    int matches = 0;                // Number of matches added
+
+    if(slash) {
+        *slash = '\0';
+        rest = slash + 1;
+        while(*rest == '/') {
+            rest++;
+        }
+    }
+    if(strpbrk(pattern, GLOB_CHARS)) {
+        listing = listDirectory(pathLength ? path : ".");
+        if(!listing) {
+            if(slash) {
+                *slash = '/';
+            }
+            return 0;
+        }
+        listing->busy = true;
+    }
+
+    // Try each name in the directory, or just the literal part
+    int count = listing ? listing->count : 1;
+    for(int i = 0; i < count; i++) {
+        char *name = listing ? listing->entries[i] + 1 : pattern;
+        unsigned char type = listing ? (unsigned char)listing->entries[i][0]
+                                     : DT_UNKNOWN;
+        if(listing && fnmatch(pattern, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        size_t length = strlen(name);
+        if(pathLength + length + 2 > PATH_MAX) {
+            continue;
+        }
+        memcpy(path + pathLength, name, length + 1);
+        size_t end = pathLength + length;
+
+        // Go on into a directory, or add the path if this is the last part
+        struct stat info;
+        if(rest) {
+            if(!isDirectory(path, type)) {
+                continue;
+            }
+            path[end++] = '/';
+            path[end] = '\0';
+            if(*rest) {
+                matches += globPath(command, index + matches, end, rest);
+                continue;
+            }
+        } else if(!listing && lstat(path, &info) == -1) {
+            continue;
+        }
+        reserveArgs(command, index + matches + 1);
+        command->args[index + matches] = memcpy(arenaAlloc(&command->arena,
+                                                           end + 1),
+                                                path, end + 1);
+        matches++;
+    }
+
+    if(listing) {
+        listing->busy = false;
+    }
+    if(slash) {
+        *slash = '/';
+    }
+    return matches;
+}
+
+/*******************************************************************************
+ * Function name:   bool isDirectory(const char *path, unsigned char type)
+ *
+ * Description:     Tells whether a directory entry is a directory or a
+ *                  symbolic link to one. Only a link, or an entry whose type
+ *                  the file system didn't report, needs a stat().
+ *
+ * Receives:        path        Path of the entry
+ *                  type        unsigned char   DT_* type from the listing
+ *
+ * Returns:         true if path names a directory
+ ******************************************************************************/
+
+bool isDirectory(const char *path, unsigned char type) {
+    struct stat info;
+
+    if(type == DT_DIR) {
+        return true;
+    }
+    if(type != DT_UNKNOWN && type != DT_LNK) {
+        return false;
+    }
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+/*******************************************************************************
+ * Function name:   DirListing *listDirectory(const char *path)
+ *
+ * Description:     Finds the listing of a directory, checking with one
+ *                  stat() that the cached one is still current, and
+ *                  otherwise reads the directory again into its slot or the
+ *                  least recently used one.
+ *
+ * Receives:        path        Path of the directory
+ *
+ * Returns:         The directory's listing, or NULL if it isn't a directory
+ *                  that can be read or every slot is busy
+ ******************************************************************************/
+
+DirListing *listDirectory(const char *path) {
+    struct stat info;                   // The directory as it is now
+    DirListing *listing = NULL;         // Slot holding the directory
+    DirListing *oldest = NULL;          // Least recently used idle slot
+
+    if(stat(path, &info) == -1 || !S_ISDIR(info.st_mode)) {
+        return NULL;
+    }
+    dir_cache.clock++;
+    for(int i = 0; i < DIR_CACHE_SIZE && !listing; i++) {
+        DirListing *slot = &dir_cache.listings[i];
+        if(slot->used && slot->device == info.st_dev &&
+           slot->inode == info.st_ino) {
+            listing = slot;
+        } else if(!slot->busy && (!oldest || slot->used < oldest->used)) {
+            oldest = slot;
+        }
+    }
+
+    // A listing being matched against is used as it is, since reading it
+    // again would move the entries under the match
+    if(listing && (listing->busy ||
+                   (listing->settled &&
+                    listing->mtime.tv_sec == info.st_mtim.tv_sec &&
+                    listing->mtime.tv_nsec == info.st_mtim.tv_nsec))) {
+        listing->used = dir_cache.clock;
+        dir_cache.cached++;
+        return listing;
+    }
+    if(!listing) {
+        listing = oldest;
+    }
+    if(!listing) {
+        return NULL;
+    }
+
+    // Read the directory, labelling the listing with the one opened
+    listing->used = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        return NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool read = fstat(fd, &info) == 0 && readDirectory(listing, fd);
+    close(fd);
+    dir_cache.reads++;
+    if(!read) {
+        return NULL;
+    }
+    listing->device = info.st_dev;
+    listing->inode = info.st_ino;
+    listing->mtime = info.st_mtim;
+    listing->settled = (int64_t)(now.tv_sec - info.st_mtim.tv_sec) *
+                       1000000000 + (now.tv_nsec - info.st_mtim.tv_nsec) >=
+                       DIR_SETTLE_NS;
+    listing->used = dir_cache.clock;
+    return listing;
+}
+
+/*******************************************************************************
+ * Function name:   bool readDirectory(DirListing *listing, int fd)
+ *
+ * Description:     Reads every entry of a directory with getdents64(),
+ *                  leaving out "." and "..", and sorts them by name. The
+ *                  listing's buffers are grown as needed and kept.
+ *
+ * Receives:        listing     DirListing struct pointer
+ *                  fd          int     Open directory
+ *
+ * Returns:         true if the whole directory was read
+ ******************************************************************************/
+
+bool readDirectory(DirListing *listing, int fd) {
+    size_t used = 0;        // Number of bytes used in listing->names
+
+    listing->count = 0;
+    while(true) {
+        long bytes = syscall(SYS_getdents64, fd, dir_cache.buffer,
+                             DIR_READ_SIZE);
+        if(bytes == -1) {
+            return false;
+        }
+        if(bytes == 0) {
+            break;
+        }
+        for(long offset = 0; offset < bytes;) {
+            DirentRecord *record = (DirentRecord*)(dir_cache.buffer + offset);
+            offset += record->length;
+            char *name = record->name;
+            if(name[0] == '.' &&
+               (!name[1] || (name[1] == '.' && !name[2]))) {
+                continue;
+            }
+
+            // Store the type byte, then the name
+            size_t length = strlen(name) + 2;
+            if(used + length > listing->namesSize) {
+                size_t size = listing->namesSize ? listing->namesSize
+                                                 : DIR_READ_SIZE;
+                while(size < used + length) {
+                    size *= 2;
+                }
+                listing->names = heapRealloc(listing->names, size);
+                listing->namesSize = size;
+            }
+            listing->names[used] = (char)record->type;
+            memcpy(listing->names + used + 1, name, length - 1);
+            used += length;
+            listing->count++;
+        }
+    }
+
+    // Point at each entry now that the names won't move, and sort them
+    if(listing->count > listing->capacity) {
+        listing->capacity = listing->count;
+        listing->entries = heapRealloc(listing->entries,
+                                       sizeof(char*) * listing->capacity);
+    }
+    char *entry = listing->names;
+    for(int i = 0; i < listing->count; i++) {
+        listing->entries[i] = entry;
+        entry += strlen(entry + 1) + 2;
+    }
+    qsort(listing->entries, (size_t)listing->count, sizeof(char*),
+          compareEntries);
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   int compareEntries(const void *left, const void *right)
+ *
+ * Description:     qsort() comparison of two DirListing entries by name
+ *
+ * Receives:        left        Pointer to an entry
+ *                  right       Pointer to an entry
+ *
+ * Returns:         Less than, equal to or more than 0, as strcmp() does
+ ******************************************************************************/
+
+int compareEntries(const void *left, const void *right) {
+    return strcmp(*(char* const*)left + 1, *(char* const*)right + 1);
+}
+
+/*******************************************************************************
+ * Function name:   void cachePIDString()
+ *
+ * Description:     Gets the PID of the running process and stores its string
+ *                  representation in pid_string, from which the "$"
+ *                  variable that "$$" expands to is set.
+ *
+ * Postconditions:  pid_string holds the PID and pid_string_len its length,
+ *                  and shell_pid the PID itself
+ ******************************************************************************/
+
+void cachePIDString() {
+    pid_t pid = getpid();
+    shell_pid = pid;
+    pid_string_len = (size_t)snprintf(pid_string, MAX_PID_CHARS, "%ld",
+                                      (long)pid);
+}
+
+/*******************************************************************************
+ * Function name:   bool isNameChar(char c, bool first)
+ *
+ * Description:     Tells whether c can appear in a variable name: a letter,
+ *                  digit or underscore, but not a digit first.
+ *
+ * Receives:        c           char    Character to check
+ *                  first       bool    True if c would start the name
+ *
+ * Returns:         true if c can appear in the name at that position
+ ******************************************************************************/
+
+bool isNameChar(char c, bool first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           (!first && c >= '0' && c <= '9');
+}
+
+/*******************************************************************************
+ * Function name:   bool isName(const char *name, size_t length)
+ *
+ * Description:     Tells whether the first length characters of name form
+ *                  a valid variable name.
+ *
+ * Receives:        name        Characters to check
+ *                  length      size_t  Number of characters
+ *
+ * Returns:         true if they form a name
+ ******************************************************************************/
+
+bool isName(const char *name, size_t length) {
+    for(size_t i = 0; i < length; i++) {
+        if(!isNameChar(name[i], i == 0)) {
+            return false;
+        }
+    }
+    return length > 0;
+}
+
+/*******************************************************************************
+ * Function name:   size_t parseReference(const char *ref, const char **name,
+ *                                        size_t *nameLength)
+ *
+ * Description:     Measures the variable reference at the start of ref:
+ *                  "$$", "$NAME" or "${NAME}". "$$" names the variable "$",
+ *                  which holds the shell's PID.
+ *
+ * Receives:        ref         Text starting with PID_EXPAND_CHAR
+ *                  name        Set to the start of the name, or NULL
+ *                  nameLength  Set to the length of the name, or NULL
+ *
+ * Returns:         Number of characters in the reference, or 0 if ref
+ *                  doesn't start with one
+ ******************************************************************************/
+
+size_t parseReference(const char *ref, const char **name, size_t *nameLength) {
+    const char *start = ref + 1;    // First character of the name
+    size_t length = 0;              // Number of characters in the name
+    size_t extra = 1;               // Characters of the reference around it
+
+    if(ref[1] == PID_EXPAND_CHAR) {
+        length = 1;
+    } else {
+        if(ref[1] == '{') {
+            start++;
+            extra = 3;
+        }
+        while(isNameChar(start[length], length == 0)) {
+            length++;
+        }
+        if(length == 0 || (extra == 3 && start[length] != '}')) {
+            return 0;
+        }
+    }
+    if(name) {
+        *name = start;
+        *nameLength = length;
+    }
+    return length + extra;
+}
+
+/*******************************************************************************
+ * Function name:   void initVariables()
+ *
+ * Description:     Fills the variable store with the environment the shell
+ *                  was started with, every variable exported, and with "$"
+ *                  holding the shell's PID. From then on environ points at
+ *                  the store's environment, which children are given.
+ *
+ * Preconditions:   cachePIDString() has been called
+ *
+ * Postconditions:  var_store holds every variable and environ is
+ *                  var_store.envp
+ ******************************************************************************/
+
+void initVariables() {
+    size_t count = 0;               // Number of environment entries
+    while(environ[count]) {
+        count++;
+    }
+    var_store.capacity = VAR_STORE_SIZE;
+    while(var_store.capacity < 2 * (count + 1)) {
+        var_store.capacity *= 2;
+    }
+    var_store.slots = heapAlloc(var_store.capacity * sizeof(Variable));
+    memset(var_store.slots, 0, var_store.capacity * sizeof(Variable));
+    var_store.envCapacity = (int)count + 1;
+    var_store.envp = heapAlloc(var_store.envCapacity * sizeof(char*));
+    var_store.envp[0] = NULL;
+
+    char **startup = environ;
+    for(size_t i = 0; i < count; i++) {
+        char *equals = strchr(startup[i], '=');
+        if(equals && equals > startup[i]) {
+            setVariable(startup[i], (size_t)(equals - startup[i]),
+                        equals + 1, strlen(equals + 1), true);
+        }
+    }
+    setVariable("$", 1, pid_string, pid_string_len, false);
+    environ = var_store.envp;
+}
+
+/*******************************************************************************
+ * Function name:   size_t hashName(const char *name, size_t length)
+ *
+ * Description:     FNV-1a hash of the length characters of name, which need
+ *                  not be terminated.
+ *
+ * Receives:        name        Characters to hash
+ *                  length      size_t  Number of characters
+ *
+ * Returns:         Hash of the characters
+ ******************************************************************************/
+
+size_t hashName(const char *name, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ull;
+    }
+    return (size_t)hash;
+}
+
+/*******************************************************************************
+ * Function name:   Variable *findVariable(const char *name, size_t length)
+ *
+ * Description:     Looks up a variable with a single probe sequence of the
+ *                  variable store.
+ *
+ * Receives:        name        Name to look up, which need not be terminated
+ *                  length      size_t  Number of characters in name
+ *
+ * Returns:         The variable, or NULL if it isn't set
+ ******************************************************************************/
+
+Variable *findVariable(const char *name, size_t length) {
+    if(var_store.capacity == 0) {
+        return NULL;
+    }
+    size_t hash = hashName(name, length);
+    size_t mask = var_store.capacity - 1;
+    for(size_t slot = hash & mask; var_store.slots[slot].name;
+        slot = (slot + 1) & mask) {
+        Variable *variable = &var_store.slots[slot];
+        if(variable->hash == hash && variable->nameLength == length &&
+           !memcmp(variable->name, name, length)) {
+            return variable;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * Function name:   Variable *setVariable(const char *name, size_t nameLength,
+ *                                        const char *value,
+ *                                        size_t valueLength, bool export)
+ *
+ * Description:     Sets a variable, creating it if needed. Its "NAME=value"
+ *                  entry is rewritten in place when the new value fits, and
+ *                  an exported variable's slot in the environment is
+ *                  updated to match, so the environment is never rebuilt.
+ *
+ * Receives:        name        Name of the variable, which need not be
+ *                              terminated
+ *                  nameLength  size_t  Number of characters in name
+ *                  value       New value, which need not be terminated and
+ *                              must not point into the variable's entry
+ *                  valueLength size_t  Number of characters in value
+ *                  export      bool    True to export the variable too
+ *
+ * Returns:         The variable
+ ******************************************************************************/
+
+Variable *setVariable(const char *name, size_t nameLength, const char *value,
+                      size_t valueLength, bool export) {
+    Variable *variable = findVariable(name, nameLength);
+
+    // Intern the name of a new variable
+    if(!variable) {
+        if(2 * (var_store.count + 1) > var_store.capacity) {
+            growVariables();
+        }
+        size_t hash = hashName(name, nameLength);
+        size_t mask = var_store.capacity - 1;
+        size_t slot = hash & mask;
+        while(var_store.slots[slot].name) {
+            slot = (slot + 1) & mask;
+        }
+        variable = &var_store.slots[slot];
+        variable->name = heapAlloc(nameLength + 1);
+        memcpy(variable->name, name, nameLength);
+        variable->name[nameLength] = '\0';
+        variable->nameLength = nameLength;
+        variable->hash = hash;
+        variable->entry = NULL;
+        variable->entrySize = 0;
+        variable->envIndex = -1;
+        var_store.count++;
+    }
+
+    // Write the entry, growing it only if the value doesn't fit
+    size_t size = nameLength + valueLength + 2;
+    if(size > variable->entrySize) {
+        variable->entry = heapRealloc(variable->entry, size);
+        variable->entrySize = size;
+    }
+    memcpy(variable->entry, variable->name, nameLength);
+    variable->entry[nameLength] = '=';
+    variable->value = variable->entry + nameLength + 1;
+    memcpy(variable->value, value, valueLength);
+    variable->value[valueLength] = '\0';
+    variable->valueLength = valueLength;
+
+    if(variable->envIndex != -1) {
+        var_store.envp[variable->envIndex] = variable->entry;
+        var_store.envVersion++;
+    }
+    if(export) {
+        exportVariable(variable);
+    }
+    if(nameLength == 4 && !memcmp(name, "PATH", 4)) {
+        var_store.pathVersion++;
+    }
+    return variable;
+}
+
+/*******************************************************************************
+ * Function name:   void exportVariable(Variable *variable)
+ *
+ * Description:     Adds a variable's entry to the end of the environment
+ *                  children are given, if it isn't there already.
+ *
+ * Postconditions:  environ is var_store.envp, which may have moved
+ *
+ * Receives:        variable    Variable struct pointer
+ ******************************************************************************/
+
+void exportVariable(Variable *variable) {
+    if(variable->envIndex != -1) {
+        return;
+    }
+    if(var_store.envCount + 1 >= var_store.envCapacity) {
+        var_store.envCapacity *= 2;
+        var_store.envp = heapRealloc(var_store.envp, var_store.envCapacity *
+                                                     sizeof(char*));
+        environ = var_store.envp;
+    }
+    variable->envIndex = var_store.envCount;
+    var_store.envp[var_store.envCount++] = variable->entry;
+    var_store.envp[var_store.envCount] = NULL;
+    var_store.envVersion++;
+}
+
+/*******************************************************************************
+ * Function name:   void unsetVariable(const char *name, size_t length)
+ *
+ * Description:     Removes a variable. An exported variable's slot in the
+ *                  environment is filled with the last entry, and its slot
+ *                  in the store by shifting back the entries that follow it
+ *                  in the probe sequence.
+ *
+ * Receives:        name        Name of the variable
+ *                  length      size_t  Number of characters in name
+ ******************************************************************************/
+
+void unsetVariable(const char *name, size_t length) {
+    Variable *variable = findVariable(name, length);
+    if(!variable) {
+        return;
+    }
+
+    // Move the last environment entry into the variable's slot
+    if(variable->envIndex != -1) {
+        char *last = var_store.envp[--var_store.envCount];
+        var_store.envp[var_store.envCount] = NULL;
+        if(last != variable->entry) {
+            Variable *moved = findVariable(last, strcspn(last, "="));
+            moved->envIndex = variable->envIndex;
+            var_store.envp[variable->envIndex] = last;
+        }
+        var_store.envVersion++;
+    }
+    if(length == 4 && !memcmp(name, "PATH", 4)) {
+        var_store.pathVersion++;
+    }
+    heapFree(variable->name);
+    heapFree(variable->entry);
+    variable->name = NULL;
+    var_store.count--;
+
+    // Shift back later entries that would be cut off from their home slot
+    size_t mask = var_store.capacity - 1;
+    size_t hole = (size_t)(variable - var_store.slots);
+    size_t slot = (hole + 1) & mask;
+    while(var_store.slots[slot].name) {
+        size_t home = var_store.slots[slot].hash & mask;
+        if(((slot - home) & mask) >= ((slot - hole) & mask)) {
+            var_store.slots[hole] = var_store.slots[slot];
+            var_store.slots[slot].name = NULL;
+            hole = slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void growVariables()
+ *
+ * Description:     Doubles the number of slots in the variable store and
+ *                  reinserts every variable. Environment indexes are kept,
+ *                  since the entries don't move.
+ ******************************************************************************/
+
+void growVariables() {
+    Variable *old = var_store.slots;
+    size_t oldCapacity = var_store.capacity;
+
+    var_store.capacity = oldCapacity ? oldCapacity * 2 : VAR_STORE_SIZE;
+    var_store.slots = heapAlloc(var_store.capacity * sizeof(Variable));
+    memset(var_store.slots, 0, var_store.capacity * sizeof(Variable));
+    size_t mask = var_store.capacity - 1;
+    for(size_t i = 0; i < oldCapacity; i++) {
+        if(old[i].name) {
+            size_t slot = old[i].hash & mask;
+            while(var_store.slots[slot].name) {
+                slot = (slot + 1) & mask;
+            }
+            var_store.slots[slot] = old[i];
+        }
+    }
+    heapFree(old);
+}
+
+/*******************************************************************************
+ * Function name:   void printExitValOrSignal(int exitStatus)
+ *
+ * Description:     Takes in an integer representing the exit status of a
+ *                  process. If the process exited normally, prints the exit
+ *                  value. If the process was killed or stopped by a
+ *                  signal, prints the signal number.
+ *
+ * Preconditions:   exitStatus is the exit status of a process
+ *
+ * Receives:        exitStatus      int     Exit status of a process
+ ******************************************************************************/
+
+void printExitValOrSignal(int exitStatus) {
+    char text[CONTROL_REPLY_MAX];   // Description of the status
+
+    if(formatExitValOrSignal(text, sizeof(text), exitStatus) > 0) {
+        printf("%s\n", text);
+        fflush(stdout);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int formatExitValOrSignal(char *text, size_t size,
+ *                                            int exitStatus)
+ *
+ * Description:     Describes an exit status the way printExitValOrSignal()
+ *                  prints it, without the newline.
+ *
+ * Receives:        text        Buffer the description is written to
+ *                  size        Size of text
+ *                  exitStatus  int     Exit status of a process
+ *
+ * Returns:         Number of characters written, or 0 if the status is none
+ *                  of exited, signaled or stopped
+ ******************************************************************************/
+
+int formatExitValOrSignal(char *text, size_t size, int exitStatus) {
+    text[0] = '\0';
+    if(WIFEXITED(exitStatus)) {
+        return snprintf(text, size, "exit value %d", WEXITSTATUS(exitStatus));
+    } else if (WIFSIGNALED(exitStatus)) {
+        return snprintf(text, size, "terminated by signal %d",
+                        WTERMSIG(exitStatus));
+    } else if (WIFSTOPPED(exitStatus)) {
+        return snprintf(text, size, "stopped by signal %d",
+                        WSTOPSIG(exitStatus));
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int executeCommand(Command *command)
+ *
+ * Description:     Takes in a Command struct and runs the pipelines of its
+ *                  line with runList().
+ *
+ * Preconditions:   command has received user input via promptLoop and its
+ *                  arguments have been parsed with parseCommandLine()
+ *
+ * Receives:        command     Command struct pointer
+ *
+ * Returns:         int     -1 if the user used the exit command
+ *                           0 otherwise
+ ******************************************************************************/
+
+int executeCommand(Command *command) {
+    if(command->numStages == 0) {
+        return 0;
+    }
+
+    // Every stage of every pipeline needs a command to run
+    for(int i = 0; i < command->numStages; i++) {
+        if(command->stages[i].numArgs == 0) {
+            fprintf(stderr, "smallsh: syntax error: missing command\n");
+            fflush(stdout);
+            return 0;
+        }
+    }
+    return runList(command, 0);
+}
+
+/*******************************************************************************
+ * Function name:   int runList(Command *command, int status)
+ *
+ * Description:     Runs the pipelines of a command's list in order, each as
+ *                  a command of its own with the stages and background mode
+ *                  of that pipeline. A pipeline after "&&" only runs if the
+ *                  status of the one before was 0, and one after "||" only
+ *                  if it wasn't, so a skipped pipeline starts no process.
+ *                  A pipeline run in the background counts as having
+ *                  succeeded once it has started. A control request's
+ *                  pipelines all run in the background, and each gets a
+ *                  reply: its job's, "done" and its status, or "skipped".
+ *                  Once one that doesn't end with "&" launches or queues a
+ *                  job, the rest of the list is stored in the job, and
+ *                  continueLists() runs it when the job's status is known.
+ *
+ * Preconditions:   Every stage of command has a command to run
+ *
+ * Receives:        command     Command struct pointer
+ *                  status      int     Status of the pipeline before the
+ *                                      first one, which its joiner tests
+ *
+ * Returns:         int     -1 if the user used the exit command
+ *                           0 otherwise
+ ******************************************************************************/
+
+int runList(Command *command, int status) {
+    Stage *stages = command->stages;    // Stages of the whole line
+    int numStages = command->numStages; // Number of stages in the line
+    bool background = command->background;  // Mode to restore
+    int client = control_table.client;  // Client the list runs for, or -1
+    char reply[CONTROL_REPLY_MAX];      // Reply for a pipeline with no job
+    int result = 0;                     // Return value
+
+    for(int i = 0; i < command->numPipelines && result == 0; i++) {
+        Pipeline *pipeline = &command->pipelines[i];
+        if((pipeline->joiner == LIST_AND && status != 0) ||
+           (pipeline->joiner == LIST_OR && status == 0)) {
+            if(client != -1) {
+                replyControl(client, "skipped");
+            }
+            continue;
+        }
+        command->stages = stages + pipeline->firstStage;
+        command->numStages = pipeline->numStages;
+        command->background = client != -1 ||
+                              (pipeline->background && !foreground_only);
+        control_table.job = -1;
+        control_table.replied = false;
+        result = executePipeline(command, &status);
+        if(client == -1 || result != 0) {
+            continue;
+        }
+
+        // The rest of a request's list waits for the job to finish
+        if(control_table.job != -1 && !pipeline->background) {
+            if(i + 1 < command->numPipelines) {
+                command->stages = stages;
+                command->numStages = numStages;
+                storeJobList(&job_table.jobs[control_table.job], command,
+                             i + 1);
+            }
+            break;
+        }
+        if(!control_table.replied) {
+            int used = snprintf(reply, sizeof(reply), "done ");
+            formatExitValOrSignal(reply + used, sizeof(reply) - used,
+                                  status);
+            replyControl(client, reply);
+            control_table.replied = true;
+        }
+    }
+    command->stages = stages;
+    command->numStages = numStages;
+    command->background = background;
+    return result;
+}
+
+/*******************************************************************************
+ * Function name:   int executePipeline(Command *command, int *status)
+ *
+ * Description:     Executes the pipeline the command's stages describe. A
+ *                  pipeline's stages are all launched before the shell waits
+ *                  for any of them.
+ *
+ * Preconditions:   command->stages and command->numStages describe one
+ *                  pipeline of the line, each stage with a command
+ *
+ * Postconditions:  *status is the pipeline's exit status: that of a
+ *                  built-in or a foreground job, 0 for a background job
+ *                  that was started or queued, or nonzero if the pipeline
+ *                  couldn't be run
+ *
+ * Receives:        command     Command struct pointer
+ *                  status      Where the pipeline's status is stored
+ *
+ * Returns:         int     -1 if the user used the exit command
+ *                           0 otherwise
+ ******************************************************************************/
+
+int executePipeline(Command *command, int *status) {
+    *status = W_EXITCODE(1, 0);
+
+    // "slice NAME command" launches the command into a slice
+    int slice = -1;         // Slice the job is launched into
+    Stage *first = &command->stages[0];
+    if(first->numArgs > 2 && !strcmp(first->args[0], "slice") &&
+       first->args[1][0] != '-') {
+        if(!slicePrefix(command, &slice)) {
+            return 0;
+        }
+    }
+
+    // Background commands wait for a free slot if SMALLSH_MAX_JOBS is set,
+    // and so do commands run with the parallel built-in
+    bool throttled = command->background && throttle_all;
+    if(!strcmp(command->stages[0].args[0], "parallel")) {
+        if(!parallelBuiltin(command)) {
+            return 0;
+        }
+        throttled = command->background;
+    }
+    if(slice == -1 && command->background) {
+        slice = slice_table.background;
+    }
+
+    // Built-in commands run in the shell process unless part of a pipeline.
+    // A utility run in the background is launched like the program it
+    // stands in for, with its output going to /dev/null.
+    const Builtin *shellBuiltin = findBuiltin(command->stages[0].args[0]);
+    if(command->numStages == 1 &&
+       !(command->background && shellBuiltin && shellBuiltin->utility)) {
+        BuiltinResult builtin = runShellBuiltin(&command->stages[0]);
+        if(builtin == BUILTIN_EXIT) {
+            return -1;
+        }
+        if(builtin == BUILTIN_DONE) {
+            metrics.builtins++;
+            *status = builtin_status;
+            return 0;
+        }
+    }
+
+    // All other commands: launch a child process for each stage and connect
+    // the stages with pipes. The processes are tracked as one job.
+    Job *job = addJob(command->background);
+    metrics.external++;
+    job->slice = slice;
+    job->client = control_table.client;
+    setJobText(job, command);
+
+    // Queue a throttled command while the limit is reached or earlier
+    // commands are still waiting
+    if(throttled && (job_table.running >= jobLimit() ||
+                     job_table.queueHead != -1)) {
+        queueJob(job, command);
+        if(job->client != -1) {
+            control_table.job = job->id - 1;
+            replyJob(job, "queued");
+        } else {
+            printf("background job [%d] queued\n", job->id);
+            fflush(stdout);
+        }
+        *status = 0;
+        return 0;
+    }
+    bool handoff = launchPipeline(command, job);
+
+    // None of the stages could be launched
+    if(job->numProcs == 0) {
+        if(!command->background) {
+            fg_status = job->status;
+        }
+        builtin_status = job->status;
+        *status = job->status;
+        freeJob(job);
+        return 0;
+    }
+
+    // Wait for foreground processes. The status of the final stage is the
+    // status of the pipeline.
+    if(!command->background) {
+        waitForeground(job, handoff);
+        *status = fg_status;
+    }
+        // Print PID for background processes
+    else {
+        *status = 0;
+        countRunningJob();
+        job_table.current = job->id - 1;
+        if(job->client != -1) {
+            control_table.job = job->id - 1;
+            replyJobStarted(job);
+        }
+        for(int i = command->numStages - 1; i >= 0 && job->client == -1;
+            i--) {
+            if(command->stages[i].pid > 0) {
+                printf("background pid is %d\n", command->stages[i].pid);
+                fflush(stdout);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   const Builtin *findBuiltin(const char *name)
+ *
+ * Description:     Looks a command name up in the builtins table. The name's
+ *                  length and first and last characters select the only
+ *                  built-in it can be, so one strcmp() confirms it. To add a
+ *                  built-in command, give it a BuiltinId, a table entry and
+ *                  a case here.
+ *
+ * Receives:        name        Command name
+ *
+ * Returns:         The built-in command, or NULL if name isn't one
+ ******************************************************************************/
+
+const Builtin *findBuiltin(const char *name) {
+    size_t length = strnlen(name, 8);   // No built-in name is longer than 7
+    BuiltinId id;                       // The built-in name could be
+
+    if(length == 0 || length == 8) {
+        return NULL;
+    }
+    switch(BUILTIN_KEY(length, name[0], name[length - 1])) {
+        case BUILTIN_KEY(1, '[', '['):
+            id = BUILTIN_ID_BRACKET;
+            break;
+        case BUILTIN_KEY(2, 'b', 'g'):
+            id = BUILTIN_ID_BG;
+            break;
+        case BUILTIN_KEY(2, 'c', 'd'):
+            id = BUILTIN_ID_CD;
+            break;
+        case BUILTIN_KEY(2, 'f', 'g'):
+            id = BUILTIN_ID_FG;
+            break;
+        case BUILTIN_KEY(3, 'p', 'd'):
+            id = BUILTIN_ID_PWD;
+            break;
+        case BUILTIN_KEY(3, 's', 't'):
+            id = BUILTIN_ID_SET;
+            break;
+        case BUILTIN_KEY(4, 'e', 'o'):
+            id = BUILTIN_ID_ECHO;
+            break;
+        case BUILTIN_KEY(4, 'e', 't'):
+            id = BUILTIN_ID_EXIT;
+            break;
+        case BUILTIN_KEY(4, 'h', 'h'):
+            id = BUILTIN_ID_HASH;
+            break;
+        case BUILTIN_KEY(4, 'j', 's'):
+            id = BUILTIN_ID_JOBS;
+            break;
+        case BUILTIN_KEY(4, 't', 'e'):
+            id = BUILTIN_ID_TRUE;
+            break;
+        case BUILTIN_KEY(4, 't', 't'):
+            id = BUILTIN_ID_TEST;
+            break;
+        case BUILTIN_KEY(4, 'w', 't'):
+            id = BUILTIN_ID_WAIT;
+            break;
+        case BUILTIN_KEY(5, 'f', 'e'):
+            id = BUILTIN_ID_FALSE;
+            break;
+        case BUILTIN_KEY(5, 's', 'e'):
+            id = BUILTIN_ID_SLICE;
+            break;
+        case BUILTIN_KEY(5, 's', 's'):
+            id = BUILTIN_ID_STATS;
+            break;
+        case BUILTIN_KEY(5, 'u', 't'):
+            id = BUILTIN_ID_UNSET;
+            break;
+        case BUILTIN_KEY(6, 'e', 't'):
+            id = BUILTIN_ID_EXPORT;
+            break;
+        case BUILTIN_KEY(6, 's', 's'):
+            id = BUILTIN_ID_STATUS;
+            break;
+        case BUILTIN_KEY(6, 'u', 't'):
+            id = BUILTIN_ID_ULIMIT;
+            break;
+        case BUILTIN_KEY(7, 'h', 'y'):
+            id = BUILTIN_ID_HISTORY;
+            break;
+        case BUILTIN_KEY(7, 't', 's'):
+            id = BUILTIN_ID_TIMINGS;
+            break;
+        default:
+            return NULL;
+    }
+    return strcmp(name, builtins[id].name) ? NULL : &builtins[id];
+}
+
+/*******************************************************************************
+ * Function name:   BuiltinResult runBuiltin(char **args, int *status)
+ *
+ * Description:     Runs args as a built-in command if its name is one: exit,
+ *                  cd, status, set, timings, hash, jobs, wait, fg, bg,
+ *                  stats, history, export, unset, ulimit, slice, or the
+ *                  in-shell versions of echo, true, false, test, [ and pwd.
+ *
+ * Postconditions:  status holds the built-in command's exit status
+ *
+ * Receives:        args        NULL-terminated argument list
+ *                  status      int pointer for the exit status
+ *
+ * Returns:         BUILTIN_NONE if args isn't a built-in command,
+ *                  BUILTIN_EXIT for the exit command or BUILTIN_DONE
+ ******************************************************************************/
+
+BuiltinResult runBuiltin(char **args, int *status) {
+    const Builtin *builtin = findBuiltin(args[0]);
+    if(!builtin) {
+        return BUILTIN_NONE;
+    }
+    // Built-in exit command: promptLoop() will return and quit the program
+    if(!builtin->run) {
+        *status = 0;
+        return BUILTIN_EXIT;
+    }
+    *status = builtin->run(args);
+    return BUILTIN_DONE;
+}
+
+/*******************************************************************************
+ * Function name:   BuiltinResult runShellBuiltin(Stage *stage)
+ *
+ * Description:     Runs a single-stage built-in command inside the shell
+ *                  process. The stage's redirections are applied to the
+ *                  shell's own FDs, which are saved first and restored once
+ *                  the command has run, so no process is needed. The exit
+ *                  status of a utility built-in becomes the foreground
+ *                  status. A built-in whose output is captured with "&>"
+ *                  is left to be launched like any other command.
+ *
+ * Receives:        stage       Stage struct pointer
+ *
+ * Returns:         BUILTIN_NONE if the stage isn't a built-in command or is
+ *                  captured, BUILTIN_EXIT for the exit command or
+ *                  BUILTIN_DONE
+ ******************************************************************************/
+
+BuiltinResult runShellBuiltin(Stage *stage) {
+    int saved[STDERR_FILENO + 1] = {-1, -1, -1};    // Copies of stdio FDs
+    bool savedFD[STDERR_FILENO + 1] = {false};      // True once saved
+    Launch launch = {-1, -1, -1, false, false, -1, -1}; // Shell's stdio
+    int status = 1;             // Exit status of the built-in command
+
+    const Builtin *builtin = findBuiltin(stage->args[0]);
+    if(!builtin) {
+        return BUILTIN_NONE;
+    }
+    if(!builtin->run) {
+        return BUILTIN_EXIT;
+    }
+
+    // Captured output is read by the shell while the command writes it, so
+    // the command runs in a forked copy of the shell as in a pipeline
+    for(int i = 0; i < stage->numRedirections; i++) {
+        if(stage->redirections[i].capture) {
+            return BUILTIN_NONE;
+        }
+    }
+
+    // Save each FD that will be redirected, then redirect it
+    if(stage->numRedirections > 0) {
+        fflush(stdout);
+        fflush(stderr);
+        if(!openRedirections(stage, &launch)) {
+            builtin_status = W_EXITCODE(1, 0);
+            if(builtin->utility) {
+                fg_status = builtin_status;
+            }
+            return BUILTIN_DONE;
+        }
+        for(int i = 0; i < stage->numRedirections; i++) {
+            Redirection *redirection = &stage->redirections[i];
+            int fd = redirection->fd;
+            if(!savedFD[fd]) {
+                saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, SAVED_FD_MIN);
+                savedFD[fd] = true;
+            }
+            dup2(redirection->file ? redirection->openedFD
+                                   : redirection->sourceFD, fd);
+        }
+        closeRedirections(stage, &launch);
+    }
+
+    status = builtin->run(stage->args);
+
+    // Put the shell's own FDs back. One that was closed is closed again.
+    if(stage->numRedirections > 0) {
+        fflush(stdout);
+        fflush(stderr);
+        for(int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+            if(!savedFD[fd]) {
+                continue;
+            }
+            if(saved[fd] == -1) {
+                close(fd);
+            } else {
+                dup2(saved[fd], fd);
+                close(saved[fd]);
+            }
+        }
+    }
+    builtin_status = W_EXITCODE(status, 0);
+    if(builtin->utility) {
+        fg_status = builtin_status;
+    }
+    return BUILTIN_DONE;
+}
+
+/*******************************************************************************
+ * Function name:   int cdBuiltin(char **args)
+ *
+ * Description:     Built-in cd command: goes to the directory given, or to
+ *                  the user's home directory if none is given, and counts
+ *                  the change in cwd_version for the spawn server.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0 if the directory was changed, 1 otherwise
+ ******************************************************************************/
+
+int cdBuiltin(char **args) {
+    Variable *home = NULL;  // HOME, if no directory is given
+
+    // Go to the directory given, or home if none is given
+    if(!args[1]) {
+        home = findVariable("HOME", 4);
+        if(!home) {
+            return 1;
+        }
+    }
+    if(chdir(args[1] ? args[1] : home->value) == -1) {
+        return 1;
+    }
+    cwd_version++;
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int statusBuiltin(char **args)
+ *
+ * Description:     Built-in status command: prints the exit value or signal
+ *                  of the last foreground process. With -v, also prints the
+ *                  resources used by the last foreground job.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0
+ ******************************************************************************/
+
+int statusBuiltin(char **args) {
+    printExitValOrSignal(fg_status);
+    if(args[1] && !strcmp(args[1], "-v")) {
+        printJobUsage(&last_fg_job);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int jobsBuiltin(char **args)
+ *
+ * Description:     Built-in jobs command: lists the shell's jobs, with the
+ *                  resources each has used if given -v.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0
+ ******************************************************************************/
+
+int jobsBuiltin(char **args) {
+    printJobs(args[1] && !strcmp(args[1], "-v"));
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int statsBuiltin(char **args)
+ *
+ * Description:     Built-in stats command: stats [-p]. Prints the shell's
+ *                  counters, or with -p its metrics in the Prometheus text
+ *                  format. A control client running stats -p gets the
+ *                  metrics as its reply, and again every metrics interval.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 for a usage error
+ ******************************************************************************/
+
+int statsBuiltin(char **args) {
+    if(args[1] && (strcmp(args[1], "-p") || args[2])) {
+        fprintf(stderr, "usage: stats [-p]\n");
+        return 1;
+    }
+    if(!args[1]) {
+        printStats();
+        return 0;
+    }
+    formatMetrics();
+    if(control_table.client != -1 && getpid() == shell_pid) {
+        replyControl(control_table.client, metrics.text);
+        control_table.replied = true;
+        control_table.clients[control_table.client].metrics = true;
+        armMetricsTimer();
+        return 0;
+    }
+    fwrite(metrics.text, 1, metrics.textUsed, stdout);
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int echoBuiltin(char **args)
+ *
+ * Description:     Built-in echo command: prints its arguments separated by
+ *                  spaces and followed by a newline. Leading options are
+ *                  read as the installed echo reads them: -n leaves off the
+ *                  newline, -e turns on backslash escapes and -E turns them
+ *                  off again, and they can be combined, as in -ne.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0
+ ******************************************************************************/
+
+int echoBuiltin(char **args) {
+    bool newline = true;    // False if -n was given
+    bool escapes = false;   // True if -e was given after any -E
+    int i = 1;              // Index of the next argument to print
+
+    while(args[i] && echoOptions(args[i], &newline, &escapes)) {
+        i++;
+    }
+    for(int first = i; args[i]; i++) {
+        if(i > first) {
+            putchar(' ');
+        }
+        if(!escapes) {
+            fputs(args[i], stdout);
+        } else if(!echoEscaped(args[i])) {
+            newline = false;
+            break;
+        }
+    }
+    if(newline) {
+        putchar('\n');
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   bool echoOptions(const char *arg, bool *newline,
+ *                                   bool *escapes)
+ *
+ * Description:     Reads an argument of echo as options if it is "-"
+ *                  followed only by the letters n, e and E
+ *
+ * Receives:        arg         Argument to read
+ *                  newline     Set to false by n
+ *                  escapes     Set to true by e and to false by E
+ *
+ * Returns:         false if arg isn't options and is to be printed
+ ******************************************************************************/
+
+bool echoOptions(const char *arg, bool *newline, bool *escapes) {
+    if(arg[0] != '-' || !arg[1] || arg[strspn(arg + 1, "neE") + 1]) {
+        return false;
+    }
+    for(const char *option = arg + 1; *option; option++) {
+        if(*option == 'n') {
+            *newline = false;
+        } else {
+            *escapes = *option == 'e';
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   bool echoEscaped(const char *text)
+ *
+ * Description:     Prints an argument of echo -e, replacing the escapes
+ *                  \\, \a, \b, \e, \f, \n, \r, \t, \v, \0NNN (octal) and
+ *                  \xHH (hexadecimal) with the characters they stand for. A
+ *                  \c ends the output.
+ *
+ * Receives:        text        Argument to print
+ *
+ * Returns:         false if \c ended the output
+ ******************************************************************************/
+
+bool echoEscaped(const char *text) {
+    static const char escapes[] = "abefnrtv\\";     // Letters of escapes
+    static const char chars[] = "\a\b\033\f\n\r\t\v\\"; // What they stand for
+
+    for(const char *c = text; *c; c++) {
+        if(*c != '\\' || !c[1]) {
+            putchar(*c);
+            continue;
+        }
+        c++;
+        char *escape = strchr(escapes, *c);
+        int value = 0;      // Character a numeric escape stands for
+        int digits = 0;     // Digits read for a numeric escape
+        if(*c == 'c') {
+            return false;
+        } else if(escape) {
+            putchar(chars[escape - escapes]);
+        } else if(*c == '0') {
+            while(digits < 3 && c[1] >= '0' && c[1] <= '7') {
+                value = value * 8 + *++c - '0';
+                digits++;
+            }
+            putchar(value);
+        } else if(*c == 'x' && isxdigit((unsigned char)c[1])) {
+            while(digits < 2 && isxdigit((unsigned char)c[1])) {
+                c++;
+                value = value * 16 + (isdigit((unsigned char)*c) ? *c - '0'
+                                      : tolower((unsigned char)*c) - 'a' + 10);
+                digits++;
+            }
+            putchar(value);
+        } else {
+            putchar('\\');
+            putchar(*c);
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   int trueBuiltin(char **args)
+ *
+ * Description:     Built-in true command: does nothing, successfully.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0
+ ******************************************************************************/
+
+int trueBuiltin(char **args) {
+    (void)args;
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int falseBuiltin(char **args)
+ *
+ * Description:     Built-in false command: does nothing, unsuccessfully.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         1
+ ******************************************************************************/
+
+int falseBuiltin(char **args) {
+    (void)args;
+    return 1;
+}
+
+/*******************************************************************************
+ * Function name:   int testBuiltin(char **args)
+ *
+ * Description:     Built-in test and [ commands: evaluates a test
+ *                  expression, in which -a and -o join tests as the
+ *                  installed test does. [ needs "]" as its last argument.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0 if the expression is true, 1 if it is false, 2 if it
+ *                  is malformed
+ ******************************************************************************/
+
+int testBuiltin(char **args) {
+    int count = 0;          // Number of arguments of the expression
+
+    while(args[count + 1]) {
+        count++;
+    }
+    if(args[0][0] == '[') {
+        if(count == 0 || strcmp(args[count], "]")) {
+            fprintf(stderr, "[: missing ]\n");
+            fflush(stdout);
+            return 2;
+        }
+        count--;
+    }
+    int result = testExpression(args + 1, count);
+    if(result == 2) {
+        fprintf(stderr, "%s: bad expression\n", args[0]);
+        fflush(stdout);
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * Function name:   int testExpression(char **args, int count)
+ *
+ * Description:     Evaluates a test expression by its number of arguments,
+ *                  as POSIX specifies: one argument is true if not empty,
+ *                  two are "!" and an argument or a unary operator and its
+ *                  operand, three are a binary operator and its operands,
+ *                  "!" and a two-argument expression or a parenthesized
+ *                  argument, and four are "!" and a three-argument
+ *                  expression or a parenthesized two-argument expression.
+ *                  Any other expression, such as one joining tests with -a
+ *                  or -o, is parsed by testOr().
+ *
+ * Receives:        args        Arguments of the expression
+ *                  count       int     Number of arguments
+ *
+ * Returns:         0 if the expression is true, 1 if it is false, 2 if it
+ *                  is malformed
+ ******************************************************************************/
+
+int testExpression(char **args, int count) {
+    int result = 2;         // Value of a negated expression
+
+    switch(count) {
+        case 0:
+            return 1;
+        case 1:
+            return args[0][0] ? 0 : 1;
+        case 2:
+            if(!strcmp(args[0], "!")) {
+                result = testExpression(args + 1, 1);
+                break;
+            }
+            return testUnary(args[0], args[1]);
+        case 3:
+            result = testBinary(args[0], args[1], args[2]);
+            if(result != 2) {
+                return result;
+            }
+            if(!strcmp(args[0], "!")) {
+                result = testExpression(args + 1, 2);
+                break;
+            }
+            if(!strcmp(args[0], "(") && !strcmp(args[2], ")")) {
+                return testExpression(args + 1, 1);
+            }
+            break;
+        case 4:
+            if(!strcmp(args[0], "!")) {
+                result = testExpression(args + 1, 3);
+                break;
+            }
+            if(!strcmp(args[0], "(") && !strcmp(args[3], ")")) {
+                return testExpression(args + 1, 2);
+            }
+            break;
+        default:
+            break;
+    }
+    if(result != 2) {
+        return !result;
+    }
+
+    // Parse the whole expression, which must use every argument
+    int next = 0;           // Index of the next argument to parse
+    result = testOr(args, count, &next);
+    return next == count ? result : 2;
+}
+
+/*******************************************************************************
+ * Function name:   int testOr(char **args, int count, int *next)
+ *
+ * Description:     Parses and evaluates tests joined by -o, each of which
+ *                  can be tests joined by -a, which binds more tightly
+ *
+ * Receives:        args        Arguments of the expression
+ *                  count       int     Number of arguments
+ *                  next        Index of the next argument, moved past the
+ *                              arguments parsed
+ *
+ * Returns:         0 if the expression is true, 1 if it is false, 2 if it
+ *                  is malformed
+ ******************************************************************************/
+
+int testOr(char **args, int count, int *next) {
+    int result = testAnd(args, count, next);
+    while(result != 2 && *next < count && !strcmp(args[*next], "-o")) {
+        (*next)++;
+        int right = testAnd(args, count, next);
+        result = right == 2 ? 2 : result && right;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * Function name:   int testAnd(char **args, int count, int *next)
+ *
+ * Description:     Parses and evaluates tests joined by -a
+ *
+ * Receives:        args        Arguments of the expression
+ *                  count       int     Number of arguments
+ *                  next        Index of the next argument, moved past the
+ *                              arguments parsed
+ *
+ * Returns:         0 if the expression is true, 1 if it is false, 2 if it
+ *                  is malformed
+ ******************************************************************************/
+
+int testAnd(char **args, int count, int *next) {
+    int result = testTerm(args, count, next);
+    while(result != 2 && *next < count && !strcmp(args[*next], "-a")) {
+        (*next)++;
+        int right = testTerm(args, count, next);
+        result = right == 2 ? 2 : result || right;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * Function name:   int testTerm(char **args, int count, int *next)
+ *
+ * Description:     Parses and evaluates one test of an expression: "!" and
+ *                  a test, a parenthesized expression, a binary test, a
+ *                  unary test, or a string that is true if not empty
+ *
+ * Receives:        args        Arguments of the expression
+ *                  count       int     Number of arguments
+ *                  next        Index of the next argument, moved past the
+ *                              arguments parsed
+ *
+ * Returns:         0 if the test is true, 1 if it is false, 2 if it is
+ *                  malformed
+ ******************************************************************************/
+
+int testTerm(char **args, int count, int *next) {
+    int result;             // Value of the test
+
+    if(*next >= count) {
+        return 2;
+    }
+    char *arg = args[*next];
+    if(!strcmp(arg, "!")) {
+        (*next)++;
+        result = testTerm(args, count, next);
+        return result == 2 ? 2 : !result;
+    }
+    if(!strcmp(arg, "(")) {
+        (*next)++;
+        result = testOr(args, count, next);
+        if(result == 2 || *next >= count || strcmp(args[*next], ")")) {
+            return 2;
+        }
+        (*next)++;
+        return result;
+    }
+    if(*next + 2 < count && testBinaryOperator(args[*next + 1])) {
+        result = testBinary(arg, args[*next + 1], args[*next + 2]);
+        *next += 3;
+        return result;
+    }
+    if(*next + 1 < count &&
+       (result = testUnary(arg, args[*next + 1])) != 2) {
+        *next += 2;
+        return result;
+    }
+    (*next)++;
+    return arg[0] ? 0 : 1;
+}
+
+/*******************************************************************************
+ * Function name:   int testUnary(const char *operator, const char *operand)
+ *
+ * Description:     Evaluates a unary test: -n and -z test a string's
+ *                  length, and -e, -f, -d, -r, -w, -x, -s and -L (or -h)
+ *                  test a file.
+ *
+ * Receives:        operator    Unary operator
+ *                  operand     String or filename
+ *
+ * Returns:         0 if the test is true, 1 if it is false, 2 if operator
+ *                  isn't a unary operator
+ ******************************************************************************/
+
+int testUnary(const char *operator, const char *operand) {
+    struct stat info;       // File tested
+
+    if(operator[0] != '-' || !operator[1] || operator[2]) {
+        return 2;
+    }
+    switch(operator[1]) {
+        case 'n':
+            return !operand[0];
+        case 'z':
+            return operand[0] != '\0';
+        case 'r':
+            return access(operand, R_OK) != 0;
+        case 'w':
+            return access(operand, W_OK) != 0;
+        case 'x':
+            return access(operand, X_OK) != 0;
+        case 'L':
+        case 'h':
+            return lstat(operand, &info) != 0 || !S_ISLNK(info.st_mode);
+        case 'e':
+        case 'f':
+        case 'd':
+        case 's':
+            break;
+        default:
+            return 2;
+    }
+    if(stat(operand, &info) != 0) {
+        return 1;
+    }
+    switch(operator[1]) {
+        case 'f':
+            return !S_ISREG(info.st_mode);
+        case 'd':
+            return !S_ISDIR(info.st_mode);
+        case 's':
+            return info.st_size == 0;
+        default:
+            return 0;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int testBinary(const char *left, const char *operator,
+ *                                 const char *right)
+ *
+ * Description:     Evaluates a binary test: = and != compare strings, and
+ *                  -eq, -ne, -lt, -le, -gt and -ge compare integers.
+ *
+ * Receives:        left        Left operand
+ *                  operator    Binary operator
+ *                  right       Right operand
+ *
+ * Returns:         0 if the test is true, 1 if it is false, 2 if operator
+ *                  isn't a binary operator or an operand isn't an integer
+ ******************************************************************************/
+
+int testBinary(const char *left, const char *operator, const char *right) {
+    if(!testBinaryOperator(operator)) {
+        return 2;
+    }
+    if(!strcmp(operator, "=")) {
+        return strcmp(left, right) != 0;
+    }
+    if(!strcmp(operator, "!=")) {
+        return strcmp(left, right) == 0;
+    }
+    if(operator[0] != '-' || strlen(operator) != 3) {
+        return 2;
+    }
+
+    char *leftEnd = NULL;   // First character after the left integer
+    char *rightEnd = NULL;  // First character after the right integer
+    errno = 0;
+    long a = strtol(left, &leftEnd, 10);
+    long b = strtol(right, &rightEnd, 10);
+    bool integers = errno == 0 && leftEnd != left && !*leftEnd &&
+                    rightEnd != right && !*rightEnd;
+    bool result;            // Value of the comparison
+
+    if(!strcmp(operator, "-eq")) {
+        result = a == b;
+    } else if(!strcmp(operator, "-ne")) {
+        result = a != b;
+    } else if(!strcmp(operator, "-lt")) {
+        result = a < b;
+    } else if(!strcmp(operator, "-le")) {
+        result = a <= b;
+    } else if(!strcmp(operator, "-gt")) {
+        result = a > b;
+    } else if(!strcmp(operator, "-ge")) {
+        result = a >= b;
+    } else {
+        return 2;
+    }
+    return integers ? !result : 2;
+}
+
+/*******************************************************************************
+ * Function name:   bool testBinaryOperator(const char *operator)
+ *
+ * Description:     Tells whether an argument is a binary test operator
+ *
+ * Receives:        operator    Argument to check
+ *
+ * Returns:         true if testBinary() can evaluate operator
+ ******************************************************************************/
+
+bool testBinaryOperator(const char *operator) {
+    static const char *operators[] = {"=", "!=", "-eq", "-ne", "-lt", "-le",
+                                      "-gt", "-ge"};
+
+    for(size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        if(!strcmp(operator, operators[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * Function name:   int pwdBuiltin(char **args)
+ *
+ * Description:     Built-in pwd command: prints the current directory.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 if the current directory can't be found
+ ******************************************************************************/
+
+int pwdBuiltin(char **args) {
+    char directory[PATH_MAX];   // Path of the current directory
+
+    (void)args;
+    if(!getcwd(directory, sizeof(directory))) {
+        perror("pwd");
+        fflush(stdout);
+        return 1;
+    }
+    puts(directory);
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int exportBuiltin(char **args)
+ *
+ * Description:     Built-in export command: export [NAME[=value] ...]
+ *                  Sets each NAME=value and exports it to the commands the
+ *                  shell runs; a NAME on its own exports the variable with
+ *                  its current value, or empty if it isn't set. With no
+ *                  arguments, lists the exported variables.
+ *
+ * Receives:        args        Arguments of the command
+ *
+ * Returns:         0, or 1 if an argument isn't a valid name
+ ******************************************************************************/
+
+int exportBuiltin(char **args) {
+    int status = 0;         // Exit status
+
+    if(!args[1]) {
+        for(int i = 0; i < var_store.envCount; i++) {
+            printf("export %s\n", var_store.envp[i]);
+        }
+    }
+    for(int i = 1; args[i]; i++) {
+        size_t length = strcspn(args[i], "=");
+        if(!isName(args[i], length)) {
+            fprintf(stderr, "export: %s: not a valid name\n", args[i]);
+            status = 1;
+            continue;
+        }
+        Variable *variable = findVariable(args[i], length);
+        if(args[i][length] == '=') {
+            char *value = args[i] + length + 1;
+            setVariable(args[i], length, value, strlen(value), true);
+        } else if(variable) {
+            exportVariable(variable);
+        } else {
+            setVariable(args[i], length, "", 0, true);
+        }
+    }
+    fflush(stdout);
+    return status;
+}
+
+/*******************************************************************************
+ * Function name:   int unsetBuiltin(char **args)
+ *
+ * Description:     Built-in unset command: unset NAME ...
+ *                  Removes each variable, and from the environment of the
+ *                  commands the shell runs if it was exported.
+ *
+ * Receives:        args        Arguments of the command
+ *
+ * Returns:         0, or 1 if an argument isn't a valid name
+ ******************************************************************************/
+
+int unsetBuiltin(char **args) {
+    int status = 0;         // Exit status
+
+    for(int i = 1; args[i]; i++) {
+        size_t length = strlen(args[i]);
+        if(!isName(args[i], length)) {
+            fprintf(stderr, "unset: %s: not a valid name\n", args[i]);
+            fflush(stdout);
+            status = 1;
+            continue;
+        }
+        unsetVariable(args[i], length);
+    }
+    return status;
+}
+
+/*******************************************************************************
+ * Function name:   bool launchPipeline(Command *command, Job *job)
+ *
+ * Description:     Launches every stage of the command at once, connecting
+ *                  each stage's stdout to the next stage's stdin with a
+ *                  close-on-exec pipe. A pipeline of more than one stage is
+ *                  put in its own process group, led by its first stage; in
+ *                  interactive mode a foreground pipeline is also given the
+ *                  terminal so that CTRL-C reaches it. If SMALLSH_PIPE_SIZE
+ *                  is set, each pipe's buffer is resized to that many bytes.
+ *                  Each stage's redirection files are opened here, before it
+ *                  is launched, so a stage whose file can't be opened is
+ *                  never started. Stages that don't need fork() go to the
+ *                  spawn server if it is running, or to posix_spawn().
+ *
+ * Preconditions:   command has been split into stages by parseCommandLine()
+ *                  and its background flag set
+ *
+ * Postconditions:  Each stage's pid is set, or is -1 if it couldn't be
+ *                  launched (the error has already been printed). Every
+ *                  launched process has been added to the job. If no stage
+ *                  was launched, the shell still has the terminal.
+ *
+ * Receives:        command     Command struct pointer
+ *                  job         Job struct pointer for the pipeline
+ *
+ * Returns:         true if the terminal was handed to the pipeline's process
+ *                  group and must be taken back once it finishes
+ ******************************************************************************/
+
+bool launchPipeline(Command *command, Job *job) {
+    Launch launch = {0};    // Where the stage being launched connects
+    int pipeIn = -1;        // Read end of the pipe from the previous stage
+
+    // A multi-stage pipeline starts a new process group, and so does every
+    // job under job control; 0 means its first successfully launched stage
+    // will lead it
+    launch.pgid = command->numStages > 1 || job_control ? 0 : -1;
+    launch.background = command->background;
+    launch.sliceFD = job->slice == -1 ? -1 : slice_table.slices[job->slice].fd;
+    launch.terminal = launch.pgid == 0 && interactive && !command->background
+                      && tcgetpgrp(STDIN_FILENO) == getpgrp();
+
+    for(int i = 0; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        int pipeFDs[2] = {-1, -1};  // Pipe to the next stage
+
+        // Every stage but the last writes into a new pipe
+        if(i < command->numStages - 1) {
+            if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+                perror("pipe2()");
+                fflush(stdout);
+                pipeFDs[0] = pipeFDs[1] = -1;
+            } else if(pipe_size > 0) {
+                fcntl(pipeFDs[1], F_SETPIPE_SZ, pipe_size);
+            }
+        }
+        launch.inputFD = pipeIn;
+        launch.outputFD = pipeFDs[1];
+
+        // Open the stage's redirection files, then launch it
+        uint64_t redirectStart = traceNow();
+        bool opened = openRedirections(stage, &launch);
+        traceRecord(TRACE_REDIRECT, redirectStart);
+        stage->pid = -1;
+        if(opened) {
+            if(needsFork(stage, &launch)) {
+                stage->pid = forkStage(stage, &launch);
+            } else if(spawn_server_fd != -1) {
+                stage->pid = serverStage(stage, &launch);
+            } else {
+                stage->pid = spawnStage(stage, &launch);
+            }
+            labelCaptures(stage, job);
+            closeRedirections(stage, &launch);
+        }
+        if(stage->pid > 0) {
+            addJobProcess(job, stage->pid, i == command->numStages - 1);
+            metrics.launched++;
+        } else if(opened) {
+            metrics.launchFailures++;
+        }
+
+        // A stage that would have led the group may have taken the
+        // terminal before its exec() failed; take it back so that the
+        // shell can still read the terminal
+        if(launch.terminal && launch.pgid == 0 && stage->pid <= 0) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+
+        // The first stage launched leads the process group. Setting it here
+        // as well as in the child closes the race with later stages.
+        if(launch.pgid == 0 && stage->pid > 0) {
+            launch.pgid = stage->pid;
+            job->pgid = launch.pgid;
+            setpgid(stage->pid, stage->pid);
+            if(launch.terminal) {
+                tcsetpgrp(STDIN_FILENO, launch.pgid);
+            }
+        }
+
+        // The children have their own copies of the pipe ends
+        if(pipeIn != -1) {
+            close(pipeIn);
+        }
+        if(pipeFDs[1] != -1) {
+            close(pipeFDs[1]);
+        }
+        pipeIn = pipeFDs[0];
+    }
+    return launch.terminal && launch.pgid > 0;
+}
+
+/*******************************************************************************
+ * Function name:   bool needsFork(Stage *stage, Launch *launch)
+ *
+ * Description:     Decides whether a pipeline stage must be launched with
+ *                  fork() rather than posix_spawn(). A built-in command in a
+ *                  pipeline runs in a forked copy of the shell. posix_spawn()
+ *                  has no attribute for resource limits or a cgroup, so a
+ *                  stage is also forked while ulimit has set a limit or when
+ *                  it is launched into a slice. Every other command is
+ *                  expressible as spawn file actions and attributes, so only
+ *                  the SMALLSH_SPAWN override selects fork() for it.
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ *
+ * Returns:         true if the stage must be forked, false otherwise
+ ******************************************************************************/
+
+bool needsFork(Stage *stage, Launch *launch) {
+    return spawn_mode == SPAWN_FORK || job_limits.set != 0 ||
+           launch->sliceFD != -1 || isBuiltin(stage->args[0]);
+}
+
+/*******************************************************************************
+ * Function name:   bool isBuiltin(char *name)
+ *
+ * Description:     Checks whether a command name is one of the built-in
+ *                  commands handled by runBuiltin().
+ *
+ * Receives:        name        Command name
+ *
+ * Returns:         true if name is a built-in command
+ ******************************************************************************/
+
+bool isBuiltin(char *name) {
+    return findBuiltin(name) != NULL;
+}
+
+/*******************************************************************************
+ * Function name:   pid_t forkStage(Stage *stage, Launch *launch)
+ *
+ * Description:     Forks a child process that joins the launch's process
+ *                  group, applies the stage's IO redirections and executes
+ *                  the stage's command, using the location remembered in the
+ *                  command hash if there is one. A built-in command runs in
+ *                  the child itself. A stage launched into a slice is
+ *                  cloned straight into the slice's cgroup, and the child
+ *                  sets the limits given to ulimit before the command runs.
+ *
+ * Preconditions:   stage->args has been parsed and openRedirections() has
+ *                  opened the stage's files
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ *
+ * Returns:         PID of the child process, or -1 if fork() failed (the
+ *                  error has already been printed)
+ ******************************************************************************/
+
+pid_t forkStage(Stage *stage, Launch *launch) {
+    struct sigaction default_action = {{0}};    // Sigaction for overriding
+    default_action.sa_handler = SIG_DFL;        // SIG_IGN with SIG_DFL
+
+    // Look up the executable in the parent so the command hash is kept
+    char *path = isBuiltin(stage->args[0]) ? NULL
+                                           : findCommand(stage->args[0]);
+
+    uint64_t spawnStart = traceNow();
+    pid_t spawnPid = launch->sliceFD != -1 ? cloneIntoSlice(launch->sliceFD)
+                                           : fork();
+
+    // Handle fork errors. The shell carries on without the stage.
+    if(spawnPid == -1) {
+        perror(launch->sliceFD != -1 ? "clone3()" : "fork()");
+        fflush(stdout);
+        return -1;
+
+        // Child process
+    } else if(spawnPid == 0) {
+        // Join the pipeline's process group and take the terminal
+        if(launch->pgid != -1) {
+            setpgid(0, launch->pgid);
+            if(launch->terminal) {
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+            }
+        }
+        // If foreground process, receive SIGINT signals
+        if(!launch->background) {
+            sigaction(SIGINT, &default_action, NULL);
+        }
+        // A built-in run here must stop on Ctrl-Z rather than toggle
+        // foreground-only mode
+        sigaction(SIGTSTP, &default_action, NULL);
+        sigaction(SIGTTOU, &default_action, NULL);
+        sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+        // Apply IO redirections and limits, then execute command
+        applyRedirections(stage, launch);
+        applyJobLimits();
+        int status = 0;
+        if(runBuiltin(stage->args, &status) != BUILTIN_NONE) {
+            fflush(stdout);
+            exit(status);
+        }
+        if(path) {
+            execv(path, stage->args);
+        }
+        execvp(stage->args[0], stage->args);
+
+        // Handle command errors
+        perror(stage->args[0]);
+        fflush(stdout);
+        countChildFailure();
+        exit(1);
+    }
+
+    // Parent process
+    traceRecord(TRACE_SPAWN, spawnStart);
+    return spawnPid;
+}
+
+/*******************************************************************************
+ * Function name:   pid_t spawnStage(Stage *stage, Launch *launch)
+ *
+ * Description:     Launches the stage's command with posix_spawn(), which
+ *                  glibc implements with a vfork-style clone so the parent's
+ *                  page tables are never copied. The executable's location
+ *                  comes from the command hash, so PATH is only searched the
+ *                  first time a command is run. The work
+ *                  applyRedirections() does in a forked child is expressed
+ *                  as spawn file actions, and the signal resets, signal mask
+ *                  and process group as spawn attributes.
+ *
+ * Preconditions:   stage->args has been parsed and openRedirections() has
+ *                  opened the stage's files
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ *
+ * Returns:         PID of the child process, or -1 if the command could not
+ *                  be started (the error has already been printed)
+ ******************************************************************************/
+
+pid_t spawnStage(Stage *stage, Launch *launch) {
+    posix_spawn_file_actions_t actions; // dup2() calls run in the child
+    posix_spawnattr_t attributes;       // Signal and group setup for child
+    sigset_t defaultSignals;            // Signals reset to SIG_DFL
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    pid_t spawnPid = -1;                // PID of the child process
+    int result = 0;                     // Return value of posix_spawn()
+
+    // The child takes the terminal while its stdin is still the shell's,
+    // then duplicates the pipe ends or /dev/null onto stdin and stdout and
+    // applies the redirection plan in order; the originals are
+    // close-on-exec
+    posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 35)
+    if(launch->pgid != -1 && launch->terminal) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    if(launch->inputFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, launch->inputFD,
+                                         STDIN_FILENO);
+    }
+    if(launch->outputFD != -1) {
+        posix_spawn_file_actions_adddup2(&actions, launch->outputFD,
+                                         STDOUT_FILENO);
+    }
+    for(int i = 0; i < stage->numRedirections; i++) {
+        Redirection *redirection = &stage->redirections[i];
+        posix_spawn_file_actions_adddup2(&actions, redirection->file
+                                         ? redirection->openedFD
+                                         : redirection->sourceFD,
+                                         redirection->fd);
+    }
+
+    // If foreground process, receive SIGINT signals. SIGTTOU is ignored by
+    // an interactive shell but not by the commands it runs.
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&defaultSignals);
+    sigaddset(&defaultSignals, SIGTTOU);
+    if(!launch->background) {
+        sigaddset(&defaultSignals, SIGINT);
+    }
+    posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+    posix_spawnattr_setsigmask(&attributes, &shell_sigmask);
+
+    // Join the pipeline's process group
+    if(launch->pgid != -1) {
+        posix_spawnattr_setpgroup(&attributes, launch->pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    // Execute the location remembered in the command hash. If it has gone
+    // away, forget it and fall back to searching PATH.
+    uint64_t spawnStart = traceNow();
+    char *path = findCommand(stage->args[0]);
+    if(path) {
+        result = posix_spawn(&spawnPid, path, &actions, &attributes,
+                             stage->args, environ);
+        if(result == ENOENT) {
+            forgetCommand(stage->args[0]);
+            path = NULL;
+        }
+    }
+    if(!path) {
+        result = posix_spawnp(&spawnPid, stage->args[0], &actions,
+                              &attributes, stage->args, environ);
+    }
+    traceRecord(TRACE_SPAWN, spawnStart);
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    // Handle command errors
+    if(result != 0) {
+        fprintf(stderr, "%s: %s\n", stage->args[0], strerror(result));
+        fflush(stdout);
+        return -1;
+    }
+    return spawnPid;
+}
+
+/*******************************************************************************
+ * Function name:   bool startSpawnServer()
+ *
+ * Description:     Forks the spawn server, a helper process that launches
+ *                  external commands on the shell's behalf. It is started
+ *                  while the shell is still small, so its own fork()s stay
+ *                  cheap and don't fail under strict overcommit however much
+ *                  memory the shell has grown to use. The shell and server
+ *                  talk over a Unix socketpair of sequenced packets, one
+ *                  message per request.
+ *
+ * Postconditions:  spawn_server_fd and spawn_server_pid are set if the
+ *                  server started
+ *
+ * Returns:         true if the server started, false otherwise (the error
+ *                  has already been printed)
+ ******************************************************************************/
+
+bool startSpawnServer() {
+    int fds[2];             // Shell's and server's ends of the socket
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("socketpair()");
+        fflush(stdout);
+        return false;
+    }
+    pid_t pid = fork();
+    if(pid == -1) {
+        perror("fork()");
+        fflush(stdout);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if(pid == 0) {
+        close(fds[0]);
+        runSpawnServer(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    spawn_server_fd = fds[0];
+    spawn_server_pid = pid;
+    spawn_server_env = var_store.envVersion;
+    spawn_server_cwd = cwd_version;
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   void runSpawnServer(int socketFD)
+ *
+ * Description:     Main loop of the spawn server. Receives each request with
+ *                  the FDs passed along with it, clones a child with
+ *                  CLONE_PARENT so that the child belongs to the shell,
+ *                  which reaps it and gets its SIGCHLD like any other, and
+ *                  replies with the child's PID or -errno. A request that
+ *                  carries the shell's environment replaces the one the
+ *                  server's children are given, and one that carries the
+ *                  shell's working directory moves the server there, so
+ *                  its children start in it. Returns when the shell
+ *                  closes its end of the socket.
+ *
+ * Receives:        socketFD    int     Server's end of the socket
+ ******************************************************************************/
+
+void runSpawnServer(int socketFD) {
+    static char message[SPAWN_MESSAGE_SIZE];    // Request being handled
+    static char *args[SPAWN_MESSAGE_SIZE / 2];  // Arguments of the request
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_FDS)];
+    int fds[SPAWN_SERVER_FDS];                  // FDs passed with it
+    char *envText = NULL;       // Environment entries children are given
+    char **env = NULL;          // Pointers to the entries
+
+    // Ctrl-Z reaches the whole foreground process group, server included
+    signal(SIGTSTP, SIG_IGN);
+    if(sigchld_fd != -1) {
+        close(sigchld_fd);
+    }
+
+    while(true) {
+        struct iovec data = {message, sizeof(message)};
+        struct msghdr header = {0};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(socketFD, &header, MSG_CMSG_CLOEXEC);
+        if(received == -1 && errno == EINTR) {
+            continue;
+        }
+        if(received <= 0) {
+            return;
+        }
+
+        // Find the passed FDs
+        int numFDs = 0;
+        struct cmsghdr *rights = CMSG_FIRSTHDR(&header);
+        if(rights && rights->cmsg_level == SOL_SOCKET &&
+           rights->cmsg_type == SCM_RIGHTS) {
+            numFDs = (int)((rights->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(rights), sizeof(int) * numFDs);
+        }
+
+        // Find the dup2() pairs, path and arguments after the header
+        SpawnRequest *request = (SpawnRequest*)message;
+        int *dups = (int*)(request + 1);
+        char *path = (char*)(dups + 2 * request->numDups);
+        char *arg = path + request->pathLength;
+        for(int i = 0; i < request->numArgs; i++) {
+            args[i] = arg;
+            arg += strlen(arg) + 1;
+        }
+        args[request->numArgs] = NULL;
+
+        // Keep a copy of a new environment and make it the server's own,
+        // which execvp() searches PATH from
+        if(request->numEnv >= 0) {
+            size_t size = (size_t)(message + received - arg);
+            envText = heapRealloc(envText, size ? size : 1);
+            memcpy(envText, arg, size);
+            env = heapRealloc(env, (request->numEnv + 1) * sizeof(char*));
+            char *entry = envText;
+            for(int i = 0; i < request->numEnv; i++) {
+                env[i] = entry;
+                entry += strlen(entry) + 1;
+            }
+            env[request->numEnv] = NULL;
+            environ = env;
+        }
+
+        // Follow the shell into its working directory. If that fails the
+        // command isn't run, rather than run somewhere else.
+        int result = 0;
+        if(request->directory && (numFDs == 0 || fchdir(fds[numFDs - 1]))) {
+            result = numFDs == 0 ? -EBADF : -errno;
+        }
+
+        // A clone with no new stack returns in the child like fork() does
+        if(result == 0) {
+            result = (int)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0,
+                                  0);
+        }
+        if(result == 0) {
+            launchServerChild(request, dups, fds,
+                              request->pathLength ? path : NULL, args);
+        }
+        if(result == -1) {
+            result = -errno;
+        }
+        for(int i = 0; i < numFDs; i++) {
+            close(fds[i]);
+        }
+        send(socketFD, &result, sizeof(result), MSG_NOSIGNAL);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void launchServerChild(SpawnRequest *request, int *dups,
+ *                                         int *fds, char *path, char **args)
+ *
+ * Description:     In a child cloned by the spawn server, does what
+ *                  forkStage() does in its child: joins the process group,
+ *                  takes the terminal, resets signals, applies the dup2()
+ *                  calls and executes the command. Never returns.
+ *
+ * Receives:        request     SpawnRequest struct pointer
+ *                  dups        numDups source and target pairs
+ *                  fds         FDs passed with the request
+ *                  path        Executable to run, or NULL to search PATH
+ *                  args        NULL-terminated argument list
+ ******************************************************************************/
+
+void launchServerChild(SpawnRequest *request, int *dups, int *fds,
+                       char *path, char **args) {
+    // Join the pipeline's process group and take the terminal
+    if(request->pgid != -1) {
+        setpgid(0, request->pgid);
+        if(request->terminal) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+    }
+    // The server ignores SIGTSTP; a foreground process receives SIGINT
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    if(!request->background) {
+        signal(SIGINT, SIG_DFL);
+    }
+    sigprocmask(SIG_SETMASK, &shell_sigmask, NULL);
+
+    for(int i = 0; i < request->numDups; i++) {
+        int source = dups[2 * i];
+        source = source >= 0 ? fds[source] : -source - 1;
+        if(dup2(source, dups[2 * i + 1]) == -1) {
+            fprintf(stderr, "cannot redirect FD %d\n", dups[2 * i + 1]);
+            countChildFailure();
+            _exit(2);
+        }
+    }
+    if(path) {
+        execv(path, args);
+    }
+    execvp(args[0], args);
+    perror(args[0]);
+    countChildFailure();
+    _exit(1);
+}
+
+/*******************************************************************************
+ * Function name:   pid_t serverStage(Stage *stage, Launch *launch)
+ *
+ * Description:     Launches the stage's command through the spawn server,
+ *                  passing the pipe ends, /dev/null and redirection files
+ *                  the parent opened with SCM_RIGHTS. The executable comes
+ *                  from the command hash as in spawnStage(). The shell's
+ *                  environment and working directory are only sent when
+ *                  they have changed since the server last received them,
+ *                  the directory as an O_PATH FD. If the request
+ *                  doesn't fit in a message or the server has gone away,
+ *                  the stage is launched with spawnStage() instead, and a
+ *                  dead server isn't used again.
+ *
+ * Preconditions:   stage->args has been parsed and openRedirections() has
+ *                  opened the stage's files
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ *
+ * Returns:         PID of the child process, or -1 if the command could not
+ *                  be started (the error has already been printed)
+ ******************************************************************************/
+
+pid_t serverStage(Stage *stage, Launch *launch) {
+    static char message[SPAWN_MESSAGE_SIZE];    // Request being built
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_FDS)] = {0};
+    int fds[SPAWN_SERVER_FDS];  // FDs to pass
+    int numFDs = 0;             // Number of FDs to pass
+    int result = 0;             // Server's reply
+
+    SpawnRequest *request = (SpawnRequest*)message;
+    int *dups = (int*)(request + 1);
+    request->pgid = launch->pgid;
+    request->terminal = launch->terminal;
+    request->background = launch->background;
+    request->directory = spawn_server_cwd != cwd_version;
+    request->numDups = 0;
+
+    // Pipe ends or /dev/null go onto stdin and stdout first, then the
+    // redirections in order
+    if(launch->inputFD != -1) {
+        dups[2 * request->numDups] = numFDs;
+        dups[2 * request->numDups++ + 1] = STDIN_FILENO;
+        fds[numFDs++] = launch->inputFD;
+    }
+    if(launch->outputFD != -1) {
+        dups[2 * request->numDups] = numFDs;
+        dups[2 * request->numDups++ + 1] = STDOUT_FILENO;
+        fds[numFDs++] = launch->outputFD;
+    }
+    if(stage->numRedirections + numFDs + request->directory >
+       SPAWN_SERVER_FDS) {
+        return spawnStage(stage, launch);
+    }
+    for(int i = 0; i < stage->numRedirections; i++) {
+        Redirection *redirection = &stage->redirections[i];
+        if(redirection->file) {
+            dups[2 * request->numDups] = numFDs;
+            fds[numFDs++] = redirection->openedFD;
+        } else {
+            dups[2 * request->numDups] = -redirection->sourceFD - 1;
+        }
+        dups[2 * request->numDups++ + 1] = redirection->fd;
+    }
+
+    // Add the path and arguments if they fit
+    char *path = findCommand(stage->args[0]);
+    char *out = (char*)(dups + 2 * request->numDups);
+    char *end = message + sizeof(message);
+    request->pathLength = path ? (int)strlen(path) + 1 : 0;
+    if(request->pathLength > end - out) {
+        return spawnStage(stage, launch);
+    }
+    if(path) {
+        memcpy(out, path, request->pathLength);
+        out += request->pathLength;
+    }
+    request->numArgs = stage->numArgs;
+    for(int i = 0; i < stage->numArgs; i++) {
+        size_t length = strlen(stage->args[i]) + 1;
+        if(length > (size_t)(end - out)) {
+            return spawnStage(stage, launch);
+        }
+        memcpy(out, stage->args[i], length);
+        out += length;
+    }
+    request->numEnv = -1;
+    if(spawn_server_env != var_store.envVersion) {
+        request->numEnv = var_store.envCount;
+        for(int i = 0; i < var_store.envCount; i++) {
+            size_t length = strlen(var_store.envp[i]) + 1;
+            if(length > (size_t)(end - out)) {
+                return spawnStage(stage, launch);
+            }
+            memcpy(out, var_store.envp[i], length);
+            out += length;
+        }
+    }
+
+    // Pass the working directory after the other FDs
+    int directoryFD = -1;
+    if(request->directory) {
+        directoryFD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if(directoryFD == -1) {
+            return spawnStage(stage, launch);
+        }
+        fds[numFDs++] = directoryFD;
+    }
+
+    // Send the request and wait for the child's PID
+    uint64_t spawnStart = traceNow();
+    struct iovec data = {message, (size_t)(out - message)};
+    struct msghdr header = {0};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    if(numFDs > 0) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * numFDs);
+        struct cmsghdr *rights = CMSG_FIRSTHDR(&header);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int) * numFDs);
+        memcpy(CMSG_DATA(rights), fds, sizeof(int) * numFDs);
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(spawn_server_fd, &header, MSG_NOSIGNAL);
+    } while(sent == -1 && errno == EINTR);
+    ssize_t received = -1;
+    if(sent != -1) {
+        do {
+            received = recv(spawn_server_fd, &result, sizeof(result), 0);
+        } while(received == -1 && errno == EINTR);
+    }
+    if(directoryFD != -1) {
+        close(directoryFD);
+    }
+    if(received != sizeof(result)) {
+        closeSpawnServer();
+        return spawnStage(stage, launch);
+    }
+    traceRecord(TRACE_SPAWN, spawnStart);
+    spawn_server_env = var_store.envVersion;
+    if(result >= 0 || !request->directory) {
+        spawn_server_cwd = cwd_version;
+    }
+
+    if(result < 0) {
+        fprintf(stderr, "%s: %s\n", stage->args[0], strerror(-result));
+        fflush(stdout);
+        return -1;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * Function name:   void closeSpawnServer()
+ *
+ * Description:     Warns that the spawn server has exited and stops using
+ *                  it, so that commands are launched directly from then on.
+ *
+ * Postconditions:  spawn_server_fd is -1
+ ******************************************************************************/
+
+void closeSpawnServer() {
+    fprintf(stderr, "smallsh: spawn server has exited, launching directly\n");
+    fflush(stdout);
+    watchEvents(EVENT_SERVER, -1);
+    close(spawn_server_fd);
+    spawn_server_fd = -1;
+}
+
+/*******************************************************************************
+ * Function name:   bool planRedirections(Command *command, Stage *stage)
+ *
+ * Description:     Turns the redirection operators of a pipeline stage and
+ *                  the filenames after them into the stage's redirection
+ *                  plan, and takes them out of the stage's arguments so that
+ *                  they won't be sent to the child process. "<" redirects
+ *                  stdin, ">" and ">>" stdout (">>" appending), "2>"
+ *                  stderr, and "2>&1" sends stderr wherever stdout goes.
+ *                  "&>" sends both stdout and stderr to its file, or, if
+ *                  the file is "@name", captures them into the log of that
+ *                  name. Runs when the line is parsed, so launching a stage only
+ *                  has to open the files.
+ *
+ * Preconditions:   The stage's arguments are ended by a NULL pointer
+ *
+ * Postconditions:  The stage's redirections point into
+ *                  command->redirections and its arguments are the rest
+ *
+ * Receives:        command     Command struct pointer
+ *                  stage       Stage struct pointer
+ *
+ * Returns:         false if a redirection has no filename, after printing
+ *                  an error, true otherwise
+ ******************************************************************************/
+
+bool planRedirections(Command *command, Stage *stage) {
+    int kept = 0;           // Number of arguments kept
+
+    stage->redirections = &command->redirections[command->numRedirections];
+    stage->numRedirections = 0;
+    for(int i = 0; i < stage->numArgs; i++) {
+        char *arg = stage->args[i];
+        if(arg != input_operator && arg != output_operator &&
+           arg != append_operator && arg != error_operator &&
+           arg != error_to_output_operator && arg != all_output_operator) {
+            stage->args[kept++] = arg;
+            continue;
+        }
+
+        Redirection *redirection =
+            &command->redirections[command->numRedirections++];
+        stage->numRedirections++;
+        redirection->operator = arg;
+        redirection->file = NULL;
+        redirection->flags = 0;
+        redirection->sourceFD = -1;
+        redirection->openedFD = -1;
+        redirection->capture = false;
+        redirection->captured = -1;
+        if(arg == error_to_output_operator) {
+            redirection->fd = STDERR_FILENO;
+            redirection->sourceFD = STDOUT_FILENO;
+            continue;
+        }
+
+        // The filename is the argument after the redirect operator
+        char *file = stage->args[i + 1];
+        if(!file || operatorToken(file) == file) {
+            fprintf(stderr, "smallsh: syntax error: missing filename after "
+                    "%s\n", arg);
+            fflush(stdout);
+            return false;
+        }
+        redirection->file = file;
+        i++;
+        if(arg == input_operator) {
+            redirection->fd = STDIN_FILENO;
+            redirection->flags = O_RDONLY;
+        } else {
+            redirection->fd = arg == error_operator ? STDERR_FILENO
+                                                    : STDOUT_FILENO;
+            redirection->flags = O_WRONLY | O_CREAT |
+                                 (arg == append_operator ? O_APPEND : O_TRUNC);
+        }
+
+        // "&>" then sends stderr wherever stdout now goes
+        if(arg == all_output_operator) {
+            redirection->capture = file[0] == CAPTURE_PREFIX;
+            Redirection *error =
+                &command->redirections[command->numRedirections++];
+            stage->numRedirections++;
+            *error = (Redirection){STDERR_FILENO, NULL, NULL, 0,
+                                   STDOUT_FILENO, -1, false, -1};
+        }
+    }
+
+    // End the arguments after the ones kept
+    for(int i = kept; i < stage->numArgs; i++) {
+        stage->args[i] = NULL;
+    }
+    stage->numArgs = kept;
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   bool openRedirections(Stage *stage, Launch *launch)
+ *
+ * Description:     Opens the files of a stage's redirection plan in the
+ *                  parent, so that a bad filename is reported before any
+ *                  process is launched. A background stage whose stdin or
+ *                  stdout isn't connected to a pipe or redirected by the
+ *                  user gets /dev/null instead. A capture gets the write end
+ *                  of a new capture pipe. Every FD is close-on-exec.
+ *
+ * Postconditions:  Each file redirection's openedFD is set, and if
+ *                  launch->nullFD was needed launch->inputFD and
+ *                  launch->outputFD use it; or nothing is left open
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ *
+ * Returns:         false if a file could not be opened, after printing an
+ *                  error, true otherwise
+ ******************************************************************************/
+
+bool openRedirections(Stage *stage, Launch *launch) {
+    bool inputSet = launch->inputFD != -1;      // stdin goes somewhere
+    bool outputSet = launch->outputFD != -1;    // stdout goes somewhere
+
+    launch->nullFD = -1;
+    for(int i = 0; i < stage->numRedirections; i++) {
+        Redirection *redirection = &stage->redirections[i];
+        inputSet = inputSet || redirection->fd == STDIN_FILENO;
+        outputSet = outputSet || redirection->fd == STDOUT_FILENO;
+        if(!redirection->file) {
+            continue;
+        }
+        if(redirection->capture) {
+            redirection->captured = startCapture(redirection->file + 1,
+                                                 &redirection->openedFD);
+            if(redirection->captured == -1) {
+                closeRedirections(stage, launch);
+                return false;
+            }
+            continue;
+        }
+        redirection->openedFD = open(redirection->file,
+                                     redirection->flags | O_CLOEXEC, 0644);
+        if(redirection->openedFD == -1) {
+            perror(redirection->file);
+            fflush(stdout);
+            closeRedirections(stage, launch);
+            return false;
+        }
+    }
+
+    if(launch->background && (!inputSet || !outputSet)) {
+        launch->nullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if(launch->nullFD == -1) {
+            perror("/dev/null");
+            fflush(stdout);
+            closeRedirections(stage, launch);
+            return false;
+        }
+        if(!inputSet) {
+            launch->inputFD = launch->nullFD;
+        }
+        if(!outputSet) {
+            launch->outputFD = launch->nullFD;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   void closeRedirections(Stage *stage, Launch *launch)
+ *
+ * Description:     Closes the parent's copies of the FDs opened by
+ *                  openRedirections() once the stage has been launched. A
+ *                  capture pipe's read end stays open in the capture table,
+ *                  which logs what the stage writes until it reaches the
+ *                  end of the pipe.
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ ******************************************************************************/
+
+void closeRedirections(Stage *stage, Launch *launch) {
+    for(int i = 0; i < stage->numRedirections; i++) {
+        if(stage->redirections[i].openedFD != -1) {
+            close(stage->redirections[i].openedFD);
+            stage->redirections[i].openedFD = -1;
+        }
+        stage->redirections[i].captured = -1;
+    }
+    if(launch->nullFD != -1) {
+        close(launch->nullFD);
+        launch->nullFD = -1;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void applyRedirections(Stage *stage, Launch *launch)
+ *
+ * Description:     In a forked child, connects stdin and stdout to the
+ *                  stage's pipes or /dev/null and then applies the stage's
+ *                  redirection plan in order, duplicating the FDs the parent
+ *                  opened. Nothing is opened or searched for here.
+ *
+ * Preconditions:   openRedirections() has succeeded for the stage
+ *
+ * Postconditions:  IO has been redirected
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  launch      Launch struct pointer
+ ******************************************************************************/
+
+void applyRedirections(Stage *stage, Launch *launch) {
+    if(launch->inputFD != -1 && dup2(launch->inputFD, STDIN_FILENO) == -1) {
+        fprintf(stderr, "cannot redirect input\n");
+        fflush(stdout);
+        countChildFailure();
+        exit(2);
+    }
+    if(launch->outputFD != -1 && dup2(launch->outputFD, STDOUT_FILENO) == -1) {
+        fprintf(stderr, "cannot redirect output\n");
+        fflush(stdout);
+        countChildFailure();
+        exit(2);
+    }
+    for(int i = 0; i < stage->numRedirections; i++) {
+        Redirection *redirection = &stage->redirections[i];
+        int from = redirection->file ? redirection->openedFD
+                                     : redirection->sourceFD;
+        if(dup2(from, redirection->fd) == -1) {
+            fprintf(stderr, "cannot redirect with %s\n",
+                    redirection->operator ? redirection->operator
+                                          : ALL_OUTPUT_REDIRECT);
+            fflush(stdout);
+            countChildFailure();
+            exit(2);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int startCapture(const char *name, int *writeFD)
+ *
+ * Description:     Starts capturing a stage's output into the log called
+ *                  name: creates a pipe whose read end is watched through
+ *                  the capture table's epoll set and whose write end the
+ *                  stage is given. The capture lasts until every writer has
+ *                  closed the pipe, so one that is never launched ends by
+ *                  itself once the parent closes the write end.
+ *
+ * Postconditions:  writeFD holds the close-on-exec write end of the pipe
+ *
+ * Receives:        name        Log name, without the "@"
+ *                  writeFD     int pointer for the pipe's write end
+ *
+ * Returns:         Slot of the capture, or -1 if it couldn't be started
+ *                  (the error has already been printed)
+ ******************************************************************************/
+
+int startCapture(const char *name, int *writeFD) {
+    int pipeFDs[2] = {-1, -1};  // Pipe the stage writes into
+    int log = openCaptureLog(name);
+    if(log == -1) {
+        return -1;
+    }
+
+    // The epoll set is created with the first capture
+    if(capture_table.epollFD == -1) {
+        capture_table.epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if(capture_table.epollFD == -1) {
+            perror("epoll_create1()");
+            fflush(stdout);
+            releaseCaptureLog(log);
+            return -1;
+        }
+        watchEvents(EVENT_CAPTURE, capture_table.epollFD);
+    }
+    if(pipe2(pipeFDs, O_CLOEXEC) == -1) {
+        perror("pipe2()");
+        fflush(stdout);
+        releaseCaptureLog(log);
+        return -1;
+    }
+    if(pipe_size > 0) {
+        fcntl(pipeFDs[1], F_SETPIPE_SZ, pipe_size);
+    }
+    fcntl(pipeFDs[0], F_SETFL, O_NONBLOCK);
+
+    // Take a free slot, growing the table if there is none
+    int index = 0;
+    while(index < capture_table.capacity &&
+          capture_table.captures[index].fd != -1) {
+        index++;
+    }
+    if(index == capture_table.capacity) {
+        int capacity = capture_table.capacity ? capture_table.capacity * 2
+                                              : CAPTURE_TABLE_SIZE;
+        capture_table.captures = heapRealloc(capture_table.captures,
+                                             sizeof(Capture) * capacity);
+        for(int i = capture_table.capacity; i < capacity; i++) {
+            capture_table.captures[i].fd = -1;
+        }
+        capture_table.capacity = capacity;
+    }
+
+    struct epoll_event event = {EPOLLIN, {.u32 = (uint32_t)index}};
+    if(epoll_ctl(capture_table.epollFD, EPOLL_CTL_ADD, pipeFDs[0],
+                 &event) == -1) {
+        perror("epoll_ctl()");
+        fflush(stdout);
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        releaseCaptureLog(log);
+        return -1;
+    }
+    capture_table.captures[index] = (Capture){pipeFDs[0], log, 0, 0, 0};
+    *writeFD = pipeFDs[1];
+    return index;
+}
+
+/*******************************************************************************
+ * Function name:   int openCaptureLog(const char *name)
+ *
+ * Description:     Finds the log called name, or opens name.log in the
+ *                  directory named by SMALLSH_LOG_DIR, or the working
+ *                  directory if it is unset, and adds a capture to it. The
+ *                  log is rotated once it grows past SMALLSH_LOG_SIZE bytes
+ *                  (LOG_SIZE by default).
+ *
+ * Receives:        name        Log name, without the "@"
+ *
+ * Returns:         Index of the log, or -1 if it couldn't be opened (the
+ *                  error has already been printed)
+ ******************************************************************************/
+
+int openCaptureLog(const char *name) {
+    char directory[PATH_MAX];   // Directory the log goes in
+    int index = -1;             // Slot for a newly opened log
+
+    if(!*name || strchr(name, '/')) {
+        fprintf(stderr, "smallsh: %c%s: bad log name\n", CAPTURE_PREFIX,
+                name);
+        fflush(stdout);
+        return -1;
+    }
+    for(int i = 0; i < capture_table.numLogs; i++) {
+        CaptureLog *log = &capture_table.logs[i];
+        if(log->name && !strcmp(log->name, name)) {
+            log->captures++;
+            return i;
+        }
+        if(!log->name && index == -1) {
+            index = i;
+        }
+    }
+
+    // Build the log's absolute path and open it for appending chunks. It
+    // is readable too, so a line left unfinished at its end can be seen.
+    char *logDir = getenv(LOG_DIR_VAR);
+    if(logDir && *logDir) {
+        snprintf(directory, sizeof(directory), "%s", logDir);
+    } else if(!getcwd(directory, sizeof(directory))) {
+        perror("getcwd()");
+        fflush(stdout);
+        return -1;
+    }
+    size_t nameLength = strlen(name);
+    size_t pathLength = strlen(directory) + 1 + nameLength +
+                        strlen(LOG_SUFFIX);
+    char *names = heapAlloc(nameLength + 1 + pathLength + 1);
+    memcpy(names, name, nameLength + 1);
+    char *path = names + nameLength + 1;
+    snprintf(path, pathLength + 1, "%s/%s%s", directory, name, LOG_SUFFIX);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        perror(path);
+        fflush(stdout);
+        heapFree(names);
+        return -1;
+    }
+
+    if(index == -1) {
+        int numLogs = capture_table.numLogs ? capture_table.numLogs * 2
+                                            : CAPTURE_TABLE_SIZE;
+        capture_table.logs = heapRealloc(capture_table.logs,
+                                         sizeof(CaptureLog) * numLogs);
+        for(int i = capture_table.numLogs; i < numLogs; i++) {
+            capture_table.logs[i].name = NULL;
+        }
+        index = capture_table.numLogs;
+        capture_table.numLogs = numLogs;
+    }
+    char *logSize = getenv(LOG_SIZE_VAR);
+    CaptureLog *log = &capture_table.logs[index];
+    log->name = names;
+    log->path = path;
+    log->fd = fd;
+    log->size = lseek(fd, 0, SEEK_END);
+    log->limit = logSize && atol(logSize) > 0 ? atol(logSize) : LOG_SIZE;
+    log->captures = 1;
+    log->writer = 0;
+    return index;
+}
+
+/*******************************************************************************
+ * Function name:   void releaseCaptureLog(int index)
+ *
+ * Description:     Removes a capture from a log, closing the log once no
+ *                  capture writes to it.
+ *
+ * Receives:        index       int     Index of the log
+ ******************************************************************************/
+
+void releaseCaptureLog(int index) {
+    CaptureLog *log = &capture_table.logs[index];
+    if(--log->captures > 0) {
+        return;
+    }
+    close(log->fd);
+    heapFree(log->name);
+    log->name = NULL;
+}
+
+/*******************************************************************************
+ * Function name:   void labelCaptures(Stage *stage, Job *job)
+ *
+ * Description:     Records the job, PID and launch number of a launched
+ *                  stage in each of its captures, so that its chunks can be
+ *                  told apart from other jobs' in a shared log, even ones
+ *                  given the same job id or PID later.
+ *
+ * Receives:        stage       Stage struct pointer
+ *                  job         Job struct pointer
+ ******************************************************************************/
+
+void labelCaptures(Stage *stage, Job *job) {
+    unsigned long launch = 0;   // Launch number shared by the captures
+
+    for(int i = 0; i < stage->numRedirections; i++) {
+        int index = stage->redirections[i].captured;
+        if(index != -1) {
+            if(launch == 0) {
+                launch = ++capture_table.launches;
+            }
+            capture_table.captures[index].jobId = job->id;
+            capture_table.captures[index].pid = stage->pid;
+            capture_table.captures[index].launch = launch;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void drainCaptures()
+ *
+ * Description:     Logs the output waiting in every ready capture pipe
+ *                  without blocking, and ends the captures whose writers
+ *                  have all finished.
+ ******************************************************************************/
+
+void drainCaptures() {
+    struct epoll_event events[CAPTURE_BATCH];   // Ready captures
+    int count = CAPTURE_BATCH;
+
+    if(capture_table.epollFD == -1) {
+        return;
+    }
+    while(count == CAPTURE_BATCH) {
+        count = epoll_wait(capture_table.epollFD, events, CAPTURE_BATCH, 0);
+        for(int i = 0; i < count; i++) {
+            logCapture((int)events[i].data.u32, events[i].events);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void logCapture(int index, uint32_t events)
+ *
+ * Description:     Moves what is in a capture pipe into its log as one
+ *                  chunk, spliced from the pipe to the file so that it is
+ *                  never copied through the shell. A chunk from a different
+ *                  launch than the last one, or LOG_STAMP_SECONDS after the
+ *                  last header, is preceded by a header line giving the
+ *                  time, job, launch number and PID, so each job's output
+ *                  can be told apart. The log is rotated first if the chunk
+ *                  would take it past its limit, once the line the chunk's
+ *                  writer was in the middle of has been finished in it, so
+ *                  that no line is split between two files.
+ *
+ * Receives:        index       int     Slot of the capture
+ *                  events      uint32_t    epoll events reported for it
+ ******************************************************************************/
+
+void logCapture(int index, uint32_t events) {
+    Capture *capture = &capture_table.captures[index];
+    CaptureLog *log = &capture_table.logs[capture->log];
+    char header[LOG_HEADER_MAX];    // Header line of the chunk
+    struct timespec now;            // Time the chunk is logged
+    struct tm local;
+    int available = 0;              // Bytes waiting in the pipe
+    bool written = true;            // False once the log can't be written
+
+    if(ioctl(capture->fd, FIONREAD, &available) == -1 || available <= 0) {
+        // An empty pipe that hung up has no writers left
+        if(events & (EPOLLHUP | EPOLLERR)) {
+            endCapture(index);
+        }
+        return;
+    }
+
+    if(log->size > 0 && log->size + available > log->limit) {
+        int lineEnd = capturedLineEnd(capture, log, available);
+        if(lineEnd > 0) {
+            written = moveCaptured(capture, log, lineEnd);
+            available -= lineEnd;
+        }
+        if(written && available > 0) {
+            rotateCaptureLog(log);
+        }
+    }
+
+    // Stamp the chunk unless it carries on the last writer's output,
+    // starting the header on a line of its own
+    size_t length = 0;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(written && available > 0 && (log->writer != capture->launch ||
+       now.tv_sec - log->stamped >= LOG_STAMP_SECONDS)) {
+        char last = '\n';  // Last character in the log
+        if(log->size > 0 && pread(log->fd, &last, 1, log->size - 1) == 1 &&
+           last != '\n') {
+            header[length++] = '\n';
+        }
+        localtime_r(&now.tv_sec, &local);
+        length += strftime(header + length, sizeof(header) - length,
+                           "# %Y-%m-%d %H:%M:%S", &local);
+        length += (size_t)snprintf(header + length, sizeof(header) - length,
+                                   ".%03ld job %d launch %lu pid %ld\n",
+                                   now.tv_nsec / 1000000, capture->jobId,
+                                   capture->launch, (long)capture->pid);
+        log->writer = capture->launch;
+        log->stamped = now.tv_sec;
+    }
+    if(written && available > 0) {
+        written = pwrite(log->fd, header, length, log->size) ==
+                  (ssize_t)length;
+        if(written) {
+            log->size += (off_t)length;
+            written = moveCaptured(capture, log, available);
+        }
+    }
+    if(!written) {
+        // Stop capturing rather than fill the log with partial chunks
+        perror(log->path);
+        fflush(stdout);
+        endCapture(index);
+        return;
+    }
+    capture_table.chunks++;
+
+    // A pipe that hung up and is now empty is finished
+    if(events & EPOLLHUP && ioctl(capture->fd, FIONREAD, &available) == 0 &&
+       available == 0) {
+        endCapture(index);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int capturedLineEnd(Capture *capture, CaptureLog *log,
+ *                                      int available)
+ *
+ * Description:     Works out how much of a chunk belongs in a log that is
+ *                  about to be rotated: the rest of the line its writer
+ *                  left unfinished at the end of the log. The chunk is
+ *                  looked at through a copy made with tee(), so it stays in
+ *                  the capture pipe to be spliced. A line that doesn't end
+ *                  in the chunk takes all of it, unless the log has already
+ *                  grown to twice its limit, so output without newlines
+ *                  still gets rotated.
+ *
+ * Receives:        capture     Capture struct pointer
+ *                  log         CaptureLog struct pointer
+ *                  available   int     Number of bytes waiting in the pipe
+ *
+ * Returns:         Number of bytes to move into the log before rotating
+ *                  it, which is 0 if none of them carry on its last line
+ ******************************************************************************/
+
+int capturedLineEnd(Capture *capture, CaptureLog *log, int available) {
+    static char peek[PIPE_BUF];     // Part of the copy being looked at
+    char last = '\n';               // Last character in the log
+
+    if(log->writer != capture->launch || log->size >= 2 * log->limit ||
+       pread(log->fd, &last, 1, log->size - 1) != 1 || last == '\n') {
+        return 0;
+    }
+    if(capture_table.peekFDs[0] == -1 &&
+       pipe2(capture_table.peekFDs, O_CLOEXEC | O_NONBLOCK) == -1) {
+        capture_table.peekFDs[0] = capture_table.peekFDs[1] = -1;
+        return 0;
+    }
+    ssize_t copied = tee(capture->fd, capture_table.peekFDs[1],
+                         (size_t)available, SPLICE_F_NONBLOCK);
+    if(copied <= 0) {
+        return 0;
+    }
+    int lineEnd = 0;        // Bytes up to and including the first newline
+    bool ended = false;     // True once the newline has been found
+
+    // Read the whole copy back, so the pipe is empty for the next time
+    while(copied > 0) {
+        ssize_t got = read(capture_table.peekFDs[0], peek,
+                           copied < (ssize_t)sizeof(peek) ? (size_t)copied
+                                                          : sizeof(peek));
+        if(got <= 0) {
+            break;
+        }
+        char *newline = ended ? NULL : memchr(peek, '\n', (size_t)got);
+        if(!ended) {
+            lineEnd += newline ? (int)(newline - peek) + 1 : (int)got;
+            ended = newline != NULL;
+        }
+        copied -= got;
+    }
+    return ended ? lineEnd : available;
+}
+
+/*******************************************************************************
+ * Function name:   bool moveCaptured(Capture *capture, CaptureLog *log,
+ *                                    int length)
+ *
+ * Description:     Moves length bytes from a capture pipe to the end of its
+ *                  log with splice(). The log isn't opened for appending,
+ *                  which splice() refuses, so the offset is passed
+ *                  explicitly. If the log's file system can't be spliced
+ *                  into, the bytes are copied with read() and pwrite()
+ *                  instead, as they are from then on.
+ *
+ * Preconditions:   The chunk's header has been written and counted in
+ *                  log->size
+ *
+ * Receives:        capture     Capture struct pointer
+ *                  log         CaptureLog struct pointer
+ *                  length      int     Number of bytes waiting in the pipe
+ *
+ * Returns:         false if the log couldn't be written, with errno set
+ ******************************************************************************/
+
+bool moveCaptured(Capture *capture, CaptureLog *log, int length) {
+    static char copy[PIPE_BUF];     // Bytes copied when splice() can't be used
+    loff_t offset = log->size;      // Where the next byte goes in the log
+    bool written = true;
+
+    while(length > 0) {
+        ssize_t moved;
+        if(capture_table.splice) {
+            moved = splice(capture->fd, NULL, log->fd, &offset,
+                           (size_t)length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(moved == -1 && errno == EINVAL) {
+                capture_table.splice = false;
+                continue;
+            }
+        } else {
+            moved = read(capture->fd, copy,
+                         length < (int)sizeof(copy) ? (size_t)length
+                                                    : sizeof(copy));
+            if(moved > 0 && pwrite(log->fd, copy, (size_t)moved,
+                                   offset) != moved) {
+                written = false;
+                break;
+            }
+            offset += moved > 0 ? moved : 0;
+        }
+        // Stop if the pipe is unexpectedly empty
+        if(moved <= 0) {
+            written = moved == 0 || errno == EAGAIN;
+            break;
+        }
+        length -= (int)moved;
+        capture_table.bytes += (unsigned long)moved;
+    }
+    log->size = offset;
+    return written;
+}
+
+/*******************************************************************************
+ * Function name:   void rotateCaptureLog(CaptureLog *log)
+ *
+ * Description:     Renames log.log to log.log.1, shifting older logs up to
+ *                  LOG_KEEP and dropping the oldest, and starts an empty log
+ *                  file. If the new file can't be created, logging carries
+ *                  on into the renamed one.
+ *
+ * Receives:        log         CaptureLog struct pointer
+ ******************************************************************************/
+
+void rotateCaptureLog(CaptureLog *log) {
+    char from[PATH_MAX];    // Name of a log being moved up
+    char to[PATH_MAX];      // Name it is given
+
+    for(int i = LOG_KEEP - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), "%s.%d", log->path, i);
+        snprintf(to, sizeof(to), "%s.%d", log->path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    rename(log->path, to);
+    int fd = open(log->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        perror(log->path);
+        fflush(stdout);
+        return;
+    }
+    close(log->fd);
+    log->fd = fd;
+    log->size = 0;
+    log->writer = 0;
+}
+
+/*******************************************************************************
+ * Function name:   void endCapture(int index)
+ *
+ * Description:     Takes a capture pipe out of the epoll set, closes it and
+ *                  releases its log. Closing alone isn't enough: a child
+ *                  being spawned can still hold a copy of the read end, and
+ *                  epoll keeps reporting a pipe until every copy is closed.
+ *
+ * Receives:        index       int     Slot of the capture
+ ******************************************************************************/
+
+void endCapture(int index) {
+    Capture *capture = &capture_table.captures[index];
+    epoll_ctl(capture_table.epollFD, EPOLL_CTL_DEL, capture->fd, NULL);
+    close(capture->fd);
+    capture->fd = -1;
+    releaseCaptureLog(capture->log);
+}
+
+/*******************************************************************************
+ * Function name:   void closeCaptures()
+ *
+ * Description:     Logs whatever captured output is waiting when the shell
+ *                  exits, then ends every capture. Output a job writes after
+ *                  this isn't logged.
+ ******************************************************************************/
+
+void closeCaptures() {
+    drainCaptures();
+    for(int i = 0; i < capture_table.capacity; i++) {
+        if(capture_table.captures[i].fd != -1) {
+            endCapture(i);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void printStats()
+ *
+ * Description:     Prints the shell's internal counters: the number of heap
+ *                  calls made so far, which stays constant in a steady-state
+ *                  prompt loop, the line classifier in use, the signals
+ *                  handled through the signal ring, the parse cache's hits,
+ *                  misses and entries, the directory reads glob patterns
+ *                  needed, how much output has been captured into logs,
+ *                  the commands run and jobs started, and how long lines
+ *                  took to parse and children to be reaped.
+ ******************************************************************************/
+
+void printStats() {
+    printf("heap calls %lu\n", heap_calls);
+    printf("line classifier %s\n", classifier_name);
+    printf("event loop %s (%lu waits)\n", event_loop.fd == -1 ? "unopened"
+           : event_backend_names[event_loop.backend], event_loop.waits);
+    printf("signals %lu handled, %lu past a full ring of %d\n",
+           signal_ring.handled, signal_ring.coalesced, SIGNAL_RING_SIZE);
+    printf("parse cache hits %lu misses %lu (%d of %d entries)\n",
+           parse_cache.hits, parse_cache.misses, parse_cache.count,
+           parse_cache.capacity);
+    printf("globs %lu expanded, %lu directory reads, %lu listings reused\n",
+           dir_cache.globs, dir_cache.reads, dir_cache.cached);
+    int captures = 0;
+    for(int i = 0; i < capture_table.capacity; i++) {
+        captures += capture_table.captures[i].fd != -1;
+    }
+    printf("captures %d open, %lu chunks, %lu bytes %s\n", captures,
+           capture_table.chunks, capture_table.bytes,
+           capture_table.splice ? "spliced" : "copied");
+    printf("slices %d open, %lu processes cloned in, %lu moved in\n",
+           slice_table.count, slice_table.cloned, slice_table.moved);
+    int clients = 0;
+    for(int i = 0; i < control_table.capacity; i++) {
+        clients += control_table.clients[i].fd != -1;
+    }
+    printf("control %d clients, %lu requests, %lu replies\n", clients,
+           control_table.requests, control_table.replies);
+    printf("commands %lu built-in, %lu external, %lu launch failures\n",
+           metrics.builtins, metrics.external,
+           metrics.launchFailures + childFailures());
+    printf("jobs %ld running, %ld peak\n", job_table.running,
+           metrics.peakJobs);
+    printHistogram("parse", &metrics.parse);
+    printHistogram("reap", &metrics.reap);
+    if(metrics.path) {
+        printf("metrics %lu writes to %s every %lds\n", metrics.writes,
+               metrics.path, metrics.interval);
+    }
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void printHistogram(const char *name,
+ *                                      const Histogram *histogram)
+ *
+ * Description:     Prints a line of stats for a histogram of durations: its
+ *                  median, 99th percentile and largest value in
+ *                  microseconds, and how many values it holds.
+ *
+ * Receives:        name        Label for the line
+ *                  histogram   Histogram struct pointer
+ ******************************************************************************/
+
+void printHistogram(const char *name, const Histogram *histogram) {
+    printf("%s us p50 %.1f p99 %.1f max %.1f (%llu)\n", name,
+           histogramQuantile(histogram, 0.5) / 1000.0,
+           histogramQuantile(histogram, 0.99) / 1000.0,
+           histogram->max / 1000.0, (unsigned long long)histogram->count);
+}
+
+/*******************************************************************************
+ * Function name:   int histogramBucket(uint64_t value)
+ *
+ * Description:     Finds the Histogram bucket a value falls in. A value
+ *                  below HISTOGRAM_SUB is its own bucket; above that, the
+ *                  position of the top bit picks a group of HISTOGRAM_SUB
+ *                  buckets and the bits below it pick one in the group.
+ *
+ * Receives:        value       uint64_t    Value to place
+ *
+ * Returns:         Index of the bucket, below HISTOGRAM_BUCKETS
+ ******************************************************************************/
+
+int histogramBucket(uint64_t value) {
+    if(value < HISTOGRAM_SUB) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB +
+           (int)((value >> shift) & (HISTOGRAM_SUB - 1));
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t bucketStart(int bucket)
+ *
+ * Description:     Gives the smallest value a Histogram bucket holds, the
+ *                  inverse of histogramBucket()
+ *
+ * Receives:        bucket      int     Index of the bucket
+ *
+ * Returns:         Smallest value in the bucket
+ ******************************************************************************/
+
+uint64_t bucketStart(int bucket) {
+    if(bucket < HISTOGRAM_SUB) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB - 1;
+    return (uint64_t)(HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) << shift;
+}
+
+/*******************************************************************************
+ * Function name:   void recordHistogram(Histogram *histogram, uint64_t value)
+ *
+ * Description:     Adds a value to a histogram
+ *
+ * Receives:        histogram   Histogram struct pointer
+ *                  value       uint64_t    Value to add
+ ******************************************************************************/
+
+void recordHistogram(Histogram *histogram, uint64_t value) {
+    histogram->counts[histogramBucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if(value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t histogramQuantile(const Histogram *histogram,
+ *                                             double quantile)
+ *
+ * Description:     Estimates a quantile of the values in a histogram as the
+ *                  largest value in the bucket it falls in, which is within
+ *                  an eighth of the true value, and never more than the
+ *                  largest value recorded.
+ *
+ * Receives:        histogram   Histogram struct pointer
+ *                  quantile    double  Fraction of the values at or below
+ *                                      the one wanted, from 0 to 1
+ *
+ * Returns:         The estimate, or 0 if the histogram is empty
+ ******************************************************************************/
+
+uint64_t histogramQuantile(const Histogram *histogram, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * histogram->count + 0.5);
+    uint64_t seen = 0;      // Values in the buckets so far
+
+    if(rank == 0) {
+        rank = 1;
+    }
+    for(int i = 0; i < HISTOGRAM_BUCKETS - 1 && histogram->count; i++) {
+        seen += histogram->counts[i];
+        if(seen >= rank) {
+            uint64_t end = bucketStart(i + 1) - 1;
+            return end < histogram->max ? end : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/*******************************************************************************
+ * Function name:   void countRunningJob()
+ *
+ * Description:     Counts a job that has started running in the background,
+ *                  keeping the peak number of background jobs up to date
+ ******************************************************************************/
+
+void countRunningJob() {
+    job_table.running++;
+    if(job_table.running > metrics.peakJobs) {
+        metrics.peakJobs = job_table.running;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void mapChildFailures()
+ *
+ * Description:     Maps the page children count their launch failures in.
+ *                  Every process forked after it shares the page, the spawn
+ *                  server and its children included, so a stage whose
+ *                  exec() fails in a child is counted just as one that
+ *                  posix_spawn() reports to the shell.
+ ******************************************************************************/
+
+void mapChildFailures() {
+    void *page = mmap(NULL, sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(page != MAP_FAILED) {
+        metrics.childFailures = page;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void countChildFailure()
+ *
+ * Description:     Counts a launch failure in a child, just before it exits
+ *                  without running its command.
+ ******************************************************************************/
+
+void countChildFailure() {
+    if(metrics.childFailures) {
+        __atomic_fetch_add(metrics.childFailures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   unsigned long childFailures()
+ *
+ * Description:     Reads the number of launch failures children have
+ *                  counted. Each of them was counted as launched by the
+ *                  shell when it got the child's PID.
+ *
+ * Returns:         The number of failures
+ ******************************************************************************/
+
+unsigned long childFailures() {
+    return metrics.childFailures ? __atomic_load_n(metrics.childFailures,
+                                                   __ATOMIC_RELAXED) : 0;
+}
+
+/*******************************************************************************
+ * Function name:   void openMetrics()
+ *
+ * Description:     Reads SMALLSH_METRICS_FILE and SMALLSH_METRICS_INTERVAL.
+ *                  If a file is named, the metrics are written to it every
+ *                  interval and when the shell exits, each time by writing
+ *                  a temporary file next to it and renaming it over the
+ *                  file, so a scraper never reads a partial one.
+ *
+ * Preconditions:   initEventLoop() has been called
+ ******************************************************************************/
+
+void openMetrics() {
+    char *interval = getenv(METRICS_INTERVAL_VAR);
+    if(interval && atol(interval) > 0) {
+        metrics.interval = atol(interval);
+    }
+    char *path = getenv(METRICS_FILE_VAR);
+    if(!path || !*path) {
+        return;
+    }
+    size_t length = strlen(path);
+    metrics.path = memcpy(heapAlloc(length + 1), path, length + 1);
+    metrics.tempPath = heapAlloc(length + 5);
+    memcpy(metrics.tempPath, path, length);
+    memcpy(metrics.tempPath + length, ".tmp", 5);
+    armMetricsTimer();
+}
+
+/*******************************************************************************
+ * Function name:   void armMetricsTimer()
+ *
+ * Description:     Starts the timerfd that expires every metrics interval
+ *                  and has the event loop watch it as EVENT_METRICS, unless
+ *                  it is already running
+ ******************************************************************************/
+
+void armMetricsTimer() {
+    if(metrics.timerFD != -1) {
+        return;
+    }
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec period = {{metrics.interval, 0},
+                                {metrics.interval, 0}};
+    if(fd == -1 || timerfd_settime(fd, 0, &period, NULL) == -1) {
+        perror("metrics timer");
+        fflush(stdout);
+        if(fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    metrics.timerFD = fd;
+    watchEvents(EVENT_METRICS, fd);
+}
+
+/*******************************************************************************
+ * Function name:   void drainMetricsTimer()
+ *
+ * Description:     Handles the metrics timer expiring: writes the metrics
+ *                  file and sends the metrics as a frame to each control
+ *                  client that has asked for them with stats -p. The timer
+ *                  is stopped once there is neither to send them to.
+ ******************************************************************************/
+
+void drainMetricsTimer() {
+    uint64_t expirations;   // Times the timer expired since the last read
+
+    if(metrics.timerFD == -1 ||
+       read(metrics.timerFD, &expirations, sizeof(expirations)) <= 0) {
+        return;
+    }
+    formatMetrics();
+    if(metrics.path) {
+        writeMetrics();
+    }
+    bool subscribed = false;
+    for(int i = 0; i < control_table.capacity; i++) {
+        ControlClient *client = &control_table.clients[i];
+        if(client->fd != -1 && client->metrics) {
+            replyControl(i, metrics.text);
+            subscribed = true;
+        }
+    }
+    if(!subscribed && !metrics.path) {
+        watchEvents(EVENT_METRICS, -1);
+        close(metrics.timerFD);
+        metrics.timerFD = -1;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void writeMetrics()
+ *
+ * Description:     Writes the metrics last formatted to the metrics file
+ *                  through its temporary file. If that fails, the error is
+ *                  printed and the file isn't written again.
+ *
+ * Preconditions:   formatMetrics() has been called and metrics.path is set
+ ******************************************************************************/
+
+void writeMetrics() {
+    int fd = open(metrics.tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    bool written = fd != -1;
+    for(size_t done = 0; written && done < metrics.textUsed;) {
+        ssize_t bytes = write(fd, metrics.text + done,
+                              metrics.textUsed - done);
+        if(bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        written = bytes > 0;
+        done += written ? (size_t)bytes : 0;
+    }
+    if(fd != -1 && close(fd) == -1) {
+        written = false;
+    }
+    if(!written || rename(metrics.tempPath, metrics.path) == -1) {
+        perror(metrics.path);
+        fflush(stdout);
+        unlink(metrics.tempPath);
+        heapFree(metrics.path);
+        heapFree(metrics.tempPath);
+        metrics.path = NULL;
+        metrics.tempPath = NULL;
+        return;
+    }
+    metrics.writes++;
+}
+
+/*******************************************************************************
+ * Function name:   void formatMetrics()
+ *
+ * Description:     Formats the shell's counters and histograms into
+ *                  metrics.text in the Prometheus text exposition format.
+ *                  Durations are in seconds, as Prometheus expects.
+ *
+ * Postconditions:  metrics.text holds metrics.textUsed characters and a
+ *                  null terminator
+ ******************************************************************************/
+
+void formatMetrics() {
+    metrics.textUsed = 0;
+    appendMetrics("# HELP smallsh_commands_total Commands run, by whether "
+                  "the shell ran them itself.\n"
+                  "# TYPE smallsh_commands_total counter\n"
+                  "smallsh_commands_total{kind=\"builtin\"} %lu\n"
+                  "smallsh_commands_total{kind=\"external\"} %lu\n",
+                  metrics.builtins, metrics.external);
+    appendMetrics("# HELP smallsh_processes_launched_total Processes "
+                  "that started their commands.\n"
+                  "# TYPE smallsh_processes_launched_total counter\n"
+                  "smallsh_processes_launched_total %lu\n",
+                  metrics.launched - childFailures());
+    appendMetrics("# HELP smallsh_launch_failures_total Pipeline stages "
+                  "whose command couldn't be started.\n"
+                  "# TYPE smallsh_launch_failures_total counter\n"
+                  "smallsh_launch_failures_total %lu\n",
+                  metrics.launchFailures + childFailures());
+    appendMetrics("# HELP smallsh_background_jobs Background jobs "
+                  "running.\n"
+                  "# TYPE smallsh_background_jobs gauge\n"
+                  "smallsh_background_jobs %ld\n"
+                  "# HELP smallsh_background_jobs_peak Most background "
+                  "jobs running at once.\n"
+                  "# TYPE smallsh_background_jobs_peak gauge\n"
+                  "smallsh_background_jobs_peak %ld\n",
+                  job_table.running, metrics.peakJobs);
+    appendMetrics("# HELP smallsh_parse_cache_lookups_total Parse cache "
+                  "lookups, by result.\n"
+                  "# TYPE smallsh_parse_cache_lookups_total counter\n"
+                  "smallsh_parse_cache_lookups_total{result=\"hit\"} %lu\n"
+                  "smallsh_parse_cache_lookups_total{result=\"miss\"} %lu\n",
+                  parse_cache.hits, parse_cache.misses);
+    appendMetrics("# HELP smallsh_glob_listings_total Directory listings "
+                  "glob patterns used, by whether they were cached.\n"
+                  "# TYPE smallsh_glob_listings_total counter\n"
+                  "smallsh_glob_listings_total{result=\"hit\"} %lu\n"
+                  "smallsh_glob_listings_total{result=\"miss\"} %lu\n",
+                  dir_cache.cached, dir_cache.reads);
+    appendMetrics("# HELP smallsh_heap_calls_total Calls to the heap "
+                  "allocator.\n"
+                  "# TYPE smallsh_heap_calls_total counter\n"
+                  "smallsh_heap_calls_total %lu\n", heap_calls);
+    appendHistogramMetrics("smallsh_parse_seconds",
+                           "Time taken to parse each command line.",
+                           &metrics.parse);
+    appendHistogramMetrics("smallsh_reap_latency_seconds",
+                           "Time from the shell waking for child "
+                           "notifications to each child being reaped.",
+                           &metrics.reap);
+}
+
+/*******************************************************************************
+ * Function name:   void appendMetrics(const char *format, ...)
+ *
+ * Description:     Appends formatted text to metrics.text, growing it as
+ *                  needed
+ *
+ * Receives:        format      printf() format string
+ *                  ...         Values for the format
+ ******************************************************************************/
+
+void appendMetrics(const char *format, ...) {
+    va_list values;         // Values for the format
+
+    while(true) {
+        size_t room = metrics.textSize - metrics.textUsed;
+        va_start(values, format);
+        int length = metrics.text ? vsnprintf(metrics.text + metrics.textUsed,
+                                              room, format, values)
+                                  : -1;
+        va_end(values);
+        if(length >= 0 && (size_t)length < room) {
+            metrics.textUsed += (size_t)length;
+            return;
+        }
+        metrics.textSize = metrics.textSize ? metrics.textSize * 2
+                                            : METRICS_TEXT_SIZE;
+        metrics.text = heapRealloc(metrics.text, metrics.textSize);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void appendHistogramMetrics(const char *name,
+ *                                              const char *help,
+ *                                              const Histogram *histogram)
+ *
+ * Description:     Appends a histogram of durations to metrics.text as a
+ *                  Prometheus histogram, with a bucket bound at each power
+ *                  of two nanoseconds from 2^HISTOGRAM_LE_FIRST (about a
+ *                  microsecond) to 2^HISTOGRAM_LE_LAST (about 17 seconds).
+ *                  Each bound falls at the start of a Histogram bucket, so
+ *                  the counts are exact for values below it.
+ *
+ * Receives:        name        Name of the metric
+ *                  help        Description of the metric
+ *                  histogram   Histogram struct pointer
+ ******************************************************************************/
+
+void appendHistogramMetrics(const char *name, const char *help,
+                            const Histogram *histogram) {
+    uint64_t below = 0;     // Values in the buckets under the bound so far
+    int bucket = 0;         // Next Histogram bucket to count
+
+    appendMetrics("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(int bit = HISTOGRAM_LE_FIRST; bit <= HISTOGRAM_LE_LAST; bit++) {
+        uint64_t bound = (uint64_t)1 << bit;
+        for(; bucketStart(bucket) < bound; bucket++) {
+            below += histogram->counts[bucket];
+        }
+        appendMetrics("%s_bucket{le=\"%.12g\"} %llu\n", name, bound / 1e9,
+                      (unsigned long long)below);
+    }
+    appendMetrics("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n"
+                  "%s_count %llu\n", name,
+                  (unsigned long long)histogram->count, name,
+                  histogram->sum / 1e9, name,
+                  (unsigned long long)histogram->count);
+}
+
+/*******************************************************************************
+ * Function name:   void initReaper()
+ *
+ * Description:     Blocks SIGCHLD and opens a signalfd that becomes readable
+ *                  whenever a child process changes state, so that children
+ *                  can be reaped as soon as they finish while the shell waits
+ *                  for input or for a foreground job.
+ *
+ * Postconditions:  SIGCHLD is blocked, shell_sigmask holds the signal mask
+ *                  to restore in children and sigchld_fd is open
+ ******************************************************************************/
+
+void initReaper() {
+    sigset_t childSignal;   // Set containing only SIGCHLD
+
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, &shell_sigmask);
+    sigchld_fd = signalfd(-1, &childSignal, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(sigchld_fd == -1) {
+        perror("signalfd()");
+        exit(1);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   Job *addJob(bool background)
+ *
+ * Description:     Takes a free slot in the job table for a new job, growing
+ *                  the table if every slot is in use. Freed slots are reused
+ *                  so job ids stay dense. The job's start time is recorded.
+ *
+ * Receives:        background  bool    True for a background job
+ *
+ * Returns:         Pointer to the new job, which has no processes yet
+ ******************************************************************************/
+
+Job *addJob(bool background) {
+    // Double the table when it is full and put the new slots on the free list
+    if(job_table.freeHead == -1) {
+        int capacity = job_table.capacity ? job_table.capacity * 2
+                                          : JOB_TABLE_SIZE;
+        job_table.jobs = heapRealloc(job_table.jobs, sizeof(Job) * capacity);
+        for(int i = capacity - 1; i >= job_table.capacity; i--) {
+            job_table.jobs[i].id = i + 1;
+            job_table.jobs[i].state = JOB_FREE;
+            job_table.jobs[i].text = NULL;
+            job_table.jobs[i].textSize = 0;
+            job_table.jobs[i].queued = NULL;
+            job_table.jobs[i].queuedSize = 0;
+            job_table.jobs[i].rest = NULL;
+            job_table.jobs[i].restSize = 0;
+            job_table.jobs[i].next = job_table.freeHead;
+            job_table.freeHead = i;
+        }
+        job_table.capacity = capacity;
+    }
+
+    Job *job = &job_table.jobs[job_table.freeHead];
+    job_table.freeHead = job->next;
+    job->state = JOB_RUNNING;
+    job->background = background;
+    job->numProcs = 0;
+    job->numStopped = 0;
+    job->lastPid = -1;
+    job->pgid = -1;
+    job->slice = -1;
+    job->client = -1;
+    job->status = W_EXITCODE(1, 0);
+    job->stopSignal = 0;
+    job->stopNotice = false;
+    job->savedModes = false;
+    job->hasRest = false;
+    job->next = -1;
+    memset(&job->usage, 0, sizeof(job->usage));
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->end = job->start;
+    return job;
+}
+
+/*******************************************************************************
+ * Function name:   void addJobProcess(Job *job, pid_t pid, bool last)
+ *
+ * Description:     Records a process launched for a job so that the reaper
+ *                  can find the job from the process's PID.
+ *
+ * Receives:        job         Job struct pointer
+ *                  pid         PID of the launched process
+ *                  last        True if the process runs the job's final
+ *                              stage, whose status is the job's status
+ ******************************************************************************/
+
+void addJobProcess(Job *job, pid_t pid, bool last) {
+    // Keep the PID map at most half full
+    if((job_table.pidCount + 1) * 2 > job_table.pidCapacity) {
+        growPidMap();
+    }
+
+    // Linear probing from the PID's hash
+    size_t mask = job_table.pidCapacity - 1;
+    size_t slot = hashPid(pid) & mask;
+    while(job_table.pids[slot].pid != 0) {
+        slot = (slot + 1) & mask;
+    }
+    job_table.pids[slot].pid = pid;
+    job_table.pids[slot].job = job->id - 1;
+    job_table.pids[slot].stopped = false;
+    job_table.pidCount++;
+
+    job->numProcs++;
+    if(last) {
+        job->lastPid = pid;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   size_t hashPid(pid_t pid)
+ *
+ * Description:     Hashes a PID for the job table's PID map.
+ *
+ * Receives:        pid         PID to hash
+ *
+ * Returns:         Hash of the PID
+ ******************************************************************************/
+
+size_t hashPid(pid_t pid) {
+    return (size_t)((uint32_t)pid * 2654435761u);
+}
+
+/*******************************************************************************
+ * Function name:   void growPidMap()
+ *
+ * Description:     Doubles the capacity of the job table's PID map and
+ *                  reinserts every entry.
+ ******************************************************************************/
+
+void growPidMap() {
+    PidEntry *old = job_table.pids;
+    size_t oldCapacity = job_table.pidCapacity;
+    size_t capacity = oldCapacity ? oldCapacity * 2 : JOB_TABLE_SIZE * 2;
+
+    job_table.pids = heapAlloc(sizeof(PidEntry) * capacity);
+    memset(job_table.pids, 0, sizeof(PidEntry) * capacity);
+    job_table.pidCapacity = capacity;
+
+    size_t mask = capacity - 1;
+    for(size_t i = 0; i < oldCapacity; i++) {
+        if(old[i].pid != 0) {
+            size_t slot = hashPid(old[i].pid) & mask;
+            while(job_table.pids[slot].pid != 0) {
+                slot = (slot + 1) & mask;
+            }
+            job_table.pids[slot] = old[i];
+        }
+    }
+    heapFree(old);
+}
+
+/*******************************************************************************
+ * Function name:   PidEntry *findJobProcess(pid_t pid)
+ *
+ * Description:     Finds a process's entry in the job table's PID map.
+ *
+ * Receives:        pid         PID of a child process
+ *
+ * Returns:         Pointer to the entry, or NULL if the process doesn't
+ *                  belong to a job
+ ******************************************************************************/
+
+PidEntry *findJobProcess(pid_t pid) {
+    if(job_table.pidCount == 0) {
+        return NULL;
+    }
+    size_t mask = job_table.pidCapacity - 1;
+    size_t slot = hashPid(pid) & mask;
+    while(job_table.pids[slot].pid != pid) {
+        if(job_table.pids[slot].pid == 0) {
+            return NULL;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &job_table.pids[slot];
+}
+
+/*******************************************************************************
+ * Function name:   Job *takeJobProcess(pid_t pid)
+ *
+ * Description:     Finds the job a process belongs to and removes the
+ *                  process from the PID map, no longer counting it as
+ *                  stopped. Entries after the removed one are shifted back
+ *                  so that no tombstones are needed.
+ *
+ * Receives:        pid         PID of a reaped process
+ *
+ * Returns:         Pointer to the process's job, or NULL if the process
+ *                  doesn't belong to a job
+ ******************************************************************************/
+
+Job *takeJobProcess(pid_t pid) {
+    PidEntry *entry = findJobProcess(pid);
+    if(!entry) {
+        return NULL;
+    }
+    size_t mask = job_table.pidCapacity - 1;
+    size_t slot = (size_t)(entry - job_table.pids);
+    Job *job = &job_table.jobs[entry->job];
+    if(entry->stopped) {
+        job->numStopped--;
+    }
+
+    // Backward-shift deletion: move later entries of the probe run into the
+    // hole unless doing so would put them before their home slot
+    size_t hole = slot;
+    size_t next = (hole + 1) & mask;
+    while(job_table.pids[next].pid != 0) {
+        size_t home = hashPid(job_table.pids[next].pid) & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            job_table.pids[hole] = job_table.pids[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    job_table.pids[hole].pid = 0;
+    job_table.pidCount--;
+    return job;
+}
+
+/*******************************************************************************
+ * Function name:   void freeJob(Job *job)
+ *
+ * Description:     Returns a finished job's slot to the job table's free
+ *                  list.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void freeJob(Job *job) {
+    if(job_table.current == job->id - 1) {
+        job_table.current = -1;
+    }
+    job->state = JOB_FREE;
+    job->next = job_table.freeHead;
+    job_table.freeHead = job->id - 1;
+}
+
+/*******************************************************************************
+ * Function name:   void setJobText(Job *job, Command *command)
+ *
+ * Description:     Records the command a job runs: the arguments of every
+ *                  stage joined by spaces, with " | " between stages. The
+ *                  slot's buffer is only reallocated when it is too small.
+ *
+ * Preconditions:   command has been split into stages by parseCommandLine()
+ *
+ * Receives:        job         Job struct pointer
+ *                  command     Command struct pointer
+ ******************************************************************************/
+
+void setJobText(Job *job, Command *command) {
+    size_t length = 0;      // Number of characters in the text
+
+    // Measure the text
+    for(int i = 0; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        for(int j = 0; j < stage->numArgs; j++) {
+            length += strlen(stage->args[j]) + 1;
+        }
+        for(int j = 0; j < stage->numRedirections; j++) {
+            Redirection *redirection = &stage->redirections[j];
+            if(!redirection->operator) {
+                continue;
+            }
+            length += strlen(redirection->operator) + 1;
+            if(redirection->file) {
+                length += strlen(redirection->file) + 1;
+            }
+        }
+        length += 2;
+    }
+    if(length + 1 > job->textSize) {
+        job->text = heapRealloc(job->text, length + 1);
+        job->textSize = length + 1;
+    }
+
+    // Join the arguments
+    char *out = job->text;
+    for(int i = 0; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        if(i > 0) {
+            out = stpcpy(out, "| ");
+        }
+        for(int j = 0; j < stage->numArgs; j++) {
+            out = stpcpy(out, stage->args[j]);
+            *out++ = ' ';
+        }
+        for(int j = 0; j < stage->numRedirections; j++) {
+            Redirection *redirection = &stage->redirections[j];
+            if(!redirection->operator) {
+                continue;
+            }
+            out = stpcpy(out, redirection->operator);
+            *out++ = ' ';
+            if(redirection->file) {
+                out = stpcpy(out, redirection->file);
+                *out++ = ' ';
+            }
+        }
+    }
+    // Drop the trailing space
+    if(out > job->text) {
+        out--;
+    }
+    *out = '\0';
+}
+
+/*******************************************************************************
+ * Function name:   Job *findJob(char *spec)
+ *
+ * Description:     Finds a background job from a job id written as %id, or
+ *                  from the PID of its final stage.
+ *
+ * Receives:        spec        Job id or PID
+ *
+ * Returns:         Pointer to the job, or NULL if there is no such job
+ ******************************************************************************/
+
+Job *findJob(char *spec) {
+    char *end = NULL;       // First character not part of the number
+    bool byId = spec[0] == JOB_ID_PREFIX;
+    long number = strtol(spec + (byId ? 1 : 0), &end, 10);
+    if(*end || end == spec + (byId ? 1 : 0)) {
+        return NULL;
+    }
+
+    for(int i = 0; i < job_table.capacity; i++) {
+        Job *job = &job_table.jobs[i];
+        if(job->state != JOB_FREE && job->background &&
+           (byId ? job->id == number : job->lastPid == number)) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * Function name:   void addUsage(struct rusage *total, struct rusage *usage)
+ *
+ * Description:     Adds the CPU times of one process to a job's total and
+ *                  keeps the largest maximum resident set size.
+ *
+ * Receives:        total       rusage struct pointer for the job's total
+ *                  usage       rusage struct pointer for a reaped process
+ ******************************************************************************/
+
+void addUsage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if(usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   double jobSeconds(Job *job)
+ *
+ * Description:     Computes the wall-clock time a job has been running (or
+ *                  queued), or ran for if it is done.
+ *
+ * Receives:        job         Job struct pointer
+ *
+ * Returns:         Elapsed time in seconds
+ ******************************************************************************/
+
+double jobSeconds(Job *job) {
+    struct timespec end = job->end;     // Finish time, or now if running
+    if(job->state != JOB_DONE) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    return (double)(end.tv_sec - job->start.tv_sec) +
+           (double)(end.tv_nsec - job->start.tv_nsec) / 1e9;
+}
+
+/*******************************************************************************
+ * Function name:   void printJobUsage(Job *job)
+ *
+ * Description:     Prints a job's wall-clock time, user and system CPU time
+ *                  and maximum resident set size on one line.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void printJobUsage(Job *job) {
+    char text[CONTROL_REPLY_MAX];   // Description of the usage
+
+    formatJobUsage(text, sizeof(text), job);
+    printf("%s\n", text);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   int formatJobUsage(char *text, size_t size, Job *job)
+ *
+ * Description:     Describes a job's resource usage the way printJobUsage()
+ *                  prints it, without the newline.
+ *
+ * Receives:        text        Buffer the description is written to
+ *                  size        Size of text
+ *                  job         Job struct pointer
+ *
+ * Returns:         Number of characters written
+ ******************************************************************************/
+
+int formatJobUsage(char *text, size_t size, Job *job) {
+    return snprintf(text, size, "real %.3fs user %ld.%03lds sys %ld.%03lds "
+                    "maxrss %ld KB", jobSeconds(job),
+                    (long)job->usage.ru_utime.tv_sec,
+                    (long)job->usage.ru_utime.tv_usec / 1000,
+                    (long)job->usage.ru_stime.tv_sec,
+                    (long)job->usage.ru_stime.tv_usec / 1000,
+                    job->usage.ru_maxrss);
+}
+
+/*******************************************************************************
+ * Function name:   void printJobs(bool verbose)
+ *
+ * Description:     Built-in jobs command. Lists every background job that
+ *                  hasn't been reported yet with its job id, PID, state,
+ *                  elapsed time and command. With -v, also prints the
+ *                  resources used by the job's processes reaped so far.
+ *
+ * Receives:        verbose     bool    True if -v was given
+ ******************************************************************************/
+
+void printJobs(bool verbose) {
+    for(int i = 0; i < job_table.capacity; i++) {
+        Job *job = &job_table.jobs[i];
+        if(job->state == JOB_FREE || !job->background) {
+            continue;
+        }
+        char *state = job->state == JOB_QUEUED ? "queued" :
+                      job->state == JOB_RUNNING ? "running" :
+                      job->state == JOB_STOPPED ? "stopped" : "done";
+        printf("[%d] %d %-7s %9.3fs  %s\n", job->id, job->lastPid, state,
+               jobSeconds(job), job->text);
+        if(verbose) {
+            printf("    ");
+            printJobUsage(job);
+        }
+    }
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   int waitBuiltin(char **args)
+ *
+ * Description:     Built-in wait command. Waits for the background jobs
+ *                  given as %id or PID arguments, or for every background
+ *                  job if none are given. Reports each job when it is done
+ *                  with its exit status and resource usage instead of the
+ *                  usual completion notice.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 if an argument isn't a job
+ ******************************************************************************/
+
+int waitBuiltin(char **args) {
+    // Check every argument names a job before waiting
+    for(int i = 1; args[i]; i++) {
+        if(!findJob(args[i])) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            fflush(stdout);
+            return 1;
+        }
+    }
+
+    while(true) {
+        // Report the waited-for jobs that are done
+        bool running = false;
+        int previous = -1;
+        int index = job_table.doneHead;
+        while(index != -1) {
+            Job *job = &job_table.jobs[index];
+            int next = job->next;
+            bool waited = !args[1];
+            for(int i = 1; args[i] && !waited; i++) {
+                waited = findJob(args[i]) == job;
+            }
+            if(waited) {
+                // Unlink the job from the completion list
+                if(previous == -1) {
+                    job_table.doneHead = next;
+                } else {
+                    job_table.jobs[previous].next = next;
+                }
+                if(job_table.doneTail == index) {
+                    job_table.doneTail = previous;
+                }
+                printf("[%d] %d ", job->id, job->lastPid);
+                printExitValOrSignal(job->status);
+                printf("    ");
+                printJobUsage(job);
+                freeJob(job);
+            } else {
+                previous = index;
+            }
+            index = next;
+        }
+
+        // Stop once none of the waited-for jobs are running
+        for(int i = 0; i < job_table.capacity && !running; i++) {
+            Job *job = &job_table.jobs[i];
+            if((job->state != JOB_RUNNING && job->state != JOB_QUEUED) ||
+               !job->background) {
+                continue;
+            }
+            running = !args[1];
+            for(int j = 1; args[j] && !running; j++) {
+                running = findJob(args[j]) == job;
+            }
+        }
+        if(!running) {
+            drainCaptures();
+            return 0;
+        }
+        int ready = waitEvents(EVENT_BIT(EVENT_CHILD) |
+                               EVENT_BIT(EVENT_SERVER) |
+                               EVENT_BIT(EVENT_CAPTURE) |
+                               EVENT_BIT(EVENT_SIGNAL) |
+                               EVENT_BIT(EVENT_METRICS));
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_SIGNAL))) {
+            drainSignals();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_SERVER))) {
+            closeSpawnServer();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CAPTURE))) {
+            drainCaptures();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_METRICS))) {
+            drainMetricsTimer();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CHILD))) {
+            reapChildren();
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int fgBuiltin(char **args)
+ *
+ * Description:     Built-in fg command: fg [%id | pid]. Continues a stopped
+ *                  or background job in the foreground, handing it the
+ *                  terminal with the modes it stopped with under job
+ *                  control, and waits for it as if it had just been run.
+ *                  Without an argument the current job is used: the one
+ *                  that stopped or was put in the background last.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 if there is no such job
+ ******************************************************************************/
+
+int fgBuiltin(char **args) {
+    Job *job = jobArgument("fg", args);
+    if(!job) {
+        return 1;
+    }
+    printf("%s\n", job->text);
+    fflush(stdout);
+
+    bool handoff = job_control && job->pgid > 0;
+    job->background = false;
+    job_table.running--;
+    if(handoff) {
+        if(job->savedModes) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->modes);
+        }
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    continueJob(job);
+    waitForeground(job, handoff);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int bgBuiltin(char **args)
+ *
+ * Description:     Built-in bg command: bg [%id | pid]. Continues a stopped
+ *                  job in the background, the current job if none is given.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 if there is no such job
+ ******************************************************************************/
+
+int bgBuiltin(char **args) {
+    Job *job = jobArgument("bg", args);
+    if(!job) {
+        return 1;
+    }
+    continueJob(job);
+    job_table.current = job->id - 1;
+    printf("[%d] %s &\n", job->id, job->text);
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   Job *jobArgument(const char *name, char **args)
+ *
+ * Description:     Finds the job fg or bg acts on: the one given as %id or
+ *                  PID, or else the current job, or else the background job
+ *                  started last. Jobs that are queued or done can't be
+ *                  continued, and a forked copy of the shell running in a
+ *                  pipeline has no jobs of its own to control.
+ *
+ * Receives:        name        Name of the built-in, for error messages
+ *                  args        NULL-terminated argument list
+ *
+ * Returns:         Pointer to the job, or NULL after printing an error
+ ******************************************************************************/
+
+Job *jobArgument(const char *name, char **args) {
+    Job *job = NULL;        // Job to act on
+
+    if(getpid() != shell_pid) {
+        fprintf(stderr, "%s: no job control in a pipeline\n", name);
+    } else if(args[1] && args[2]) {
+        fprintf(stderr, "usage: %s [%%id | pid]\n", name);
+    } else if(args[1]) {
+        job = findJob(args[1]);
+        if(!job) {
+            fprintf(stderr, "%s: %s: no such job\n", name, args[1]);
+        }
+    } else {
+        for(int i = 0; i < job_table.capacity; i++) {
+            Job *candidate = &job_table.jobs[i];
+            if((candidate->state != JOB_RUNNING &&
+                candidate->state != JOB_STOPPED) || !candidate->background) {
+                continue;
+            }
+            if(i == job_table.current) {
+                job = candidate;
+                break;
+            }
+            if(!job || candidate->start.tv_sec > job->start.tv_sec ||
+               (candidate->start.tv_sec == job->start.tv_sec &&
+                candidate->start.tv_nsec > job->start.tv_nsec)) {
+                job = candidate;
+            }
+        }
+        if(!job) {
+            fprintf(stderr, "%s: no current job\n", name);
+        }
+    }
+    if(job && (job->state == JOB_QUEUED || job->state == JOB_DONE)) {
+        fprintf(stderr, "%s: job [%d] is %s\n", name, job->id,
+                job->state == JOB_QUEUED ? "queued" : "done");
+        job = NULL;
+    }
+    fflush(stdout);
+    return job;
+}
+
+/*******************************************************************************
+ * Function name:   void continueJob(Job *job)
+ *
+ * Description:     Sends SIGCONT to a job's processes. They are counted as
+ *                  running again straight away so that a wait that follows
+ *                  doesn't take the job for still stopped before the
+ *                  reaper hears that they have continued.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void continueJob(Job *job) {
+    if(job->numStopped > 0) {
+        for(size_t i = 0; i < job_table.pidCapacity; i++) {
+            PidEntry *entry = &job_table.pids[i];
+            if(entry->pid != 0 && entry->job == job->id - 1) {
+                entry->stopped = false;
+            }
+        }
+        job->numStopped = 0;
+    }
+    job->state = JOB_RUNNING;
+    signalJob(job, SIGCONT);
+}
+
+/*******************************************************************************
+ * Function name:   void signalJob(Job *job, int signo)
+ *
+ * Description:     Sends a signal to every process of a job. A job in its
+ *                  own process group, as every job is under job control, is
+ *                  signalled with one killpg(); otherwise the job's
+ *                  processes are found in the PID map.
+ *
+ * Receives:        job         Job struct pointer
+ *                  signo       int     Signal to send
+ ******************************************************************************/
+
+void signalJob(Job *job, int signo) {
+    if(job->pgid > 0) {
+        killpg(job->pgid, signo);
+        return;
+    }
+    for(size_t i = 0; i < job_table.pidCapacity; i++) {
+        PidEntry *entry = &job_table.pids[i];
+        if(entry->pid != 0 && entry->job == job->id - 1) {
+            kill(entry->pid, signo);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   long jobLimit()
+ *
+ * Description:     Returns the number of background jobs allowed to run at
+ *                  once. Unless SMALLSH_MAX_JOBS or "parallel -j" set it,
+ *                  it is one per online CPU, which is only counted the
+ *                  first time a job is throttled since glibc reads it from
+ *                  sysfs.
+ *
+ * Postconditions:  max_jobs is at least 1
+ *
+ * Returns:         max_jobs
+ ******************************************************************************/
+
+long jobLimit() {
+    if(max_jobs == 0) {
+        max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if(max_jobs < 1) {
+            max_jobs = 1;
+        }
+    }
+    return max_jobs;
+}
+
+/*******************************************************************************
+ * Function name:   bool parallelBuiltin(Command *command)
+ *
+ * Description:     Built-in parallel command: parallel [-j N] command ...
+ *                  Removes "parallel" and its options from the first stage
+ *                  so the rest of the line runs as a background job that
+ *                  waits for a free slot. -j N sets the number of background
+ *                  jobs allowed to run at once, which stays in effect for
+ *                  later commands.
+ *
+ * Postconditions:  The command is in background mode unless foreground-only
+ *                  mode is in effect
+ *
+ * Receives:        command     Command struct pointer
+ *
+ * Returns:         true if there is a command to run, false after a usage
+ *                  error has been printed
+ ******************************************************************************/
+
+bool parallelBuiltin(Command *command) {
+    Stage *stage = &command->stages[0];
+    int skip = 1;           // Number of arguments belonging to parallel
+
+    if(stage->args[1] && !strcmp(stage->args[1], "-j")) {
+        char *end = NULL;
+        long limit = stage->args[2] ? strtol(stage->args[2], &end, 10) : 0;
+        if(limit < 1 || *end) {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            fflush(stdout);
+            return false;
+        }
+        max_jobs = limit;
+        skip = 3;
+    }
+    if(skip >= stage->numArgs) {
+        fprintf(stderr, "usage: parallel [-j N] command ...\n");
+        fflush(stdout);
+        return false;
+    }
+
+    stage->args += skip;
+    stage->numArgs -= skip;
+    command->numArgs -= skip;
+    if(!foreground_only) {
+        command->background = true;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   void queueJob(Job *job, Command *command)
+ *
+ * Description:     Stores the command's arguments and redirections in the
+ *                  job and adds the job to the end of the launch queue. The
+ *                  arguments are copied because the command's arena is
+ *                  reused for the next line.
+ *
+ * Preconditions:   job was added for command and hasn't been launched
+ *
+ * Receives:        job         Job struct pointer
+ *                  command     Command struct pointer
+ ******************************************************************************/
+
+void queueJob(Job *job, Command *command) {
+    size_t length = 0;      // Number of bytes needed for the arguments
+
+    for(int i = 0; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        for(int j = 0; j < stage->numArgs; j++) {
+            length += strlen(stage->args[j]) + 2;
+        }
+        for(int j = 0; j < stage->numRedirections; j++) {
+            Redirection *redirection = &stage->redirections[j];
+            if(!redirection->operator) {
+                continue;
+            }
+            length += strlen(redirection->operator) + 2;
+            if(redirection->file) {
+                length += strlen(redirection->file) + 2;
+            }
+        }
+        length++;
+    }
+    length++;               // Terminator after the last stage
+    if(length > job->queuedSize) {
+        job->queued = heapRealloc(job->queued, length);
+        job->queuedSize = length;
+    }
+
+    // Store each argument after a marker byte, then each redirection as its
+    // operator and filename, and mark the end of each stage
+    char *out = job->queued;
+    for(int i = 0; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        for(int j = 0; j < stage->numArgs; j++) {
+            *out++ = operatorToken(stage->args[j]) == stage->args[j]
+                     ? QUEUED_OPERATOR : QUEUED_ARG;
+            out = stpcpy(out, stage->args[j]) + 1;
+        }
+        for(int j = 0; j < stage->numRedirections; j++) {
+            Redirection *redirection = &stage->redirections[j];
+            if(!redirection->operator) {
+                continue;
+            }
+            *out++ = QUEUED_OPERATOR;
+            out = stpcpy(out, redirection->operator) + 1;
+            if(redirection->file) {
+                *out++ = QUEUED_ARG;
+                out = stpcpy(out, redirection->file) + 1;
+            }
+        }
+        *out++ = QUEUED_STAGE_END;
+    }
+    *out = '\0';
+
+    job->state = JOB_QUEUED;
+    job->next = -1;
+    if(job_table.queueTail == -1) {
+        job_table.queueHead = job->id - 1;
+    } else {
+        job_table.jobs[job_table.queueTail].next = job->id - 1;
+    }
+    job_table.queueTail = job->id - 1;
+}
+
+/*******************************************************************************
+ * Function name:   void startQueuedJobs()
+ *
+ * Description:     Launches queued jobs in the order they were queued until
+ *                  max_jobs background jobs are running or the queue is
+ *                  empty. A job none of whose stages could be launched is
+ *                  reported as done straight away.
+ ******************************************************************************/
+
+void startQueuedJobs() {
+    while(job_table.queueHead != -1 && job_table.running < jobLimit()) {
+        Job *job = &job_table.jobs[job_table.queueHead];
+        job_table.queueHead = job->next;
+        if(job_table.queueHead == -1) {
+            job_table.queueTail = -1;
+        }
+
+        // Rebuild the command and launch it
+        if(!queue_command) {
+            queue_command = heapAlloc(sizeof(Command));
+            initCommand(queue_command);
+        }
+        loadQueuedJob(job, queue_command);
+        job->state = JOB_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        launchPipeline(queue_command, job);
+        resetCommand(queue_command);
+
+        if(job->numProcs > 0) {
+            countRunningJob();
+            if(job->client != -1) {
+                replyJobStarted(job);
+            }
+            continue;
+        }
+        job->state = JOB_DONE;
+        job->end = job->start;
+        noticeJobDone(job);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void loadQueuedJob(Job *job, Command *command)
+ *
+ * Description:     Rebuilds the stages of a queued job into a Command struct
+ *                  so that it can be launched.
+ *
+ * Preconditions:   command has been reset and job was stored by queueJob()
+ *
+ * Postconditions:  command holds the job's stages and their redirection
+ *                  plans and is in background mode
+ *
+ * Receives:        job         Job struct pointer
+ *                  command     Command struct pointer
+ ******************************************************************************/
+
+void loadQueuedJob(Job *job, Command *command) {
+    char *in = job->queued;     // Next marker byte in the stored arguments
+    int count = 0;              // Number of arguments and stage ends
+
+    // Make room for every argument before any stage points into the list
+    while(*in) {
+        in += *in == QUEUED_STAGE_END ? 1 : strlen(in + 1) + 2;
+        count++;
+    }
+    reserveArgs(command, count);
+    in = job->queued;
+
+    Stage *stage = &command->stages[0];
+
+    stage->args = command->args;
+    stage->numArgs = 0;
+    while(true) {
+        if(*in == QUEUED_OPERATOR) {
+            command->args[command->numArgs++] = operatorToken(in + 1);
+            stage->numArgs++;
+            in += strlen(in + 1) + 2;
+            continue;
+        }
+        if(*in == QUEUED_ARG) {
+            size_t length = strlen(in + 1);
+            char *arg = arenaAlloc(&command->arena, length + 1);
+            command->args[command->numArgs++] = memcpy(arg, in + 1,
+                                                       length + 1);
+            stage->numArgs++;
+            in += length + 2;
+            continue;
+        }
+        // End the stage, and stop after the last one
+        command->args[command->numArgs++] = NULL;
+        command->numStages++;
+        in++;
+        if(*in != QUEUED_ARG && *in != QUEUED_OPERATOR) {
+            break;
+        }
+        stage = &command->stages[command->numStages];
+        stage->args = &command->args[command->numArgs];
+        stage->numArgs = 0;
+    }
+    command->numArgs--;
+    command->background = true;
+
+    // Plan the redirections again, which can't fail since they were planned
+    // when the line was parsed
+    for(int i = 0; i < command->numStages; i++) {
+        planRedirections(command, &command->stages[i]);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void storeJobList(Job *job, Command *command, int first)
+ *
+ * Description:     Stores the pipelines of a control request's list from
+ *                  first on in the job, to run once the job is done. They
+ *                  are stored as the words they were parsed from, so
+ *                  loadJobList() splits them again, and are copied because
+ *                  the command's arena is reused for the next line.
+ *
+ * Preconditions:   command->stages holds the stages of the whole list
+ *
+ * Receives:        job         Job struct pointer
+ *                  command     Command struct pointer
+ *                  first       int     Index of the first pipeline to store
+ ******************************************************************************/
+
+void storeJobList(Job *job, Command *command, int first) {
+    size_t length = 1;      // Number of bytes needed, with the terminator
+
+    // Each stage is followed by an operator of up to 2 characters
+    int firstStage = command->pipelines[first].firstStage;
+    for(int i = firstStage; i < command->numStages; i++) {
+        Stage *stage = &command->stages[i];
+        for(int j = 0; j < stage->numArgs; j++) {
+            length += strlen(stage->args[j]) + 2;
+        }
+        for(int j = 0; j < stage->numRedirections; j++) {
+            Redirection *redirection = &stage->redirections[j];
+            if(!redirection->operator) {
+                continue;
+            }
+            length += strlen(redirection->operator) + 2;
+            if(redirection->file) {
+                length += strlen(redirection->file) + 2;
+            }
+        }
+        length += 4;
+    }
+    if(length > job->restSize) {
+        job->rest = heapRealloc(job->rest, length);
+        job->restSize = length;
+    }
+
+    // Store each stage's arguments, then its redirections, then the
+    // operator that ends it
+    char *out = job->rest;
+    for(int p = first; p < command->numPipelines; p++) {
+        Pipeline *pipeline = &command->pipelines[p];
+        for(int i = 0; i < pipeline->numStages; i++) {
+            Stage *stage = &command->stages[pipeline->firstStage + i];
+            for(int j = 0; j < stage->numArgs; j++) {
+                *out++ = QUEUED_ARG;
+                out = stpcpy(out, stage->args[j]) + 1;
+            }
+            for(int j = 0; j < stage->numRedirections; j++) {
+                Redirection *redirection = &stage->redirections[j];
+                if(!redirection->operator) {
+                    continue;
+                }
+                *out++ = QUEUED_OPERATOR;
+                out = stpcpy(out, redirection->operator) + 1;
+                if(redirection->file) {
+                    *out++ = QUEUED_ARG;
+                    out = stpcpy(out, redirection->file) + 1;
+                }
+            }
+
+            const char *operator = NULL;    // Operator after the stage
+            if(i < pipeline->numStages - 1) {
+                operator = pipe_operator;
+            } else if(pipeline->background) {
+                operator = background_operator;
+            } else if(p < command->numPipelines - 1) {
+                ListOperator joiner = command->pipelines[p + 1].joiner;
+                operator = joiner == LIST_AND ? and_operator
+                           : joiner == LIST_OR ? or_operator
+                           : sequence_operator;
+            }
+            if(operator) {
+                *out++ = QUEUED_OPERATOR;
+                out = stpcpy(out, operator) + 1;
+            }
+        }
+    }
+    *out = '\0';
+    job->restJoiner = command->pipelines[first].joiner;
+    job->hasRest = true;
+}
+
+/*******************************************************************************
+ * Function name:   void loadJobList(Job *job, Command *command)
+ *
+ * Description:     Rebuilds the pipelines stored by storeJobList() into a
+ *                  Command struct, splitting them into stages again.
+ *
+ * Preconditions:   command has been reset and job->hasRest is true
+ *
+ * Postconditions:  command holds the pipelines, the first of them joined to
+ *                  the job the way it was on the line
+ *
+ * Receives:        job         Job struct pointer
+ *                  command     Command struct pointer
+ ******************************************************************************/
+
+void loadJobList(Job *job, Command *command) {
+    int count = 0;          // Number of words
+
+    for(char *in = job->rest; *in; in += strlen(in + 1) + 2) {
+        count++;
+    }
+    reserveArgs(command, count);
+    char *in = job->rest;   // Next marker byte in the stored words
+    while(*in) {
+        size_t length = strlen(in + 1);
+        if(*in == QUEUED_OPERATOR) {
+            command->args[command->numArgs++] = operatorToken(in + 1);
+        } else {
+            char *arg = arenaAlloc(&command->arena, length + 1);
+            command->args[command->numArgs++] = memcpy(arg, in + 1,
+                                                       length + 1);
+        }
+        in += length + 2;
+    }
+    command->args[command->numArgs] = NULL;
+
+    // The words were split and planned when the line was parsed, so this
+    // can't fail
+    splitStages(command);
+    command->pipelines[0].joiner = job->restJoiner;
+}
+
+/*******************************************************************************
+ * Function name:   void continueLists()
+ *
+ * Description:     Runs the rest of the list of each job on the list queue,
+ *                  in the order the jobs finished, with its job's status
+ *                  as the status the first pipeline's joiner tests, and
+ *                  frees the job. A list whose client has disconnected is
+ *                  dropped. Running a list can finish more jobs, as wait
+ *                  does, so a call made while lists are running leaves
+ *                  them to the running one.
+ ******************************************************************************/
+
+void continueLists() {
+    if(list_running) {
+        return;
+    }
+    list_running = true;
+    while(job_table.listHead != -1) {
+        Job *job = &job_table.jobs[job_table.listHead];
+        job_table.listHead = job->next;
+        if(job_table.listHead == -1) {
+            job_table.listTail = -1;
+        }
+
+        // Rebuild the rest of the list and free the job before running it
+        if(!list_command) {
+            list_command = heapAlloc(sizeof(Command));
+            initCommand(list_command);
+        }
+        int client = job->client;   // Client the list runs for
+        int status = job->status;   // Status the next pipeline tests
+        if(client != -1) {
+            loadJobList(job, list_command);
+        }
+        job->hasRest = false;
+        freeJob(job);
+        if(client == -1) {
+            continue;
+        }
+
+        int runningClient = control_table.client;   // Request running now
+        bool replied = control_table.replied;
+        control_table.client = client;
+        int result = runList(list_command, status);
+        control_table.client = runningClient;
+        control_table.replied = replied;
+        resetCommand(list_command);
+        if(result == -1) {
+            closeControlClient(client);
+        }
+    }
+    list_running = false;
+}
+
+/*******************************************************************************
+ * Function name:   void reapChildren()
+ *
+ * Description:     Consumes pending SIGCHLD notifications from sigchld_fd and
+ *                  reaps every terminated child with wait4() without
+ *                  blocking. Each child's status and resource usage are
+ *                  recorded in its job; a job whose last process has
+ *                  terminated is marked done with its finish time and, if it
+ *                  is a background job, reported by noticeJobDone().
+ *                  Under job control, children that stop or continue are
+ *                  reported too, and a job whose remaining processes have
+ *                  all stopped is marked stopped. Queued jobs are then
+ *                  launched into any freed slots, and the lists of control
+ *                  requests whose jobs are done carry on.
+ ******************************************************************************/
+
+void reapChildren() {
+    struct signalfd_siginfo info[SIGNAL_BATCH]; // Pending notifications
+    struct rusage usage;    // Resources used by the child
+    pid_t pid;              // PID of child process
+    int status;             // Exit status of child
+    int options = WNOHANG | (job_control ? WUNTRACED | WCONTINUED : 0);
+    uint64_t woken = clockNanoseconds(CLOCK_MONOTONIC); // Start of the pass
+
+    // Signals of the same kind coalesce, so the notifications only say that
+    // some children are ready; wait4() finds each of them
+    while(read(sigchld_fd, info, sizeof(info)) > 0) {
+        continue;
+    }
+
+    while((pid = wait4(-1, &status, options, &usage)) > 0) {
+        if(WIFSTOPPED(status) || WIFCONTINUED(status)) {
+            stopJobProcess(pid, status);
+            continue;
+        }
+        recordHistogram(&metrics.reap,
+                        clockNanoseconds(CLOCK_MONOTONIC) - woken);
+        Job *job = takeJobProcess(pid);
+        if(!job) {
+            continue;
+        }
+        addUsage(&job->usage, &usage);
+        if(pid == job->lastPid) {
+            job->status = status;
+        }
+        if(--job->numProcs == 0) {
+            job->state = JOB_DONE;
+            clock_gettime(CLOCK_MONOTONIC, &job->end);
+            if(job->background) {
+                job_table.running--;
+                noticeJobDone(job);
+            }
+        } else {
+            checkJobStopped(job);
+        }
+    }
+
+    // Launch queued jobs into the slots that have freed up, then go on
+    // with the lists of the jobs that are done
+    startQueuedJobs();
+    continueLists();
+}
+
+/*******************************************************************************
+ * Function name:   void stopJobProcess(pid_t pid, int status)
+ *
+ * Description:     Records that a child has stopped or continued, and
+ *                  whether that stops or restarts its job.
+ *
+ * Receives:        pid         PID of the child
+ *                  status      int     Status wait4() reported for it
+ ******************************************************************************/
+
+void stopJobProcess(pid_t pid, int status) {
+    PidEntry *entry = findJobProcess(pid);
+    if(!entry) {
+        return;
+    }
+    Job *job = &job_table.jobs[entry->job];
+    bool stopped = WIFSTOPPED(status);
+    if(stopped != entry->stopped) {
+        entry->stopped = stopped;
+        job->numStopped += stopped ? 1 : -1;
+    }
+    if(stopped) {
+        job->stopSignal = WSTOPSIG(status);
+    }
+    checkJobStopped(job);
+}
+
+/*******************************************************************************
+ * Function name:   void checkJobStopped(Job *job)
+ *
+ * Description:     Marks a running job stopped once every process it has
+ *                  left is stopped, and a stopped one running again once
+ *                  any of them has been continued from outside the shell. A
+ *                  background job that stops becomes the current job and is
+ *                  reported with the next completion notices.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void checkJobStopped(Job *job) {
+    if(job->state == JOB_RUNNING && job->numStopped == job->numProcs) {
+        job->state = JOB_STOPPED;
+        if(job->background) {
+            job->stopNotice = true;
+            job_table.stopNotices++;
+            job_table.current = job->id - 1;
+        }
+    } else if(job->state == JOB_STOPPED && job->numStopped < job->numProcs) {
+        job->state = JOB_RUNNING;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void initEventLoop()
+ *
+ * Description:     Sets up the event loop the shell waits on for input,
+ *                  child notifications and the spawn server. Only the FDs
+ *                  are recorded here: the io_uring or epoll set is created
+ *                  by openEventLoop() the first time the shell has to
+ *                  block, which a script read from a file that runs no
+ *                  program never does.
+ *
+ * Preconditions:   initReaper() has created sigchld_fd
+ *
+ * Postconditions:  event_loop watches sigchld_fd, the signal ring's eventfd
+ *                  and, if it is running, the spawn server's socket
+ ******************************************************************************/
+
+void initEventLoop() {
+    watchEvents(EVENT_CHILD, sigchld_fd);
+    watchEvents(EVENT_SERVER, spawn_server_fd);
+    watchEvents(EVENT_SIGNAL, signal_ring.wakeFD);
+}
+
+/*******************************************************************************
+ * Function name:   void openEventLoop()
+ *
+ * Description:     Creates the kernel side of the event loop. io_uring is
+ *                  used unless SMALLSH_EVENTS is "epoll" or the kernel
+ *                  refuses to set one up, in which case epoll is used.
+ *
+ * Postconditions:  event_loop.fd is the io_uring or epoll FD, with no
+ *                  source armed yet
+ ******************************************************************************/
+
+void openEventLoop() {
+    char *backend = getenv(EVENTS_VAR);
+    if(!(backend && !strcmp(backend, "epoll")) && initUring()) {
+        event_loop.backend = EVENTS_URING;
+    } else {
+        event_loop.backend = EVENTS_EPOLL;
+        event_loop.fd = epoll_create1(EPOLL_CLOEXEC);
+        if(event_loop.fd == -1) {
+            perror("epoll_create1()");
+            exit(1);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   bool initUring()
+ *
+ * Description:     Creates an io_uring with URING_ENTRIES entries and maps
+ *                  its submission and completion rings into event_loop.
+ *
+ * Returns:         true if the io_uring is ready, false if it couldn't be
+ *                  set up
+ ******************************************************************************/
+
+bool initUring() {
+    struct io_uring_params params;  // Ring layout filled in by the kernel
+
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+    if(fd == -1) {
+        return false;
+    }
+
+    // Map both rings, which share one mapping on kernels that allow it
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && cqSize > sqSize) {
+        sqSize = cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if(sq != MAP_FAILED && !single) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if(sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+    }
+    if(sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    event_loop.fd = fd;
+    event_loop.sqHead = (unsigned*)(sq + params.sq_off.head);
+    event_loop.sqTail = (unsigned*)(sq + params.sq_off.tail);
+    event_loop.sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    event_loop.sqArray = (unsigned*)(sq + params.sq_off.array);
+    event_loop.sqes = sqes;
+    event_loop.cqHead = (unsigned*)(cq + params.cq_off.head);
+    event_loop.cqTail = (unsigned*)(cq + params.cq_off.tail);
+    event_loop.cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    event_loop.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   void watchEvents(EventSource source, int fd)
+ *
+ * Description:     Sets the FD the event loop watches for source. A regular
+ *                  file is never waited on, since it can always be read.
+ *                  With epoll, the old FD is removed from the epoll set; an
+ *                  io_uring poll still pending on it completes or is
+ *                  dropped when the FD is closed.
+ *
+ * Preconditions:   initEventLoop() has been called
+ *
+ * Receives:        source      EventSource the FD belongs to
+ *                  fd          int     FD to watch, or -1 to stop watching
+ ******************************************************************************/
+
+void watchEvents(EventSource source, int fd) {
+    struct stat info;       // Type of the new FD
+
+    if(event_loop.fds[source] == fd) {
+        return;
+    }
+    if(event_loop.backend == EVENTS_EPOLL && event_loop.armed[source]) {
+        epoll_ctl(event_loop.fd, EPOLL_CTL_DEL, event_loop.fds[source],
+                  NULL);
+        event_loop.armed[source] = false;
+    }
+    event_loop.fds[source] = fd;
+    event_loop.alwaysReady[source] = fd != -1 && fstat(fd, &info) == 0 &&
+                                     S_ISREG(info.st_mode);
+    if(event_loop.backend == EVENTS_URING) {
+        event_loop.armed[source] = false;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int waitEvents(unsigned wanted)
+ *
+ * Description:     Waits until at least one of the wanted sources is ready.
+ *                  Readiness reported for a source outside wanted is
+ *                  dropped; it is reported again the next time the source
+ *                  is wanted if it still holds.
+ *
+ * Preconditions:   initEventLoop() has been called
+ *
+ * Receives:        wanted      unsigned    EVENT_BIT() of each source to
+ *                                          wait on
+ *
+ * Returns:         EVENT_BIT() of each ready source, or -1 with errno set
+ *                  if the wait failed or a signal interrupted it
+ ******************************************************************************/
+
+int waitEvents(unsigned wanted) {
+    // Don't wait on a source that is never watched
+    unsigned ready = 0;
+    for(int source = 0; source < EVENT_SOURCES; source++) {
+        if(event_loop.fds[source] == -1) {
+            wanted &= ~EVENT_BIT(source);
+        } else if(event_loop.alwaysReady[source]) {
+            ready |= wanted & EVENT_BIT(source);
+        }
+    }
+    if(ready) {
+        return (int)ready;
+    }
+    if(!wanted) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(event_loop.fd == -1) {
+        openEventLoop();
+    }
+    event_loop.waits++;
+    return event_loop.backend == EVENTS_URING ? waitUring(wanted)
+                                              : waitEpoll(wanted);
+}
+
+/*******************************************************************************
+ * Function name:   int waitEpoll(unsigned wanted)
+ *
+ * Description:     epoll back end of waitEvents(). Child notifications and
+ *                  the spawn server stay in the epoll set once added; the
+ *                  input is added one-shot and re-armed each time it is
+ *                  wanted.
+ *
+ * Receives:        wanted      unsigned    EVENT_BIT() of each source to
+ *                                          wait on
+ *
+ * Returns:         EVENT_BIT() of each ready source, or -1 with errno set
+ ******************************************************************************/
+
+int waitEpoll(unsigned wanted) {
+    struct epoll_event events[EVENT_SOURCES];   // Sources that are ready
+    static bool added[EVENT_SOURCES];   // True once a source is in the set
+
+    for(int source = 0; source < EVENT_SOURCES; source++) {
+        if(!(wanted & EVENT_BIT(source)) || event_loop.armed[source]) {
+            continue;
+        }
+        struct epoll_event event = {EPOLLIN, {.u32 = source}};
+        if(source == EVENT_INPUT) {
+            event.events |= EPOLLONESHOT;
+        }
+        int operation = added[source] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if(epoll_ctl(event_loop.fd, operation, event_loop.fds[source],
+                     &event) == -1 &&
+           (errno != EEXIST ||
+            epoll_ctl(event_loop.fd, EPOLL_CTL_MOD, event_loop.fds[source],
+                      &event) == -1)) {
+            return -1;
+        }
+        added[source] = source == EVENT_INPUT;
+        event_loop.armed[source] = true;
+    }
+
+    unsigned ready = 0;
+    while(!ready) {
+        int count = epoll_wait(event_loop.fd, events, EVENT_SOURCES, -1);
+        if(count == -1) {
+            return -1;
+        }
+        for(int i = 0; i < count; i++) {
+            if(events[i].data.u32 == EVENT_INPUT) {
+                event_loop.armed[EVENT_INPUT] = false;
+            }
+            ready |= wanted & EVENT_BIT(events[i].data.u32);
+        }
+    }
+    return (int)ready;
+}
+
+/*******************************************************************************
+ * Function name:   int waitUring(unsigned wanted)
+ *
+ * Description:     io_uring back end of waitEvents(). Queues a one-shot
+ *                  IORING_OP_POLL_ADD for each wanted source that isn't
+ *                  armed, then submits them and waits for a completion with
+ *                  a single io_uring_enter(). Completions left over from
+ *                  earlier waits only disarm their source, since what they
+ *                  report may no longer hold.
+ *
+ * Receives:        wanted      unsigned    EVENT_BIT() of each source to
+ *                                          wait on
+ *
+ * Returns:         EVENT_BIT() of each ready source, or -1 with errno set
+ ******************************************************************************/
+
+int waitUring(unsigned wanted) {
+    unsigned ready = 0;     // Sources that completed during this wait
+    bool waited = false;    // True once io_uring_enter() has been called
+
+    while(true) {
+        // Reap completions, which disarm their source
+        unsigned completed = 0;
+        unsigned head = *event_loop.cqHead;
+        while(head != __atomic_load_n(event_loop.cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe =
+                &event_loop.cqes[head & *event_loop.cqMask];
+            event_loop.armed[cqe->user_data] = false;
+            if(waited) {
+                ready |= wanted & EVENT_BIT(cqe->user_data);
+            }
+            completed++;
+            head++;
+        }
+        __atomic_store_n(event_loop.cqHead, head, __ATOMIC_RELEASE);
+        if(ready) {
+            return (int)ready;
+        }
+        // The kernel returns the number submitted rather than EINTR when a
+        // signal interrupts the wait after a submission
+        if(waited && !completed) {
+            errno = EINTR;
+            return -1;
+        }
+
+        // Arm the wanted sources
+        for(int source = 0; source < EVENT_SOURCES; source++) {
+            if(!(wanted & EVENT_BIT(source)) || event_loop.armed[source]) {
+                continue;
+            }
+            unsigned tail = *event_loop.sqTail;
+            unsigned index = tail & *event_loop.sqMask;
+            struct io_uring_sqe *sqe = &event_loop.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = event_loop.fds[source];
+            sqe->poll32_events = POLLIN;
+            sqe->user_data = (uint64_t)source;
+            event_loop.sqArray[index] = index;
+            __atomic_store_n(event_loop.sqTail, tail + 1, __ATOMIC_RELEASE);
+            event_loop.queued++;
+            event_loop.armed[source] = true;
+        }
+
+        // Submit and wait in one call
+        int result = (int)syscall(SYS_io_uring_enter, event_loop.fd,
+                                  event_loop.queued, 1,
+                                  IORING_ENTER_GETEVENTS, NULL, 0);
+        if(result == -1) {
+            return -1;
+        }
+        event_loop.queued -= (unsigned)result;
+        waited = true;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void waitForJob(Job *job)
+ *
+ * Description:     Waits for every process of a foreground job to terminate,
+ *                  or for the job to stop. Background children that finish
+ *                  in the meantime are
+ *                  reaped as soon as they terminate rather than after the
+ *                  foreground job, and captured output is logged as it
+ *                  arrives, so a job never blocks on a full capture pipe.
+ *                  What is left in the pipes is logged before returning.
+ *
+ * Postconditions:  The job is done and job->status holds its exit status, or
+ *                  the job is stopped
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void waitForJob(Job *job) {
+    reapChildren();
+    while(job->state == JOB_RUNNING) {
+        // Restart the wait if it is interrupted by a signal
+        int ready = waitEvents(EVENT_BIT(EVENT_CHILD) |
+                               EVENT_BIT(EVENT_SERVER) |
+                               EVENT_BIT(EVENT_CAPTURE) |
+                               EVENT_BIT(EVENT_SIGNAL) |
+                               EVENT_BIT(EVENT_METRICS));
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_SIGNAL))) {
+            drainSignals();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_SERVER))) {
+            closeSpawnServer();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CAPTURE))) {
+            drainCaptures();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_METRICS))) {
+            drainMetricsTimer();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CHILD))) {
+            reapChildren();
+        }
+    }
+    drainCaptures();
+}
+
+/*******************************************************************************
+ * Function name:   void waitForeground(Job *job, bool handoff)
+ *
+ * Description:     Waits for a foreground job and takes the terminal back
+ *                  from it. A job that is done has its status kept for the
+ *                  status command and is freed, with its signal number
+ *                  shown if a signal terminated it. A job that stopped, as
+ *                  Ctrl-Z does under job control, is reported and carries
+ *                  on as a background job that fg or bg can continue; the
+ *                  terminal modes it had are kept for fg to give back.
+ *
+ * Receives:        job         Job struct pointer
+ *                  handoff     bool    True if the terminal was handed to
+ *                                      the job's process group
+ ******************************************************************************/
+
+void waitForeground(Job *job, bool handoff) {
+    uint64_t waitStart = traceNow();
+    waitForJob(job);
+    traceRecord(TRACE_WAIT, waitStart);
+
+    // Take the terminal back from the job's process group
+    if(handoff) {
+        if(job->state == JOB_STOPPED) {
+            job->savedModes = tcgetattr(STDIN_FILENO, &job->modes) == 0;
+        }
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        if(job_control) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_modes);
+        }
+    }
+
+    if(job->state == JOB_STOPPED) {
+        job->background = true;
+        countRunningJob();
+        job_table.current = job->id - 1;
+        fg_status = W_STOPCODE(job->stopSignal);
+        printf("\n");
+        printJobStopped(job);
+        return;
+    }
+    fg_status = job->status;
+    last_fg_job = *job;
+    freeJob(job);
+    // Display signal number if terminated by signal
+    if(WIFSIGNALED(fg_status)) {
+        printf("terminated by signal %d\n", WTERMSIG(fg_status));
+        fflush(stdout);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   bool waitForInput(int fd)
+ *
+ * Description:     Waits until fd has input to read. Children that terminate
+ *                  in the meantime are reaped straight away and, in
+ *                  interactive mode, reported before the prompt is printed
+ *                  again. Captured output is logged as it arrives.
+ *
+ * Receives:        fd          int     File descriptor input is read from
+ *
+ * Returns:         false if a signal interrupted the wait, true otherwise
+ ******************************************************************************/
+
+bool waitForInput(int fd) {
+    watchEvents(EVENT_INPUT, fd);
+    while(true) {
+        int ready = waitEvents(EVENT_BIT(EVENT_INPUT) |
+                               EVENT_BIT(EVENT_CHILD) |
+                               EVENT_BIT(EVENT_SERVER) |
+                               EVENT_BIT(EVENT_CAPTURE) |
+                               EVENT_BIT(EVENT_SIGNAL) |
+                               EVENT_BIT(EVENT_CONTROL) |
+                               EVENT_BIT(EVENT_METRICS));
+        if(ready == -1 && errno != EINTR) {
+            return true;
+        }
+        // A signal interrupts the read once the main loop has acted on it
+        if(ready == -1 || (ready & EVENT_BIT(EVENT_SIGNAL))) {
+            drainSignals();
+            errno = EINTR;
+            return false;
+        }
+        if(ready & EVENT_BIT(EVENT_SERVER)) {
+            closeSpawnServer();
+        }
+        if(ready & EVENT_BIT(EVENT_CAPTURE)) {
+            drainCaptures();
+        }
+        if(ready & EVENT_BIT(EVENT_CHILD)) {
+            reapChildren();
+            if(interactive && printBackgroundNotices()) {
+                printf("%s", PROMPT);
+                fflush(stdout);
+            }
+        }
+        if(ready & EVENT_BIT(EVENT_CONTROL)) {
+            drainControl();
+        }
+        if(ready & EVENT_BIT(EVENT_METRICS)) {
+            drainMetricsTimer();
+        }
+        if(ready & EVENT_BIT(EVENT_INPUT)) {
+            return true;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   bool printBackgroundNotices()
+ *
+ * Description:     Prints a notification for each background job that has
+ *                  stopped since the last notifications, then for each one
+ *                  that has completed, in the order they completed,
+ *                  including the PID and either exit status or signal
+ *                  number, and frees the completed jobs.
+ *
+ * Returns:         true if any notification was printed
+ ******************************************************************************/
+
+bool printBackgroundNotices() {
+    bool printed = false;
+
+    // Background jobs stop when they read from the terminal, for example
+    if(job_table.stopNotices > 0) {
+        for(int i = 0; i < job_table.capacity; i++) {
+            Job *job = &job_table.jobs[i];
+            if(job->state == JOB_STOPPED && job->stopNotice) {
+                printJobStopped(job);
+                printed = true;
+            }
+            if(job->state != JOB_FREE) {
+                job->stopNotice = false;
+            }
+        }
+        job_table.stopNotices = 0;
+    }
+
+    while(job_table.doneHead != -1) {
+        Job *job = &job_table.jobs[job_table.doneHead];
+        job_table.doneHead = job->next;
+        printf("Background pid %d is done: ", job->lastPid);
+        printExitValOrSignal(job->status);
+        freeJob(job);
+        printed = true;
+    }
+    job_table.doneTail = -1;
+    return printed;
+}
+
+/*******************************************************************************
+ * Function name:   void printJobStopped(Job *job)
+ *
+ * Description:     Prints that a job has stopped, with its job id, PID,
+ *                  the signal that stopped it and its command.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void printJobStopped(Job *job) {
+    printf("[%d] %d stopped by signal %d  %s\n", job->id, job->lastPid,
+           job->stopSignal, job->text);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void checkBackgroundChildren()
+ *
+ * Description:     Checks for any child processes that have terminated. If
+ *                  a background job has completed, prints a notification
+ *                  including PID and either exit status or signal number.
+ ******************************************************************************/
+
+void checkBackgroundChildren() {
+    reapChildren();
+    printBackgroundNotices();
+}
+
+/*******************************************************************************
+ * Function name:   void initSignalRing()
+ *
+ * Description:     Opens the eventfd signal handlers wake the event loop
+ *                  with.
+ *
+ * Postconditions:  signal_ring.wakeFD is open
+ ******************************************************************************/
+
+void initSignalRing() {
+    signal_ring.wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(signal_ring.wakeFD == -1) {
+        perror("eventfd()");
+        exit(1);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void catchSignal(int signo)
+ *
+ * Description:     Catches a signal with queueSignal(), blocking every other
+ *                  signal while it runs so that handlers never interrupt
+ *                  each other.
+ *
+ * Receives:        signo       int     Signal to catch
+ ******************************************************************************/
+
+void catchSignal(int signo) {
+    struct sigaction action = {{0}};    // Queue the signal with all blocked
+
+    action.sa_handler = queueSignal;
+    sigfillset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(signo, &action, NULL);
+}
+
+/*******************************************************************************
+ * Function name:   void queueSignal(int signo)
+ *
+ * Description:     Signal handler for every caught signal. Adds the signal
+ *                  to the ring, or counts it if the ring is full, and writes
+ *                  to the eventfd if the main loop hasn't been woken since
+ *                  it last drained the ring. Only atomic loads and stores
+ *                  and write() are used, which are async-signal-safe, and
+ *                  errno is preserved.
+ *
+ * Receives:        signo       int     Signal caught
+ ******************************************************************************/
+
+void queueSignal(int signo) {
+    int savedErrno = errno;
+    unsigned tail = signal_ring.tail;
+    unsigned head = __atomic_load_n(&signal_ring.head, __ATOMIC_ACQUIRE);
+
+    if(tail - head < SIGNAL_RING_SIZE) {
+        signal_ring.signals[tail & (SIGNAL_RING_SIZE - 1)] = signo;
+        __atomic_store_n(&signal_ring.tail, tail + 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_add(&signal_ring.overflow[signo], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&signal_ring.overflowed, 1, __ATOMIC_RELEASE);
+    }
+    if(!__atomic_exchange_n(&signal_ring.woken, 1, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        write(signal_ring.wakeFD, &one, sizeof(one));
+    }
+    errno = savedErrno;
+}
+
+/*******************************************************************************
+ * Function name:   void drainSignals()
+ *
+ * Description:     Acts on every signal the handler has queued, in the
+ *                  order they were caught, taking SIGNAL_DRAIN_BATCH off the
+ *                  ring at a time so that the handler has room again before
+ *                  they are acted on, then on the signals that were counted
+ *                  while the ring was full. The eventfd is read and the
+ *                  wakeup cleared first, so a signal caught during the drain
+ *                  wakes the event loop again.
+ ******************************************************************************/
+
+void drainSignals() {
+    int batch[SIGNAL_DRAIN_BATCH];  // Signals taken off the ring
+    uint64_t wakeups;               // Value read from the eventfd
+
+    read(signal_ring.wakeFD, &wakeups, sizeof(wakeups));
+    __atomic_store_n(&signal_ring.woken, 0, __ATOMIC_SEQ_CST);
+    while(true) {
+        unsigned head = signal_ring.head;
+        unsigned tail = __atomic_load_n(&signal_ring.tail, __ATOMIC_ACQUIRE);
+        unsigned count = tail - head;
+        if(count == 0) {
+            break;
+        }
+        if(count > SIGNAL_DRAIN_BATCH) {
+            count = SIGNAL_DRAIN_BATCH;
+        }
+        for(unsigned i = 0; i < count; i++) {
+            batch[i] = signal_ring.signals[(head + i) &
+                                           (SIGNAL_RING_SIZE - 1)];
+        }
+        __atomic_store_n(&signal_ring.head, head + count, __ATOMIC_RELEASE);
+        for(unsigned i = 0; i < count; i++) {
+            handleSignal(batch[i]);
+        }
+    }
+
+    // Signals that found the ring full
+    if(__atomic_exchange_n(&signal_ring.overflowed, 0, __ATOMIC_ACQ_REL)) {
+        for(int signo = 1; signo < NSIG; signo++) {
+            unsigned missed = __atomic_exchange_n(&signal_ring.overflow[signo],
+                                                  0, __ATOMIC_ACQ_REL);
+            signal_ring.coalesced += missed;
+            while(missed-- > 0) {
+                handleSignal(signo);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void handleSignal(int signo)
+ *
+ * Description:     Acts on a caught signal in the main loop, where anything
+ *                  may be called. SIGTSTP toggles foreground-only mode.
+ *                  SIGTERM, caught while there is a control socket, removes
+ *                  the socket and then terminates the shell as SIGTERM would
+ *                  have.
+ *
+ * Receives:        signo       int     Signal caught
+ ******************************************************************************/
+
+void handleSignal(int signo) {
+    signal_ring.handled++;
+    if(signo == SIGTSTP) {
+        toggleForegroundOnly();
+    } else if(signo == SIGTERM) {
+        struct sigaction default_action = {{0}};
+        default_action.sa_handler = SIG_DFL;
+        closeControl();
+        closeCaptures();
+        sigaction(SIGTERM, &default_action, NULL);
+        raise(SIGTERM);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void toggleForegroundOnly()
+ *
+ * Description:     Toggles between foreground-only mode and regular mode
+ *                  when SIGTSTP reaches the shell.
+ *
+ * Postconditions:  Global variable foreground_only has been toggled to its
+ *                  opposite value.
+ ******************************************************************************/
+
+void toggleForegroundOnly() {
+    foreground_only = !foreground_only;
+    printf(foreground_only
+           ? "\nEntering foreground-only mode (& is now ignored)\n"
+           : "\nExiting foreground-only mode\n");
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * Function name:   void openControl()
+ *
+ * Description:     Opens the control socket named by SMALLSH_CONTROL, if
+ *                  set: a Unix socket at that path, or a TCP socket for an
+ *                  address of the form tcp:[HOST:]PORT, on 127.0.0.1 if no
+ *                  host is given. A Unix socket is made readable and
+ *                  writable by its owner only. Clients connect and send
+ *                  command lines as frames, which the shell runs between
+ *                  the commands it reads itself. SIGTERM is caught so that
+ *                  the socket file is removed when the shell is stopped.
+ *
+ * Preconditions:   initEventLoop() and initSignalRing() have been called
+ *
+ * Postconditions:  The event loop watches the control socket, or the error
+ *                  has been printed and the shell runs without one
+ ******************************************************************************/
+
+void openControl() {
+    char *address = getenv(CONTROL_VAR);
+    if(!address || !*address) {
+        return;
+    }
+    int fd = bindControl(address);
+    if(fd == -1) {
+        return;
+    }
+
+    control_table.epollFD = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {EPOLLIN, {.u32 = 0}};
+    if(control_table.epollFD == -1 ||
+       epoll_ctl(control_table.epollFD, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("control socket epoll");
+        fflush(stdout);
+        close(fd);
+        return;
+    }
+    control_table.listenFD = fd;
+    watchEvents(EVENT_CONTROL, control_table.epollFD);
+    catchSignal(SIGTERM);
+}
+
+/*******************************************************************************
+ * Function name:   int bindControl(const char *address)
+ *
+ * Description:     Creates a non-blocking listening socket for a control
+ *                  socket address. A socket file left at a Unix socket's
+ *                  path by an earlier shell is replaced; any other file
+ *                  there is an error.
+ *
+ * Receives:        address     Path or tcp:[HOST:]PORT
+ *
+ * Returns:         The listening socket, or -1 after the error has been
+ *                  printed
+ ******************************************************************************/
+
+int bindControl(const char *address) {
+    int fd = -1;            // Listening socket
+
+    if(!strncmp(address, CONTROL_TCP_PREFIX, strlen(CONTROL_TCP_PREFIX))) {
+        char host[NI_MAXHOST] = CONTROL_HOST;   // Host to bind
+        const char *port = address + strlen(CONTROL_TCP_PREFIX);
+        const char *colon = strrchr(port, ':');
+        if(colon && colon > port && (size_t)(colon - port) < sizeof(host)) {
+            // An IPv6 address is written in brackets before its port
+            size_t length = colon - port;
+            if(port[0] == '[' && port[length - 1] == ']') {
+                port++;
+                length -= 2;
+            }
+            memcpy(host, port, length);
+            host[length] = '\0';
+        }
+        port = colon ? colon + 1 : port;
+
+        struct addrinfo hints;      // A passive TCP socket is wanted
+        struct addrinfo *found;     // Addresses the host resolves to
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int result = getaddrinfo(host, port, &hints, &found);
+        if(result != 0) {
+            fprintf(stderr, "smallsh: %s: %s\n", address,
+                    gai_strerror(result));
+            fflush(stdout);
+            return -1;
+        }
+        for(struct addrinfo *info = found; info && fd == -1;
+            info = info->ai_next) {
+            int one = 1;
+            fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK |
+                        SOCK_CLOEXEC, info->ai_protocol);
+            if(fd == -1) {
+                continue;
+            }
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if(bind(fd, info->ai_addr, info->ai_addrlen) == -1 ||
+               listen(fd, SOMAXCONN) == -1) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    } else {
+        struct sockaddr_un unixAddress;     // Path of the socket file
+        struct stat info;                   // What is at the path now
+        memset(&unixAddress, 0, sizeof(unixAddress));
+        unixAddress.sun_family = AF_UNIX;
+        if(strlen(address) >= sizeof(unixAddress.sun_path)) {
+            fprintf(stderr, "smallsh: %s: path too long for a socket\n",
+                    address);
+            fflush(stdout);
+            return -1;
+        }
+        strcpy(unixAddress.sun_path, address);
+        if(lstat(address, &info) == 0 && S_ISSOCK(info.st_mode)) {
+            unlink(address);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        mode_t mask = umask(077);
+        if(fd != -1 && (bind(fd, (struct sockaddr*)&unixAddress,
+                             sizeof(unixAddress)) == -1 ||
+                        listen(fd, SOMAXCONN) == -1)) {
+            close(fd);
+            fd = -1;
+        }
+        umask(mask);
+        if(fd != -1) {
+            control_table.path = heapAlloc(strlen(address) + 1);
+            strcpy(control_table.path, address);
+        }
+    }
+    if(fd == -1) {
+        fprintf(stderr, "smallsh: %s: %s\n", address, strerror(errno));
+        fflush(stdout);
+    }
+    return fd;
+}
+
+/*******************************************************************************
+ * Function name:   void drainControl()
+ *
+ * Description:     Handles up to CONTROL_BATCH control socket events without
+ *                  blocking: accepts new clients, runs the requests that
+ *                  have arrived in full, and writes replies that didn't fit
+ *                  in a client's socket earlier. A client that hangs up or
+ *                  fails is closed.
+ ******************************************************************************/
+
+void drainControl() {
+    struct epoll_event events[CONTROL_BATCH];   // Sockets that are ready
+
+    int count = epoll_wait(control_table.epollFD, events, CONTROL_BATCH, 0);
+    for(int i = 0; i < count; i++) {
+        // Slot 0 is the listening socket, and client i is slot i + 1
+        if(events[i].data.u32 == 0) {
+            acceptControl();
+            continue;
+        }
+        int index = (int)events[i].data.u32 - 1;
+        if(control_table.clients[index].fd == -1) {
+            continue;
+        }
+        if(events[i].events & EPOLLOUT) {
+            flushControl(index);
+        }
+        if(control_table.clients[index].fd != -1 &&
+           (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            readControl(index);
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void acceptControl()
+ *
+ * Description:     Accepts every connection waiting on the control socket
+ *                  and adds each to the epoll set, in the first free client
+ *                  slot. The table of slots is doubled when it is full.
+ ******************************************************************************/
+
+void acceptControl() {
+    int fd;                 // Socket of the new client
+
+    while((fd = accept4(control_table.listenFD, NULL, NULL,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        int index = 0;
+        while(index < control_table.capacity &&
+              control_table.clients[index].fd != -1) {
+            index++;
+        }
+        if(index == control_table.capacity) {
+            int capacity = control_table.capacity
+                           ? control_table.capacity * 2 : CONTROL_TABLE_SIZE;
+            control_table.clients = heapRealloc(control_table.clients,
+                                                sizeof(ControlClient) *
+                                                capacity);
+            for(int i = control_table.capacity; i < capacity; i++) {
+                ControlClient *client = &control_table.clients[i];
+                memset(client, 0, sizeof(*client));
+                client->fd = -1;
+            }
+            control_table.capacity = capacity;
+        }
+
+        ControlClient *client = &control_table.clients[index];
+        struct epoll_event event = {EPOLLIN, {.u32 = (uint32_t)index + 1}};
+        if(epoll_ctl(control_table.epollFD, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->writing = false;
+        client->inUsed = 0;
+        client->outUsed = 0;
+        client->metrics = false;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void readControl(int index)
+ *
+ * Description:     Reads what a control client has sent and runs each
+ *                  request frame that has arrived in full, in order. A frame
+ *                  longer than CONTROL_FRAME_MAX gets an error reply and the
+ *                  client is closed, as is a client that has hung up.
+ *
+ * Receives:        index       Slot of the client
+ ******************************************************************************/
+
+void readControl(int index) {
+    ControlClient *client = &control_table.clients[index];
+
+    if(client->inSize < client->inUsed + CONTROL_READ) {
+        client->inSize = client->inUsed + CONTROL_READ;
+        client->in = heapRealloc(client->in, client->inSize);
+    }
+    ssize_t count = read(client->fd, client->in + client->inUsed,
+                         client->inSize - client->inUsed);
+    if(count == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if(count > 0) {
+        client->inUsed += (size_t)count;
+    }
+
+    // Run every whole frame, then keep the start of the next
+    size_t used = 0;        // Bytes of in taken by whole frames
+    while(client->fd != -1 && client->inUsed - used >= CONTROL_HEADER) {
+        uint32_t length;
+        memcpy(&length, client->in + used, CONTROL_HEADER);
+        length = ntohl(length);
+        if(length > CONTROL_FRAME_MAX) {
+            replyControl(index, "error frame longer than the limit");
+            closeControlClient(index);
+            return;
+        }
+        if(client->inUsed - used < CONTROL_HEADER + length) {
+            break;
+        }
+        runControlRequest(index, client->in + used + CONTROL_HEADER, length);
+        used += CONTROL_HEADER + length;
+    }
+    if(client->fd == -1) {
+        return;
+    }
+    memmove(client->in, client->in + used, client->inUsed - used);
+    client->inUsed -= used;
+    if(count <= 0) {
+        closeControlClient(index);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void runControlRequest(int index, const char *line,
+ *                                         size_t length)
+ *
+ * Description:     Parses and executes a command line sent by a control
+ *                  client, the way promptLoop() runs one it reads, except
+ *                  that every pipeline runs in the background. A pipeline
+ *                  that launches a job gets a reply with the job's id and
+ *                  PID, or saying it is queued, and a second one when the
+ *                  job finishes; the pipelines after it wait for that.
+ *                  One that launches none, such as a built-in, gets one
+ *                  reply with its exit status, and one that "&&" or "||"
+ *                  skips gets "skipped". exit ends the client's session
+ *                  rather than the shell.
+ *
+ * Receives:        index       Slot of the client
+ *                  line        Command line, not NUL-terminated
+ *                  length      Number of characters in line
+ ******************************************************************************/
+
+void runControlRequest(int index, const char *line, size_t length) {
+    char reply[CONTROL_REPLY_MAX];  // Reply for a line without a job
+
+    // The classifier may read a block past the line's end
+    if(control_table.lineSize < length + 64) {
+        control_table.lineSize = length + 64;
+        heapFree(control_table.line);
+        control_table.line = heapAlloc(control_table.lineSize);
+    }
+    memcpy(control_table.line, line, length);
+    memset(control_table.line + length, 0, 64);
+    if(!control_table.command) {
+        control_table.command = heapAlloc(sizeof(Command));
+        initCommand(control_table.command);
+    }
+    Command *command = control_table.command;
+    command->line = control_table.line;
+    command->lineLength = length;
+    control_table.requests++;
+
+    // A line that is a comment or has no words succeeds without running
+    trace_command++;
+    uint64_t lineStart = traceNow();
+    uint64_t parseStart = clockNanoseconds(CLOCK_MONOTONIC);
+    parseCommandLine(command);
+    recordHistogram(&metrics.parse,
+                    clockNanoseconds(CLOCK_MONOTONIC) - parseStart);
+    traceRecord(TRACE_PARSE, lineStart);
+    bool empty = command->numStages == 0 || line[0] == COMMENT_PREFIX;
+    builtin_status = empty ? 0 : W_EXITCODE(1, 0);
+    control_table.client = index;
+    control_table.replied = false;
+    int result = empty ? 0 : executeCommand(command);
+    control_table.client = -1;
+    traceRecord(TRACE_TOTAL, lineStart);
+    if(trace_used) {
+        traceFlush();
+    }
+    resetCommand(command);
+
+    if(result == -1) {
+        closeControlClient(index);
+    } else if(!control_table.replied) {
+        int used = snprintf(reply, sizeof(reply), "done ");
+        formatExitValOrSignal(reply + used, sizeof(reply) - used,
+                              builtin_status);
+        replyControl(index, reply);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void replyControl(int index, const char *text)
+ *
+ * Description:     Queues a reply frame for a control client and writes as
+ *                  much as its socket takes now.
+ *
+ * Receives:        index       Slot of the client
+ *                  text        Body of the reply
+ ******************************************************************************/
+
+void replyControl(int index, const char *text) {
+    ControlClient *client = &control_table.clients[index];
+    uint32_t length = (uint32_t)strlen(text);
+
+    if(client->fd == -1) {
+        return;
+    }
+    if(client->outSize < client->outUsed + CONTROL_HEADER + length) {
+        client->outSize = (client->outUsed + CONTROL_HEADER + length) * 2;
+        client->out = heapRealloc(client->out, client->outSize);
+    }
+    uint32_t header = htonl(length);
+    memcpy(client->out + client->outUsed, &header, CONTROL_HEADER);
+    memcpy(client->out + client->outUsed + CONTROL_HEADER, text, length);
+    client->outUsed += CONTROL_HEADER + length;
+    control_table.replies++;
+    flushControl(index);
+}
+
+/*******************************************************************************
+ * Function name:   void flushControl(int index)
+ *
+ * Description:     Writes a control client's queued replies until its
+ *                  socket is full. The socket is watched for room to write
+ *                  only while replies are left over, so a client that stops
+ *                  reading never blocks the shell.
+ *
+ * Receives:        index       Slot of the client
+ ******************************************************************************/
+
+void flushControl(int index) {
+    ControlClient *client = &control_table.clients[index];
+
+    while(client->outUsed > 0) {
+        ssize_t sent = send(client->fd, client->out, client->outUsed,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if(sent == -1 && errno != EAGAIN) {
+            closeControlClient(index);
+            return;
+        }
+        if(sent == -1) {
+            break;
+        }
+        memmove(client->out, client->out + sent, client->outUsed - sent);
+        client->outUsed -= (size_t)sent;
+    }
+
+    bool writing = client->outUsed > 0;
+    if(writing != client->writing) {
+        struct epoll_event event = {EPOLLIN | (writing ? EPOLLOUT : 0),
+                                    {.u32 = (uint32_t)index + 1}};
+        epoll_ctl(control_table.epollFD, EPOLL_CTL_MOD, client->fd, &event);
+        client->writing = writing;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void closeControlClient(int index)
+ *
+ * Description:     Closes a control client's connection. Its jobs carry on
+ *                  as ordinary background jobs, reported at the prompt.
+ *
+ * Receives:        index       Slot of the client
+ ******************************************************************************/
+
+void closeControlClient(int index) {
+    ControlClient *client = &control_table.clients[index];
+
+    if(client->fd == -1) {
+        return;
+    }
+    epoll_ctl(control_table.epollFD, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    for(int i = 0; i < job_table.capacity; i++) {
+        if(job_table.jobs[i].state != JOB_FREE &&
+           job_table.jobs[i].client == index) {
+            job_table.jobs[i].client = -1;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void replyJob(Job *job, const char *text)
+ *
+ * Description:     Sends "job ID " and the text to the control client that
+ *                  submitted the job.
+ *
+ * Preconditions:   job->client is not -1
+ *
+ * Receives:        job         Job struct pointer
+ *                  text        What happened to the job
+ ******************************************************************************/
+
+void replyJob(Job *job, const char *text) {
+    char reply[CONTROL_REPLY_MAX + 16];     // "job ID " and the text
+
+    snprintf(reply, sizeof(reply), "job %d %s", job->id, text);
+    if(job->client == control_table.client) {
+        control_table.replied = true;
+    }
+    replyControl(job->client, reply);
+}
+
+/*******************************************************************************
+ * Function name:   void replyJobStarted(Job *job)
+ *
+ * Description:     Tells a job's control client that the job has been
+ *                  launched, with the PID of its final stage.
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void replyJobStarted(Job *job) {
+    char text[CONTROL_REPLY_MAX];   // What happened to the job
+
+    snprintf(text, sizeof(text), "pid %d", job->lastPid);
+    replyJob(job, text);
+}
+
+/*******************************************************************************
+ * Function name:   void noticeJobDone(Job *job)
+ *
+ * Description:     Reports a background job that has finished. A job
+ *                  submitted through the control socket has its exit status
+ *                  and resource usage sent to the client straight away and
+ *                  is freed, or, if its list has more pipelines to run,
+ *                  added to the list queue for continueLists(); any other
+ *                  job is queued for a completion notice, in order of
+ *                  completion.
+ *
+ * Preconditions:   job is a background job that is done
+ *
+ * Receives:        job         Job struct pointer
+ ******************************************************************************/
+
+void noticeJobDone(Job *job) {
+    char text[CONTROL_REPLY_MAX];   // Exit status and resource usage
+
+    if(job->client != -1) {
+        int used = formatExitValOrSignal(text, sizeof(text), job->status);
+        text[used++] = ' ';
+        formatJobUsage(text + used, sizeof(text) - used, job);
+        replyJob(job, text);
+        if(!job->hasRest) {
+            freeJob(job);
+            return;
+        }
+        job->next = -1;
+        if(job_table.listTail == -1) {
+            job_table.listHead = job->id - 1;
+        } else {
+            job_table.jobs[job_table.listTail].next = job->id - 1;
+        }
+        job_table.listTail = job->id - 1;
+        return;
+    }
+    job->next = -1;
+    if(job_table.doneTail == -1) {
+        job_table.doneHead = job->id - 1;
+    } else {
+        job_table.jobs[job_table.doneTail].next = job->id - 1;
+    }
+    job_table.doneTail = job->id - 1;
+}
+
+/*******************************************************************************
+ * Function name:   void serveControl()
+ *
+ * Description:     Once the shell's input has ended, keeps serving the
+ *                  control socket if there is one, so a shell driven only
+ *                  through it can be started with no input. It serves
+ *                  until SIGTERM stops the shell.
+ ******************************************************************************/
+
+void serveControl() {
+    while(control_table.listenFD != -1) {
+        int ready = waitEvents(EVENT_BIT(EVENT_CHILD) |
+                               EVENT_BIT(EVENT_SERVER) |
+                               EVENT_BIT(EVENT_CAPTURE) |
+                               EVENT_BIT(EVENT_SIGNAL) |
+                               EVENT_BIT(EVENT_CONTROL) |
+                               EVENT_BIT(EVENT_METRICS));
+        if(ready == -1 && errno != EINTR) {
+            return;
+        }
+        if(ready == -1 || (ready & EVENT_BIT(EVENT_SIGNAL))) {
+            drainSignals();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_SERVER))) {
+            closeSpawnServer();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CAPTURE))) {
+            drainCaptures();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CHILD))) {
+            checkBackgroundChildren();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_CONTROL))) {
+            drainControl();
+        }
+        if(ready > 0 && (ready & EVENT_BIT(EVENT_METRICS))) {
+            drainMetricsTimer();
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void closeControl()
+ *
+ * Description:     Closes the control socket and its clients, and removes a
+ *                  Unix socket's file.
+ ******************************************************************************/
+
+void closeControl() {
+    if(control_table.listenFD == -1) {
+        return;
+    }
+    for(int i = 0; i < control_table.capacity; i++) {
+        closeControlClient(i);
+    }
+    close(control_table.listenFD);
+    control_table.listenFD = -1;
+    if(control_table.path) {
+        unlink(control_table.path);
+    }
+}
+
+/*******************************************************************************
+ * Function name:   size_t hashString(const char *str)
+ *
+ * Description:     Hashes a string with 64-bit FNV-1a.
+ *
+ * Receives:        str         String to hash
+ *
+ * Returns:         Hash of the string
+ ******************************************************************************/
+
+size_t hashString(const char *str) {
+    uint64_t hash = 14695981039346656037ull;
+    while(*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ull;
+    }
+    return (size_t)hash;
+}
+
+/*******************************************************************************
+ * Function name:   char *findCommand(char *name)
+ *
+ * Description:     Finds the file a command name runs, as execvp() would, and
+ *                  remembers it in the command hash so that later commands
+ *                  can be executed directly without searching PATH again.
+ *                  The hash is cleared whenever PATH has been set since it
+ *                  was filled, which the variable store's path version shows
+ *                  without comparing the strings. Names containing a slash
+ *                  aren't searched for.
+ *
+ * Receives:        name        Command name
+ *
+ * Returns:         Path of the executable, or NULL if the name contains a
+ *                  slash or isn't found in PATH
+ ******************************************************************************/
+
+char *findCommand(char *name) {
+    if(strchr(name, '/')) {
+        return NULL;
+    }
+
+    // Forget every location if PATH has changed
+    if(command_hash.pathVersion != var_store.pathVersion) {
+        clearCommandHash();
+        command_hash.pathVersion = var_store.pathVersion;
+    }
+
+    // Look for a remembered location
+    size_t mask = command_hash.capacity - 1;
+    size_t slot = 0;
+    if(command_hash.capacity) {
+        slot = hashString(name) & mask;
+        while(command_hash.entries[slot].name) {
+            if(!strcmp(command_hash.entries[slot].name, name)) {
+                command_hash.entries[slot].hits++;
+                return command_hash.entries[slot].path;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    // Search each directory in PATH; an empty entry means the current one
+    Variable *pathVariable = findVariable("PATH", 4);
+    char *path = pathVariable ? pathVariable->value : DEFAULT_PATH;
+    size_t nameLength = strlen(name);
+    char candidate[PATH_MAX];
+    char *dir = path;
+    while(true) {
+        size_t dirLength = strcspn(dir, ":");
+        if(dirLength + nameLength + 2 <= sizeof(candidate)) {
+            struct stat info;
+            if(dirLength == 0) {
+                candidate[0] = '.';
+                dirLength = 1;
+            } else {
+                memcpy(candidate, dir, dirLength);
+            }
+            candidate[dirLength] = '/';
+            memcpy(candidate + dirLength + 1, name, nameLength + 1);
+            if(!access(candidate, X_OK) && !stat(candidate, &info) &&
+               S_ISREG(info.st_mode)) {
+                return addHashedCommand(name, candidate);
+            }
+        }
+        dir += strcspn(dir, ":");
+        if(!*dir++) {
+            return NULL;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   char *addHashedCommand(char *name, char *path)
+ *
+ * Description:     Adds a command's location to the command hash, growing
+ *                  the hash when it becomes half full.
+ *
+ * Receives:        name        Command name
+ *                  path        Path of the command's executable
+ *
+ * Returns:         The hash's copy of the path
+ ******************************************************************************/
+
+char *addHashedCommand(char *name, char *path) {
+    // Double the hash and reinsert every entry when it is half full
+    if((command_hash.count + 1) * 2 > command_hash.capacity) {
+        HashedCommand *old = command_hash.entries;
+        size_t oldCapacity = command_hash.capacity;
+        command_hash.capacity = oldCapacity ? oldCapacity * 2
+                                            : COMMAND_HASH_SIZE;
+        command_hash.entries = heapAlloc(sizeof(HashedCommand) *
+                                         command_hash.capacity);
+        memset(command_hash.entries, 0,
+               sizeof(HashedCommand) * command_hash.capacity);
+        for(size_t i = 0; i < oldCapacity; i++) {
+            if(old[i].name) {
+                size_t slot = hashString(old[i].name) &
+                              (command_hash.capacity - 1);
+                while(command_hash.entries[slot].name) {
+                    slot = (slot + 1) & (command_hash.capacity - 1);
+                }
+                command_hash.entries[slot] = old[i];
+            }
+        }
+        heapFree(old);
+    }
+
+    size_t mask = command_hash.capacity - 1;
+    size_t slot = hashString(name) & mask;
+    while(command_hash.entries[slot].name) {
+        slot = (slot + 1) & mask;
+    }
+
+    // The name and path share one allocation
+    size_t nameLength = strlen(name);
+    HashedCommand *entry = &command_hash.entries[slot];
+    entry->name = heapAlloc(nameLength + strlen(path) + 2);
+    strcpy(entry->name, name);
+    entry->path = strcpy(entry->name + nameLength + 1, path);
+    entry->hits = 1;
+    command_hash.count++;
+    return entry->path;
+}
+
+/*******************************************************************************
+ * Function name:   void forgetCommand(char *name)
+ *
+ * Description:     Removes a command's location from the command hash, for
+ *                  example after its executable has been removed. Entries
+ *                  after it are shifted back so that no tombstones are needed.
+ *
+ * Receives:        name        Command name
+ ******************************************************************************/
+
+void forgetCommand(char *name) {
+    if(command_hash.count == 0) {
+        return;
+    }
+    size_t mask = command_hash.capacity - 1;
+    size_t hole = hashString(name) & mask;
+    while(!command_hash.entries[hole].name ||
+          strcmp(command_hash.entries[hole].name, name)) {
+        if(!command_hash.entries[hole].name) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    heapFree(command_hash.entries[hole].name);
+
+    size_t next = (hole + 1) & mask;
+    while(command_hash.entries[next].name) {
+        size_t home = hashString(command_hash.entries[next].name) & mask;
+        if(((next - home) & mask) >= ((next - hole) & mask)) {
+            command_hash.entries[hole] = command_hash.entries[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    command_hash.entries[hole].name = NULL;
+    command_hash.count--;
+}
+
+/*******************************************************************************
+ * Function name:   void clearCommandHash()
+ *
+ * Description:     Forgets every command location in the command hash.
+ *
+ * Postconditions:  The hash is empty
+ ******************************************************************************/
+
+void clearCommandHash() {
+    for(size_t i = 0; i < command_hash.capacity; i++) {
+        heapFree(command_hash.entries[i].name);
+        command_hash.entries[i].name = NULL;
+    }
+    command_hash.count = 0;
+}
+
+/*******************************************************************************
+ * Function name:   int hashBuiltin(char **args)
+ *
+ * Description:     Built-in hash command. With no arguments, lists every
+ *                  remembered command location with the number of times it
+ *                  has been used. hash -r forgets them all, and hash name ...
+ *                  looks up each name and remembers its location.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 1 if a command wasn't found
+ ******************************************************************************/
+
+int hashBuiltin(char **args) {
+    int status = 0;         // Exit status
+
+    if(!args[1]) {
+        if(command_hash.count == 0) {
+            printf("hash: hash table empty\n");
+        } else {
+            printf("hits\tcommand\n");
+        }
+        for(size_t i = 0; i < command_hash.capacity; i++) {
+            HashedCommand *entry = &command_hash.entries[i];
+            if(entry->name) {
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
+        }
+    } else if(!strcmp(args[1], "-r")) {
+        clearCommandHash();
+    } else {
+        for(int i = 1; args[i]; i++) {
+            if(!findCommand(args[i]) && !strchr(args[i], '/')) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+        }
+    }
+    fflush(stdout);
+    return status;
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t traceNow()
+ *
+ * Description:     Reads the monotonic clock for latency tracing.
+ *
+ * Returns:         Monotonic time in nanoseconds, or 0 if tracing is off
+ ******************************************************************************/
+
+uint64_t traceNow() {
+    return trace_enabled ? clockNanoseconds(CLOCK_MONOTONIC) : 0;
+}
+
+/*******************************************************************************
+ * Function name:   void traceRecord(TracePhase phase, uint64_t start)
+ *
+ * Description:     Records how long a phase of the command lifecycle took,
+ *                  from start until now. The duration is kept for the timings
+ *                  built-in, and if a trace FD was chosen a JSON-lines record
+ *                  is added to the trace buffer.
+ *
+ * Receives:        phase       TracePhase  Phase that has finished
+ *                  start       uint64_t    Value of traceNow() when the phase
+ *                                          began
+ ******************************************************************************/
+
+void traceRecord(TracePhase phase, uint64_t start) {
+    if(!trace_enabled || start == 0) {
+        return;
+    }
+    uint64_t duration = traceNow() - start;
+
+    // Keep the most recent TRACE_SAMPLES durations of each phase
+    TraceSamples *samples = &trace_samples[phase];
+    samples->ns[samples->next] = duration;
+    samples->next = (samples->next + 1) % TRACE_SAMPLES;
+    samples->total++;
+
+    if(trace_fd == -1) {
+        return;
+    }
+    if(trace_used + TRACE_RECORD_MAX > sizeof(trace_buffer)) {
+        traceFlush();
+    }
+    trace_used += (size_t)snprintf(trace_buffer + trace_used,
+                                   sizeof(trace_buffer) - trace_used,
+                                   "{\"cmd\":%lu,\"pid\":%ld,\"phase\":\"%s\","
+                                   "\"start_ns\":%llu,\"ns\":%llu}\n",
+                                   trace_command, (long)getpid(),
+                                   trace_phase_names[phase],
+                                   (unsigned long long)start,
+                                   (unsigned long long)duration);
+}
+
+/*******************************************************************************
+ * Function name:   void traceFlush()
+ *
+ * Description:     Writes the buffered trace records to the trace FD, so that
+ *                  tracing costs one write() per command.
+ *
+ * Postconditions:  The trace buffer is empty
+ ******************************************************************************/
+
+void traceFlush() {
+    size_t written = 0;
+    while(written < trace_used) {
+        ssize_t result = write(trace_fd, trace_buffer + written,
+                               trace_used - written);
+        if(result == -1 && errno == EINTR) {
+            continue;
+        }
+        if(result <= 0) {
+            break;
+        }
+        written += (size_t)result;
+    }
+    trace_used = 0;
+}
+
+/*******************************************************************************
+ * Function name:   int compareDurations(const void *a, const void *b)
+ *
+ * Description:     qsort() comparison function for uint64_t durations.
+ *
+ * Receives:        a, b        Pointers to the durations to compare
+ *
+ * Returns:         Negative, zero or positive as a is less than, equal to or
+ *                  greater than b
+ ******************************************************************************/
+
+int compareDurations(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+    return (first > second) - (first < second);
+}
+
+/*******************************************************************************
+ * Function name:   int timingsBuiltin(char **args)
+ *
+ * Description:     Built-in timings command. Prints the number of samples
+ *                  and the median and 99th percentile duration, in
+ *                  microseconds, of each traced phase over its most recent
+ *                  samples. timings -r discards the samples.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0
+ ******************************************************************************/
+
+int timingsBuiltin(char **args) {
+    static uint64_t sorted[TRACE_SAMPLES];     // Samples of one phase
+
+    if(args[1] && !strcmp(args[1], "-r")) {
+        memset(trace_samples, 0, sizeof(trace_samples));
+        return 0;
+    }
+    if(!trace_enabled) {
+        printf("timings: tracing is off (set -o trace-timing)\n");
+    }
+    printf("%-10s %8s %12s %12s\n", "phase", "count", "p50 us", "p99 us");
+    for(int phase = 0; phase < TRACE_PHASES; phase++) {
+        TraceSamples *samples = &trace_samples[phase];
+        size_t count = samples->total < TRACE_SAMPLES ? samples->total
+                                                      : TRACE_SAMPLES;
+        if(count == 0) {
+            printf("%-10s %8d %12s %12s\n", trace_phase_names[phase], 0,
+                   "-", "-");
+            continue;
+        }
+        memcpy(sorted, samples->ns, count * sizeof(uint64_t));
+        qsort(sorted, count, sizeof(uint64_t), compareDurations);
+        printf("%-10s %8lu %12.1f %12.1f\n", trace_phase_names[phase],
+               samples->total, sorted[(count - 1) / 2] / 1000.0,
+               sorted[(count - 1) * 99 / 100] / 1000.0);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int setBuiltin(char **args)
+ *
+ * Description:     Built-in set command for shell options. set -o name turns
+ *                  an option on, set +o name turns it off and set -o lists
+ *                  the options. The only option is trace-timing, which
+ *                  records the duration of each phase of every command.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 2 if the arguments are wrong
+ ******************************************************************************/
+
+int setBuiltin(char **args) {
+    int status = 0;         // Exit status
+
+    if(args[1] && !args[2] && !strcmp(args[1], "-o")) {
+        printf("%-14s %s\n", TRACE_OPTION, trace_enabled ? "on" : "off");
+    } else if(args[1] && args[2] && !strcmp(args[2], TRACE_OPTION) &&
+              (!strcmp(args[1], "-o") || !strcmp(args[1], "+o"))) {
+        trace_enabled = args[1][0] == '-';
+    } else {
+        fprintf(stderr, "usage: set [-o|+o] %s\n", TRACE_OPTION);
+        status = 2;
+    }
+    fflush(stdout);
+    return status;
+}
+
+/*******************************************************************************
+ * Function name:   void openHistory()
+ *
+ * Description:     Opens and maps the history file named by SMALLSH_HISTORY,
+ *                  or ~/.smallsh_history if it is unset, its index, named
+ *                  with ".idx" added, and its sorted index, named with
+ *                  ".srt" added. Nothing is read: lines the index doesn't
+ *                  cover yet are the only ones looked at. If
+ *                  SMALLSH_HISTORY is empty or the files can't be opened,
+ *                  the history lasts only as long as the shell.
+ *
+ * Postconditions:  history is open, or has no FDs if even the in-memory
+ *                  files couldn't be created
+ ******************************************************************************/
+
+void openHistory() {
+    char path[PATH_MAX];    // Path of the history file
+
+    if(history.opened) {
+        return;
+    }
+    history.opened = true;
+
+    char *file = getenv(HISTORY_VAR);
+    char *home = getenv("HOME");
+    path[0] = '\0';
+    if(file) {
+        snprintf(path, sizeof(path), "%s", file);
+    } else if(home && *home) {
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+    }
+    if(path[0]) {
+        history.textFD = openHistoryFile(path, "");
+        history.indexFD = openHistoryFile(path, HISTORY_INDEX_SUFFIX);
+    }
+
+    if(history.textFD != -1 && history.indexFD != -1) {
+        size_t size = strlen(path) + sizeof(HISTORY_SORTED_SUFFIX);
+        history.sortedPath = heapAlloc(size);
+        snprintf(history.sortedPath, size, "%s%s", path,
+                 HISTORY_SORTED_SUFFIX);
+    }
+
+    // Fall back to files in memory that vanish when the shell exits
+    else {
+        if(history.textFD != -1) {
+            close(history.textFD);
+        }
+        if(history.indexFD != -1) {
+            close(history.indexFD);
+        }
+        history.textFD = memfd_create("smallsh-history", MFD_CLOEXEC);
+        history.indexFD = memfd_create("smallsh-history-index", MFD_CLOEXEC);
+        if(history.textFD == -1 || history.indexFD == -1) {
+            perror("memfd_create()");
+            fflush(stdout);
+            return;
+        }
+    }
+    flock(history.textFD, LOCK_EX);
+    mapHistory();
+    flock(history.textFD, LOCK_UN);
+}
+
+/*******************************************************************************
+ * Function name:   int openHistoryFile(const char *path, const char *suffix)
+ *
+ * Description:     Opens path with suffix added for reading and writing,
+ *                  creating it readable only by the user if it doesn't
+ *                  exist.
+ *
+ * Receives:        path        Path of the history file
+ *                  suffix      Characters added to path
+ *
+ * Returns:         The close-on-exec FD, or -1 after printing an error
+ ******************************************************************************/
+
+int openHistoryFile(const char *path, const char *suffix) {
+    char name[PATH_MAX];    // path with suffix added
+
+    snprintf(name, sizeof(name), "%s%s", path, suffix);
+    int fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1) {
+        perror(name);
+        fflush(stdout);
+    }
+    return fd;
+}
+
+/*******************************************************************************
+ * Function name:   void mapHistory()
+ *
+ * Description:     Brings history up to date with its files, which other
+ *                  shells may have added to: maps any part that isn't
+ *                  mapped yet and indexes the lines the index doesn't
+ *                  cover. An index that doesn't match the file is built
+ *                  again from the start. Once more than
+ *                  HISTORY_UNSORTED_MAX entries aren't in the sorted index
+ *                  they are merged into it.
+ *
+ * Preconditions:   The caller holds the lock on history.textFD
+ ******************************************************************************/
+
+void mapHistory() {
+    struct stat text, index;    // Sizes of the history file and index
+
+    if(fstat(history.textFD, &text) == -1 ||
+       fstat(history.indexFD, &index) == -1) {
+        return;
+    }
+    history.textSize = (size_t)text.st_size;
+    history.count = (size_t)index.st_size / sizeof(HistoryEntry);
+    history.text = mapHistoryFile(history.text, &history.textMapped,
+                                  history.textFD, history.textSize);
+    history.entries = mapHistoryFile(history.entries, &history.indexMapped,
+                                     history.indexFD,
+                                     history.count * sizeof(HistoryEntry));
+    if(!history.text || !history.entries) {
+        history.textSize = 0;
+        history.count = 0;
+        history.sortedCount = 0;
+        return;
+    }
+
+    // Find where the last indexed line ends
+    size_t end = 0;
+    if(history.count > 0) {
+        const HistoryEntry *last = &history.entries[history.count - 1];
+        if(last->offset >= history.textSize) {
+            history.count = 0;
+            history.sortedCount = 0;
+        } else {
+            const char *newline = memchr(history.text + last->offset, '\n',
+                                         history.textSize - last->offset);
+            end = newline ? (size_t)(newline - history.text) + 1
+                          : history.textSize;
+        }
+    }
+    if(end < history.textSize ||
+       (size_t)index.st_size != history.count * sizeof(HistoryEntry)) {
+        indexHistory(end);
+    }
+    mapSortedHistory();
+    if(history.count - history.sortedCount > HISTORY_UNSORTED_MAX) {
+        sortHistory();
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void *mapHistoryFile(void *map, size_t *mapped, int fd,
+ *                                       size_t size)
+ *
+ * Description:     Makes sure the first size bytes of a history file are
+ *                  mapped, mapping it again HISTORY_RESERVE bytes longer
+ *                  than size if they aren't. The pages past the end of the
+ *                  file are never touched until the file has grown over
+ *                  them.
+ *
+ * Receives:        map         Current mapping of the file, or NULL
+ *                  mapped      size_t pointer to the length of map
+ *                  fd          int     FD of the file
+ *                  size        size_t  Number of bytes that must be mapped
+ *
+ * Returns:         The mapping, or NULL if the file couldn't be mapped
+ ******************************************************************************/
+
+void *mapHistoryFile(void *map, size_t *mapped, int fd, size_t size) {
+    if(map && size <= *mapped) {
+        return map;
+    }
+    if(map) {
+        munmap(map, *mapped);
+    }
+    *mapped = size + HISTORY_RESERVE;
+    map = mmap(NULL, *mapped, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        *mapped = 0;
+        return NULL;
+    }
+    return map;
+}
+
+/*******************************************************************************
+ * Function name:   void indexHistory(size_t end)
+ *
+ * Description:     Adds an index entry for each line of the history file
+ *                  from offset end on, writing HISTORY_BATCH entries at a
+ *                  time, and drops any partly written entry after them.
+ *
+ * Preconditions:   end is the offset of a line, and the first history.count
+ *                  index entries cover the lines before it
+ *
+ * Receives:        end         size_t  Offset of the first line to index
+ ******************************************************************************/
+
+void indexHistory(size_t end) {
+    HistoryEntry batch[HISTORY_BATCH];  // Entries waiting to be written
+    size_t batched = 0;                 // Number of entries in batch
+    size_t count = history.count;       // Number of entries written
+
+    while(end < history.textSize) {
+        const char *line = history.text + end;
+        const char *newline = memchr(line, '\n', history.textSize - end);
+        size_t length = newline ? (size_t)(newline - line)
+                                : history.textSize - end;
+        batch[batched].offset = end;
+        batch[batched].key = historyKey(line, length);
+        batched++;
+        end += length + 1;
+        if(batched == HISTORY_BATCH || end >= history.textSize) {
+            pwrite(history.indexFD, batch, batched * sizeof(HistoryEntry),
+                   (off_t)(count * sizeof(HistoryEntry)));
+            count += batched;
+            batched = 0;
+        }
+    }
+    ftruncate(history.indexFD, (off_t)(count * sizeof(HistoryEntry)));
+    history.count = count;
+    history.entries = mapHistoryFile(history.entries, &history.indexMapped,
+                                     history.indexFD,
+                                     count * sizeof(HistoryEntry));
+    if(!history.entries) {
+        history.count = 0;
+        history.sortedCount = 0;
+    }
+}
+
+/*******************************************************************************
+ * Function name:   void mapSortedHistory()
+ *
+ * Description:     Maps the sorted index again if another shell has
+ *                  replaced it since it was mapped, then checks that it
+ *                  still matches the index: it must end at an entry the
+ *                  index has, with the same line, and hold no larger
+ *                  numbers. The entries it covers are searched through it.
+ *
+ * Preconditions:   The caller holds the lock on history.textFD
+ ******************************************************************************/
+
+void mapSortedHistory() {
+    struct stat file, mapped;   // The sorted index and the one mapped
+
+    if(history.sortedPath && stat(history.sortedPath, &file) == 0 &&
+       file.st_size > 0 && (history.sortedFD == -1 ||
+                            fstat(history.sortedFD, &mapped) == -1 ||
+                            file.st_ino != mapped.st_ino ||
+                            file.st_dev != mapped.st_dev)) {
+        int fd = open(history.sortedPath, O_RDONLY | O_CLOEXEC);
+        if(fd != -1) {
+            void *order = mmap(NULL, (size_t)file.st_size, PROT_READ,
+                               MAP_SHARED, fd, 0);
+            if(order == MAP_FAILED) {
+                close(fd);
+            } else {
+                useHistoryOrder(fd, order, (size_t)file.st_size);
+            }
+        }
+    }
+
+    history.sortedCount = 0;
+    if(!history.order || history.orderMapped < sizeof(HistoryOrder)) {
+        return;
+    }
+    size_t count = history.order->count;
+    if(count == 0 || count > history.count ||
+       history.orderMapped != historyOrderSize(count) ||
+       history.entries[count - 1].offset != history.order->lastOffset ||
+       history.entries[count - 1].key != history.order->lastKey) {
+        return;
+    }
+    history.sorted = (const uint32_t*)(history.order + 1);
+    history.blockMax = history.sorted + count;
+    for(size_t i = 0; i < (count + HISTORY_BLOCK - 1) / HISTORY_BLOCK; i++) {
+        if(history.blockMax[i] > count) {
+            return;
+        }
+    }
+    history.sortedCount = count;
+}
+
+/*******************************************************************************
+ * Function name:   void useHistoryOrder(int fd, HistoryOrder *order,
+ *                                       size_t size)
+ *
+ * Description:     Replaces the mapped sorted index with another one. It
+ *                  isn't searched until mapSortedHistory() has checked it.
+ *
+ * Postconditions:  history.sortedCount is 0
+ *
+ * Receives:        fd          int     FD of the new sorted index
+ *                  order       Mapping of the whole file
+ *                  size        size_t  Number of bytes mapped at order
+ ******************************************************************************/
+
+void useHistoryOrder(int fd, HistoryOrder *order, size_t size) {
+    if(history.order) {
+        munmap(history.order, history.orderMapped);
+    }
+    if(history.sortedFD != -1) {
+        close(history.sortedFD);
+    }
+    history.sortedFD = fd;
+    history.order = order;
+    history.orderMapped = size;
+    history.sorted = NULL;
+    history.blockMax = NULL;
+    history.sortedCount = 0;
+}
+
+/*******************************************************************************
+ * Function name:   size_t historyOrderSize(size_t count)
+ *
+ * Description:     Works out the size of a sorted index of count entries.
+ *
+ * Receives:        count       size_t  Number of entries sorted
+ *
+ * Returns:         Number of bytes in the file
+ ******************************************************************************/
+
+size_t historyOrderSize(size_t count) {
+    return sizeof(HistoryOrder) +
+           (count + (count + HISTORY_BLOCK - 1) / HISTORY_BLOCK) *
+           sizeof(uint32_t);
+}
+
+/*******************************************************************************
+ * Function name:   uint64_t historyKey(const char *line, size_t length)
+ *
+ * Description:     Packs the first 8 characters of a line, or all of a
+ *                  shorter one padded with NULs, into an index key.
+ *
+ * Receives:        line        Characters of the line
+ *                  length      size_t  Number of characters in line
+ *
+ * Returns:         The key
+ ******************************************************************************/
+
+uint64_t historyKey(const char *line, size_t length) {
+    uint64_t key = 0;
+    memcpy(&key, line, length < sizeof(key) ? length : sizeof(key));
+    return key;
+}
+
+/*******************************************************************************
+ * Function name:   const char *historyLine(size_t number, size_t *length)
+ *
+ * Description:     Finds a history entry in the mapped history file. The
+ *                  line isn't NUL-terminated.
+ *
+ * Preconditions:   number is between 1 and history.count
+ *
+ * Postconditions:  length holds the number of characters in the line
+ *
+ * Receives:        number      size_t  Number of the entry, from 1
+ *                  length      size_t pointer for the line's length
+ *
+ * Returns:         The first character of the line
+ ******************************************************************************/
+
+const char *historyLine(size_t number, size_t *length) {
+    size_t offset = history.entries[number - 1].offset;
+    const char *line = history.text + offset;
+    const char *newline = memchr(line, '\n', history.textSize - offset);
+    *length = newline ? (size_t)(newline - line) : history.textSize - offset;
+    return line;
+}
+
+/*******************************************************************************
+ * Function name:   size_t findHistoryPrefix(const char *prefix,
+ *                                           size_t length)
+ *
+ * Description:     Finds the most recent history entry that starts with
+ *                  prefix. The entries added since the history was last
+ *                  sorted are scanned first, newest first; the sorted ones
+ *                  are found with two binary searches for the range of
+ *                  lines starting with prefix, and the largest number in
+ *                  the range is read from the block maxima. Nothing is
+ *                  sorted here: mapHistory() keeps the unsorted entries to
+ *                  HISTORY_UNSORTED_MAX or fewer.
+ *
+ * Receives:        prefix      Characters the line must start with
+ *                  length      size_t  Number of characters in prefix
+ *
+ * Returns:         Number of the entry, or 0 if there is none
+ ******************************************************************************/
+
+size_t findHistoryPrefix(const char *prefix, size_t length) {
+    size_t number = scanHistoryPrefix(prefix, length, history.count + 1,
+                                      history.sortedCount);
+    if(number || history.sortedCount == 0) {
+        return number;
+    }
+
+    // Find the largest number among the sorted entries in the range,
+    // reading whole blocks from their maxima
+    size_t first = historyBound(prefix, length, false);
+    size_t end = historyBound(prefix, length, true);
+    for(size_t i = first; i < end;) {
+        if(i % HISTORY_BLOCK == 0 && i + HISTORY_BLOCK <= end) {
+            if(history.blockMax[i / HISTORY_BLOCK] > number) {
+                number = history.blockMax[i / HISTORY_BLOCK];
+            }
+            i += HISTORY_BLOCK;
+            continue;
+        }
+        if(history.sorted[i] > number) {
+            number = history.sorted[i];
+        }
+        i++;
+    }
+    return number;
+}
+
+/*******************************************************************************
+ * Function name:   size_t scanHistoryPrefix(const char *prefix,
+ *                                           size_t length, size_t before,
+ *                                           size_t after)
+ *
+ * Description:     Finds the most recent history entry numbered between
+ *                  after and before that starts with prefix, by scanning
+ *                  the index: an entry whose key doesn't match is skipped
+ *                  without touching the history file, which is only read
+ *                  to check characters past the eighth.
+ *
+ * Receives:        prefix      Characters the line must start with
+ *                  length      size_t  Number of characters in prefix
+ *                  before      size_t  Entries from this number on are
+ *                                      skipped
+ *                  after       size_t  Entries up to this number are
+ *                                      skipped
+ *
+ * Returns:         Number of the entry, or 0 if there is none
+ ******************************************************************************/
+
+size_t scanHistoryPrefix(const char *prefix, size_t length, size_t before,
+                         size_t after) {
+    size_t keyLength = length < sizeof(uint64_t) ? length : sizeof(uint64_t);
+    uint64_t want = historyKey(prefix, keyLength);  // Key the entry needs
+    uint64_t mask = 0;                              // Bits of want to check
+
+    memset(&mask, 0xff, keyLength);
+    if(before > history.count + 1) {
+        before = history.count + 1;
+    }
+    for(size_t number = before - 1; number > after; number--) {
+        // Check four keys at a time until one of them matches
+        const HistoryEntry *entry = &history.entries[number - 1];
+        if(number >= after + 4 && ((entry[0].key & mask) != want) &
+                                  ((entry[-1].key & mask) != want) &
+                                  ((entry[-2].key & mask) != want) &
+                                  ((entry[-3].key & mask) != want)) {
+            number -= 3;
+            continue;
+        }
+        if((entry->key & mask) != want) {
+            continue;
+        }
+        if(length <= sizeof(uint64_t)) {
+            return number;
+        }
+        size_t lineLength;
+        const char *line = historyLine(number, &lineLength);
+        if(lineLength >= length && !memcmp(line + sizeof(uint64_t),
+                                           prefix + sizeof(uint64_t),
+                                           length - sizeof(uint64_t))) {
+            return number;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   void sortHistory()
+ *
+ * Description:     Sorts the entries added since the sorted index was
+ *                  written and merges them into a new one: each new entry's
+ *                  place among the sorted ones is found by binary search,
+ *                  and the runs between them are copied whole. The new
+ *                  index is written beside the old one and renamed over
+ *                  it, so other shells keep searching the old one until
+ *                  they map it again. Only a history with no sorted index
+ *                  is sorted from the start, which takes a few hundred
+ *                  milliseconds for a million lines; later merges sort at
+ *                  most a little over HISTORY_UNSORTED_MAX entries.
+ *
+ * Preconditions:   The caller holds the lock on history.textFD
+ ******************************************************************************/
+
+void sortHistory() {
+    char name[PATH_MAX];                    // Path of the new sorted index
+    size_t older = history.sortedCount;     // Entries already sorted
+    size_t count = history.count;           // Entries the new index sorts
+    size_t added = count - older;           // Entries to merge in
+    size_t size = historyOrderSize(count);  // Bytes in the new index
+
+    if(added == 0) {
+        return;
+    }
+    int fd;
+    if(history.sortedPath) {
+        snprintf(name, sizeof(name), "%s.new", history.sortedPath);
+        fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    } else {
+        fd = memfd_create("smallsh-history-sorted", MFD_CLOEXEC);
+    }
+    if(fd == -1) {
+        return;
+    }
+
+    // Allocate the blocks first so that a full disk fails here rather than
+    // with SIGBUS while the mapping is written
+    HistoryOrder *order = MAP_FAILED;
+    if(posix_fallocate(fd, 0, (off_t)size) == 0) {
+        order = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(order == MAP_FAILED) {
+        close(fd);
+        if(history.sortedPath) {
+            unlink(name);
+        }
+        return;
+    }
+
+    uint32_t *newer = heapAlloc(added * sizeof(uint32_t));
+    for(size_t i = 0; i < added; i++) {
+        newer[i] = (uint32_t)(older + i + 1);
+    }
+    qsort(newer, added, sizeof(uint32_t), compareHistoryEntries);
+    uint32_t *sorted = (uint32_t*)(order + 1);
+    size_t out = 0;         // Entries written to sorted
+    size_t from = 0;        // First old entry not written yet
+    for(size_t i = 0; i < added; i++) {
+        size_t low = from;      // Old entries before low come first
+        size_t high = older;    // Old entries from high on come after
+        while(low < high) {
+            size_t middle = low + (high - low) / 2;
+            if(compareHistoryEntries(&history.sorted[middle],
+                                     &newer[i]) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if(low > from) {
+            memcpy(sorted + out, history.sorted + from,
+                   (low - from) * sizeof(uint32_t));
+            out += low - from;
+            from = low;
+        }
+        sorted[out++] = newer[i];
+    }
+    if(older > from) {
+        memcpy(sorted + out, history.sorted + from,
+               (older - from) * sizeof(uint32_t));
+    }
+    heapFree(newer);
+
+    uint32_t *blockMax = sorted + count;
+    for(size_t i = 0; i < count; i++) {
+        if(i % HISTORY_BLOCK == 0) {
+            blockMax[i / HISTORY_BLOCK] = 0;
+        }
+        if(sorted[i] > blockMax[i / HISTORY_BLOCK]) {
+            blockMax[i / HISTORY_BLOCK] = sorted[i];
+        }
+    }
+    order->count = count;
+    order->lastOffset = history.entries[count - 1].offset;
+    order->lastKey = history.entries[count - 1].key;
+
+    if(history.sortedPath && rename(name, history.sortedPath) == -1) {
+        munmap(order, size);
+        close(fd);
+        unlink(name);
+        return;
+    }
+    useHistoryOrder(fd, order, size);
+    mapSortedHistory();
+}
+
+/*******************************************************************************
+ * Function name:   int compareHistoryEntries(const void *left,
+ *                                            const void *right)
+ *
+ * Description:     qsort() comparison of two history entry numbers by
+ *                  their lines, then by number. The keys decide most
+ *                  comparisons without reading the history file.
+ *
+ * Receives:        left        Pointer to a uint32_t entry number
+ *                  right       Pointer to a uint32_t entry number
+ *
+ * Returns:         Less than, equal to or more than 0
+ ******************************************************************************/
+
+int compareHistoryEntries(const void *left, const void *right) {
+    uint32_t a = *(const uint32_t*)left;
+    uint32_t b = *(const uint32_t*)right;
+    uint64_t keyA = history.entries[a - 1].key;
+    uint64_t keyB = history.entries[b - 1].key;
+
+    if(keyA != keyB) {
+        return memcmp(&keyA, &keyB, sizeof(uint64_t));
+    }
+    size_t lengthA, lengthB;
+    const char *lineA = historyLine(a, &lengthA);
+    const char *lineB = historyLine(b, &lengthB);
+    size_t shorter = lengthA < lengthB ? lengthA : lengthB;
+    int order = shorter > sizeof(uint64_t)
+                ? memcmp(lineA + sizeof(uint64_t), lineB + sizeof(uint64_t),
+                         shorter - sizeof(uint64_t))
+                : 0;
+    if(order == 0 && lengthA != lengthB) {
+        order = lengthA < lengthB ? -1 : 1;
+    }
+    if(order == 0) {
+        order = a < b ? -1 : a > b;
+    }
+    return order;
+}
+
+/*******************************************************************************
+ * Function name:   int compareHistoryPrefix(uint32_t number,
+ *                                           const char *prefix,
+ *                                           size_t length)
+ *
+ * Description:     Compares a history entry's line with a prefix
+ *
+ * Receives:        number      uint32_t    Number of the entry
+ *                  prefix      Characters to compare with
+ *                  length      size_t  Number of characters in prefix
+ *
+ * Returns:         0 if the line starts with prefix, and otherwise less
+ *                  or more than 0 as the line sorts before or after the
+ *                  lines that do
+ ******************************************************************************/
+
+int compareHistoryPrefix(uint32_t number, const char *prefix, size_t length) {
+    size_t lineLength;
+    const char *line = historyLine(number, &lineLength);
+    int order = memcmp(line, prefix, lineLength < length ? lineLength
+                                                         : length);
+    if(order == 0 && lineLength < length) {
+        order = -1;
+    }
+    return order;
+}
+
+/*******************************************************************************
+ * Function name:   size_t historyBound(const char *prefix, size_t length,
+ *                                      bool past)
+ *
+ * Description:     Binary search of history.sorted for one end of the
+ *                  range of lines starting with prefix
+ *
+ * Receives:        prefix      Characters the lines start with
+ *                  length      size_t  Number of characters in prefix
+ *                  past        bool    True for the end of the range,
+ *                                      false for its start
+ *
+ * Returns:         Index in history.sorted of the first line in the range,
+ *                  or of the first line after it
+ ******************************************************************************/
+
+size_t historyBound(const char *prefix, size_t length, bool past) {
+    size_t low = 0;                     // Lines before low are before it
+    size_t high = history.sortedCount;  // Lines from high on are after it
+
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = compareHistoryPrefix(history.sorted[middle], prefix,
+                                         length);
+        if(order < 0 || (past && order == 0)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*******************************************************************************
+ * Function name:   int compareNumbersDown(const void *left,
+ *                                         const void *right)
+ *
+ * Description:     qsort() comparison that puts uint32_t numbers in
+ *                  decreasing order
+ *
+ * Receives:        left        Pointer to a uint32_t
+ *                  right       Pointer to a uint32_t
+ *
+ * Returns:         Less than, equal to or more than 0
+ ******************************************************************************/
+
+int compareNumbersDown(const void *left, const void *right) {
+    uint32_t a = *(const uint32_t*)left;
+    uint32_t b = *(const uint32_t*)right;
+    return a > b ? -1 : a < b;
+}
+
+/*******************************************************************************
+ * Function name:   void addHistory(const char *line, size_t length)
+ *
+ * Description:     Appends a line to the history file and its entry to the
+ *                  index. The file is locked while they are written, so
+ *                  shells sharing a history add whole entries one at a
+ *                  time, each seeing the others' entries first.
+ *
+ * Receives:        line        Characters of the line, without a newline
+ *                  length      size_t  Number of characters in line
+ ******************************************************************************/
+
+void addHistory(const char *line, size_t length) {
+    if(history.textFD == -1) {
+        return;
+    }
+    flock(history.textFD, LOCK_EX);
+    mapHistory();
+
+    // A last line left without its newline is ended first
+    size_t offset = history.textSize;
+    if(offset > 0 && history.text[offset - 1] != '\n' &&
+       pwrite(history.textFD, "\n", 1, (off_t)offset) == 1) {
+        offset++;
+    }
+    struct iovec parts[2] = {{(void*)line, length}, {"\n", 1}};
+    HistoryEntry entry = {offset, historyKey(line, length)};
+    if(pwritev(history.textFD, parts, 2, (off_t)offset) ==
+       (ssize_t)length + 1) {
+        pwrite(history.indexFD, &entry, sizeof(entry),
+               (off_t)(history.count * sizeof(HistoryEntry)));
+    }
+    mapHistory();
+    flock(history.textFD, LOCK_UN);
+}
+
+/*******************************************************************************
+ * Function name:   bool expandHistory(Command *command)
+ *
+ * Description:     History expansion, run on a line typed interactively
+ *                  before it is parsed. A word starting with "!" outside
+ *                  single quotes is replaced by a history entry: "!!" is
+ *                  the last line, "!n" entry n, "!-n" the nth last line and
+ *                  "!prefix" the last line starting with prefix. A "!"
+ *                  that is escaped or isn't followed by one of these is
+ *                  left alone. The expanded line is printed.
+ *
+ * Postconditions:  command->line holds the expanded line, built in
+ *                  history.line, and command->lineLength its length
+ *
+ * Receives:        command     Command struct pointer
+ *
+ * Returns:         false if an entry wasn't found or the line got too long,
+ *                  after printing an error, true otherwise
+ ******************************************************************************/
+
+bool expandHistory(Command *command) {
+    const char *line = command->line;
+    size_t length = command->lineLength;
+    TokenState state = TOKEN_UNQUOTED;  // Quoting at the current character
+    size_t used = 0;                    // Characters of the expanded line
+    size_t copied = 0;                  // Characters of line handled so far
+
+    if(!memchr(line, HISTORY_CHAR, length)) {
+        return true;
+    }
+    for(size_t i = 0; i < length; i++) {
+        char c = line[i];
+        if(c == '\\' && state != TOKEN_SINGLE_QUOTED) {
+            i++;
+            continue;
+        }
+        if(c == '\'' && state != TOKEN_DOUBLE_QUOTED) {
+            state = state == TOKEN_UNQUOTED ? TOKEN_SINGLE_QUOTED
+                                            : TOKEN_UNQUOTED;
+            continue;
+        }
+        if(c == '"' && state != TOKEN_SINGLE_QUOTED) {
+            state = state == TOKEN_UNQUOTED ? TOKEN_DOUBLE_QUOTED
+                                            : TOKEN_UNQUOTED;
+            continue;
+        }
+        if(c != HISTORY_CHAR || state == TOKEN_SINGLE_QUOTED ||
+           (i > 0 && line[i - 1] != ' ' && line[i - 1] != '\t' &&
+            line[i - 1] != '"')) {
+            continue;
+        }
+
+        // Replace the reference with the entry it names
+        size_t number;
+        size_t refLength = historyReference(line + i, &number);
+        if(refLength == 0) {
+            continue;
+        }
+        if(number == 0) {
+            fprintf(stderr, "smallsh: %.*s: event not found\n",
+                    (int)refLength, line + i);
+            fflush(stdout);
+            return false;
+        }
+        size_t entryLength;
+        const char *entry = historyLine(number, &entryLength);
+        appendHistoryLine(&used, line + copied, i - copied);
+        appendHistoryLine(&used, entry, entryLength);
+        i += refLength - 1;
+        copied = i + 1;
+    }
+    if(copied == 0) {
+        return true;
+    }
+    appendHistoryLine(&used, line + copied, length - copied);
+    if(used > line_limit) {
+        fprintf(stderr, "smallsh: expanded line is longer than the limit of "
+                "%zu characters\n", line_limit);
+        fflush(stdout);
+        return false;
+    }
+    history.line[used] = '\0';
+    command->line = history.line;
+    command->lineLength = used;
+    printf("%s\n", history.line);
+    fflush(stdout);
+    return true;
+}
+
+/*******************************************************************************
+ * Function name:   size_t historyReference(const char *ref, size_t *number)
+ *
+ * Description:     Reads a history reference: "!!", "!n", "!-n" or
+ *                  "!prefix", where the prefix runs to the next blank,
+ *                  quote or operator character and starts with a letter,
+ *                  digit, "_", "." or "/".
+ *
+ * Postconditions:  number holds the number of the entry it names, or 0 if
+ *                  there is no such entry
+ *
+ * Receives:        ref         Characters starting with "!"
+ *                  number      size_t pointer for the entry's number
+ *
+ * Returns:         Number of characters in the reference, or 0 if ref isn't
+ *                  one
+ ******************************************************************************/
+
+size_t historyReference(const char *ref, size_t *number) {
+    size_t length = 1;      // Characters of the reference read so far
+
+    *number = 0;
+    if(ref[1] == HISTORY_CHAR) {
+        *number = history.count;
+        return 2;
+    }
+    bool back = ref[1] == '-';
+    if((ref[1] >= '0' && ref[1] <= '9') ||
+       (back && ref[2] >= '0' && ref[2] <= '9')) {
+        size_t n = 0;
+        length += back;
+        while(ref[length] >= '0' && ref[length] <= '9') {
+            n = n * 10 + (size_t)(ref[length++] - '0');
+        }
+        if(n >= 1 && n <= history.count) {
+            *number = back ? history.count - n + 1 : n;
+        }
+        return length;
+    }
+    if(!isNameChar(ref[1], false) && ref[1] != '.' && ref[1] != '/') {
+        return 0;
+    }
+    while(ref[length] && !strchr(" \t'\"|&<>", ref[length])) {
+        length++;
+    }
+    *number = findHistoryPrefix(ref + 1, length - 1);
+    return length;
+}
+
+/*******************************************************************************
+ * Function name:   void appendHistoryLine(size_t *used, const char *text,
+ *                                         size_t length)
+ *
+ * Description:     Adds characters to the line being built by history
+ *                  expansion, doubling history.line when they don't fit.
+ *
+ * Postconditions:  used has grown by length and history.line has room for
+ *                  a terminator after it
+ *
+ * Receives:        used        size_t pointer to the characters in the line
+ *                  text        Characters to add
+ *                  length      size_t  Number of characters in text
+ ******************************************************************************/
+
+void appendHistoryLine(size_t *used, const char *text, size_t length) {
+    if(*used + length + 1 > history.lineSize) {
+        size_t size = history.lineSize ? history.lineSize : CMD_CHARS;
+        while(*used + length + 1 > size) {
+            size *= 2;
+        }
+        history.line = heapRealloc(history.line, size);
+        history.lineSize = size;
+    }
+    memcpy(history.line + *used, text, length);
+    *used += length;
+}
+
+/*******************************************************************************
+ * Function name:   int historyBuiltin(char **args)
+ *
+ * Description:     Built-in history command. Lists every history entry
+ *                  with its number, or the last count entries with
+ *                  history count. history -s prefix lists the entries that
+ *                  start with prefix, most recent first.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, or 2 after a usage error
+ ******************************************************************************/
+
+int historyBuiltin(char **args) {
+    const char *line;       // Entry being listed
+    size_t length;          // Number of characters in line
+    size_t first = 1;       // Number of the first entry listed
+
+    openHistory();
+    if(args[1] && !strcmp(args[1], "-s") && args[2] && !args[3]) {
+        size_t prefixLength = strlen(args[2]);
+        size_t start = historyBound(args[2], prefixLength, false);
+        size_t sorted = historyBound(args[2], prefixLength, true) - start;
+        uint32_t *numbers = heapAlloc((sorted + history.count -
+                                       history.sortedCount + 1) *
+                                      sizeof(uint32_t));
+
+        // The entries not in the sorted index are newer than the rest, and
+        // are found newest first
+        size_t count = 0;
+        size_t number = history.count + 1;
+        while((number = scanHistoryPrefix(args[2], prefixLength, number,
+                                          history.sortedCount))) {
+            numbers[count++] = (uint32_t)number;
+        }
+        if(sorted > 0) {
+            memcpy(numbers + count, history.sorted + start,
+                   sorted * sizeof(uint32_t));
+            qsort(numbers + count, sorted, sizeof(uint32_t),
+                  compareNumbersDown);
+            count += sorted;
+        }
+        for(size_t i = 0; i < count; i++) {
+            line = historyLine(numbers[i], &length);
+            printf("%5u  %.*s\n", numbers[i], (int)length, line);
+        }
+        heapFree(numbers);
+        fflush(stdout);
+        return 0;
+    }
+    if(args[1]) {
+        char *end = NULL;
+        long count = strtol(args[1], &end, 10);
+        if(args[2] || *end || count < 0) {
+            fprintf(stderr, "usage: history [count | -s prefix]\n");
+            fflush(stdout);
+            return 2;
+        }
+        if((size_t)count < history.count) {
+            first = history.count - (size_t)count + 1;
+        }
+    }
+    for(size_t number = first; number <= history.count; number++) {
+        line = historyLine(number, &length);
+        printf("%5zu  %.*s\n", number, (int)length, line);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int ulimitBuiltin(char **args)
+ *
+ * Description:     Built-in ulimit command:
+ *                  ulimit [-H | -S] [-a | -c | -d | -f | -n | -s | -t | -u |
+ *                  -v] [limit]
+ *                  Shows or sets a resource limit of the commands the shell
+ *                  launches, -f (file size) if no limit is chosen. A limit
+ *                  is a number of the units ulimit -a lists, or "unlimited".
+ *                  -S sets only the soft limit and -H only the hard one;
+ *                  without either both are set, and the soft limit is
+ *                  shown. Unlike the ulimit of other shells the shell's own
+ *                  limits are left alone, so a low limit on open files or
+ *                  memory can't break the shell.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, 1 if the limit can't be set, or 2 after a usage error
+ ******************************************************************************/
+
+int ulimitBuiltin(char **args) {
+    bool softOnly = false;  // True if -S was given
+    bool hardOnly = false;  // True if -H was given
+    bool all = false;       // True if -a was given
+    int index = limitOption('f');   // Limit shown or set
+    int i = 1;
+
+    for(; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        for(char *option = args[i] + 1; *option; option++) {
+            int chosen = limitOption(*option);
+            if(*option == 'S' || *option == 'H') {
+                softOnly = *option == 'S';
+                hardOnly = *option == 'H';
+            } else if(*option == 'a') {
+                all = true;
+            } else if(chosen != -1) {
+                index = chosen;
+            } else {
+                fprintf(stderr, "usage: ulimit [-H | -S] [-a | -cdfnstuv] "
+                        "[limit]\n");
+                fflush(stdout);
+                return 2;
+            }
+        }
+    }
+    if(args[i] && (args[i + 1] || all)) {
+        fprintf(stderr, "usage: ulimit [-H | -S] [-a | -cdfnstuv] [limit]\n");
+        fflush(stdout);
+        return 2;
+    }
+
+    // Show the limits commands are launched with
+    const LimitOption *option = &limit_options[index];
+    struct rlimit shell;    // The shell's own limit
+    getrlimit(option->resource, &shell);
+    struct rlimit limit = job_limits.set & (1u << index)
+                          ? job_limits.limits[index] : shell;
+    if(all) {
+        for(int j = 0; j < LIMIT_OPTIONS; j++) {
+            getrlimit(limit_options[j].resource, &limit);
+            if(job_limits.set & (1u << j)) {
+                limit = job_limits.limits[j];
+            }
+            printf("%-24s(-%c) ", limit_options[j].name,
+                   limit_options[j].option);
+            printLimit(hardOnly ? limit.rlim_max : limit.rlim_cur,
+                       limit_options[j].unit);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if(!args[i]) {
+        printLimit(hardOnly ? limit.rlim_max : limit.rlim_cur, option->unit);
+        fflush(stdout);
+        return 0;
+    }
+
+    // Set the soft limit, the hard limit or both
+    rlim_t value;
+    if(!parseLimit(args[i], option->unit, &value)) {
+        fprintf(stderr, "ulimit: %s: invalid limit\n", args[i]);
+        fflush(stdout);
+        return 1;
+    }
+    if(!hardOnly) {
+        limit.rlim_cur = value;
+    }
+    if(!softOnly) {
+        limit.rlim_max = value;
+    }
+    if(limit.rlim_cur > limit.rlim_max) {
+        fprintf(stderr, "ulimit: -%c: soft limit is above the hard limit\n",
+                option->option);
+        fflush(stdout);
+        return 1;
+    }
+    if(limit.rlim_max > shell.rlim_max && geteuid() != 0) {
+        fprintf(stderr, "ulimit: -%c: can't raise the hard limit\n",
+                option->option);
+        fflush(stdout);
+        return 1;
+    }
+
+    // A command launched with the shell's own limits needn't set them
+    job_limits.limits[index] = limit;
+    if(limit.rlim_cur == shell.rlim_cur && limit.rlim_max == shell.rlim_max) {
+        job_limits.set &= ~(1u << index);
+    } else {
+        job_limits.set |= 1u << index;
+    }
+    return 0;
+}
 
 /*******************************************************************************
- * Function name:   void initCommand(Command *command)
- *
- * Description:     Initializes a Command struct.
+ * Function name:   int limitOption(char option)
  *
- * Preconditions:   Command struct is uninitialized
+ * Description:     Finds the resource limit a ulimit option letter selects.
  *
- * Postconditions:  Memory has been allocated for the args char pointer array
- *                  and all pointers are set to NULL, numArgs = 0, and
- *                  background = false.
+ * Receives:        option      Option letter
  *
- * Receives:        command     Command struct pointer
+ * Returns:         Index of the limit in limit_options, or -1 if the letter
+ *                  doesn't select one
  ******************************************************************************/
 
-void initCommand(Command *command) {
-    // Allocate memory for args and set pointers to NULL
-    command->args = malloc(sizeof(char*) * MAX_ARGS + 1);
-    for(int i = 0; i < MAX_ARGS + 1; i++) {
-        command->args[i] = NULL;
+int limitOption(char option) {
+    for(int i = 0; i < LIMIT_OPTIONS; i++) {
+        if(limit_options[i].option == option) {
+            return i;
+        }
     }
-    // Set all other struct members to defaults
-    command->line = NULL;
-    command->numArgs = 0;
-    command->background = false;
+    return -1;
 }
 
 /*******************************************************************************
- * Function name:   void freeCommand(Command *command)
+ * Function name:   bool parseLimit(const char *value, rlim_t unit,
+ *                                  rlim_t *limit)
  *
- * Description:     Frees the memory allocated for members of a Command struct
+ * Description:     Converts a limit given to ulimit into a resource limit.
  *
- * Postconditions:  All memory allocated for args and line members has been
- *                  freed.
+ * Receives:        value       A number of units, or "unlimited"
+ *                  unit        Size of one unit
+ *                  limit       Where the limit is stored
  *
- * Receives:        command     Command struct pointer
+ * Returns:         false if value isn't a limit that can be represented
  ******************************************************************************/
 
-void freeCommand(Command *command) {
-    // Free and set to NULL all args pointers that aren't already NULL
-    int i = 0;
-    while(command->args[i]) {
-        free(command->args[i]);
-        command->args[i] = NULL;
-        i++;
+bool parseLimit(const char *value, rlim_t unit, rlim_t *limit) {
+    char *end = NULL;
+
+    if(!strcmp(value, "unlimited")) {
+        *limit = RLIM_INFINITY;
+        return true;
+    }
+    if(*value < '0' || *value > '9') {
+        return false;
     }
-    // Free the args array and command line
-    free(command->args);
-    if(command->line) {
-        free(command->line);
-        command->line = NULL;
+    errno = 0;
+    unsigned long long count = strtoull(value, &end, 10);
+    if(*end || errno == ERANGE || count >= (RLIM_INFINITY - 1) / unit) {
+        return false;
     }
+    *limit = count * unit;
+    return true;
 }
 
 /*******************************************************************************
- * Function name:   void promptLoop(Command *command)
+ * Function name:   void printLimit(rlim_t limit, rlim_t unit)
  *
- * Description:     Prompts user for input. Ignores input that is blank,
- *                  represents a comment, or has more characters than the limit.
- *                  Parses the input and executes the command, then prompts the
- *                  user again in a loop until the user runs the exit command.
+ * Description:     Prints a resource limit on its own line in the units
+ *                  ulimit takes it in.
  *
- * Receives:        command     Command struct pointer
+ * Receives:        limit       Resource limit
+ *                  unit        Size of one unit
  ******************************************************************************/
 
-void promptLoop(Command *command) {
-    size_t len;             // Size of initial buffer
-    ssize_t chars_read;     // Number of characters read by getline()
-    int returnStatus = 0;   // Return value of executeCommand()
-    // -1 means the user typed in the exit command
-    // Prompt user
-    while(true) {
-        do {
-            checkBackgroundChildren();  // Check for terminated bg children
-            printf("%s", PROMPT);
-            fflush(stdout);
-            chars_read = getline(&command->line, &len, stdin);
-            // Handle error if getline() is interrupted by a signal
-            if(chars_read == -1) {
-                clearerr(stdin);
-                continue;
-            }
-            command->line[strcspn(command->line, "\n")] = 0;
-        } while(command->line[0] == COMMENT_PREFIX || strlen(command->line) == 0
-                || chars_read > MAX_CMD_CHARS + 1);
-
-        // Parse and execute command
-        parseCommandLine(command);
-        returnStatus = executeCommand(command);
-        freeCommand(command);
-
-        // If user typed exit, quit the program by returning to main.
-        if(returnStatus == -1) {
-            free(command);
-            return;
-        }
-
-        // Otherwise, initialize the Command struct to prepare for more input
-        initCommand(command);
+void printLimit(rlim_t limit, rlim_t unit) {
+    if(limit == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(limit / unit));
     }
 }
 
 /*******************************************************************************
- * Function name:   void parseCommandLine(Command *command)
- *
- * Description:     Parses the line entered by the user into an array of tokens
- *                  which is stored in command->args.
+ * Function name:   void applyJobLimits()
  *
- * Preconditions:   command->line contains user input
+ * Description:     Sets the limits given to ulimit on the calling process,
+ *                  a child about to run its command. A child that can't
+ *                  have its limits doesn't run the command at all.
  *
- * Postconditions:  command->args contains parsed user input
- *
- * Receives:        command     Command struct pointer
+ * Postconditions:  Every limit in job_limits is in effect, or the process
+ *                  has exited with status 1
  ******************************************************************************/
 
-void parseCommandLine(Command *command) {
-    int i = 0;                                      // Index for command->args
-    char* token = strtok(command->line, " \n");     // Get first token
-
-    // Get remaining tokens and copy them into command->args
-    while(token && i < MAX_ARGS) {
-        command->args[i] = malloc(sizeof(char) * (strlen(token) + 1));
-        strcpy(command->args[i], token);
-        expandPID(&command->args[i]);
-        i++;
-        token = strtok(NULL, " \n");
+void applyJobLimits() {
+    for(int i = 0; i < LIMIT_OPTIONS; i++) {
+        if((job_limits.set & (1u << i)) &&
+           setrlimit(limit_options[i].resource, &job_limits.limits[i]) == -1) {
+            fprintf(stderr, "ulimit: -%c: %s\n", limit_options[i].option,
+                    strerror(errno));
+            fflush(stdout);
+            exit(1);
+        }
     }
-
-    // Set argument count
-    command->numArgs = i;
 }
 
 /*******************************************************************************
- * Function name:   void expandPID(char** argument)
+ * Function name:   bool findSliceRoot()
  *
- * Description:     Takes in a pointer to an argument, searches for the
- *                  substring "$$", and replaces it with the
- *                  PID of the currently running process.
+ * Description:     Opens the cgroup v2 directory slices are made in: the
+ *                  directory named by SMALLSH_CGROUP, or else the shell's
+ *                  own cgroup under the cgroup2 mount. Its subtree has to be
+ *                  delegated to the user running the shell.
  *
- * Postconditions:  All instances of "$$" have been replaced with the PID
+ * Postconditions:  slice_table.root and slice_table.rootFD are set if the
+ *                  directory was opened; otherwise the error has been
+ *                  printed
  *
- * Receives:        argument        char double-pointer
+ * Returns:         true if the slice root is open
  ******************************************************************************/
 
-void expandPID(char** argument) {
-    // Iterate through the argument looking for "$$"
-    for(int i = 0; i < strlen(*argument) - 1; i++) {
-        if((*argument)[i] == PID_EXPAND_CHAR &&
-           (*argument)[i + 1] == PID_EXPAND_CHAR) {
-
-            // Get the PID as a string
-            char* pidStr = NULL;
-            int numPIDChars = getPIDString(&pidStr);
-
-            // Create new string large enough to contain PID expansion
-            char* newArg = malloc(sizeof(char) *
-                                  (strlen(*argument) - 1) + numPIDChars);
-            memset(newArg, '\0', strlen(*argument) -1 + numPIDChars);
+bool findSliceRoot() {
+    char path[PATH_MAX];    // Path of the slice root
+    char *line = NULL;      // Line of a /proc file
+    size_t lineSize = 0;    // Size of the buffer allocated for line
 
-            // Copy argument before "$$" to new string, then PID, then
-            // argument after "$$"
-            strncpy(newArg, *argument, (size_t)i);
-            strcat(newArg, pidStr);
-            strncat(newArg, (*argument) + (i + 2), strlen(*argument) - i);
-
-            // Replace old argument with new expanded string
-            free(pidStr);
-            free(*argument);
-            *argument = newArg;
-            newArg = NULL;
-
-            // Recursively look for more instances of "$$"
-            expandPID(argument);
-
-            return;
+    if(slice_table.rootFD != -1) {
+        return true;
+    }
+    char *root = getenv(CGROUP_VAR);
+    if(root && *root) {
+        snprintf(path, sizeof(path), "%s", root);
+    } else {
+        // The shell's cgroup is a path from the cgroup2 mount's root
+        char mount[PATH_MAX] = "";
+        char type[16];
+        FILE *mounts = fopen(CGROUP_MOUNTS, "re");
+        while(mounts && getline(&line, &lineSize, mounts) != -1) {
+            if(sscanf(line, "%*s %4095s %15s", mount, type) == 2 &&
+               !strcmp(type, "cgroup2")) {
+                break;
+            }
+            mount[0] = '\0';
+        }
+        if(mounts) {
+            fclose(mounts);
+        }
+        FILE *self = mount[0] ? fopen(CGROUP_SELF, "re") : NULL;
+        path[0] = '\0';
+        while(self && getline(&line, &lineSize, self) != -1) {
+            if(!strncmp(line, "0::/", 4)) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(path, sizeof(path), "%s%s", mount,
+                         strcmp(line + 3, "/") ? line + 3 : "");
+                break;
+            }
+        }
+        if(self) {
+            fclose(self);
+        }
+        free(line);
+        if(!path[0]) {
+            fprintf(stderr, "slice: no cgroup v2 hierarchy found; set "
+                    CGROUP_VAR "\n");
+            fflush(stdout);
+            return false;
         }
     }
-}
-
-/*******************************************************************************
- * Function name:   int getPIDString(char **pidStr)
- *
- * Description:     Takes in a char pointer, gets the PID of the running
- *                  process, copies the PID into a char array attached to the
- *                  char pointer.
- *
- * Postconditions:  Char pointer points to PID string
- *
- * Receives:        pidStr      Char double-pointer
- *
- * Returns:         The number of characters in the string representation
- *                  of the PID
- ******************************************************************************/
 
-int getPIDString(char **pidStr) {
-    pid_t pid = getpid();
-    *pidStr = malloc(sizeof(char) * MAX_PID_CHARS);
-    return sprintf(*pidStr, "%ld", (long)pid);
+    slice_table.rootFD = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(slice_table.rootFD == -1) {
+        fprintf(stderr, "slice: %s: %s\n", path, strerror(errno));
+        fflush(stdout);
+        return false;
+    }
+    slice_table.root = heapAlloc(strlen(path) + 1);
+    strcpy(slice_table.root, path);
+    return true;
 }
 
 /*******************************************************************************
- * Function name:   void printExitValOrSignal(int exitStatus)
+ * Function name:   int findSlice(const char *name)
  *
- * Description:     Takes in an integer representing the exit status of a
- *                  process. If the process exited normally, prints the exit
- *                  value. If the process was killed by a signal, prints
- *                  the signal number.
+ * Description:     Finds the slice with the given name, creating its cgroup
+ *                  under the slice root if the shell hasn't opened it. A
+ *                  cgroup that already exists, made by another shell for
+ *                  instance, is joined as it is.
  *
- * Preconditions:   exitStatus is the exit status of a process
+ * Receives:        name        Name of the slice
  *
- * Receives:        exitStatus      int     Exit status of a process
+ * Returns:         Index of the slice in the slice table, or -1 if it
+ *                  couldn't be opened (the error has already been printed)
  ******************************************************************************/
 
-void printExitValOrSignal(int exitStatus) {
-    if(WIFEXITED(exitStatus)) {
-        printf("exit value %d\n", WEXITSTATUS(exitStatus));
+int findSlice(const char *name) {
+    for(int i = 0; i < slice_table.count; i++) {
+        if(!strcmp(slice_table.slices[i].name, name)) {
+            return i;
+        }
+    }
+    if(!*name || strchr(name, '/') || !strcmp(name, ".") ||
+       !strcmp(name, "..")) {
+        fprintf(stderr, "slice: %s: not a valid name\n", name);
         fflush(stdout);
-    } else if (WIFSIGNALED(exitStatus)) {
-        printf("terminated by signal %d\n", WTERMSIG(exitStatus));
+        return -1;
+    }
+    if(!findSliceRoot()) {
+        return -1;
+    }
+
+    int fd = -1;            // FD of the slice's directory
+    if(mkdirat(slice_table.rootFD, name, 0755) == 0 || errno == EEXIST) {
+        fd = openat(slice_table.rootFD, name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if(fd == -1) {
+        fprintf(stderr, "slice: %s/%s: %s\n", slice_table.root, name,
+                strerror(errno));
         fflush(stdout);
+        return -1;
+    }
+
+    if(slice_table.count == slice_table.capacity) {
+        slice_table.capacity = slice_table.capacity
+                               ? slice_table.capacity * 2 : SLICE_TABLE_SIZE;
+        slice_table.slices = heapRealloc(slice_table.slices, sizeof(Slice) *
+                                         slice_table.capacity);
     }
+    Slice *slice = &slice_table.slices[slice_table.count];
+    slice->name = heapAlloc(strlen(name) + 1);
+    strcpy(slice->name, name);
+    slice->fd = fd;
+    return slice_table.count++;
 }
 
 /*******************************************************************************
- * Function name:   int executeCommand(Command *command)
+ * Function name:   bool writeSliceSetting(Slice *slice, const char *setting)
  *
- * Description:     Takes in a Command struct and executes the command
- *                  represented by the arguments in the args array.
+ * Description:     Writes a setting such as cpu.max=50000 or memory.max=1G
+ *                  to the file of that name in the slice's cgroup. A file
+ *                  that doesn't exist yet belongs to a controller not yet
+ *                  enabled for the slice root's children, so the controller
+ *                  named before the dot is enabled first.
  *
- * Preconditions:   command has received user input via promptLoop and its
- *                  arguments have been parsed with parseCommandLine()
- *
- * Receives:        command     Command struct pointer
+ * Receives:        slice       Slice struct pointer
+ *                  setting     FILE=VALUE
  *
- * Returns:         int     -1 if the user used the exit command
- *                           0 otherwise
+ * Returns:         true if the value was written, false after the error
+ *                  has been printed
  ******************************************************************************/
 
-int executeCommand(Command *command) {
-    struct sigaction default_action = {{0}};    // Sigaction for overriding
-    default_action.sa_handler = SIG_DFL;        // SIG_IGN with SIG_DFL
+bool writeSliceSetting(Slice *slice, const char *setting) {
+    char file[NAME_MAX + 2];    // Name of the file, or "+" and a controller
+    const char *equals = strchr(setting, '=');
+    size_t length = equals ? (size_t)(equals - setting) : 0;
 
-    static int fgStatus = 0;        // Exit status of foreground processes
+    if(length == 0 || length > NAME_MAX || memchr(setting, '/', length)) {
+        fprintf(stderr, "slice: %s: expected FILE=VALUE\n", setting);
+        fflush(stdout);
+        return false;
+    }
 
-    // If final argument is "&", set command into background mode
-    if(!strcmp(command->args[command->numArgs - 1], BACKGROUND_STR)) {
-        if(!foreground_only) {
-            command->background = true;
+    // Enable the file's controller in the root's cgroup.subtree_control
+    char *dot = memchr(setting, '.', length);
+    if(dot) {
+        memcpy(file, setting, length);
+        file[length] = '\0';
+        if(faccessat(slice->fd, file, F_OK, 0) == -1) {
+            file[0] = '+';
+            memcpy(file + 1, setting, dot - setting);
+            file[dot - setting + 1] = '\0';
+            int control = openat(slice_table.rootFD, "cgroup.subtree_control",
+                                 O_WRONLY | O_CLOEXEC);
+            // If this fails, opening the file below reports it missing
+            if(control != -1) {
+                write(control, file, strlen(file));
+                close(control);
+            }
         }
-
-        // Erase the final argument and decrement argument count
-        free(command->args[command->numArgs - 1]);
-        command->args[command->numArgs - 1] = NULL;
-        command->numArgs--;
     }
 
-    // Built-in exit command: return -1 so that promptLoop() will return
-    // and quit the program
-    if(!strcmp(command->args[0], "exit")) {
-        return -1;
+    memcpy(file, setting, length);
+    file[length] = '\0';
+    int fd = openat(slice->fd, file, O_WRONLY | O_CLOEXEC);
+    if(fd == -1 || write(fd, equals + 1, strlen(equals + 1)) == -1) {
+        fprintf(stderr, "slice: %s/%s: %s\n", slice->name, file,
+                strerror(errno));
+        fflush(stdout);
+        if(fd != -1) {
+            close(fd);
+        }
+        return false;
     }
+    close(fd);
+    return true;
+}
 
-    // Built-in cd command
-    if(!strcmp(command->args[0], "cd")) {
-        // User has given a directory argument: go to that directory
-        if(command->args[1]) {
-            chdir(command->args[1]);
+/*******************************************************************************
+ * Function name:   void printSliceSetting(Slice *slice, const char *file,
+ *                                         int width)
+ *
+ * Description:     Prints the first line of a file of the slice's cgroup
+ *                  as a column of the slice list, or "-" if it can't be
+ *                  read.
+ *
+ * Receives:        slice       Slice struct pointer
+ *                  file        Name of the file
+ *                  width       Width the column is padded to
+ ******************************************************************************/
 
-            // User hasn't given any arguments: go home
-        } else {
-            chdir(getenv("HOME"));
-        }
-        return 0;
-    }
+void printSliceSetting(Slice *slice, const char *file, int width) {
+    char value[SLICE_VALUE_MAX];    // Contents of the file
+    ssize_t length = -1;
 
-    // Built-in status command
-    if(!strcmp(command->args[0], "status")) {
-        printExitValOrSignal(fgStatus);
-        return 0;
+    int fd = openat(slice->fd, file, O_RDONLY | O_CLOEXEC);
+    if(fd != -1) {
+        length = read(fd, value, sizeof(value) - 1);
+        close(fd);
+    }
+    if(length <= 0) {
+        strcpy(value, "-");
+    } else {
+        value[length] = '\0';
+        value[strcspn(value, "\n")] = '\0';
     }
+    printf("  %-*s", width, value);
+}
 
-    // All other commands: fork off a child process and run the existing command
-    pid_t spawnPid = fork();
+/*******************************************************************************
+ * Function name:   int sliceBuiltin(char **args)
+ *
+ * Description:     Built-in slice command:
+ *                  slice                       lists the slices
+ *                  slice -s NAME FILE=VALUE ...    writes cgroup settings
+ *                  slice -b [NAME]             launches every background
+ *                                              job into NAME, or stops
+ *                  slice NAME command ...      launches one job into NAME
+ *                  A slice is a cgroup v2 group under the slice root,
+ *                  created the first time it is named. The last form is
+ *                  handled by slicePrefix() before the command runs.
+ *
+ * Receives:        args        NULL-terminated argument list
+ *
+ * Returns:         0, 1 if a slice or setting failed, or 2 after a usage
+ *                  error
+ ******************************************************************************/
 
-    // Handle fork errors
-    if(spawnPid == -1) {
-        perror("fork()");
-        exit(1);
+int sliceBuiltin(char **args) {
+    int status = 0;         // Exit status
 
-        // Child process
-    } else if(spawnPid == 0) {
-        // If foreground process, receive SIGINT signals
-        if(!command->background) {
-            sigaction(SIGINT, &default_action, NULL);
+    if(!args[1]) {
+        if(slice_table.count > 0) {
+            printf("  %-16s  %-16s  %s\n", "slice", "cpu.max", "memory.max");
+        }
+        for(int i = 0; i < slice_table.count; i++) {
+            Slice *slice = &slice_table.slices[i];
+            printf("%c %-16s", i == slice_table.background ? '*' : ' ',
+                   slice->name);
+            printSliceSetting(slice, "cpu.max", 16);
+            printSliceSetting(slice, "memory.max", 0);
+            printf("\n");
         }
-        // Process IO redirections and execute command
-        redirect(command);
-        execvp(command->args[0], command->args);
-
-        // Handle command errors
-        perror(command->args[0]);
         fflush(stdout);
-        exit(1);
-
-        // Parent process
-    } else {
-        // Wait for foreground processes
-        if(!command->background) {
-            spawnPid = waitpid(spawnPid, &fgStatus, 0);
-            // Display signal number if terminated by signal
-            if(WIFSIGNALED(fgStatus)) {
-                printf("terminated by signal %d\n", WTERMSIG(fgStatus));
-                fflush(stdout);
+        return 0;
+    }
+    if(!strcmp(args[1], "-s") && args[2]) {
+        int index = findSlice(args[2]);
+        if(index == -1) {
+            return 1;
+        }
+        for(int i = 3; args[i]; i++) {
+            if(!writeSliceSetting(&slice_table.slices[index], args[i])) {
+                status = 1;
             }
         }
-            // Print PID for background processes
-        else {
-            printf("background pid is %d\n", spawnPid);
-            fflush(stdout);
+        return status;
+    }
+    if(!strcmp(args[1], "-b") && (!args[2] || !args[3])) {
+        int index = args[2] ? findSlice(args[2]) : -1;
+        if(args[2] && index == -1) {
+            return 1;
         }
+        slice_table.background = index;
         return 0;
     }
+    fprintf(stderr, "usage: slice [-s name file=value ... | -b [name] | "
+            "name command ...]\n");
+    fflush(stdout);
+    return 2;
 }
 
 /*******************************************************************************
- * Function name:   void redirect(Command* command)
- *
- * Description:     Takes in a Command struct and handles any IO redirections
- *                  given in the command. If the process is a background
- *                  process any redirection not specified by the user will
- *                  go to/from /dev/null.
+ * Function name:   bool slicePrefix(Command *command, int *slice)
  *
- * Preconditions:   command has received user input via promptLoop and its
- *                  arguments have been parsed with parseCommandLine()
+ * Description:     Handles slice NAME command ...: removes "slice" and the
+ *                  name from the first stage so the rest of the line runs
+ *                  as a job launched into the slice.
  *
- * Postconditions:  IO has been redirected
+ * Preconditions:   The first stage has a command after the slice's name
  *
  * Receives:        command     Command struct pointer
+ *                  slice       Where the slice's index is stored
+ *
+ * Returns:         true if there is a job to launch, false after the error
+ *                  has been printed
  ******************************************************************************/
 
-void redirect(Command* command) {
-    int oldOutputFD = 0;        // File descriptor for redirected output
-    int oldInputFD = 0;         // File descriptor for redirected input
-    int result = 0;             // Contains return value of dup2()
-    int i = 0;                  // Index for command arguments
-    int redirectIndex = MAX_ARGS - 1;   // Index of first redirect operator
-    bool inputRedirected = false;       // Flag: user specified input redirect
-    bool outputRedirected = false;      // Flag: user specified output redirect
-
-    while(command->args[i]) {
-        if(!strcmp(command->args[i], INPUT_REDIRECT) ||
-           !strcmp(command->args[i], OUTPUT_REDIRECT)) {
-            // Set redirectIndex to index of first redirect operator found
-            if(i < redirectIndex) {
-                redirectIndex = i;
-            }
-            // If redirect operator is for input, use the filename specified
-            // in the next argument to create a new FD
-            if(!strcmp(command->args[i], INPUT_REDIRECT)) {
-                oldInputFD = open(command->args[i + 1], O_RDONLY);
-                // Handle errors opening filename
-                if(oldInputFD == -1) {
-                    perror(command->args[i + 1]);
-                    fflush(stdout);
-                    exit(1);
-                }
-                inputRedirected = true;
-            }
-                // If redirect operator is for output, use the filename specified
-                // in the next argument to create a new FD
-            else if(!strcmp(command->args[i], OUTPUT_REDIRECT)) {
-                oldOutputFD = open(command->args[i + 1],
-                                   O_RDWR | O_CREAT | O_TRUNC, 0644);
-                // Handle errors opening filename
-                if(oldOutputFD == -1) {
-                    perror(command->args[i + 1]);
-                    fflush(stdout);
-                    exit(1);
-                }
-                outputRedirected = true;
-            }
+bool slicePrefix(Command *command, int *slice) {
+    Stage *stage = &command->stages[0];
 
-            // Advance past redirect operator and filename argument
-            i += 2;
+    *slice = findSlice(stage->args[1]);
+    if(*slice == -1) {
+        return false;
+    }
+    stage->args += 2;
+    stage->numArgs -= 2;
+    command->numArgs -= 2;
+    return true;
+}
 
-        } else {
-            // Continue to iterate through arguments
-            i++;
-        }
+/*******************************************************************************
+ * Function name:   pid_t cloneIntoSlice(int fd)
+ *
+ * Description:     Creates a child process the way fork() does, but in the
+ *                  cgroup of a slice from its first instruction, with
+ *                  clone3() and CLONE_INTO_CGROUP. Like the spawn server's
+ *                  clone() the raw system call skips glibc's fork handlers,
+ *                  which the single-threaded shell doesn't need. On a kernel
+ *                  without them (before 5.7) the child is forked and writes
+ *                  itself into the cgroup's cgroup.procs before it does
+ *                  anything else.
+ *
+ * Receives:        fd          FD of the slice's directory
+ *
+ * Returns:         PID of the child in the parent, 0 in the child, or -1 if
+ *                  no child was created
+ ******************************************************************************/
+
+pid_t cloneIntoSlice(int fd) {
+    struct clone_args args;     // Child signals SIGCHLD, starts in fd
+
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = (uint64_t)fd;
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+    if(pid > 0) {
+        slice_table.cloned++;
+    }
+    if(pid != -1 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL)) {
+        return pid;
     }
 
-    // User redirected input, or no input specified and process in background
-    if(inputRedirected || (!inputRedirected && command->background)) {
-        // No input specified and process is in background: create FD by
-        // opening /dev/null
-        if(!inputRedirected && command->background) {
-            oldInputFD = open("/dev/null", O_RDONLY);
-        }
-        // Redirect input and handle errors
-        result = dup2(oldInputFD, STDIN_FILENO);
-        if(result == -1) {
-            fprintf(stderr, "cannot redirect input\n");
+    pid = fork();
+    if(pid > 0) {
+        slice_table.moved++;
+    } else if(pid == 0) {
+        int procs = openat(fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if(procs == -1 || write(procs, "0", 1) == -1) {
+            perror("cgroup.procs");
             fflush(stdout);
-            exit(2);
+            exit(1);
         }
-        close(oldInputFD);
+        close(procs);
     }
+    return pid;
+}
+
+/*******************************************************************************
+ * Function name:   void benchmarkSpawn(int runs)
+ *
+ * Description:     Launches and waits for /bin/true repeatedly through the
+ *                  fork() path, the posix_spawn() path and then the spawn
+ *                  server, printing the number of commands per second each
+ *                  path achieves.
+ *
+ * Receives:        runs        int     Number of commands to run per path
+ ******************************************************************************/
+
+void benchmarkSpawn(int runs) {
+    char *args[] = {BENCH_SPAWN_CMD, NULL};     // Benchmarked command
+    Stage stage = {args, 1, -1};                // Foreground command
+    Launch launch = {-1, -1, -1, false, false, -1, -1}; // Shell's stdio
+    struct timespec start, end;                 // Monotonic timestamps
+    int status = 0;                             // Exit status of each child
 
-    // User redirected output, or no output specified and process in background
-    if(outputRedirected || (!outputRedirected && command->background)) {
-        // No output specified and process is in background: create FD by
-        // opening /dev/null
-        if(!outputRedirected && command->background) {
-            oldOutputFD = open("/dev/null", O_RDWR);
+    for(int path = 0; path < 3; path++) {
+        char *names[] = {"fork", "posix_spawn", "server"};
+        if(path == 2 && spawn_server_fd == -1 && !startSpawnServer()) {
+            return;
         }
-        // Redirect output and handle errors
-        result = dup2(oldOutputFD, STDOUT_FILENO);
-        if(result == -1) {
-            fprintf(stderr, "cannot redirect output\n");
-            fflush(stdout);
-            exit(2);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(int i = 0; i < runs; i++) {
+            pid_t pid = path == 0 ? forkStage(&stage, &launch)
+                        : path == 1 ? spawnStage(&stage, &launch)
+                                    : serverStage(&stage, &launch);
+            if(pid == -1) {
+                return;
+            }
+            waitpid(pid, &status, 0);
         }
-        close(oldOutputFD);
-    }
+        clock_gettime(CLOCK_MONOTONIC, &end);
 
-    // If the user specified any IO redirection, delete all arguments
-    // pertaining to IO redirection so that they won't be sent to child
-    // process.
-    if(redirectIndex < MAX_ARGS - 1) {
-        i = redirectIndex;
-        while(command->args[i]) {
-            free(command->args[i]);
-            command->args[i] = NULL;
-            command->numArgs--;
-            i++;
-        }
+        double seconds = (double)(end.tv_sec - start.tv_sec) +
+                         (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-12s %d commands in %.3f s: %.0f commands/sec\n",
+               names[path], runs, seconds, runs / seconds);
+        fflush(stdout);
     }
 }
 
 /*******************************************************************************
- * Function name:   void checkBackgroundChildren()
+ * Function name:   uint64_t clockNanoseconds(clockid_t clock)
  *
- * Description:     Checks for any child processes that have terminated. If
- *                  one is found, prints a notification including PID and
- *                  either exit status or signal number.
+ * Description:     Reads a clock
+ *
+ * Receives:        clock       clockid_t   Clock to read
+ *
+ * Returns:         The clock's time in nanoseconds
  ******************************************************************************/
 
-void checkBackgroundChildren() {
-    pid_t pid;      // PID of child process
-    int bgStatus;   // Exit status of child
+uint64_t clockNanoseconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*******************************************************************************
+ * Function name:   void startStartupProfile()
+ *
+ * Description:     Starts timing the steps of startup. The time from exec()
+ *                  to main() can't be read from a clock the shell starts, so
+ *                  the CPU time the process has used by then stands in for
+ *                  it.
+ *
+ * Postconditions:  startup_profile is enabled and its first step starts now
+ ******************************************************************************/
+
+void startStartupProfile() {
+    startup_profile.beforeMain = clockNanoseconds(CLOCK_PROCESS_CPUTIME_ID);
+    startup_profile.start = clockNanoseconds(CLOCK_MONOTONIC);
+    startup_profile.mark = startup_profile.start;
+    startup_profile.enabled = true;
+}
+
+/*******************************************************************************
+ * Function name:   void startupStep(const char *name)
+ *
+ * Description:     Records that a step of startup has finished, taking the
+ *                  time since the last step ended. Does nothing unless the
+ *                  shell was started with --startup-profile.
+ *
+ * Receives:        name        Name of the step, a string constant
+ ******************************************************************************/
 
-    // Consume any zombie processes and report on their exit status or
-    // signal number
-    while((pid = waitpid(-1, &bgStatus, WNOHANG)) > 0) {
-        printf("Background pid %d is done: ", pid);
-        printExitValOrSignal(bgStatus);
+void startupStep(const char *name) {
+    if(!startup_profile.enabled ||
+       startup_profile.count == STARTUP_STEPS) {
+        return;
     }
+    uint64_t now = clockNanoseconds(CLOCK_MONOTONIC);
+    startup_profile.names[startup_profile.count] = name;
+    startup_profile.times[startup_profile.count] = now - startup_profile.mark;
+    startup_profile.count++;
+    startup_profile.mark = now;
 }
 
 /*******************************************************************************
- * Function name:   void catchSIGTSTP(int signo)
+ * Function name:   void printStartupProfile()
  *
- * Description:     Catches SIGTSTP and toggles between foreground-only mode
- *                  and regular mode.
+ * Description:     Prints how long each step of startup took to stderr, in
+ *                  microseconds, and the total from exec() to the first
+ *                  prompt. Does nothing after the first call or unless the
+ *                  shell was started with --startup-profile.
  *
- * Postconditions:  Global variable foreground_only has been toggled to its
- *                  opposite value.
+ * Postconditions:  startup_profile is disabled
  ******************************************************************************/
 
-void catchSIGTSTP(int signo) {
-    if(foreground_only) {
-        char *message = "\nExiting foreground-only mode\n";
-        write(STDOUT_FILENO, message, 30);
-        fflush(stdout);
-        foreground_only = false;
-    } else {
-        char *message = "\nEntering foreground-only mode (& is now ignored)\n";
-        write(STDOUT_FILENO, message, 50);
-        fflush(stdout);
-        foreground_only = true;
+void printStartupProfile() {
+    if(!startup_profile.enabled) {
+        return;
     }
+    startupStep("first prompt");
+    startup_profile.enabled = false;
+
+    uint64_t total = startup_profile.beforeMain +
+                     (startup_profile.mark - startup_profile.start);
+    fprintf(stderr, "startup profile (us)\n");
+    fprintf(stderr, "  %-20s %9.1f (cpu)\n", "exec to main",
+            startup_profile.beforeMain / 1000.0);
+    for(int i = 0; i < startup_profile.count; i++) {
+        fprintf(stderr, "  %-20s %9.1f\n", startup_profile.names[i],
+                startup_profile.times[i] / 1000.0);
+    }
+    fprintf(stderr, "  %-20s %9.1f\n", "total", total / 1000.0);
+    fflush(stderr);
 }
 
 /*******************************************************************************
- * Function name:   int main()
+ * Function name:   int main(int argc, char *argv[])
  *
- * Description:     Sets up signal handling to catch SIGTSTP (and send to
- *                  catchSIGTSTP()) and to ignore SIGINT. Declares and
- *                  initializes Command struct and passes it to promptLoop(),
- *                  starting the command prompt loop.
+ * Description:     Selects the launch path from the SMALLSH_SPAWN environment
+ *                  variable ("fork" forces fork(), "server" starts the spawn
+ *                  server once signals are set up). If run with --bench-spawn
+ *                  [runs], benchmarks both launch paths and exits. If given
+ *                  a script file, or if stdin is not a terminal, selects
+ *                  script mode so that no prompt is printed. Caches the PID
+ *                  string for "$$" expansion, loads the environment into the
+ *                  variable store, reads the SMALLSH_PIPE_SIZE,
+ *                  SMALLSH_PARSE_CACHE, SMALLSH_TRACE_FD and
+ *                  SMALLSH_MAX_JOBS environment variables and sets up
+ *                  signal handling to reap children
+ *                  through a signalfd, to queue SIGTSTP for the main loop
+ *                  to act on and to ignore SIGINT (and SIGTTOU in
+ *                  interactive mode). Declares and initializes Command struct
+ *                  and input reader and passes them to promptLoop(), starting
+ *                  the command prompt loop.
+ *                  Left out when SMALLSH_NO_MAIN is defined, so that bench.c
+ *                  can include this file.
  ******************************************************************************/
 
-int main() {
+#ifndef SMALLSH_NO_MAIN
+int main(int argc, char *argv[]) {
+    // Time each step up to the first prompt if asked to, before anything
+    // else runs
+    if(argc > 1 && !strcmp(argv[1], STARTUP_PROFILE_FLAG)) {
+        startStartupProfile();
+        argv++;
+        argc--;
+    }
+
+    // Select the launch path for external commands
+    char *spawnMode = getenv(SPAWN_MODE_VAR);
+    if(spawnMode && !strcmp(spawnMode, "fork")) {
+        spawn_mode = SPAWN_FORK;
+    } else if(spawnMode && !strcmp(spawnMode, "server")) {
+        spawn_mode = SPAWN_SERVER;
+    }
+
+    // Benchmark the launch paths instead of starting the shell
+    if(argc > 1 && !strcmp(argv[1], BENCH_SPAWN_FLAG)) {
+        benchmarkSpawn(argc > 2 ? atoi(argv[2]) : BENCH_SPAWN_RUNS);
+        return 0;
+    }
+
+    // Script mode: read commands from the named file, or from stdin without
+    // prompting if it isn't a terminal
+    int inputFD = STDIN_FILENO;
+    if(argc > 1) {
+        inputFD = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if(inputFD == -1) {
+            perror(argv[1]);
+            return 1;
+        }
+        interactive = false;
+    } else if(!isatty(STDIN_FILENO)) {
+        interactive = false;
+    }
+    startupStep("input");
+
+    // Cache the PID used for "$$" expansion, load the environment into the
+    // variable store, choose the line classifier and read the pipe buffer
+    // size
+    cachePIDString();
+    initVariables();
+    startupStep("variables");
+    initClassifier();
+    startupStep("classifier");
+    char *pipeSize = getenv(PIPE_SIZE_VAR);
+    if(pipeSize) {
+        pipe_size = atoi(pipeSize);
+    }
+
+    // Run lines as long as the arguments the kernel accepts
+    long argMax = sysconf(_SC_ARG_MAX);
+    if(argMax > 0) {
+        line_limit = (size_t)argMax;
+    }
+
+    // Size the parse cache from SMALLSH_PARSE_CACHE, where 0 disables it
+    char *parseCache = getenv(PARSE_CACHE_VAR);
+    initParseCache(parseCache ? atoi(parseCache) : PARSE_CACHE_SIZE);
+
+    // Turn on tracing if SMALLSH_TRACE_FD names an FD to write records to
+    char *traceFD = getenv(TRACE_FD_VAR);
+    if(traceFD && fcntl(atoi(traceFD), F_GETFD) != -1) {
+        trace_fd = atoi(traceFD);
+        trace_enabled = true;
+    }
+
+    // Limit background jobs to SMALLSH_MAX_JOBS if set, and otherwise let
+    // the parallel built-in run one job per online CPU
+    char *maxJobs = getenv(MAX_JOBS_VAR);
+    if(maxJobs && atol(maxJobs) > 0) {
+        max_jobs = atol(maxJobs);
+        throttle_all = true;
+    }
+    startupStep("settings");
+
     // Set up signal handling
-    struct sigaction SIGTSTP_action = {{0}};
+    initReaper();
+    initSignalRing();
     struct sigaction ignore_action = {{0}};
 
-    SIGTSTP_action.sa_handler = catchSIGTSTP;   // Catch SIGTSTP
-    sigfillset(&SIGTSTP_action.sa_mask);
-    SIGTSTP_action.sa_flags = 0;
-
     ignore_action.sa_handler = SIG_IGN;
 
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);  // Catch SIGTSTP
+    catchSignal(SIGTSTP);                       // Queue SIGTSTP
     sigaction(SIGINT, &ignore_action, NULL);    // Ignore SIGINT
+    // Ignore SIGTTOU so the shell can take the terminal back from a pipeline
+    if(interactive) {
+        sigaction(SIGTTOU, &ignore_action, NULL);
+    }
+    startupStep("signals");
+
+    // Under job control every job gets its own process group, which is
+    // handed the terminal while it runs in the foreground, so Ctrl-Z stops
+    // the job instead of reaching the shell
+    if(interactive && tcgetpgrp(STDIN_FILENO) == getpgrp() &&
+       tcgetattr(STDIN_FILENO, &shell_modes) == 0) {
+        job_control = true;
+    }
+    startupStep("job control");
+
+    // Start the spawn server while the shell is small, so that it inherits
+    // the signal setup and the page children count launch failures in
+    mapChildFailures();
+    if(spawn_mode == SPAWN_SERVER && !startSpawnServer()) {
+        spawn_mode = SPAWN_AUTO;
+    }
+    startupStep("spawn server");
+
+    // Wait on input, children and the spawn server through one event loop,
+    // created after the server so that it isn't inherited, and on the
+    // control socket if SMALLSH_CONTROL names one
+    initEventLoop();
+    openControl();
+    openMetrics();
+    startupStep("event sources");
 
-    // Declare and initialize Command struct, start command prompt loop
-    Command* command = malloc(sizeof(Command));
+    // Map the history of lines typed at the prompt
+    if(interactive) {
+        openHistory();
+    }
+    startupStep("history");
+
+    // Declare and initialize Command struct and input reader, start command
+    // prompt loop
+    LineReader reader;
+    initLineReader(&reader, inputFD);
+    Command* command = heapAlloc(sizeof(Command));
     initCommand(command);
-    promptLoop(command);
+    startupStep("command");
+    promptLoop(command, &reader);
+    if(metrics.path) {
+        formatMetrics();
+        writeMetrics();
+    }
+    closeControl();
+    closeCaptures();
+    heapFree(reader.buffer);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,149 @@
+/*******************************************************************************
+ * Author:      agent
+ * Date:        October 14, 2026
+ * Filename:    test.c
+ *
+ * Description: Tests for smallsh. Includes smallsh.c without its main() and
+ * checks how parseCommandLine() splits lines into pipelines, in particular
+ * that ";", "&&" and "||" end a word without a blank before or after them.
+ * Each line is parsed with the parse cache off, then twice with it on so
+ * that the second parse is a cache hit. Each failure is printed to stderr,
+ * and the exit status is the number of failures. Built and run by
+ * "make check".
+ ******************************************************************************/
+
+#define SMALLSH_NO_MAIN
+#include "smallsh.c"
+
+#define DESCRIPTION_MAX 512     // Longest description of a parsed line
+
+/*******************************************************************************
+ * Function name:   void describeCommand(Command *command, char *text,
+ *                                       size_t size)
+ *
+ * Description:     Describes the pipelines a parsed line was split into:
+ *                  each stage's arguments joined by ",", stages joined by
+ *                  " | ", and each pipeline after the first preceded by the
+ *                  operator that joins it to the one before, as " ; ",
+ *                  " & ", " && " or " || ".
+ *
+ * Receives:        command     Command struct pointer
+ *                  text        Where the description is written
+ *                  size        size_t  Size of text
+ ******************************************************************************/
+
+void describeCommand(Command *command, char *text, size_t size) {
+    size_t used = 0;        // Number of characters written
+
+    text[0] = '\0';
+    for(int p = 0; p < command->numPipelines; p++) {
+        Pipeline *pipeline = &command->pipelines[p];
+        if(p > 0) {
+            const char *joiner = command->pipelines[p - 1].background ? "&"
+                                 : pipeline->joiner == LIST_AND ? "&&"
+                                 : pipeline->joiner == LIST_OR ? "||" : ";";
+            used += snprintf(text + used, size - used, " %s ", joiner);
+        }
+        for(int i = 0; i < pipeline->numStages; i++) {
+            Stage *stage = &command->stages[pipeline->firstStage + i];
+            if(i > 0) {
+                used += snprintf(text + used, size - used, " | ");
+            }
+            for(int j = 0; j < stage->numArgs; j++) {
+                used += snprintf(text + used, size - used, "%s%s",
+                                 j > 0 ? "," : "", stage->args[j]);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ * Function name:   int checkParse(Command *command, const char *line,
+ *                                 const char *expected)
+ *
+ * Description:     Parses a line and compares the description of its
+ *                  pipelines with the one expected, printing any difference.
+ *
+ * Receives:        command     Command struct pointer to parse into
+ *                  line        Line to parse
+ *                  expected    Description describeCommand() should give
+ *
+ * Returns:         1 if the line parsed differently, 0 otherwise
+ ******************************************************************************/
+
+int checkParse(Command *command, const char *line, const char *expected) {
+    size_t length = strlen(line);
+    char *buffer = heapAlloc(length + 64);  // Copy the classifier can read
+    char text[DESCRIPTION_MAX];             // How the line was split
+
+    // Parsing writes into the line and the classifier may read a block past
+    // its end, so parse a padded copy
+    memset(buffer, 0, length + 64);
+    memcpy(buffer, line, length);
+    resetCommand(command);
+    command->line = buffer;
+    command->lineLength = length;
+    parseCommandLine(command);
+    describeCommand(command, text, sizeof(text));
+    heapFree(buffer);
+
+    if(strcmp(text, expected)) {
+        fprintf(stderr, "FAIL %s%s\n    expected: %s\n    got:      %s\n",
+                line, parse_cache.capacity > 0 ? " (cached)" : "", expected,
+                text);
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Function name:   int main()
+ *
+ * Description:     Runs every check with the parse cache off and on.
+ *
+ * Returns:         Number of checks that failed
+ ******************************************************************************/
+
+int main() {
+    const char *lines[][2] = {
+        {"a;b", "a ; b"},
+        {"a&&b", "a && b"},
+        {"a||b", "a || b"},
+        {"sleep 1; echo x", "sleep,1 ; echo,x"},
+        {"make&&make test", "make && make,test"},
+        {"a;b&&c||d", "a ; b && c || d"},
+        {"a | b||c", "a | b || c"},
+        {"true;", "true"},
+        {"a&&;b", "a &&  ; b"},
+        {"echo 'a;b' a\\;b \"c&&d\" e||''", "echo,a;b,a;b,c&&d,e || "},
+        {"echo a&& echo b", "echo,a && echo,b"},
+        {"echo 2>&1 a& b", "echo,a&,b"},
+        {"echo aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+         "aaaaaaaaaa;echo b||echo c",
+         "echo,aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+         "aaaaaaaaaaa ; echo,b || echo,c"}
+    };
+    int numLines = sizeof(lines) / sizeof(lines[0]);
+    int failures = 0;
+
+    cachePIDString();
+    initVariables();
+    initClassifier();
+    Command *command = heapAlloc(sizeof(Command));
+    initCommand(command);
+
+    for(int i = 0; i < numLines; i++) {
+        failures += checkParse(command, lines[i][0], lines[i][1]);
+    }
+    initParseCache(PARSE_CACHE_SIZE);
+    for(int run = 0; run < 2; run++) {
+        for(int i = 0; i < numLines; i++) {
+            failures += checkParse(command, lines[i][0], lines[i][1]);
+        }
+    }
+    printf("%d of %d checks failed\n", failures, 3 * numLines);
+
+    freeCommand(command);
+    heapFree(command);
+    return failures;
+}